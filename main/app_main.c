@@ -42,11 +42,12 @@
 #include "esp_log.h"
 #ifdef CONFIG_THINKSPEAK_ENABLE
 #include "mqtt.h"
-#else
-#include "modbus.h"
 #endif
 #include "led.h"
 #include "modbus.h"
+#include "status_http.h"
+#include "mb_tcp_gateway.h"
+#include "history.h"
 #include "sdkconfig.h"
 #ifdef CONFIG_HOMEKIT_ENABLED
 #include "homekit.h"
@@ -86,6 +87,10 @@ void app_main(void)
 #endif
 
     ESP_ERROR_CHECK(modbus_init());
+#ifdef CONFIG_HISTORY_ENABLE
+    // Needs the number of CIDs in the register map, so after modbus_init()
+    ESP_ERROR_CHECK(history_init());
+#endif
 
     configure_led();
     led_both();
@@ -97,14 +102,20 @@ void app_main(void)
 
     wifi_setup();
     wifi_connect();
+#ifdef CONFIG_STATUS_HTTP_ENABLE
+    status_http_start();
+#endif
+#ifdef CONFIG_MB_TCP_GATEWAY
+    mb_tcp_gateway_start();
+#endif
 
 #ifdef CONFIG_HOMEKIT_ENABLED
     homekit_start();
 #endif    
 
+    // The bus is polled by the scheduler whether or not we publish; MQTT reads the snapshot
+    modbus_start();
 #ifdef CONFIG_THINKSPEAK_ENABLE
     mqtt_app_start();
-#else
-    modbus_start();    
 #endif
 }
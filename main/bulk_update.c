@@ -0,0 +1,260 @@
+/*
+    ThingSpeak bulk update
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+#include "threads.h"
+#include "modbus.h"
+#include "bulk_update.h"
+#include "derived.h"
+
+#ifdef CONFIG_THINKSPEAK_BULK_UPDATE
+
+static const char *TAG = "BULK";
+
+// Worst case size of one entry, e.g.
+// {"created_at":"2020-11-12T10:00:00Z","field1":-40.00,"field2":100.00,"status":"GOOD_ESP"},
+// plus ,"field3":-40.00,"field4":100.00,"field5":-40.00 with derived fields
+#define BULK_DERIVED_LEN    (64)
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+#define BULK_ENTRY_LEN      (128 + BULK_DERIVED_LEN)
+#else
+#define BULK_ENTRY_LEN      (128)
+#endif
+#define BULK_HEADER_LEN     (64 + sizeof(CONFIG_THINKSPEAK_CHANNEL_WRITE_KEY))
+#define BULK_BODY_LEN       (BULK_HEADER_LEN + CONFIG_THINKSPEAK_BULK_BATCH_SIZE * BULK_ENTRY_LEN)
+#define BULK_URL_LEN        (128)
+#define BULK_HTTP_TIMEOUT   (10000)
+
+// Static, but esp_http_client_perform() still allocates inside IDF on every upload, which is
+// why bulk updates are left out of the no-heap publish path (see payload_pool.h)
+static char body[BULK_BODY_LEN];
+static char url[BULK_URL_LEN];
+static sample_t batch[CONFIG_THINKSPEAK_BULK_BATCH_SIZE];
+static esp_http_client_handle_t http_client = NULL;
+static TickType_t last_upload;
+
+// The upload runs in its own task so a slow server never holds up the publish loop. The
+// publish task owns the sample queue: it formats a batch, hands it over and removes the
+// samples once the upload task reports success. body and batch are only touched by the
+// upload task while upload_busy is set.
+static TaskHandle_t upload_task = NULL;
+static bool upload_busy = false;
+static size_t upload_len = 0;
+static uint32_t upload_count = 0;       // Samples in the batch handed over, 0 if none
+static esp_err_t upload_result = ESP_OK;
+
+/**
+ * @brief Formats the batch as a bulk-update JSON body
+ * @returns length of the body, or 0 if it did not fit
+ */
+static size_t format_batch(uint32_t count, const char *status)
+{
+    size_t len = snprintf(body, sizeof(body), "{\"write_api_key\":\"%s\",\"updates\":[", CONFIG_THINKSPEAK_CHANNEL_WRITE_KEY);
+    if (len >= sizeof(body))
+    {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        char *entry = &body[len];
+        size_t space = sizeof(body) - len;
+        uint32_t epoch;
+        int n;
+
+        if (sample_epoch_time(&batch[i], &epoch))
+        {
+            time_t t = (time_t)epoch;
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            n = strftime(entry, space, "{\"created_at\":\"%Y-%m-%dT%H:%M:%SZ\"", &tm);
+        }
+        else
+        {
+            // No wall clock time for this sample, place it relative to the one before
+            uint32_t delta = 0;
+            if ((i > 0) && !(batch[i - 1].flags & SAMPLE_FLAG_EPOCH) && (batch[i].time >= batch[i - 1].time))
+            {
+                delta = batch[i].time - batch[i - 1].time;
+            }
+            n = snprintf(entry, space, "{\"delta_t\":%u", delta);
+        }
+        if ((n <= 0) || ((size_t)n >= space))
+        {
+            return 0;
+        }
+        char derived_fields[BULK_DERIVED_LEN] = "";
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+        derived_metrics_t metrics;
+        if (derived_compute(batch[i].values[CID_INP_DATA_TEMPERATURE], batch[i].values[CID_INP_DATA_HUMIDITY], &metrics))
+        {
+            snprintf(derived_fields, sizeof(derived_fields), ",\"field3\":%0.02f,\"field4\":%0.02f,\"field5\":%0.02f",
+                        metrics.dew_point, metrics.abs_humidity, metrics.heat_index);
+        }
+#endif
+        int m = snprintf(entry + n, space - n, ",\"field1\":%0.02f,\"field2\":%0.02f%s,\"status\":\"%s\"}%s",
+                        batch[i].values[CID_INP_DATA_TEMPERATURE],
+                        batch[i].values[CID_INP_DATA_HUMIDITY],
+                        derived_fields,
+                        status,
+                        (i + 1 < count) ? "," : "");
+        if ((m < 0) || ((size_t)(n + m) >= space))
+        {
+            return 0;
+        }
+        len += n + m;
+    }
+
+    int n = snprintf(&body[len], sizeof(body) - len, "]}");
+    if ((n < 0) || (len + n >= sizeof(body)))
+    {
+        return 0;
+    }
+    return len + n;
+}
+
+/**
+ * @brief Posts the formatted body
+ */
+static esp_err_t post_batch(size_t len)
+{
+#ifdef CONFIG_THINKSPEAK_DONT_PUBLISH
+    ESP_LOGI(TAG, "Publish has been disabled, %u bytes not sent", (unsigned)len);
+    return ESP_OK;
+#else
+    esp_http_client_set_post_field(http_client, body, len);
+    esp_err_t err = esp_http_client_perform(http_client);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Bulk update failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    int code = esp_http_client_get_status_code(http_client);
+    if ((code != 200) && (code != 202))
+    {
+        ESP_LOGE(TAG, "Bulk update rejected, HTTP status %d", code);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+#endif
+}
+
+/**
+ * @brief Posts each batch handed over by bulk_update_poll()
+ */
+static void bulk_upload(void *pvParameter)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        upload_result = post_batch(upload_len);
+        __atomic_store_n(&upload_busy, false, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Removes the samples of a batch that was accepted. A sample that was pushed out of a
+ * full queue during the upload is no longer at the front and is skipped. Samples are matched
+ * by sequence number, two readings can have the same time and flags.
+ */
+static void pop_sent(uint32_t count)
+{
+    sample_t front;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (sample_queue_front(&front) && (front.seq == batch[i].seq))
+        {
+            sample_queue_pop();
+        }
+    }
+}
+
+esp_err_t bulk_update_init(void)
+{
+    snprintf(url, sizeof(url), "%s/channels/%d/bulk_update.json", CONFIG_THINKSPEAK_BULK_URL, CONFIG_THINKSPEAK_CHANNELID);
+    esp_http_client_config_t config = {
+        .url = url,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = BULK_HTTP_TIMEOUT,
+#ifdef CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        // Checks the server of an https URL against the IDF certificate bundle
+        .crt_bundle_attach = esp_crt_bundle_attach,
+#endif
+    };
+    http_client = esp_http_client_init(&config);
+    if (http_client == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create HTTP client");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_http_client_set_header(http_client, "Content-Type", "application/json");
+    if (xTaskCreate(bulk_upload, THREAD_BULK_NAME, THREAD_BULK_STACKSIZE, NULL, THREAD_BULK_PRIORITY, &upload_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Unable to create the upload task");
+        esp_http_client_cleanup(http_client);
+        http_client = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    last_upload = xTaskGetTickCount();
+    ESP_LOGI(TAG, "Bulk updates of %d samples, at least every %d sec", CONFIG_THINKSPEAK_BULK_BATCH_SIZE,
+                    CONFIG_THINKSPEAK_BULK_MAX_LATENCY_SECONDS);
+    return ESP_OK;
+}
+
+esp_err_t bulk_update_poll(const char *status)
+{
+    if (__atomic_load_n(&upload_busy, __ATOMIC_ACQUIRE))
+    {
+        // Still uploading
+        return ESP_OK;
+    }
+    if (upload_count > 0)
+    {
+        // The last batch has finished
+        uint32_t count = upload_count;
+        upload_count = 0;
+        if (upload_result != ESP_OK)
+        {
+            return upload_result;
+        }
+        pop_sent(count);
+        last_upload = xTaskGetTickCount();
+    }
+
+    uint32_t queued = sample_queue_count();
+    bool overdue = (xTaskGetTickCount() - last_upload) >= pdMS_TO_TICKS(CONFIG_THINKSPEAK_BULK_MAX_LATENCY_SECONDS * 1000);
+
+    if ((http_client == NULL) || (queued == 0) || ((queued < CONFIG_THINKSPEAK_BULK_BATCH_SIZE) && !overdue))
+    {
+        return ESP_OK;
+    }
+
+    uint32_t count = sample_queue_peek(batch, CONFIG_THINKSPEAK_BULK_BATCH_SIZE);
+    size_t len = format_batch(count, status);
+    if (len == 0)
+    {
+        ESP_LOGE(TAG, "Bulk update body too large");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ESP_LOGI(TAG, "Sending %u samples (%u bytes), %u queued", count, (unsigned)len, queued);
+    upload_len = len;
+    upload_count = count;
+    __atomic_store_n(&upload_busy, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(upload_task);
+    return ESP_OK;
+}
+
+#endif
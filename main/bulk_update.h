@@ -0,0 +1,42 @@
+/*
+    ThingSpeak bulk update
+
+    Uploads queued samples in batches through the ThingSpeak bulk-update API
+    (POST /channels/<id>/bulk_update.json) instead of one MQTT publish per sample. A batch
+    is sent once CONFIG_THINKSPEAK_BULK_BATCH_SIZE samples are waiting, or when
+    CONFIG_THINKSPEAK_BULK_MAX_LATENCY_SECONDS have passed since the last upload, whichever
+    comes first.
+
+    Each entry carries its own timestamp: created_at when the time of the sample is known,
+    otherwise delta_t, the seconds since the previous entry in the batch.
+
+    The HTTP upload runs in its own low priority task, so the publish loop that calls
+    bulk_update_poll() is never blocked by the server. An https URL is checked against the
+    IDF certificate bundle.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sample_queue.h"
+
+/**
+ * @brief Sets up the HTTP client used for the uploads and starts the upload task. The
+ * connection is kept open between batches.
+ */
+esp_err_t bulk_update_init(void);
+
+/**
+ * @brief Hands a batch from the sample queue to the upload task if one is due, and finishes
+ * the previous one. Does not wait for the upload. Samples are removed from the queue only
+ * once ThingSpeak has accepted the batch, so a failed upload is retried on a later call.
+ * Must be called from the task that pushes to the sample queue.
+ * @param status - status string stored with each entry
+ * @returns ESP_OK if nothing was due, a batch is uploading or was accepted, otherwise the
+ * error of the last upload
+ */
+esp_err_t bulk_update_poll(const char *status);
+
@@ -0,0 +1,147 @@
+/*
+    Modbus bus scheduler
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "bus_sched.h"
+
+// Signed difference of two times, safe across wrap of the millisecond clock
+#define TIME_DIFF(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
+
+void bus_sched_init(bus_sched_t *sched, const bus_sched_slave_cfg_t *cfg, uint16_t count, periodic_policy_t policy, uint32_t now_ms)
+{
+    memset(sched, 0, sizeof(bus_sched_t));
+    if (count > BUS_SCHED_MAX_SLAVES)
+    {
+        count = BUS_SCHED_MAX_SLAVES;
+    }
+    for (uint16_t i = 0; i < count; i++)
+    {
+        sched->slaves[i].cfg = cfg[i];
+        if (sched->slaves[i].cfg.period_ms == 0)
+        {
+            sched->slaves[i].cfg.period_ms = 1;
+        }
+        sched->slaves[i].release_ms = now_ms;
+    }
+    sched->count = count;
+    sched->policy = policy;
+    sched->start_ms = now_ms;
+}
+
+int bus_sched_next(bus_sched_t *sched, uint32_t now_ms, uint32_t *wait_ms)
+{
+    int best = -1;
+    uint32_t best_deadline = 0;
+    int32_t next_release = INT32_MAX;
+
+    for (int i = 0; i < sched->count; i++)
+    {
+        const bus_sched_slave_t *slave = &sched->slaves[i];
+        int32_t until_release = TIME_DIFF(slave->release_ms, now_ms);
+        if (until_release > 0)
+        {
+            if (until_release < next_release)
+            {
+                next_release = until_release;
+            }
+            continue;
+        }
+        uint32_t deadline = slave->release_ms + slave->cfg.period_ms;
+        if ((best < 0) ||
+            (TIME_DIFF(deadline, best_deadline) < 0) ||
+            ((deadline == best_deadline) && (slave->cfg.priority > sched->slaves[best].cfg.priority)))
+        {
+            best = i;
+            best_deadline = deadline;
+        }
+    }
+
+    if (wait_ms)
+    {
+        *wait_ms = (best < 0 && sched->count > 0) ? (uint32_t)next_release : 0;
+    }
+    return best;
+}
+
+void bus_sched_complete(bus_sched_t *sched, int index, uint32_t start_ms, uint32_t end_ms)
+{
+    if ((index < 0) || (index >= sched->count))
+    {
+        return;
+    }
+    bus_sched_slave_t *slave = &sched->slaves[index];
+    uint32_t busy = end_ms - start_ms;
+    uint32_t deadline = slave->release_ms + slave->cfg.period_ms;
+
+    slave->polls++;
+    slave->last_busy_ms = busy;
+    // Smooth the bus time with a 1/4 weight for the newest sample
+    slave->avg_busy_ms = (slave->polls == 1) ? busy : (slave->avg_busy_ms * 3 + busy) / 4;
+    sched->busy_ms += busy;
+
+    int32_t late = TIME_DIFF(start_ms, slave->release_ms);
+    histogram_record(&slave->lateness, late > 0 ? late : 0);
+    if (slave->polls > 1)
+    {
+        int32_t error = TIME_DIFF(start_ms, slave->last_start_ms) - (int32_t)slave->cfg.period_ms;
+        histogram_record(&slave->period_error, error > 0 ? error : -error);
+    }
+    slave->last_start_ms = start_ms;
+
+    if (TIME_DIFF(end_ms, deadline) > 0)
+    {
+        slave->deadline_misses++;
+    }
+
+    // Release the next period on the absolute grid. If we fell behind by whole periods either
+    // skip them (counting each as a miss) or leave them released so they run back to back.
+    slave->release_ms = deadline;
+    uint32_t missed = 0;
+    while (TIME_DIFF(end_ms, slave->release_ms + slave->cfg.period_ms) > 0)
+    {
+        slave->release_ms += slave->cfg.period_ms;
+        missed++;
+    }
+    if ((sched->policy == PERIODIC_CATCH_UP) && (missed < PERIODIC_MAX_CATCH_UP))
+    {
+        slave->release_ms = deadline;
+    }
+    else
+    {
+        slave->deadline_misses += missed;
+    }
+}
+
+bool bus_sched_get_stats(const bus_sched_t *sched, int index, uint32_t now_ms, bus_sched_stats_t *stats)
+{
+    if ((index < 0) || (index >= sched->count) || (stats == NULL))
+    {
+        return false;
+    }
+    const bus_sched_slave_t *slave = &sched->slaves[index];
+    uint32_t elapsed = now_ms - sched->start_ms;
+
+    stats->slave_addr = slave->cfg.slave_addr;
+    stats->period_ms = slave->cfg.period_ms;
+    stats->polls = slave->polls;
+    stats->deadline_misses = slave->deadline_misses;
+    stats->last_busy_ms = slave->last_busy_ms;
+    stats->avg_busy_ms = slave->avg_busy_ms;
+    stats->max_lateness_ms = slave->lateness.max;
+    stats->requested_rate_hz = 1000.0f / (float)slave->cfg.period_ms;
+    stats->achieved_rate_hz = (elapsed > 0) ? ((float)slave->polls * 1000.0f / (float)elapsed) : 0.0f;
+    return true;
+}
+
+uint32_t bus_sched_utilisation(const bus_sched_t *sched)
+{
+    uint32_t permille = 0;
+    for (int i = 0; i < sched->count; i++)
+    {
+        permille += (sched->slaves[i].avg_busy_ms * 1000) / sched->slaves[i].cfg.period_ms;
+    }
+    return permille / 10;
+}
@@ -0,0 +1,118 @@
+/*
+    Modbus bus scheduler
+
+    Earliest-deadline-first scheduler for polling several slaves on one half-duplex RS485
+    line. Each slave has its own poll period and priority. Only one transaction is on the
+    line at a time (the caller runs the slots one after another), so slots never collide;
+    the scheduler decides which slave owns the next slot and tracks how well each slave
+    keeps up with its requested rate.
+
+    All times are in milliseconds from a free running clock supplied by the caller.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "histogram.h"
+#include "periodic.h"
+
+// Maximum number of slaves the scheduler can handle
+#define BUS_SCHED_MAX_SLAVES (8)
+
+/**
+ * Static configuration of a slave on the bus
+ */
+typedef struct
+{
+    uint8_t slave_addr;         // Modbus slave address
+    uint32_t period_ms;         // Requested time between polls
+    uint8_t priority;           // Tie breaker when deadlines are equal (higher wins)
+} bus_sched_slave_cfg_t;
+
+/**
+ * Per slave statistics
+ */
+typedef struct
+{
+    uint8_t slave_addr;         // Modbus slave address
+    uint32_t period_ms;         // Requested time between polls
+    uint32_t polls;             // Number of completed polls
+    uint32_t deadline_misses;   // Polls that completed after their deadline, or were skipped
+    uint32_t last_busy_ms;      // Bus time used by the last poll
+    uint32_t avg_busy_ms;       // Smoothed bus time per poll
+    uint32_t max_lateness_ms;   // Longest a poll has started after its release
+    float achieved_rate_hz;     // Polls per second since the scheduler started
+    float requested_rate_hz;    // Polls per second requested by the period
+} bus_sched_stats_t;
+
+/**
+ * Runtime state of a slave
+ */
+typedef struct
+{
+    bus_sched_slave_cfg_t cfg;
+    uint32_t release_ms;        // Time the next poll becomes eligible
+    uint32_t polls;
+    uint32_t deadline_misses;
+    uint32_t last_busy_ms;
+    uint32_t avg_busy_ms;
+    uint32_t last_start_ms;     // Start of the previous poll
+    histogram_t lateness;       // Poll start minus release (ms)
+    histogram_t period_error;   // |actual period - requested period| (ms)
+} bus_sched_slave_t;
+
+typedef struct
+{
+    bus_sched_slave_t slaves[BUS_SCHED_MAX_SLAVES];
+    uint16_t count;
+    periodic_policy_t policy;   // What to do with periods missed by an overrunning poll
+    uint32_t start_ms;          // Time the scheduler was initialised
+    uint32_t busy_ms;           // Total bus time used by all polls
+} bus_sched_t;
+
+/**
+ * @brief Initialises the scheduler with a table of slaves. All slaves are released immediately.
+ * @param sched - scheduler state
+ * @param cfg - slave table
+ * @param count - number of entries in the table (extra entries past BUS_SCHED_MAX_SLAVES are ignored)
+ * @param policy - overrun policy, see periodic.h
+ * @param now_ms - current time
+ */
+void bus_sched_init(bus_sched_t *sched, const bus_sched_slave_cfg_t *cfg, uint16_t count, periodic_policy_t policy, uint32_t now_ms);
+
+/**
+ * @brief Picks the slave that owns the next bus slot. Of all the released slaves, the one with
+ * the earliest deadline (release + period) wins, ties going to the higher priority.
+ * @param sched - scheduler state
+ * @param now_ms - current time
+ * @param wait_ms - set to the time until the next release when no slave is ready
+ * @returns index of the slave to poll, or -1 if none is ready
+ */
+int bus_sched_next(bus_sched_t *sched, uint32_t now_ms, uint32_t *wait_ms);
+
+/**
+ * @brief Records the completion of a poll and releases the next one on the absolute period
+ * grid. A poll that ends past its deadline counts as a miss. With PERIODIC_SKIP, periods that
+ * were missed entirely are counted as misses and the next release is moved forward; with
+ * PERIODIC_CATCH_UP they are released immediately (up to PERIODIC_MAX_CATCH_UP of them).
+ * @param sched - scheduler state
+ * @param index - slave index returned by bus_sched_next()
+ * @param start_ms - time the poll started
+ * @param end_ms - time the poll completed
+ */
+void bus_sched_complete(bus_sched_t *sched, int index, uint32_t start_ms, uint32_t end_ms);
+
+/**
+ * @brief Returns the statistics for one slave
+ * @returns false if the index is out of range
+ */
+bool bus_sched_get_stats(const bus_sched_t *sched, int index, uint32_t now_ms, bus_sched_stats_t *stats);
+
+/**
+ * @brief Estimated bus utilisation in percent, the sum of avg_busy/period over all slaves.
+ * Anything approaching 100 means the bus is saturated and deadlines will be missed.
+ */
+uint32_t bus_sched_utilisation(const bus_sched_t *sched);
@@ -0,0 +1,178 @@
+/*
+    Derived metrics
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "derived.h"
+
+// Magnus coefficients (Sonntag 1990) over water
+#define MAGNUS_A        (17.62f)
+#define MAGNUS_B        (243.12f)
+#define MAGNUS_E0       (6.112f)        // hPa at 0C
+// Water vapour: 100 (hPa to Pa) / R_v (461.5 J/kg/K) * 1000 (kg to g)
+#define AH_FACTOR       (216.7f)
+#define KELVIN          (273.15f)
+#define LN2             (0.69314718f)
+
+#define TABLE_LEN       (DERIVED_TABLE_MAX_C - DERIVED_TABLE_MIN_C + 1)
+
+// Saturation vapour pressure (hPa) at each whole degree from DERIVED_TABLE_MIN_C, from the
+// Magnus formula above. Generated off line so there is nothing to build at run time.
+static const float es_table[] = {
+    0.190212011f, 0.210916057f, 0.233638197f, 0.258551389f, 0.285841346f, 0.315707147f,
+    0.348362178f, 0.384034932f, 0.422969788f, 0.465428025f, 0.511688769f, 0.562049806f,
+    0.616828918f, 0.676364601f, 0.741017401f, 0.811170936f, 0.887233257f, 0.969637871f,
+    1.05884516f, 1.15534353f, 1.2596513f, 1.37231719f, 1.49392283f, 1.62508345f,
+    1.76645005f, 1.91871047f, 2.0825913f, 2.25886011f, 2.44832635f, 2.65184307f,
+    2.87031031f, 3.10467529f, 3.35593486f, 3.62513876f, 3.91338944f, 4.2218461f,
+    4.55172682f, 4.9043088f, 5.2809329f, 5.68300533f, 6.11199999f, 6.56946039f,
+    7.05700254f, 7.57631826f, 8.12917614f, 8.71742725f, 9.34300423f, 10.007926f,
+    10.7143002f, 11.4643278f, 12.2603016f, 13.1046162f, 13.9997644f, 14.9483433f,
+    15.9530563f, 17.0167198f, 18.1422634f, 19.3327293f, 20.5912876f, 21.9212246f,
+    23.3259602f, 24.809042f, 26.3741512f, 28.0251102f, 29.7658806f, 31.6005688f,
+    33.5334358f, 35.5688858f, 37.7114906f, 39.9659805f, 42.3372383f, 44.8303337f,
+    47.4504967f, 50.2031403f, 53.0938568f, 56.128418f, 59.3127899f, 62.6531372f,
+    66.1558075f, 69.8273697f, 73.6745834f, 77.7044144f, 81.9240646f, 86.3409348f,
+    90.9626617f, 95.7970963f, 100.852341f, 106.136719f, 111.658798f, 117.427399f,
+    123.451584f, 129.740677f, 136.304245f, 143.152145f, 150.294479f, 157.741638f,
+    165.504272f, 173.593338f, 182.020065f, 190.795975f, 199.932877f,
+};
+
+// The same over the absolute temperature (hPa/K), for the absolute humidity
+static const float es_kelvin_table[] = {
+    0.000815835374f, 0.000900773273f, 0.000993570895f, 0.00109486096f, 0.00120531872f, 0.00132566504f,
+    0.00145666813f, 0.00159914605f, 0.00175396958f, 0.00192206493f, 0.00210441602f, 0.00230206759f,
+    0.00251612859f, 0.00274777412f, 0.00299824961f, 0.00326887332f, 0.00356104062f, 0.00387622556f,
+    0.00421598693f, 0.00458196923f, 0.00497590844f, 0.00539963506f, 0.00585507695f, 0.0063442653f,
+    0.00686933706f, 0.00743254088f, 0.00803623907f, 0.00868291408f, 0.00937517267f, 0.0101157473f,
+    0.0109075066f, 0.0117534548f, 0.0126567408f, 0.0136206597f, 0.0146486592f, 0.0157443453f,
+    0.0169114862f, 0.0181540195f, 0.0194760561f, 0.0208818875f, 0.0223759841f, 0.0239630137f,
+    0.0256478377f, 0.0274355169f, 0.0293313246f, 0.0313407406f, 0.0334694758f, 0.0357234553f,
+    0.0381088406f, 0.0406320319f, 0.0432996713f, 0.046118658f, 0.049096141f, 0.0522395335f,
+    0.0555565245f, 0.059055075f, 0.0627434328f, 0.0666301176f, 0.0707239807f, 0.0750341415f,
+    0.0795700476f, 0.0843414664f, 0.0893584639f, 0.0946314707f, 0.100171223f, 0.10598883f,
+    0.112095721f, 0.118503705f, 0.125224948f, 0.132271975f, 0.139657721f, 0.147395477f,
+    0.155498937f, 0.163982168f, 0.172859699f, 0.182146415f, 0.191857651f, 0.202009141f,
+    0.212617099f, 0.223698124f, 0.235269293f, 0.24734813f, 0.259952605f, 0.273101181f,
+    0.286812752f, 0.301106691f, 0.316002965f, 0.331521839f, 0.347684264f, 0.364511549f,
+    0.382025629f, 0.400248855f, 0.419204175f, 0.438915044f, 0.459405392f, 0.480699778f,
+    0.502823234f, 0.52580142f, 0.549660504f, 0.574427128f, 0.60012871f,
+};
+
+_Static_assert(sizeof(es_table) / sizeof(es_table[0]) == TABLE_LEN, "Vapour pressure table does not match the range");
+_Static_assert(sizeof(es_kelvin_table) / sizeof(es_kelvin_table[0]) == TABLE_LEN, "Vapour pressure table does not match the range");
+
+/**
+ * @brief Linear interpolation in one of the tables, t must be in range
+ */
+static inline float interpolate(const float *table, float t)
+{
+    float pos = t - DERIVED_TABLE_MIN_C;
+    int i = (int)pos;
+    if (i >= TABLE_LEN - 1)
+    {
+        i = TABLE_LEN - 2;
+    }
+    float frac = pos - i;
+    return table[i] + (table[i + 1] - table[i]) * frac;
+}
+
+/**
+ * @brief Natural log of a positive normal float. Splits off the exponent so the mantissa m
+ * is in [0.707, 1.414), then ln(m) is a degree 6 polynomial in m - 1 (error below 2e-6).
+ */
+static inline float fast_logf(float x)
+{
+    union { float f; uint32_t u; } v = { .f = x };
+    // Offsetting by the bits of 1/sqrt(2) splits at that point without a branch
+    uint32_t ix = v.u - 0x3F3504F3;
+    int e = (int32_t)ix >> 23;
+    v.u = (ix & 0x007FFFFF) + 0x3F3504F3;
+    float m = v.f;
+    float y = m - 1.0f;
+    float p = -1.1755003e-06f + y * (1.0000100f + y * (-0.49977364f + y * (0.33242491f +
+              y * (-0.25602723f + y * (0.22174758f + y * -0.13623688f)))));
+    return e * LN2 + p;
+}
+
+float derived_dew_point(float temperature, float humidity)
+{
+    // Actual vapour pressure, then invert Magnus for the temperature where it saturates
+    float gamma = fast_logf(interpolate(es_table, temperature) * humidity * (0.01f / MAGNUS_E0));
+    return MAGNUS_B * gamma / (MAGNUS_A - gamma);
+}
+
+float derived_abs_humidity(float temperature, float humidity)
+{
+    return AH_FACTOR * interpolate(es_kelvin_table, temperature) * humidity * 0.01f;
+}
+
+/**
+ * @brief NWS heat index (Rothfusz regression with the Steadman simple formula below 80F)
+ */
+float derived_heat_index(float temperature, float humidity)
+{
+    float t = temperature * 1.8f + 32.0f;
+    float rh = humidity;
+    float hi = 0.5f * (t + 61.0f + (t - 68.0f) * 1.2f + rh * 0.094f);
+
+    if ((hi + t) / 2.0f >= 80.0f)
+    {
+        hi = -42.379f + 2.04901523f * t + 10.14333127f * rh
+             - 0.22475541f * t * rh - 0.00683783f * t * t
+             - 0.05481717f * rh * rh + 0.00122874f * t * t * rh
+             + 0.00085282f * t * rh * rh - 0.00000199f * t * t * rh * rh;
+        if ((rh < 13.0f) && (t >= 80.0f) && (t <= 112.0f))
+        {
+            hi -= ((13.0f - rh) / 4.0f) * sqrtf((17.0f - fabsf(t - 95.0f)) / 17.0f);
+        }
+        else if ((rh > 85.0f) && (t >= 80.0f) && (t <= 87.0f))
+        {
+            hi += ((rh - 85.0f) / 10.0f) * ((87.0f - t) / 5.0f);
+        }
+    }
+    return (hi - 32.0f) / 1.8f;
+}
+
+static bool in_range(float temperature, float humidity, derived_metrics_t *out)
+{
+    if (!(temperature >= DERIVED_TABLE_MIN_C) || !(temperature <= DERIVED_TABLE_MAX_C) ||
+        !(humidity > 0.0f) || !(humidity <= 100.0f))
+    {
+        out->dew_point = NAN;
+        out->abs_humidity = NAN;
+        out->heat_index = NAN;
+        return false;
+    }
+    return true;
+}
+
+bool derived_compute(float temperature, float humidity, derived_metrics_t *out)
+{
+    if (!in_range(temperature, humidity, out))
+    {
+        return false;
+    }
+    out->dew_point = derived_dew_point(temperature, humidity);
+    out->abs_humidity = derived_abs_humidity(temperature, humidity);
+    out->heat_index = derived_heat_index(temperature, humidity);
+    return true;
+}
+
+bool derived_reference(float temperature, float humidity, derived_metrics_t *out)
+{
+    if (!in_range(temperature, humidity, out))
+    {
+        return false;
+    }
+    float gamma = logf(humidity / 100.0f) + MAGNUS_A * temperature / (MAGNUS_B + temperature);
+    out->dew_point = MAGNUS_B * gamma / (MAGNUS_A - gamma);
+    float e = MAGNUS_E0 * expf(MAGNUS_A * temperature / (MAGNUS_B + temperature)) * humidity / 100.0f;
+    out->abs_humidity = AH_FACTOR * e / (KELVIN + temperature);
+    out->heat_index = derived_heat_index(temperature, humidity);
+    return true;
+}
@@ -0,0 +1,59 @@
+/*
+    Derived metrics
+
+    Dew point, absolute humidity and heat index computed on the device from a temperature
+    (C) and relative humidity (%) reading, so they do not have to be worked out in the cloud.
+
+    The Magnus formula (a = 17.62, b = 243.12C) is used for the saturation vapour pressure
+    and dew point. Instead of expf() and logf() the saturation vapour pressure comes from a
+    1C step table with linear interpolation over DERIVED_TABLE_MIN_C to DERIVED_TABLE_MAX_C,
+    and the log in the dew point from a polynomial on the float mantissa. The tables are
+    const, generated off line, so nothing is set up at run time and any task can call this
+    at any time. Against the reference formulas over -40C to 60C and 1 to 100%RH the error
+    is below 0.02C for the dew point and 0.2% for the absolute humidity (checked by
+    tools/derived_bench). The heat index is the NWS (Rothfusz) regression, which is already a
+    polynomial.
+
+    derived_reference() computes the same metrics with the C library for checking.
+
+    This is plain C with no ESP-IDF dependencies.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+// Temperature range covered by the vapour pressure table
+#define DERIVED_TABLE_MIN_C (-40)
+#define DERIVED_TABLE_MAX_C (60)
+
+typedef struct
+{
+    float dew_point;            // C
+    float abs_humidity;         // g/m3
+    float heat_index;           // C, the "feels like" temperature
+} derived_metrics_t;
+
+/**
+ * @brief Computes the derived metrics with the fast approximations
+ * @param temperature - C
+ * @param humidity - relative humidity in %
+ * @param out - results, NAN if the inputs are out of range
+ * @returns false if the inputs are out of range
+ */
+bool derived_compute(float temperature, float humidity, derived_metrics_t *out);
+
+/**
+ * @brief The metrics of derived_compute() one at a time, for callers that need only one.
+ * The inputs are not checked and must be in the range derived_compute() accepts.
+ */
+float derived_dew_point(float temperature, float humidity);
+float derived_abs_humidity(float temperature, float humidity);
+float derived_heat_index(float temperature, float humidity);
+
+/**
+ * @brief Computes the derived metrics with logf()/expf(), for validating derived_compute()
+ */
+bool derived_reference(float temperature, float humidity, derived_metrics_t *out);
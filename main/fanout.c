@@ -0,0 +1,189 @@
+/*
+    Multi-destination sample fan-out
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "threads.h"
+#include "modbus.h"
+#include "sample_ring.h"
+#include "fanout.h"
+
+#ifdef CONFIG_PUBLISH_FANOUT
+
+static const char *TAG = "FANOUT";
+
+// A sink wakes at least this often to do its service work, even with no new samples
+#define SINK_SERVICE_INTERVAL_MS (1000)
+
+typedef struct
+{
+    fanout_sink_t cfg;
+    sample_cursor_t cursor;     // Only changed by the sink's task
+    TaskHandle_t task;
+} sink_t;
+
+// One spare slot: the slot being written is never readable, see sample_ring.h
+static sample_t ring_slots[CONFIG_SAMPLE_QUEUE_LEN + 1];
+static sample_ring_t ring;
+static sink_t sinks[FANOUT_MAX_SINKS];
+static uint16_t num_sinks = 0;
+
+#ifdef CONFIG_PUBLISH_SINK_LOG
+/**
+ * @brief Log sink: writes each sample to the console
+ */
+static bool log_send(void *ctx, const sample_t *sample)
+{
+    char line[128];
+    int n = snprintf(line, sizeof(line), "%s %u:", (sample->flags & SAMPLE_FLAG_EPOCH) ? "time" : "uptime", sample->time);
+
+    for (uint16_t i = 0; (i < sample->count) && (n > 0) && ((size_t)n < sizeof(line)); i++)
+    {
+        const regmap_param_t *param = modbus_cid_param(i);
+        n += snprintf(line + n, sizeof(line) - n, " %s=%0.02f%s", param ? param->name : "?", sample->values[i],
+                    param ? param->unit : "");
+    }
+    ESP_LOGI(TAG, "Sample %s", line);
+    return true;
+}
+#endif
+
+/**
+ * @brief Sends up to CONFIG_SAMPLE_QUEUE_DRAIN_BATCH samples, oldest first. A sample only
+ * counts as sent once the sink has taken it.
+ */
+static void drain(sink_t *sink)
+{
+    sample_t sample;
+
+    if ((sink->cfg.ready != NULL) && !sink->cfg.ready(sink->cfg.ctx))
+    {
+        return;
+    }
+    for (int i = 0; i < CONFIG_SAMPLE_QUEUE_DRAIN_BATCH; i++)
+    {
+        if (!sample_ring_peek(&ring, &sink->cursor, &sample) || !sink->cfg.send(sink->cfg.ctx, &sample))
+        {
+            break;
+        }
+        sample_ring_advance(&sink->cursor);
+    }
+}
+
+static void sink_task(void *pvParameter)
+{
+    sink_t *sink = (sink_t *)pvParameter;
+
+    while (1)
+    {
+        // Woken by fanout_push(): samples are sent at the rate they arrive, like the single
+        // destination loop, so a backlog does not flood a rate limited destination
+        uint32_t pushed = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SINK_SERVICE_INTERVAL_MS));
+        if (sink->cfg.service != NULL)
+        {
+            sink->cfg.service(sink->cfg.ctx);
+        }
+        if (pushed)
+        {
+            drain(sink);
+        }
+    }
+}
+
+void fanout_init(void)
+{
+    sample_ring_init(&ring, ring_slots, CONFIG_SAMPLE_QUEUE_LEN + 1);
+#ifdef CONFIG_PUBLISH_SINK_LOG
+    const fanout_sink_t log_sink = {
+        .name = "log",
+        .send = log_send,
+    };
+    fanout_add_sink(&log_sink);
+#endif
+}
+
+esp_err_t fanout_add_sink(const fanout_sink_t *cfg)
+{
+    if (num_sinks == FANOUT_MAX_SINKS)
+    {
+        ESP_LOGE(TAG, "No room for sink %s", cfg->name);
+        return ESP_ERR_NO_MEM;
+    }
+    sink_t *sink = &sinks[num_sinks];
+    sink->cfg = *cfg;
+    sample_cursor_init(&ring, &sink->cursor);
+    num_sinks++;
+    return ESP_OK;
+}
+
+void fanout_start(void)
+{
+    for (uint16_t i = 0; i < num_sinks; i++)
+    {
+        xTaskCreate(sink_task, sinks[i].cfg.name, THREAD_SINK_STACKSIZE, &sinks[i], THREAD_SINK_PRIORITY, &sinks[i].task);
+    }
+    ESP_LOGI(TAG, "Publishing to %d destinations, %d samples each", num_sinks, CONFIG_SAMPLE_QUEUE_LEN);
+}
+
+void fanout_push(const sample_t *sample)
+{
+    sample_ring_push(&ring, sample);
+    for (uint16_t i = 0; i < num_sinks; i++)
+    {
+        if (sinks[i].task != NULL)
+        {
+            xTaskNotifyGive(sinks[i].task);
+        }
+    }
+}
+
+bool fanout_get_stats(uint16_t index, fanout_sink_stats_t *stats)
+{
+    if (index >= num_sinks)
+    {
+        return false;
+    }
+    const sink_t *sink = &sinks[index];
+    stats->name = sink->cfg.name;
+    stats->ready = (sink->cfg.ready == NULL) || sink->cfg.ready(sink->cfg.ctx);
+    stats->lag = sample_ring_lag(&ring, &sink->cursor);
+    stats->sent = sink->cursor.sent;
+    stats->dropped = sink->cursor.dropped;
+    if (stats->lag > CONFIG_SAMPLE_QUEUE_LEN)
+    {
+        // Already overwritten, the sink counts them once it next reads
+        stats->dropped += stats->lag - CONFIG_SAMPLE_QUEUE_LEN;
+        stats->lag = CONFIG_SAMPLE_QUEUE_LEN;
+    }
+    return true;
+}
+
+uint32_t fanout_max_lag(void)
+{
+    uint32_t max = 0;
+    fanout_sink_stats_t stats;
+    for (uint16_t i = 0; fanout_get_stats(i, &stats); i++)
+    {
+        max = (stats.lag > max) ? stats.lag : max;
+    }
+    return max;
+}
+
+void fanout_log(void)
+{
+    fanout_sink_stats_t stats;
+    for (uint16_t i = 0; fanout_get_stats(i, &stats); i++)
+    {
+        ESP_LOGI(TAG, "%s: %s, %u behind, %u sent, %u dropped", stats.name, stats.ready ? "up" : "down",
+                        stats.lag, stats.sent, stats.dropped);
+    }
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+    Multi-destination sample fan-out
+
+    With CONFIG_PUBLISH_FANOUT the MQTT task hands each sample to fanout_push() once, which puts
+    it in a shared ring (sample_ring.h) of CONFIG_SAMPLE_QUEUE_LEN samples. Every sink, such
+    as a ThingSpeak channel, a self-hosted broker or the local log, has its own cursor into
+    the ring and its own task. A sink takes up to CONFIG_SAMPLE_QUEUE_DRAIN_BATCH samples
+    each time a sample arrives, at its own pace, and only moves its cursor once a sample is
+    sent. A slow or disconnected sink falls behind and, once it is a whole ring behind, loses
+    its oldest samples; neither the MQTT task nor the other sinks ever wait for it.
+
+    Each sink reports how far it is behind (lag) and how many samples it has lost (dropped).
+
+    Sinks are added with fanout_add_sink() before fanout_start(). The MQTT sinks are set up
+    in mqtt.c, the log sink here.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sample_queue.h"
+
+#ifdef CONFIG_PUBLISH_FANOUT
+
+// Most sinks that can be added
+#define FANOUT_MAX_SINKS (4)
+
+typedef struct
+{
+    const char *name;
+    /**
+     * @brief Sends one sample
+     * @returns false if it was not sent; the sink stops for now and tries it again later
+     */
+    bool (*send)(void *ctx, const sample_t *sample);
+    /**
+     * @brief Returns true if the sink can send now (may be NULL for always)
+     */
+    bool (*ready)(void *ctx);
+    /**
+     * @brief Called every time the sink's task wakes, before any samples are sent, for work
+     * such as status messages (may be NULL)
+     */
+    void (*service)(void *ctx);
+    void *ctx;
+} fanout_sink_t;
+
+typedef struct
+{
+    const char *name;
+    bool ready;
+    uint32_t lag;               // Samples written that the sink has not sent
+    uint32_t sent;
+    uint32_t dropped;           // Samples lost because the sink fell a whole ring behind
+} fanout_sink_stats_t;
+
+/**
+ * @brief Sets up the ring, and the log sink if it is enabled
+ */
+void fanout_init(void);
+
+/**
+ * @brief Adds a sink; the sink is copied. Call before fanout_start().
+ * @returns ESP_ERR_NO_MEM if FANOUT_MAX_SINKS have been added
+ */
+esp_err_t fanout_add_sink(const fanout_sink_t *sink);
+
+/**
+ * @brief Starts a task for each sink
+ */
+void fanout_start(void);
+
+/**
+ * @brief Adds a sample for every sink and wakes them. The ring has a single producer: only
+ * the MQTT task (queue_sample() in mqtt.c) may call this.
+ */
+void fanout_push(const sample_t *sample);
+
+/**
+ * @brief Returns the counters of a sink
+ * @param index - 0 to the number of sinks - 1
+ * @returns false if there is no such sink
+ */
+bool fanout_get_stats(uint16_t index, fanout_sink_stats_t *stats);
+
+/**
+ * @brief Lag of the sink furthest behind
+ */
+uint32_t fanout_max_lag(void);
+
+/**
+ * @brief Logs the counters of every sink
+ */
+void fanout_log(void);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+    Power of two histogram
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include "histogram.h"
+
+void histogram_record(histogram_t *hist, uint32_t value)
+{
+    hist->counts[histogram_bucket(value)]++;
+    hist->samples++;
+    hist->sum += value;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+uint32_t histogram_percentile(const histogram_t *hist, uint32_t permille)
+{
+    // Rank of the sample wanted, rounded up so p99 of a few samples is the largest one
+    uint64_t rank = ((uint64_t)hist->samples * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    if (hist->samples == 0)
+    {
+        return 0;
+    }
+    for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += hist->counts[bucket];
+        if ((seen >= rank) && (hist->counts[bucket] > 0))
+        {
+            uint32_t bound = histogram_bucket_bound(bucket);
+            return (bound < hist->max) ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int histogram_format(const histogram_t *hist, char *buffer, size_t len)
+{
+    int used = 0;
+    if (len == 0)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+    for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        if (hist->counts[bucket] == 0)
+        {
+            continue;
+        }
+        int n;
+        if (bucket < HISTOGRAM_BUCKETS - 1)
+        {
+            n = snprintf(buffer + used, len - used, "%s<=%u:%u", used ? " " : "",
+                            (unsigned)histogram_bucket_bound(bucket), (unsigned)hist->counts[bucket]);
+        }
+        else
+        {
+            n = snprintf(buffer + used, len - used, "%s>%u:%u", used ? " " : "",
+                            (unsigned)histogram_bucket_bound(bucket - 1), (unsigned)hist->counts[bucket]);
+        }
+        if ((n < 0) || ((size_t)n >= len - used))
+        {
+            break;
+        }
+        used += n;
+    }
+    return used;
+}
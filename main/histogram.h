@@ -0,0 +1,67 @@
+/*
+    Power of two histogram
+
+    Small histogram with power of two buckets: bucket 0 holds 0 and bucket b holds 2^(b-1) to
+    2^b - 1, so recording is a count-leading-zeros and an increment and never allocates. It
+    is safe to use on the polling hot path. The unit is the caller's: the schedulers and the
+    bus scan record milliseconds, the runtime metrics (metrics.h) microseconds or cycles.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of buckets, enough for any 32 bit value. The last one has no bound.
+#define HISTOGRAM_BUCKETS (32)
+
+typedef struct
+{
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint32_t samples;
+    uint32_t max;
+    uint64_t sum;
+} histogram_t;
+
+/**
+ * @brief Returns the bucket a value falls in: 0 for 0, otherwise its number of significant bits
+ */
+static inline uint32_t histogram_bucket(uint32_t value)
+{
+    uint32_t bucket = value ? 32 - __builtin_clz(value) : 0;
+    return (bucket < HISTOGRAM_BUCKETS) ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @brief Returns the largest value that falls in a bucket
+ */
+static inline uint32_t histogram_bucket_bound(uint32_t bucket)
+{
+    return (bucket >= HISTOGRAM_BUCKETS - 1) ? UINT32_MAX : (uint32_t)((1ULL << bucket) - 1);
+}
+
+/**
+ * @brief Adds a sample to the histogram
+ * @param hist - histogram
+ * @param value - sample value
+ */
+void histogram_record(histogram_t *hist, uint32_t value);
+
+/**
+ * @brief Returns the upper bound (inclusive) of the bucket holding the given fraction of
+ * the samples, limited to the largest sample
+ * @param hist - histogram
+ * @param permille - fraction of the samples, 500 for the median
+ */
+uint32_t histogram_percentile(const histogram_t *hist, uint32_t permille);
+
+/**
+ * @brief Formats the non-empty buckets as "<=bound:count" pairs for logging
+ * @param hist - histogram
+ * @param buffer - output buffer
+ * @param len - size of the output buffer
+ * @returns number of characters written (excluding the terminator)
+ */
+int histogram_format(const histogram_t *hist, char *buffer, size_t len);
@@ -0,0 +1,249 @@
+/*
+    On-device sensor history
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "sdkconfig.h"
+#include "modbus.h"
+#include "history.h"
+#include "regmap.h"
+
+#ifdef CONFIG_HISTORY_ENABLE
+
+static const char *TAG = "HISTORY";
+
+_Static_assert(REGMAP_MAX_ENTRIES <= TSDB_MAX_SERIES, "Too many CIDs for the history store");
+
+static tsdb_block_t ram_blocks[CONFIG_HISTORY_RAM_BLOCKS];
+static tsdb_t db;
+static SemaphoreHandle_t lock = NULL;
+static history_stats_t stats;
+
+// Any time before this means the clock has not been set yet (2020-01-01)
+#define EPOCH_VALID_AFTER           (1577836800L)
+
+#ifdef CONFIG_HISTORY_FLASH
+
+// Partition holding the archive (type 0x40, see partitions_hap.csv)
+#define ARCHIVE_PARTITION_TYPE      (0x40)
+#define ARCHIVE_PARTITION_NAME      "tsdb"
+#define ARCHIVE_SECTOR_SIZE         (4096)
+#define ARCHIVE_PER_SECTOR          (ARCHIVE_SECTOR_SIZE / TSDB_BLOCK_SIZE)
+
+_Static_assert(ARCHIVE_SECTOR_SIZE % TSDB_BLOCK_SIZE == 0, "Blocks must not straddle sectors");
+
+static const esp_partition_t *archive = NULL;
+static uint32_t archive_slots = 0;
+static uint32_t archive_write = 0;      // Slot the next block goes to, the oldest block follows it
+
+static bool archive_read_header(uint32_t slot, tsdb_block_header_t *header)
+{
+    return (esp_partition_read(archive, slot * TSDB_BLOCK_SIZE, header, sizeof(tsdb_block_header_t)) == ESP_OK) &&
+           (header->magic == TSDB_BLOCK_MAGIC);
+}
+
+/**
+ * @brief Finds the newest block in the archive
+ * @returns the sequence number to continue from
+ */
+static uint32_t archive_recover(void)
+{
+    tsdb_block_header_t header;
+    uint32_t max_seq = 0;
+    bool found = false;
+
+    for (uint32_t slot = 0; slot < archive_slots; slot++)
+    {
+        if (archive_read_header(slot, &header) && (!found || (header.seq > max_seq)))
+        {
+            max_seq = header.seq;
+            archive_write = (slot + 1) % archive_slots;
+            found = true;
+        }
+    }
+    ESP_LOGI(TAG, "Archive: %u blocks, next block %u", archive_slots, found ? max_seq + 1 : 0);
+    return found ? max_seq + 1 : 0;
+}
+
+/**
+ * @brief Writes a sealed block. Entering a new sector erases it, dropping the oldest blocks.
+ */
+static void archive_block(const tsdb_block_t *block)
+{
+    if (archive == NULL)
+    {
+        return;
+    }
+    esp_err_t err = ESP_OK;
+    if (archive_write % ARCHIVE_PER_SECTOR == 0)
+    {
+        err = esp_partition_erase_range(archive, archive_write * TSDB_BLOCK_SIZE, ARCHIVE_SECTOR_SIZE);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_partition_write(archive, archive_write * TSDB_BLOCK_SIZE, block, TSDB_BLOCK_SIZE);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to archive block %u: %s", block->header.seq, esp_err_to_name(err));
+        stats.archive_errors++;
+        return;
+    }
+    archive_write = (archive_write + 1) % archive_slots;
+    stats.archived++;
+}
+
+/**
+ * @brief Queries the archived blocks older than anything still in RAM, oldest first
+ */
+static uint32_t archive_query(uint32_t before_seq, uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx, bool *stopped)
+{
+    // Only one block is read at a time
+    static tsdb_block_t block;
+    uint32_t found = 0;
+
+    if (archive == NULL)
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; (i < archive_slots) && !*stopped; i++)
+    {
+        uint32_t slot = (archive_write + i) % archive_slots;
+        if (!archive_read_header(slot, &block.header) || (block.header.seq >= before_seq) ||
+            (block.header.last_ts < from) || (block.header.first_ts > to))
+        {
+            continue;
+        }
+        if (esp_partition_read(archive, slot * TSDB_BLOCK_SIZE, &block, TSDB_BLOCK_SIZE) == ESP_OK)
+        {
+            found += tsdb_block_query(&block, from, to, cb, ctx, stopped);
+        }
+    }
+    return found;
+}
+
+#endif
+
+esp_err_t history_init(void)
+{
+    uint32_t first_seq = 0;
+
+    lock = xSemaphoreCreateMutex();
+    if (lock == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+#ifdef CONFIG_HISTORY_FLASH
+    archive = esp_partition_find_first(ARCHIVE_PARTITION_TYPE, ESP_PARTITION_SUBTYPE_ANY, ARCHIVE_PARTITION_NAME);
+    if (archive == NULL)
+    {
+        ESP_LOGE(TAG, "No '%s' partition, history is kept in RAM only", ARCHIVE_PARTITION_NAME);
+    }
+    else
+    {
+        archive_slots = (archive->size / ARCHIVE_SECTOR_SIZE) * ARCHIVE_PER_SECTOR;
+        first_seq = archive_recover();
+    }
+#endif
+    tsdb_init(&db, ram_blocks, CONFIG_HISTORY_RAM_BLOCKS, modbus_cid_count(), first_seq);
+    return ESP_OK;
+}
+
+void history_record(const sensor_snapshot_t *snapshot)
+{
+    int16_t values[TSDB_MAX_SERIES];
+
+    if (lock == NULL)
+    {
+        return;
+    }
+    time_t now = time(NULL);
+    if (now <= EPOCH_VALID_AFTER)
+    {
+        // Samples are keyed by wall clock time, wait for SNTP
+        xSemaphoreTake(lock, portMAX_DELAY);
+        stats.unsynced++;
+        xSemaphoreGive(lock);
+        return;
+    }
+    for (uint16_t i = 0; i < db.series; i++)
+    {
+        const snapshot_value_t *v = &snapshot->values[i];
+        if ((i < snapshot->count) && (v->quality & SNAPSHOT_QUALITY_UPDATED))
+        {
+            values[i] = (int16_t)lrintf(v->value * 10.0f);
+        }
+        else
+        {
+            values[i] = TSDB_MISSING;
+        }
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const tsdb_block_t *sealed = tsdb_append(&db, (uint32_t)now, values);
+#ifdef CONFIG_HISTORY_FLASH
+    if (sealed)
+    {
+        archive_block(sealed);
+    }
+#else
+    (void)sealed;
+#endif
+    xSemaphoreGive(lock);
+}
+
+uint32_t history_query(uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx)
+{
+    uint32_t found = 0;
+
+    if (lock == NULL)
+    {
+        return 0;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+#ifdef CONFIG_HISTORY_FLASH
+    const tsdb_block_t *oldest = tsdb_oldest_block(&db);
+    bool stopped = false;
+    found += archive_query(oldest ? oldest->header.seq : db.next_seq, from, to, cb, ctx, &stopped);
+    if (!stopped)
+#endif
+    {
+        found += tsdb_query(&db, from, to, cb, ctx);
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+void history_get_stats(history_stats_t *out)
+{
+    if (lock == NULL)
+    {
+        memset(out, 0, sizeof(history_stats_t));
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *out = stats;
+    out->samples = db.samples;
+    out->bytes = db.bytes;
+    out->blocks = db.used;
+    xSemaphoreGive(lock);
+}
+
+void history_log(void)
+{
+    history_stats_t s;
+    history_get_stats(&s);
+    ESP_LOGI(TAG, "History: %u samples in %u/%d blocks, %u bytes (%0.02f bytes/sample), %u archived, %u archive errors, %u before clock set",
+                    s.samples, s.blocks, CONFIG_HISTORY_RAM_BLOCKS, s.bytes,
+                    s.samples ? (float)s.bytes / s.samples : 0.0f, s.archived, s.archive_errors, s.unsynced);
+}
+
+#endif
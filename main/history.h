@@ -0,0 +1,61 @@
+/*
+    On-device sensor history
+
+    Records every poll into the compressed time-series store (tsdb.h) so the device keeps its
+    own history rather than relying on ThingSpeak. Values are stored in the sensor's x10 fixed
+    point. The RAM ring holds CONFIG_HISTORY_RAM_BLOCKS blocks; with CONFIG_HISTORY_FLASH every
+    sealed block is also written to the "tsdb" partition, which keeps a much longer history and
+    survives a reboot. Queries cover flash and RAM, oldest first.
+
+    history_record() is called by the poller; queries may come from any task.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "snapshot.h"
+#include "tsdb.h"
+
+typedef struct
+{
+    uint32_t samples;           // Samples in RAM
+    uint32_t bytes;             // Bytes used by the samples in RAM
+    uint32_t blocks;            // Blocks in use in RAM
+    uint32_t archived;          // Blocks written to flash since boot
+    uint32_t archive_errors;    // Failed flash writes
+    uint32_t unsynced;          // Polls not recorded because the clock was not set yet
+} history_stats_t;
+
+/**
+ * @brief Sets up the store and finds the end of the flash archive
+ */
+esp_err_t history_init(void);
+
+/**
+ * @brief Adds the values of a snapshot, stamped with the current time. Only values refreshed
+ * by the poll that published the snapshot are stored, the others are stored as missing, which
+ * the store keeps out of the deltas (see tsdb.h), so a row per slave poll stays small.
+ * Nothing is recorded until SNTP has set the clock.
+ */
+void history_record(const sensor_snapshot_t *snapshot);
+
+/**
+ * @brief Finds the samples taken in [from, to] (seconds, the same clock as time()), oldest
+ * first. Values are x10 fixed point, TSDB_MISSING for a failed read. The callback runs with
+ * the store locked and should not block.
+ * @returns number of samples passed to cb
+ */
+uint32_t history_query(uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx);
+
+/**
+ * @brief Returns the store counters
+ */
+void history_get_stats(history_stats_t *stats);
+
+/**
+ * @brief Logs the store counters
+ */
+void history_log(void);
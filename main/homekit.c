@@ -18,6 +18,10 @@
 #include <app_hap_setup_payload.h>
 #include "wifi.h"
 #include "modbus.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "notify_filter.h"
+#include "derived.h"
 
 #ifdef CONFIG_HOMEKIT_ENABLED
 
@@ -36,9 +40,51 @@ static const char *homekit_TASK_NAME = "hap";
 /* The button "Boot" will be used as the Reset button for the example */
 static const uint16_t RESET_GPIO = GPIO_NUM_0;
 
-/* Char definitions for our sensors */
-static hap_char_t *temperature_char = 0;
-static hap_char_t *humidity_char = 0;
+/* Status fault values */
+#define FAULT_NONE      (0)
+#define FAULT_GENERAL   (1)
+
+/* Where a sensor's value comes from */
+typedef enum
+{
+    SOURCE_CID = 0,             // The snapshot value of cid
+    SOURCE_DEW_POINT,           // Computed from temperature and humidity, see derived.h
+    SOURCE_HEAT_INDEX,
+} sensor_source_t;
+
+/*
+ * Binds a HomeKit sensor service to the value it shows. The service priv points at its entry,
+ * so the read callback finds the source and characteristics without looking at UUIDs.
+ */
+typedef struct
+{
+    sensor_source_t source;
+    uint16_t cid;
+    const char *name;
+    hap_char_t *value_char;     // Current temperature/humidity
+    hap_char_t *fault_char;     // Status fault, set while the data is stale
+    notify_filter_t filter;     // Only meaningful changes are pushed, see notify_filter.h
+} homekit_sensor_t;
+
+enum
+{
+    SENSOR_TEMPERATURE = 0,
+    SENSOR_HUMIDITY,
+#ifdef CONFIG_HOMEKIT_DERIVED_SENSORS
+    SENSOR_DEW_POINT,
+    SENSOR_HEAT_INDEX,
+#endif
+    SENSOR_COUNT
+};
+
+static homekit_sensor_t sensors[SENSOR_COUNT] = {
+    [SENSOR_TEMPERATURE] = { .cid = CID_INP_DATA_TEMPERATURE, .name = "temperature" },
+    [SENSOR_HUMIDITY]    = { .cid = CID_INP_DATA_HUMIDITY,    .name = "humidity" },
+#ifdef CONFIG_HOMEKIT_DERIVED_SENSORS
+    [SENSOR_DEW_POINT]   = { .source = SOURCE_DEW_POINT,      .name = "dew point" },
+    [SENSOR_HEAT_INDEX]  = { .source = SOURCE_HEAT_INDEX,     .name = "heat index" },
+#endif
+};
 
 /**
  * @brief The factory reset button callback handler.
@@ -109,54 +155,148 @@ static void homekit_hap_event_handler(void* arg, esp_event_base_t event_base, in
     }
 }
 
-void temperature_update(float temperature)
+/**
+ * @brief Sets a characteristic only if the value differs, so an unchanged status does not
+ * raise an event to the controllers
+ */
+static void set_if_changed_u8(hap_char_t *hc, uint8_t value)
 {
-    ESP_LOGI(TAG, "Updating temperature: %0.01f", temperature);
+    const hap_val_t *cur = hap_char_get_val(hc);
+    if (cur && (cur->u == value))
+    {
+        return;
+    }
     hap_val_t new_val;
-    new_val.f = temperature;
-    hap_char_update_val(temperature_char, &new_val);
+    new_val.u = value;
+    hap_char_update_val(hc, &new_val);
 }
 
-void humidity_update(float humidity)
+/**
+ * @brief A value is stale if it has never been read or was last read too long ago
+ */
+static bool is_stale(const snapshot_value_t *value)
 {
-    ESP_LOGI(TAG, "Updating humidity: %0.01f", humidity);
+    uint32_t now_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    return !(value->quality & SNAPSHOT_QUALITY_VALID) ||
+           ((now_ms - value->timestamp_ms) > CONFIG_HOMEKIT_STALE_SECONDS * 1000UL);
+}
+
+/**
+ * @brief Gets the current value of a sensor. A derived value carries the older timestamp and
+ * the combined quality of the two readings it comes from.
+ */
+static bool sensor_value(const homekit_sensor_t *sensor, snapshot_value_t *value)
+{
+    if (sensor->source == SOURCE_CID)
+    {
+        return snapshot_get(sensor->cid, value);
+    }
+
+    snapshot_value_t temperature, humidity;
+    derived_metrics_t metrics;
+    if (!snapshot_get(CID_INP_DATA_TEMPERATURE, &temperature) || !snapshot_get(CID_INP_DATA_HUMIDITY, &humidity))
+    {
+        return false;
+    }
+    *value = temperature;
+    value->quality = temperature.quality & humidity.quality;
+    if ((int32_t)(humidity.timestamp_ms - temperature.timestamp_ms) < 0)
+    {
+        value->timestamp_ms = humidity.timestamp_ms;
+    }
+    if (!derived_compute(temperature.value, humidity.value, &metrics))
+    {
+        value->quality &= ~SNAPSHOT_QUALITY_VALID;
+        value->value = 0.0f;
+        return true;
+    }
+    value->value = (sensor->source == SOURCE_DEW_POINT) ? metrics.dew_point : metrics.heat_index;
+    return true;
+}
+
+/**
+ * @brief Pushes a new value to the controllers if the filter lets it through
+ */
+static void notify_update(homekit_sensor_t *sensor)
+{
+    snapshot_value_t value;
+    if ((sensor->value_char == NULL) || !sensor_value(sensor, &value))
+    {
+        // HAP is not up yet
+        return;
+    }
+    set_if_changed_u8(sensor->fault_char, is_stale(&value) ? FAULT_GENERAL : FAULT_NONE);
+    if (!notify_filter_check(&sensor->filter, value.value, xTaskGetTickCount() * portTICK_PERIOD_MS))
+    {
+        ESP_LOGD(TAG, "Not notifying %s: %0.01f (%u of %u sent)", sensor->name, value.value,
+                        sensor->filter.notified, sensor->filter.offered);
+        return;
+    }
+    // Always sent once the filter passes it: a max-interval heartbeat carries an unchanged value
+    ESP_LOGI(TAG, "Updating %s: %0.01f", sensor->name, value.value);
     hap_val_t new_val;
-    new_val.f = humidity;
-    hap_char_update_val(humidity_char, &new_val);
+    new_val.f = value.value;
+    hap_char_update_val(sensor->value_char, &new_val);
+}
+
+void homekit_notify(void)
+{
+    for (int i = 0; i < SENSOR_COUNT; i++)
+    {
+        notify_update(&sensors[i]);
+    }
 }
 
-/* 
- * Read routines are generally not required as the value is available with th HAP core
- * when it is updated from write routines. For external triggers (like fan switched on/off
- * using physical button), accessories should explicitly call hap_char_update_val()
- * instead of waiting for a read request.
+/*
+ * Reads are answered with the value the characteristic already holds, which homekit_notify()
+ * keeps up to date after every poll, rather than the latest snapshot: hap_char_update_val()
+ * from the read path would raise events to the other controllers outside the notify filter.
+ * So a read may lag the latest poll by up to the filter's deadband (see the Kconfig help of
+ * HOMEKIT_STALE_SECONDS). The service priv tells us which sensor is being read.
  */
 static int homekit_read(hap_char_t *hc, hap_status_t *status_code, void *serv_priv, void *read_priv)
 {
+    homekit_sensor_t *sensor = (homekit_sensor_t *)serv_priv;
+    METRIC_CYCLES_BEGIN(start);
+
+    METRIC_COUNT(HOMEKIT_READS);
     if (hap_req_get_ctrl_id(read_priv))
     {
-        ESP_LOGI(TAG, "HC sensor received read from %s", hap_req_get_ctrl_id(read_priv));
+        ESP_LOGD(TAG, "HC sensor received read from %s", hap_req_get_ctrl_id(read_priv));
     }
-    if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_CURRENT_TEMPERATURE)) 
+    if (sensor == NULL)
     {
-        hap_val_t new_val;
-        new_val.f = get_temperature();
-        hap_char_update_val(hc, &new_val);
-        *status_code = HAP_STATUS_SUCCESS;
-        ESP_LOGI(TAG,"READ: temperature status updated to %0.01f", new_val.f);
+        *status_code = HAP_STATUS_RES_ABSENT;
+        METRIC_CYCLES_END(HOMEKIT_READ, start);
+        return HAP_FAIL;
     }
-    // Only update the sensor info on a temperature read since they are read one after another
-    if (!strcmp(hap_char_get_type_uuid(hc), HAP_CHAR_UUID_CURRENT_RELATIVE_HUMIDITY)) 
+
+    if (hc == sensor->value_char)
     {
-        hap_val_t new_val;
-        new_val.f = get_humidity();;
-        hap_char_update_val(hc, &new_val);
-        *status_code = HAP_STATUS_SUCCESS;
-        ESP_LOGI(TAG,"READ: humidity status updated to %0.01f%%", new_val.f);
+        const hap_val_t *cur = hap_char_get_val(hc);
+        ESP_LOGD(TAG, "READ: %s %0.01f", sensor->name, cur ? cur->f : 0.0f);
     }
+    *status_code = HAP_STATUS_SUCCESS;
+    METRIC_CYCLES_END(HOMEKIT_READ, start);
     return HAP_SUCCESS;
 }
 
+/**
+ * @brief Creates the service for one sensor and binds it to its entry in sensors[]
+ */
+static hap_serv_t *create_sensor_service(homekit_sensor_t *sensor, hap_serv_t *service, const char *char_uuid, char *name)
+{
+    /* Include the "name" since this is a user visible service  */
+    hap_serv_add_char(service, hap_char_name_create(name));
+    hap_serv_add_char(service, hap_char_status_fault_create(FAULT_NONE));
+    /* Set the read callback for the service, priv tells it which sensor this is */
+    hap_serv_set_priv(service, sensor);
+    hap_serv_set_read_cb(service, homekit_read);
+    sensor->value_char = hap_serv_get_char_by_uuid(service, char_uuid);
+    sensor->fault_char = hap_serv_get_char_by_uuid(service, HAP_CHAR_UUID_STATUS_FAULT);
+    return service;
+}
+
 /**
  * @brief Main Thread to handle setting up the service and accessories for the GarageDoor
  */
@@ -201,28 +341,26 @@ static void homekit_thread_entry(void *p)
     uint8_t product_data[] = {'E','S','P','3','2','H','A','P'};
     hap_acc_add_product_data(homekitaccessory, product_data, sizeof(product_data));
 
-    float temperature = get_temperature();
-    float humidity = get_humidity();
-    ESP_LOGI(TAG, "Creating temperature service (current temp: %0.01fC)", temperature);
-    /* Create the temp Service. Include the "name" since this is a user visible service  */
-    tempservice = hap_serv_temperature_sensor_create(temperature);
-    hap_serv_add_char(tempservice, hap_char_name_create("ESP Temperature Sensor"));
-    /* Set the read callback for the service (optional) */
-    hap_serv_set_read_cb(tempservice, homekit_read);
-    /* Add the Garage Service to the Accessory Object */
+    sensor_values_t values;
+    modbus_get_values(&values);
+    ESP_LOGI(TAG, "Creating temperature service (current temp: %0.01fC)", values.temperature);
+    tempservice = create_sensor_service(&sensors[SENSOR_TEMPERATURE], hap_serv_temperature_sensor_create(values.temperature),
+                                        HAP_CHAR_UUID_CURRENT_TEMPERATURE, "ESP Temperature Sensor");
     hap_acc_add_serv(homekitaccessory, tempservice);
-    temperature_char = hap_serv_get_char_by_uuid(tempservice, HAP_CHAR_UUID_CURRENT_TEMPERATURE);
-
-    ESP_LOGI(TAG, "Creating humidity service (current humidity: %0.01f%%)", humidity);
-    /* Create the humidity Service. Include the "name" since this is a user visible service  */
-    humidityservice = hap_serv_humidity_sensor_create(humidity);
-    hap_serv_add_char(humidityservice, hap_char_name_create("ESP Humidity Sensor"));
-    /* Set the read callback for the service (optional) */
-    hap_serv_set_read_cb(humidityservice, homekit_read);
-    /* Add the Garage Service to the Accessory Object */
+
+    ESP_LOGI(TAG, "Creating humidity service (current humidity: %0.01f%%)", values.humidity);
+    humidityservice = create_sensor_service(&sensors[SENSOR_HUMIDITY], hap_serv_humidity_sensor_create(values.humidity),
+                                            HAP_CHAR_UUID_CURRENT_RELATIVE_HUMIDITY, "ESP Humidity Sensor");
     hap_acc_add_serv(homekitaccessory, humidityservice);
-    humidity_char = hap_serv_get_char_by_uuid(humidityservice, HAP_CHAR_UUID_CURRENT_TEMPERATURE);
 
+#ifdef CONFIG_HOMEKIT_DERIVED_SENSORS
+    /* HomeKit has no dew point or heat index characteristic, they show as temperature sensors */
+    ESP_LOGI(TAG, "Creating dew point and heat index services");
+    hap_acc_add_serv(homekitaccessory, create_sensor_service(&sensors[SENSOR_DEW_POINT],
+                        hap_serv_temperature_sensor_create(0.0f), HAP_CHAR_UUID_CURRENT_TEMPERATURE, "ESP Dew Point"));
+    hap_acc_add_serv(homekitaccessory, create_sensor_service(&sensors[SENSOR_HEAT_INDEX],
+                        hap_serv_temperature_sensor_create(0.0f), HAP_CHAR_UUID_CURRENT_TEMPERATURE, "ESP Heat Index"));
+#endif
 
 #if 0
     /* Create the Firmware Upgrade HomeKit Custom Service.
@@ -295,6 +433,25 @@ static void homekit_thread_entry(void *p)
 
 void homekit_start(void)
 {
+    notify_filter_cfg_t temperature_cfg = {
+        .abs_deadband = CONFIG_HOMEKIT_TEMP_DEADBAND_TENTHS / 10.0f,
+        .rel_deadband = CONFIG_HOMEKIT_TEMP_DEADBAND_PERCENT / 100.0f,
+        .min_interval_ms = CONFIG_HOMEKIT_TEMP_MIN_INTERVAL_SECONDS * 1000,
+        .max_interval_ms = CONFIG_HOMEKIT_TEMP_MAX_INTERVAL_SECONDS * 1000,
+    };
+    notify_filter_cfg_t humidity_cfg = {
+        .abs_deadband = CONFIG_HOMEKIT_HUMIDITY_DEADBAND_TENTHS / 10.0f,
+        .rel_deadband = CONFIG_HOMEKIT_HUMIDITY_DEADBAND_PERCENT / 100.0f,
+        .min_interval_ms = CONFIG_HOMEKIT_HUMIDITY_MIN_INTERVAL_SECONDS * 1000,
+        .max_interval_ms = CONFIG_HOMEKIT_HUMIDITY_MAX_INTERVAL_SECONDS * 1000,
+    };
+    notify_filter_init(&sensors[SENSOR_TEMPERATURE].filter, &temperature_cfg);
+    notify_filter_init(&sensors[SENSOR_HUMIDITY].filter, &humidity_cfg);
+#ifdef CONFIG_HOMEKIT_DERIVED_SENSORS
+    notify_filter_init(&sensors[SENSOR_DEW_POINT].filter, &temperature_cfg);
+    notify_filter_init(&sensors[SENSOR_HEAT_INDEX].filter, &temperature_cfg);
+#endif
+
     ESP_LOGI(TAG, "Creating homekit thread...");
     xTaskCreate(homekit_thread_entry, homekit_TASK_NAME, homekit_TASK_STACKSIZE, NULL, homekit_TASK_PRIORITY, NULL);
 }
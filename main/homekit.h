@@ -1,5 +1,8 @@
 #pragma once
 
 void homekit_start(void);
-void temperature_update(float temperature);
-void humidity_update(float humidity);
+/**
+ * @brief Pushes the latest snapshot to the controllers (filtered, see notify_filter.h).
+ * Called by the poller after each publish.
+ */
+void homekit_notify(void);
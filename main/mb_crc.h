@@ -0,0 +1,58 @@
+/*
+    Modbus CRC-16 and LRC
+
+    Checksums for Modbus RTU (CRC-16, polynomial 0xA001 reflected, initial value 0xFFFF) and
+    Modbus ASCII (LRC, two's complement of the byte sum). The CRC implementation is picked in
+    menuconfig to trade speed against memory:
+
+    - MB_CRC_BITWISE: no table, slowest, smallest.
+    - MB_CRC_TABLE: one 256 entry table (512 bytes, const in flash), one lookup per byte.
+    - MB_CRC_SLICE4: four 256 entry tables (2K, const in flash), four bytes per step. The
+      first of them also serves the bytes that do not fill a step.
+
+    All the tables are const, so the CRC can be used from any task from the start.
+    MB_CRC_IN_IRAM places the CRC code in IRAM and the tables in DRAM so it does not take
+    flash cache misses while the UART is busy. tools/crc_bench checks all three against known
+    Modbus frames on a host and compares their speed.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Initial value of the Modbus CRC
+#define MB_CRC16_INIT (0xFFFF)
+
+/**
+ * @brief Continues a CRC over more data, for frames that arrive in pieces
+ * @param crc - CRC so far (MB_CRC16_INIT for the first piece)
+ * @param data - data to add
+ * @param len - number of bytes
+ * @returns updated CRC
+ */
+uint16_t mb_crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+
+/**
+ * @brief Computes the Modbus CRC-16 of a buffer. The low byte goes on the wire first.
+ */
+uint16_t mb_crc16(const uint8_t *data, size_t len);
+
+/**
+ * @brief Computes the Modbus ASCII LRC of a buffer (binary bytes, before hex encoding)
+ */
+uint8_t mb_lrc(const uint8_t *data, size_t len);
+
+/**
+ * @brief Checks the selected implementation against known Modbus frames
+ * @returns true if every check value matches
+ */
+bool mb_crc_self_test(void);
+
+/**
+ * @brief Name of the selected CRC implementation for logging
+ */
+const char *mb_crc_variant(void);
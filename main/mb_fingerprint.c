@@ -0,0 +1,86 @@
+/*
+    Modbus device fingerprints
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "mb_fingerprint.h"
+
+// Sensor numbers added to the names are a single digit
+_Static_assert(REGMAP_MAX_ENTRIES < 20, "Too many XY-MD02 sensors for single digit names");
+
+static bool xymd02_check_address(uint8_t slave, const uint16_t *regs)
+{
+    return regs[0] == slave;
+}
+
+static bool xymd02_check_values(uint8_t slave, const uint16_t *regs)
+{
+    int16_t temperature = (int16_t)regs[0];
+    int16_t humidity = (int16_t)regs[1];
+    (void)slave;
+    return (temperature >= -400) && (temperature <= 600) && (humidity >= 0) && (humidity <= 1000);
+}
+
+/**
+ * @brief Appends the XY-MD02 temperature and humidity. The second and later sensors get
+ * their number added to the names so the log can tell them apart.
+ */
+static bool xymd02_add_to_map(regmap_t *map, uint8_t slave)
+{
+    regmap_t builtin;
+    regmap_builtin(&builtin, slave);
+    if (map->count + builtin.count > REGMAP_MAX_ENTRIES)
+    {
+        return false;
+    }
+    unsigned sensor = map->count / builtin.count + 1;
+    for (uint8_t i = 0; i < builtin.count; i++)
+    {
+        regmap_param_t *param = &map->params[map->count++];
+        *param = builtin.params[i];
+        if (sensor > 1)
+        {
+            size_t len = strlen(param->name);
+            len = (len < REGMAP_NAME_LEN) ? len : REGMAP_NAME_LEN - 1;
+            param->name[len] = (char)('0' + sensor);
+            param->name[len + 1] = '\0';
+        }
+    }
+    return true;
+}
+
+// The address check comes first: it is one register and rules out most other devices
+static const mb_fingerprint_probe_t xymd02_probes[] = {
+    { MB_RTU_FUNC_READ_HOLDING, 0x0101, 1, xymd02_check_address },
+    { MB_RTU_FUNC_READ_INPUT,   0x0001, 2, xymd02_check_values },
+};
+
+static const mb_fingerprint_t fingerprints[] = {
+    { "XY-MD02", xymd02_probes, sizeof(xymd02_probes) / sizeof(xymd02_probes[0]), xymd02_add_to_map },
+};
+
+const mb_fingerprint_t *mb_fingerprint_identify(uint8_t slave, mb_fingerprint_read_t read, void *ctx)
+{
+    for (size_t f = 0; f < sizeof(fingerprints) / sizeof(fingerprints[0]); f++)
+    {
+        const mb_fingerprint_t *fp = &fingerprints[f];
+        uint8_t p;
+        for (p = 0; p < fp->probe_count; p++)
+        {
+            const mb_fingerprint_probe_t *probe = &fp->probes[p];
+            uint16_t regs[MB_FINGERPRINT_MAX_REGS] = { 0 };
+            if ((read(ctx, slave, probe->function, probe->reg_start, probe->reg_count, regs) != MB_RTU_OK) ||
+                !probe->check(slave, regs))
+            {
+                break;
+            }
+        }
+        if (p == fp->probe_count)
+        {
+            return fp;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,62 @@
+/*
+    Modbus device fingerprints
+
+    Identifies the device at a slave address by probing register ranges known for each
+    supported device type and checking the answers make sense. Used by the bus scan to turn
+    the addresses that respond into a register map.
+
+    XY-MD02: holding 0x0101 holds its own slave address, and input 0x0001-0x0002 hold a
+    plausible temperature (-40 to 60C) and humidity (0 to 100%), signed x10.
+
+    The reads go through a callback, so this is plain C with no ESP-IDF dependencies and the
+    host poller in tools/xymd02_sim uses it too.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mb_rtu.h"
+#include "regmap.h"
+
+// Most registers a probe reads
+#define MB_FINGERPRINT_MAX_REGS (4)
+
+/**
+ * @brief Reads registers from a slave
+ * @param ctx - context passed to mb_fingerprint_identify()
+ * @returns MB_RTU_OK with regs filled in
+ */
+typedef mb_rtu_status_t (*mb_fingerprint_read_t)(void *ctx, uint8_t slave, uint8_t function, uint16_t reg_start,
+                                                 uint16_t reg_count, uint16_t *regs);
+
+typedef struct
+{
+    uint8_t function;           // MB_RTU_FUNC_READ_HOLDING or MB_RTU_FUNC_READ_INPUT
+    uint16_t reg_start;
+    uint16_t reg_count;         // Up to MB_FINGERPRINT_MAX_REGS
+    bool (*check)(uint8_t slave, const uint16_t *regs);
+} mb_fingerprint_probe_t;
+
+typedef struct
+{
+    const char *name;
+    const mb_fingerprint_probe_t *probes;   // All must pass
+    uint8_t probe_count;
+    /**
+     * @brief Adds the device's values to a map
+     * @returns false if the map has no room for them
+     */
+    bool (*add_to_map)(regmap_t *map, uint8_t slave);
+} mb_fingerprint_t;
+
+/**
+ * @brief Probes a slave and returns the first device type whose probes all pass
+ * @param slave - address that answered the scan
+ * @param read - register read callback
+ * @param ctx - passed to read
+ * @returns device type, or NULL if the device is not one we know
+ */
+const mb_fingerprint_t *mb_fingerprint_identify(uint8_t slave, mb_fingerprint_read_t read, void *ctx);
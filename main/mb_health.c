@@ -0,0 +1,133 @@
+/*
+    Modbus slave health tracking
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "mb_health.h"
+
+void mb_health_init(mb_health_t *health, uint8_t slave_addr)
+{
+    memset(health, 0, sizeof(mb_health_t));
+    health->slave_addr = slave_addr;
+    health->state = MB_HEALTH_HEALTHY;
+    health->probe_interval_ms = MB_HEALTH_PROBE_MIN_MS;
+}
+
+bool mb_health_should_poll(mb_health_t *health, uint32_t now_ms)
+{
+    if (health->state != MB_HEALTH_OFFLINE)
+    {
+        return true;
+    }
+    if ((int32_t)(now_ms - health->next_probe_ms) >= 0)
+    {
+        return true;
+    }
+    health->skipped_polls++;
+    return false;
+}
+
+uint8_t mb_health_attempts(const mb_health_t *health)
+{
+    switch (health->state)
+    {
+        case MB_HEALTH_HEALTHY:
+            return MB_HEALTH_ATTEMPTS_HEALTHY;
+        case MB_HEALTH_DEGRADED:
+            return MB_HEALTH_ATTEMPTS_DEGRADED;
+        default:
+            return 1;
+    }
+}
+
+uint32_t mb_health_retry_delay_ms(uint8_t retry)
+{
+    uint32_t delay = MB_HEALTH_RETRY_BASE_MS;
+    while ((retry > 1) && (delay < MB_HEALTH_RETRY_MAX_MS))
+    {
+        delay <<= 1;
+        retry--;
+    }
+    return (delay > MB_HEALTH_RETRY_MAX_MS) ? MB_HEALTH_RETRY_MAX_MS : delay;
+}
+
+void mb_health_record(mb_health_t *health, mb_result_t result, uint32_t now_ms)
+{
+    if (result == MB_RESULT_BUSY)
+    {
+        // Never reached the bus
+        return;
+    }
+    health->transactions++;
+
+    if (result == MB_RESULT_OK)
+    {
+        if (health->state != MB_HEALTH_HEALTHY)
+        {
+            health->recoveries++;
+        }
+        health->state = MB_HEALTH_HEALTHY;
+        health->consecutive_failures = 0;
+        health->probe_interval_ms = MB_HEALTH_PROBE_MIN_MS;
+        return;
+    }
+
+    switch (result)
+    {
+        case MB_RESULT_TIMEOUT:
+            health->timeouts++;
+            break;
+        case MB_RESULT_CRC:
+            health->crc_errors++;
+            break;
+        case MB_RESULT_INVALID:
+            health->invalid_responses++;
+            break;
+        default:
+            health->errors++;
+            break;
+    }
+    if (health->consecutive_failures < UINT16_MAX)
+    {
+        health->consecutive_failures++;
+    }
+
+    if (health->state == MB_HEALTH_OFFLINE)
+    {
+        // Failed probe, back off further
+        health->probe_interval_ms <<= 1;
+        if (health->probe_interval_ms > MB_HEALTH_PROBE_MAX_MS)
+        {
+            health->probe_interval_ms = MB_HEALTH_PROBE_MAX_MS;
+        }
+        health->next_probe_ms = now_ms + health->probe_interval_ms;
+    }
+    else if (health->consecutive_failures >= MB_HEALTH_OFFLINE_THRESHOLD)
+    {
+        health->state = MB_HEALTH_OFFLINE;
+        health->offline_events++;
+        health->probe_interval_ms = MB_HEALTH_PROBE_MIN_MS;
+        health->next_probe_ms = now_ms + health->probe_interval_ms;
+    }
+    else if (health->consecutive_failures >= MB_HEALTH_DEGRADED_THRESHOLD)
+    {
+        health->state = MB_HEALTH_DEGRADED;
+    }
+}
+
+const char *mb_health_state_name(mb_health_state_t state)
+{
+    switch (state)
+    {
+        case MB_HEALTH_HEALTHY:
+            return "healthy";
+        case MB_HEALTH_DEGRADED:
+            return "degraded";
+        case MB_HEALTH_OFFLINE:
+            return "offline";
+        default:
+            return "unknown";
+    }
+}
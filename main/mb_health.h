@@ -0,0 +1,119 @@
+/*
+    Modbus slave health tracking
+
+    Each slave on the bus moves between three states based on the outcome of its
+    transactions:
+
+    - HEALTHY: full retry budget, retries back off exponentially from MB_HEALTH_RETRY_BASE_MS.
+    - DEGRADED: a few consecutive failures. A single retry only, so a struggling slave does
+      not hold the bus for long.
+    - OFFLINE: the circuit is open. The slave is not polled at all; instead a single cheap
+      probe is sent every probe interval, which doubles on every failed probe up to
+      MB_HEALTH_PROBE_MAX_MS. The first good response brings the slave back to HEALTHY.
+
+    All times are in milliseconds from a free running clock supplied by the caller.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of attempts per transaction for a healthy slave
+#define MB_HEALTH_ATTEMPTS_HEALTHY      (3)
+// Number of attempts per transaction for a degraded slave
+#define MB_HEALTH_ATTEMPTS_DEGRADED     (2)
+// First retry delay, doubled on each further retry
+#define MB_HEALTH_RETRY_BASE_MS         (50)
+// Upper limit for the retry delay
+#define MB_HEALTH_RETRY_MAX_MS          (400)
+// Consecutive failed transactions before a slave is degraded
+#define MB_HEALTH_DEGRADED_THRESHOLD    (2)
+// Consecutive failed transactions before a slave is taken offline
+#define MB_HEALTH_OFFLINE_THRESHOLD     (6)
+// First probe interval once offline, doubled on every failed probe
+#define MB_HEALTH_PROBE_MIN_MS          (5000)
+// Upper limit for the probe interval
+#define MB_HEALTH_PROBE_MAX_MS          (300000)
+
+typedef enum
+{
+    MB_HEALTH_HEALTHY = 0,
+    MB_HEALTH_DEGRADED,
+    MB_HEALTH_OFFLINE,
+} mb_health_state_t;
+
+/**
+ * Outcome of a single transaction
+ */
+typedef enum
+{
+    MB_RESULT_OK = 0,
+    MB_RESULT_TIMEOUT,          // No (complete) response
+    MB_RESULT_CRC,              // Response failed the CRC check
+    MB_RESULT_INVALID,          // Response from the wrong slave or function, or of the wrong
+                                // length. The freemodbus engine does not tell these apart from
+                                // a bad CRC or an exception, so with it every bad response.
+    MB_RESULT_ERROR,            // Exception response or any other failure
+    MB_RESULT_BUSY,             // The master could not take the request, nothing was sent.
+                                // Says nothing about the slave, so it is not recorded.
+} mb_result_t;
+
+typedef struct
+{
+    uint8_t slave_addr;
+    mb_health_state_t state;
+    uint16_t consecutive_failures;
+    uint32_t probe_interval_ms; // Current probe interval while offline
+    uint32_t next_probe_ms;     // Time of the next probe while offline
+    // Counters
+    uint32_t transactions;
+    uint32_t timeouts;
+    uint32_t crc_errors;        // See MB_RESULT_CRC
+    uint32_t invalid_responses; // See MB_RESULT_INVALID
+    uint32_t errors;
+    uint32_t offline_events;    // Number of times the slave went offline
+    uint32_t recoveries;        // Number of times the slave came back to healthy
+    uint32_t skipped_polls;     // Polls not sent because the circuit was open
+} mb_health_t;
+
+/**
+ * @brief Sets up the health state of a slave (starts HEALTHY)
+ */
+void mb_health_init(mb_health_t *health, uint8_t slave_addr);
+
+/**
+ * @brief Checks if the slave should be polled now. Always true unless the slave is offline,
+ * in which case it is true once per probe interval (and the poll should be a probe).
+ * @param health - health state
+ * @param now_ms - current time
+ * @returns true if the slave should be polled
+ */
+bool mb_health_should_poll(mb_health_t *health, uint32_t now_ms);
+
+/**
+ * @brief Number of attempts allowed for a transaction in the current state. Offline slaves
+ * get exactly one (the probe).
+ */
+uint8_t mb_health_attempts(const mb_health_t *health);
+
+/**
+ * @brief Delay before the given retry (1 for the first retry), exponential backoff
+ */
+uint32_t mb_health_retry_delay_ms(uint8_t retry);
+
+/**
+ * @brief Records the outcome of a transaction and updates the state. MB_RESULT_BUSY is
+ * ignored.
+ * @param health - health state
+ * @param result - outcome of the transaction
+ * @param now_ms - current time
+ */
+void mb_health_record(mb_health_t *health, mb_result_t result, uint32_t now_ms);
+
+/**
+ * @brief Name of a state for logging
+ */
+const char *mb_health_state_name(mb_health_state_t state);
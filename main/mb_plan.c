@@ -0,0 +1,133 @@
+/*
+    Modbus read plan
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include "mb_plan.h"
+#include "mb_rtu.h"
+
+/**
+ * @brief Orders two map entries by slave, register type and start register
+ */
+static bool entry_before(const regmap_param_t *a, const regmap_param_t *b)
+{
+    if (a->slave != b->slave)
+    {
+        return a->slave < b->slave;
+    }
+    if (a->reg_type != b->reg_type)
+    {
+        return a->reg_type < b->reg_type;
+    }
+    return a->reg_start <= b->reg_start;
+}
+
+uint16_t mb_plan_build(mb_plan_t *plan, const regmap_t *map)
+{
+    // Sort the map indexes by slave, register type and start register. The table is tiny so
+    // an insertion sort is all we need.
+    for (uint16_t i = 0; i < map->count; i++)
+    {
+        uint16_t j = i;
+        while ((j > 0) && !entry_before(&map->params[plan->order[j - 1]], &map->params[i]))
+        {
+            plan->order[j] = plan->order[j - 1];
+            j--;
+        }
+        plan->order[j] = i;
+    }
+
+    plan->count = 0;
+    mb_plan_group_t *group = NULL;
+    for (uint16_t i = 0; i < map->count; i++)
+    {
+        const regmap_param_t *param = &map->params[plan->order[i]];
+        uint8_t function = (param->reg_type == REGMAP_REG_INPUT) ? MB_RTU_FUNC_READ_INPUT : MB_RTU_FUNC_READ_HOLDING;
+        uint32_t param_end = (uint32_t)param->reg_start + param->reg_count;
+        if ((group != NULL) &&
+            (group->slave_addr == param->slave) &&
+            (group->function == function) &&
+            (param->reg_start <= group->reg_start + group->reg_size) &&
+            (param_end - group->reg_start <= MB_PLAN_MAX_REGS))
+        {
+            // Contiguous (or overlapping) with the current group, so extend it
+            if (param_end > (uint32_t)group->reg_start + group->reg_size)
+            {
+                group->reg_size = (uint16_t)(param_end - group->reg_start);
+            }
+            group->count++;
+            continue;
+        }
+        group = &plan->groups[plan->count++];
+        group->slave_addr = param->slave;
+        group->function = function;
+        group->reg_start = param->reg_start;
+        group->reg_size = param->reg_count;
+        group->first = i;
+        group->count = 1;
+    }
+    return plan->count;
+}
+
+/**
+ * @brief Sends a request, retrying with exponential backoff as allowed by the health state
+ * of the slave
+ * @returns true if an attempt succeeded
+ */
+static bool send_with_retry(const mb_plan_io_t *io, mb_health_t *health, uint8_t slave_addr, uint8_t function,
+                            uint16_t reg_start, uint16_t reg_count, uint16_t *regs)
+{
+    uint8_t attempts = mb_health_attempts(health);
+    for (uint8_t attempt = 0; attempt < attempts; attempt++)
+    {
+        if (attempt > 0)
+        {
+            io->backoff(io->ctx, mb_health_retry_delay_ms(attempt));
+        }
+        // A busy master uses up the attempt but is not held against the slave
+        mb_result_t result = io->send(io->ctx, slave_addr, function, reg_start, reg_count, regs);
+        mb_health_record(health, result, io->now_ms(io->ctx));
+        if (result == MB_RESULT_OK)
+        {
+            return true;
+        }
+        if (io->failed)
+        {
+            io->failed(io->ctx, health, attempt + 1, attempts);
+        }
+        // The slave may have just gone offline, don't keep hammering it
+        attempts = (attempts < mb_health_attempts(health)) ? attempts : mb_health_attempts(health);
+    }
+    return false;
+}
+
+mb_plan_read_t mb_plan_read(const mb_plan_group_t *group, mb_health_t *health, const mb_plan_io_t *io, uint16_t *regs)
+{
+    if (!mb_health_should_poll(health, io->now_ms(io->ctx)))
+    {
+        // Circuit is open, leave the bus to the other slaves
+        return MB_PLAN_READ_SKIPPED;
+    }
+    if (health->state == MB_HEALTH_OFFLINE)
+    {
+        // Cheap probe: a single register, single attempt
+        if (!send_with_retry(io, health, group->slave_addr, group->function, group->reg_start, 1, regs))
+        {
+            return MB_PLAN_READ_OFFLINE;
+        }
+    }
+    if (!send_with_retry(io, health, group->slave_addr, group->function, group->reg_start, group->reg_size, regs))
+    {
+        return MB_PLAN_READ_FAILED;
+    }
+    return MB_PLAN_READ_OK;
+}
+
+float mb_plan_decode(const mb_plan_t *plan, const regmap_t *map, const mb_plan_group_t *group, uint16_t index,
+                     const uint16_t *regs, uint16_t *cid)
+{
+    *cid = plan->order[group->first + index];
+    const regmap_param_t *param = &map->params[*cid];
+    return param->decode(&regs[param->reg_start - group->reg_start], param->scale);
+}
@@ -0,0 +1,107 @@
+/*
+    Modbus read plan
+
+    Turns a register map (regmap.h) into the transactions that read it. Entries on the same
+    slave and register type whose registers are contiguous (or overlap) are grouped, so each
+    group is fetched with a single FC03/FC04 request and every value in it is decoded out of
+    the shared response. Groups are capped at MB_PLAN_MAX_REGS registers.
+
+    mb_plan_read() sends one group with the retry and circuit breaker policy of mb_health.h:
+    a slave whose circuit is open is skipped, an offline slave gets a single one register
+    probe first, and failed attempts back off before the retry. The transport is supplied by
+    the caller, so the firmware and the host poller (tools/xymd02_sim) share the same path.
+
+    Plain C with no ESP-IDF dependencies.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "regmap.h"
+#include "mb_health.h"
+
+// Largest number of registers read with a single request. Keeps the response buffer on the
+// stack small and well under the 125 register limit of FC03/FC04.
+#define MB_PLAN_MAX_REGS    (16)
+
+/**
+ * A group of map entries on the same slave and register type that occupy a contiguous
+ * register range, and so can be read with a single Modbus transaction.
+ */
+typedef struct
+{
+    uint8_t slave_addr;         // Modbus slave address
+    uint8_t function;           // MB_RTU_FUNC_READ_INPUT or MB_RTU_FUNC_READ_HOLDING
+    uint16_t reg_start;         // First register of the group
+    uint16_t reg_size;          // Number of registers in the group
+    uint16_t first;             // First entry in order[] for the group
+    uint16_t count;             // Number of map entries in the group
+} mb_plan_group_t;
+
+typedef struct
+{
+    mb_plan_group_t groups[REGMAP_MAX_ENTRIES];
+    uint16_t order[REGMAP_MAX_ENTRIES];     // Map indexes (CIDs), sorted so each group is a consecutive run
+    uint16_t count;                         // Number of groups
+} mb_plan_t;
+
+typedef enum
+{
+    MB_PLAN_READ_OK = 0,        // Registers read
+    MB_PLAN_READ_SKIPPED,       // The slave's circuit is open, nothing was sent
+    MB_PLAN_READ_OFFLINE,       // The slave is offline and did not answer its probe
+    MB_PLAN_READ_FAILED,        // Every attempt failed
+} mb_plan_read_t;
+
+/**
+ * Transport and clock used by mb_plan_read()
+ */
+typedef struct
+{
+    // Sends one read request, fills regs in host byte order and classifies the outcome
+    mb_result_t (*send)(void *ctx, uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count,
+                        uint16_t *regs);
+    // Waits before a retry
+    void (*backoff)(void *ctx, uint32_t delay_ms);
+    // Reports a failed attempt, after it has been recorded against the slave (unless it was
+    // MB_RESULT_BUSY). May be NULL.
+    void (*failed)(void *ctx, const mb_health_t *health, uint8_t attempt, uint8_t attempts);
+    // Free running millisecond clock for mb_health.h
+    uint32_t (*now_ms)(void *ctx);
+    void *ctx;
+} mb_plan_io_t;
+
+/**
+ * @brief Builds the read plan of a register map
+ * @param plan - plan to fill in
+ * @param map - register map, with at most REGMAP_MAX_ENTRIES entries
+ * @returns number of groups in the plan
+ */
+uint16_t mb_plan_build(mb_plan_t *plan, const regmap_t *map);
+
+/**
+ * @brief Reads one group, retrying as the health state of the slave allows. Every attempt that
+ * reached the bus is recorded against the slave's health.
+ * @param group - group to read
+ * @param health - health state of the group's slave
+ * @param io - transport and clock
+ * @param regs - MB_PLAN_MAX_REGS registers, filled in host byte order on success
+ * @returns MB_PLAN_READ_OK if the group was read
+ */
+mb_plan_read_t mb_plan_read(const mb_plan_group_t *group, mb_health_t *health, const mb_plan_io_t *io, uint16_t *regs);
+
+/**
+ * @brief Decodes one value out of the registers of a group read
+ * @param plan - plan the group belongs to
+ * @param map - register map the plan was built from
+ * @param group - group the registers were read with
+ * @param index - value within the group, 0 to group->count - 1
+ * @param regs - registers of the group, in host byte order
+ * @param cid - set to the map index of the value
+ * @returns the scaled value
+ */
+float mb_plan_decode(const mb_plan_t *plan, const regmap_t *map, const mb_plan_group_t *group, uint16_t index,
+                     const uint16_t *regs, uint16_t *cid);
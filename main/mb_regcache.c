@@ -0,0 +1,78 @@
+/*
+    Modbus register cache
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "mb_regcache.h"
+
+void mb_regcache_init(mb_regcache_t *cache)
+{
+    memset(cache, 0, sizeof(mb_regcache_t));
+}
+
+bool mb_regcache_store(mb_regcache_t *cache, uint8_t slave_addr, uint8_t function, uint16_t reg_start,
+                       uint16_t reg_count, const uint16_t *regs, uint32_t now_ms)
+{
+    mb_regcache_block_t *block = NULL;
+
+    if ((reg_count == 0) || (reg_count > MB_REGCACHE_BLOCK_REGS))
+    {
+        return false;
+    }
+    for (uint16_t i = 0; i < cache->count; i++)
+    {
+        mb_regcache_block_t *b = &cache->blocks[i];
+        if ((b->slave_addr == slave_addr) && (b->function == function) &&
+            (b->reg_start == reg_start) && (b->reg_count == reg_count))
+        {
+            block = b;
+            break;
+        }
+    }
+    if (block == NULL)
+    {
+        if (cache->count == MB_REGCACHE_MAX_BLOCKS)
+        {
+            return false;
+        }
+        block = &cache->blocks[cache->count++];
+        block->slave_addr = slave_addr;
+        block->function = function;
+        block->reg_start = reg_start;
+        block->reg_count = reg_count;
+    }
+    memcpy(block->regs, regs, reg_count * sizeof(uint16_t));
+    block->stored_ms = now_ms;
+    return true;
+}
+
+mb_regcache_result_t mb_regcache_lookup(const mb_regcache_t *cache, uint8_t slave_addr, uint8_t function,
+                                        uint16_t reg_start, uint16_t reg_count, uint32_t max_age_ms,
+                                        uint32_t now_ms, uint16_t *regs)
+{
+    mb_regcache_result_t result = MB_REGCACHE_UNKNOWN_SLAVE;
+
+    for (uint16_t i = 0; i < cache->count; i++)
+    {
+        const mb_regcache_block_t *b = &cache->blocks[i];
+        if (b->slave_addr != slave_addr)
+        {
+            continue;
+        }
+        result = MB_REGCACHE_MISS;
+        if ((b->function != function) || (reg_start < b->reg_start) ||
+            ((uint32_t)reg_start + reg_count > (uint32_t)b->reg_start + b->reg_count))
+        {
+            continue;
+        }
+        if ((max_age_ms != 0) && ((now_ms - b->stored_ms) > max_age_ms))
+        {
+            return MB_REGCACHE_STALE;
+        }
+        memcpy(regs, &b->regs[reg_start - b->reg_start], reg_count * sizeof(uint16_t));
+        return MB_REGCACHE_HIT;
+    }
+    return result;
+}
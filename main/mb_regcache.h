@@ -0,0 +1,71 @@
+/*
+    Modbus register cache
+
+    Keeps the raw registers of the latest successful read of each read plan group, so the
+    Modbus TCP gateway can answer a read without a serial transaction. The poller stores a
+    block after every successful read; a request is a hit when one block covers the whole
+    range and is not older than the allowed age.
+
+    This is plain C with no locking; the caller serialises the writer and the readers
+    (see mb_tcp_gateway.c).
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of blocks the cache holds, at least one per read plan group
+#define MB_REGCACHE_MAX_BLOCKS  (8)
+// Largest block, the largest read plan group
+#define MB_REGCACHE_BLOCK_REGS  (16)
+
+typedef enum
+{
+    MB_REGCACHE_HIT = 0,
+    MB_REGCACHE_STALE,          // Covered, but older than the allowed age
+    MB_REGCACHE_MISS,           // The slave is cached, this range is not
+    MB_REGCACHE_UNKNOWN_SLAVE,  // Nothing cached for the slave
+} mb_regcache_result_t;
+
+typedef struct
+{
+    uint8_t slave_addr;
+    uint8_t function;           // Read function of the register area (FC03 holding, FC04 input)
+    uint16_t reg_start;
+    uint16_t reg_count;
+    uint32_t stored_ms;         // Time of the read
+    uint16_t regs[MB_REGCACHE_BLOCK_REGS];
+} mb_regcache_block_t;
+
+typedef struct
+{
+    mb_regcache_block_t blocks[MB_REGCACHE_MAX_BLOCKS];
+    uint16_t count;
+} mb_regcache_t;
+
+/**
+ * @brief Empties the cache
+ */
+void mb_regcache_init(mb_regcache_t *cache);
+
+/**
+ * @brief Stores the registers of a read, replacing the block of the same range
+ * @param regs - reg_count registers in host byte order
+ * @param now_ms - time of the read
+ * @returns false if the block is too large or the cache is full
+ */
+bool mb_regcache_store(mb_regcache_t *cache, uint8_t slave_addr, uint8_t function, uint16_t reg_start,
+                       uint16_t reg_count, const uint16_t *regs, uint32_t now_ms);
+
+/**
+ * @brief Looks up a range of registers
+ * @param max_age_ms - oldest block that counts as a hit, 0 for any age
+ * @param now_ms - current time
+ * @param regs - filled with reg_count registers on a hit
+ */
+mb_regcache_result_t mb_regcache_lookup(const mb_regcache_t *cache, uint8_t slave_addr, uint8_t function,
+                                        uint16_t reg_start, uint16_t reg_count, uint32_t max_age_ms,
+                                        uint32_t now_ms, uint16_t *regs);
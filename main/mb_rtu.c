@@ -0,0 +1,152 @@
+/*
+    Modbus RTU frame and timing core
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include "mb_rtu.h"
+#include "mb_crc.h"
+
+// Bits per character on the wire: start, 8 data, parity or second stop, stop
+#define MB_RTU_BITS_PER_CHAR    (11)
+
+uint32_t mb_rtu_char_time_us(uint32_t baudrate)
+{
+    if (baudrate == 0)
+    {
+        return 0;
+    }
+    return (MB_RTU_BITS_PER_CHAR * 1000000UL + baudrate - 1) / baudrate;
+}
+
+uint32_t mb_rtu_t35_us(uint32_t baudrate)
+{
+    if (baudrate > 19200)
+    {
+        return 1750;
+    }
+    return (mb_rtu_char_time_us(baudrate) * 7 + 1) / 2;
+}
+
+uint32_t mb_rtu_t15_us(uint32_t baudrate)
+{
+    if (baudrate > 19200)
+    {
+        return 750;
+    }
+    return (mb_rtu_char_time_us(baudrate) * 3 + 1) / 2;
+}
+
+uint32_t mb_rtu_frame_time_us(uint32_t baudrate, size_t len)
+{
+    return mb_rtu_char_time_us(baudrate) * len;
+}
+
+size_t mb_rtu_build_read_request(uint8_t *frame, uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count)
+{
+    if ((reg_count == 0) || (reg_count > MB_RTU_MAX_READ_REGS) ||
+        ((function != MB_RTU_FUNC_READ_HOLDING) && (function != MB_RTU_FUNC_READ_INPUT)))
+    {
+        return 0;
+    }
+    frame[0] = slave_addr;
+    frame[1] = function;
+    frame[2] = (uint8_t)(reg_start >> 8);
+    frame[3] = (uint8_t)(reg_start & 0xFF);
+    frame[4] = (uint8_t)(reg_count >> 8);
+    frame[5] = (uint8_t)(reg_count & 0xFF);
+    // CRC goes out low byte first
+    uint16_t crc = mb_crc16(frame, 6);
+    frame[6] = (uint8_t)(crc & 0xFF);
+    frame[7] = (uint8_t)(crc >> 8);
+    return MB_RTU_READ_REQUEST_LEN;
+}
+
+size_t mb_rtu_read_response_len(uint16_t reg_count)
+{
+    // addr, fc, byte count, data, crc
+    return 3 + (size_t)reg_count * 2 + 2;
+}
+
+mb_rtu_status_t mb_rtu_parse_read_response(const uint8_t *frame, size_t len, uint8_t slave_addr, uint8_t function,
+                                           uint16_t reg_count, uint16_t *regs, uint8_t *exception)
+{
+    // Exception responses are addr, fc | 0x80, code, crc
+    if ((len >= 2) && (frame[1] == (function | MB_RTU_FUNC_ERROR_FLAG)))
+    {
+        if (len < 5)
+        {
+            return MB_RTU_INCOMPLETE;
+        }
+        uint16_t crc = mb_crc16(frame, 3);
+        if ((frame[3] != (crc & 0xFF)) || (frame[4] != (crc >> 8)))
+        {
+            return MB_RTU_BAD_CRC;
+        }
+        if (frame[0] != slave_addr)
+        {
+            return MB_RTU_BAD_ADDRESS;
+        }
+        if (exception)
+        {
+            *exception = frame[2];
+        }
+        return MB_RTU_EXCEPTION;
+    }
+
+    size_t expected = mb_rtu_read_response_len(reg_count);
+    if (len < expected)
+    {
+        return MB_RTU_INCOMPLETE;
+    }
+    uint16_t crc = mb_crc16(frame, expected - 2);
+    if ((frame[expected - 2] != (crc & 0xFF)) || (frame[expected - 1] != (crc >> 8)))
+    {
+        return MB_RTU_BAD_CRC;
+    }
+    if (frame[0] != slave_addr)
+    {
+        return MB_RTU_BAD_ADDRESS;
+    }
+    if (frame[1] != function)
+    {
+        return MB_RTU_BAD_FUNCTION;
+    }
+    if (frame[2] != reg_count * 2)
+    {
+        return MB_RTU_BAD_LENGTH;
+    }
+    const uint8_t *data = &frame[3];
+    for (uint16_t i = 0; i < reg_count; i++)
+    {
+        regs[i] = (uint16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+    }
+    return MB_RTU_OK;
+}
+
+const char *mb_rtu_status_name(mb_rtu_status_t status)
+{
+    switch (status)
+    {
+        case MB_RTU_OK:
+            return "ok";
+        case MB_RTU_INCOMPLETE:
+            return "incomplete";
+        case MB_RTU_BAD_CRC:
+            return "bad crc";
+        case MB_RTU_BAD_ADDRESS:
+            return "bad address";
+        case MB_RTU_BAD_FUNCTION:
+            return "bad function";
+        case MB_RTU_BAD_LENGTH:
+            return "bad length";
+        case MB_RTU_EXCEPTION:
+            return "exception";
+        case MB_RTU_TIMEOUT:
+            return "timeout";
+        case MB_RTU_BUSY:
+            return "busy";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,94 @@
+/*
+    Modbus RTU frame and timing core
+
+    Pure C helpers for building and checking Modbus RTU frames and for the character based
+    timing of the serial line. Nothing in here touches the UART or FreeRTOS, so it can be
+    built and exercised on a host as well as on the ESP32. The UART side lives in
+    mb_rtu_master.c.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest RTU frame (address + PDU + CRC)
+#define MB_RTU_MAX_FRAME            (256)
+// Largest number of registers in a single FC03/FC04 read
+#define MB_RTU_MAX_READ_REGS        (125)
+// Size of a read request frame: addr, fc, start(2), count(2), crc(2)
+#define MB_RTU_READ_REQUEST_LEN     (8)
+
+#define MB_RTU_FUNC_READ_HOLDING    (0x03)
+#define MB_RTU_FUNC_READ_INPUT      (0x04)
+#define MB_RTU_FUNC_ERROR_FLAG      (0x80)
+
+typedef enum
+{
+    MB_RTU_OK = 0,
+    MB_RTU_INCOMPLETE,          // Not enough bytes yet for a full frame
+    MB_RTU_BAD_CRC,             // CRC check failed
+    MB_RTU_BAD_ADDRESS,         // Response from a different slave
+    MB_RTU_BAD_FUNCTION,        // Response to a different function
+    MB_RTU_BAD_LENGTH,          // Byte count does not match the request
+    MB_RTU_EXCEPTION,           // Slave returned an exception response
+    MB_RTU_TIMEOUT,             // No (complete) response in time
+    MB_RTU_BUSY,                // Not sent, the master's request queue was full
+} mb_rtu_status_t;
+
+/**
+ * @brief Time for one character (start bit, 8 data bits, parity/stop bits = 11 bits) in microseconds
+ */
+uint32_t mb_rtu_char_time_us(uint32_t baudrate);
+
+/**
+ * @brief Inter-frame gap (3.5 character times). Fixed at 1750us above 19200 baud as the spec requires.
+ */
+uint32_t mb_rtu_t35_us(uint32_t baudrate);
+
+/**
+ * @brief Inter-character timeout (1.5 character times). Fixed at 750us above 19200 baud.
+ */
+uint32_t mb_rtu_t15_us(uint32_t baudrate);
+
+/**
+ * @brief Time on the wire for a frame of the given length, in microseconds
+ */
+uint32_t mb_rtu_frame_time_us(uint32_t baudrate, size_t len);
+
+/**
+ * @brief Builds a FC03/FC04 read request
+ * @param frame - output buffer, at least MB_RTU_READ_REQUEST_LEN bytes
+ * @param slave_addr - slave address
+ * @param function - MB_RTU_FUNC_READ_HOLDING or MB_RTU_FUNC_READ_INPUT
+ * @param reg_start - first register
+ * @param reg_count - number of registers (1 to MB_RTU_MAX_READ_REGS)
+ * @returns length of the frame, or 0 if the arguments are invalid
+ */
+size_t mb_rtu_build_read_request(uint8_t *frame, uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count);
+
+/**
+ * @brief Expected length of a normal FC03/FC04 response
+ */
+size_t mb_rtu_read_response_len(uint16_t reg_count);
+
+/**
+ * @brief Checks a received FC03/FC04 response and extracts the registers
+ * @param frame - received bytes
+ * @param len - number of received bytes
+ * @param slave_addr - slave the request went to
+ * @param function - function code of the request
+ * @param reg_count - number of registers requested
+ * @param regs - output, reg_count registers in host byte order
+ * @param exception - set to the exception code for MB_RTU_EXCEPTION (may be NULL)
+ * @returns MB_RTU_OK when the registers are valid
+ */
+mb_rtu_status_t mb_rtu_parse_read_response(const uint8_t *frame, size_t len, uint8_t slave_addr, uint8_t function,
+                                           uint16_t reg_count, uint16_t *regs, uint8_t *exception);
+
+/**
+ * @brief Name of a status for logging
+ */
+const char *mb_rtu_status_name(mb_rtu_status_t status);
@@ -0,0 +1,269 @@
+/*
+    Native Modbus RTU master
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "rom/ets_sys.h"
+#include "sdkconfig.h"
+#include "threads.h"
+#include "mb_rtu_master.h"
+
+#ifdef CONFIG_MB_MASTER_NATIVE
+
+static const char *TAG = "MB_RTU";
+
+// UART driver buffer and event queue sizes
+#define MB_RTU_UART_RX_BUFFER   (512)
+#define MB_RTU_UART_QUEUE_LEN   (20)
+
+typedef struct
+{
+    TaskHandle_t task;
+    mb_rtu_status_t status;
+} mb_rtu_sync_t;
+
+static uart_port_t mb_port;
+static uint32_t mb_baudrate;
+static uint32_t t35_us;
+static QueueHandle_t uart_queue = NULL;
+static QueueHandle_t request_queue = NULL;
+static TaskHandle_t master_task = NULL;
+static int64_t last_activity_us = 0;    // End of the last frame sent or received
+
+// Frames are built and received in place, no allocation per transaction
+static uint8_t tx_frame[MB_RTU_READ_REQUEST_LEN];
+static uint8_t rx_frame[MB_RTU_MAX_FRAME];
+
+/**
+ * @brief Waits until the line has been idle for at least 3.5 characters
+ */
+static void wait_inter_frame_gap(void)
+{
+    int64_t idle = esp_timer_get_time() - last_activity_us;
+    if (idle < t35_us)
+    {
+        ets_delay_us((uint32_t)(t35_us - idle));
+    }
+}
+
+/**
+ * @brief Runs a single transaction on the bus
+ */
+static mb_rtu_status_t run_transaction(const mb_rtu_request_t *request)
+{
+    size_t len = mb_rtu_build_read_request(tx_frame, request->slave_addr, request->function,
+                                           request->reg_start, request->reg_count);
+    if (len == 0)
+    {
+        return MB_RTU_BAD_LENGTH;
+    }
+    size_t expected = mb_rtu_read_response_len(request->reg_count);
+    if (expected > sizeof(rx_frame))
+    {
+        return MB_RTU_BAD_LENGTH;
+    }
+
+    wait_inter_frame_gap();
+    // Drop anything left over from a previous (late) response
+    uart_flush_input(mb_port);
+    xQueueReset(uart_queue);
+
+    uart_write_bytes(mb_port, (const char *)tx_frame, len);
+    uart_wait_tx_done(mb_port, pdMS_TO_TICKS(100));
+    last_activity_us = esp_timer_get_time();
+
+    uint32_t timeout_ms = request->timeout_ms ? request->timeout_ms : CONFIG_MB_RESPONSE_TIMEOUT_MS;
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+    size_t rx_len = 0;
+    mb_rtu_status_t status = MB_RTU_TIMEOUT;
+
+    while (1)
+    {
+        int32_t remaining = (int32_t)(deadline - xTaskGetTickCount());
+        uart_event_t event;
+        if ((remaining <= 0) || (xQueueReceive(uart_queue, &event, remaining) != pdTRUE))
+        {
+            // Nothing, or only part of a frame, arrived in time
+            status = MB_RTU_TIMEOUT;
+            break;
+        }
+        if (event.type == UART_DATA)
+        {
+            size_t space = sizeof(rx_frame) - rx_len;
+            size_t want = (event.size < space) ? event.size : space;
+            int n = uart_read_bytes(mb_port, &rx_frame[rx_len], want, 0);
+            if (n > 0)
+            {
+                rx_len += n;
+            }
+            last_activity_us = esp_timer_get_time();
+            status = mb_rtu_parse_read_response(rx_frame, rx_len, request->slave_addr, request->function,
+                                                request->reg_count, request->regs, NULL);
+            if (status != MB_RTU_INCOMPLETE)
+            {
+                break;
+            }
+            if (event.timeout_flag)
+            {
+                // The line went quiet for 3.5 characters in the middle of the frame
+                status = MB_RTU_BAD_LENGTH;
+                break;
+            }
+        }
+        else if ((event.type == UART_FIFO_OVF) || (event.type == UART_BUFFER_FULL))
+        {
+            ESP_LOGW(TAG, "UART overflow");
+            status = MB_RTU_BAD_LENGTH;
+            break;
+        }
+        // Frame and parity errors are left to the CRC check
+    }
+    return status;
+}
+
+static void mb_rtu_master_thread(void *pvParameter)
+{
+    mb_rtu_request_t request;
+    while (1)
+    {
+        if (xQueueReceive(request_queue, &request, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        mb_rtu_status_t status = run_transaction(&request);
+        ESP_LOGD(TAG, "Slave %d fc %d regs 0x%04x+%d: %s", request.slave_addr, request.function,
+                        request.reg_start, request.reg_count, mb_rtu_status_name(status));
+        if (request.done)
+        {
+            request.done(request.ctx, status);
+        }
+    }
+}
+
+esp_err_t mb_rtu_master_init(uart_port_t port, uint32_t baudrate, int txd, int rxd, int rts)
+{
+    uart_config_t uart_config = {
+        .baud_rate = baudrate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 0,
+    };
+    mb_port = port;
+    mb_baudrate = baudrate;
+    t35_us = mb_rtu_t35_us(baudrate);
+
+    esp_err_t err = uart_param_config(port, &uart_config);
+    if (err != ESP_OK) return err;
+    err = uart_set_pin(port, txd, rxd, rts, UART_PIN_NO_CHANGE);
+    if (err != ESP_OK) return err;
+    err = uart_driver_install(port, MB_RTU_UART_RX_BUFFER, 0, MB_RTU_UART_QUEUE_LEN, &uart_queue, 0);
+    if (err != ESP_OK) return err;
+    err = uart_set_mode(port, UART_MODE_RS485_HALF_DUPLEX);
+    if (err != ESP_OK) return err;
+
+    // The UART raises a data event with timeout_flag once the line has been idle for this many
+    // characters, which is our end of frame detection
+    uint32_t char_us = mb_rtu_char_time_us(baudrate);
+    uint32_t tout = (t35_us + char_us - 1) / char_us;
+    err = uart_set_rx_timeout(port, (uint8_t)(tout > 0 ? tout : 1));
+    if (err != ESP_OK) return err;
+
+    request_queue = xQueueCreate(MB_RTU_MASTER_QUEUE_LEN, sizeof(mb_rtu_request_t));
+    if (request_queue == NULL) return ESP_ERR_NO_MEM;
+    if (xTaskCreate(mb_rtu_master_thread, THREAD_MB_RTU_NAME, THREAD_MB_RTU_STACKSIZE, NULL,
+                    THREAD_MB_RTU_PRIORITY, &master_task) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    last_activity_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "RTU master on UART%d at %u baud, t3.5 = %u us", port, mb_baudrate, t35_us);
+    return ESP_OK;
+}
+
+esp_err_t mb_rtu_master_submit(const mb_rtu_request_t *request)
+{
+    if (request_queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xQueueSend(request_queue, request, 0) != pdTRUE)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+static void sync_done(void *ctx, mb_rtu_status_t status)
+{
+    mb_rtu_sync_t *sync = (mb_rtu_sync_t *)ctx;
+    sync->status = status;
+    xTaskNotifyGive(sync->task);
+}
+
+mb_rtu_status_t mb_rtu_master_read(uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count,
+                                   uint16_t *regs, uint32_t timeout_ms)
+{
+    mb_rtu_sync_t sync = {
+        .task = xTaskGetCurrentTaskHandle(),
+        .status = MB_RTU_TIMEOUT
+    };
+    mb_rtu_request_t request = {
+        .slave_addr = slave_addr,
+        .function = function,
+        .reg_start = reg_start,
+        .reg_count = reg_count,
+        .regs = regs,
+        .timeout_ms = timeout_ms,
+        .done = sync_done,
+        .ctx = &sync
+    };
+    if (mb_rtu_master_submit(&request) != ESP_OK)
+    {
+        return MB_RTU_BUSY;
+    }
+    // The master task always completes a request within its timeout, so waiting forever is
+    // safe and keeps sync valid until the callback has run
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return sync.status;
+}
+
+esp_err_t mb_rtu_status_to_err(mb_rtu_status_t status)
+{
+    switch (status)
+    {
+        case MB_RTU_OK:
+            return ESP_OK;
+        case MB_RTU_TIMEOUT:
+            return ESP_ERR_TIMEOUT;
+        case MB_RTU_BAD_CRC:
+            return ESP_ERR_INVALID_CRC;
+        case MB_RTU_EXCEPTION:
+            return ESP_FAIL;
+        case MB_RTU_BUSY:
+            return ESP_ERR_INVALID_STATE;
+        default:
+            return ESP_ERR_INVALID_RESPONSE;
+    }
+}
+
+void mb_rtu_master_shutdown(void)
+{
+    if (master_task)
+    {
+        vTaskDelete(master_task);
+        master_task = NULL;
+    }
+    uart_driver_delete(mb_port);
+    uart_queue = NULL;
+}
+
+#endif
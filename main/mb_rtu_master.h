@@ -0,0 +1,75 @@
+/*
+    Native Modbus RTU master
+
+    In-tree replacement for the freemodbus master controller. A single master task owns the
+    UART: it takes requests from a queue, builds the frame into a preallocated buffer, waits
+    out the 3.5 character inter-frame gap, sends it and assembles the response from the UART
+    event queue. Completion is reported through a callback, so submitting a request never
+    blocks. mb_rtu_master_read() wraps this for callers that want to wait for the result,
+    using a task notification rather than polling.
+
+    Selected with CONFIG_MB_MASTER_NATIVE. Frame building, checking and timing is in mb_rtu.c.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+#include "mb_rtu.h"
+
+// Number of requests that can be queued for the master task
+#define MB_RTU_MASTER_QUEUE_LEN     (8)
+
+/**
+ * @brief Completion callback, called from the master task
+ * @param ctx - context pointer from the request
+ * @param status - result of the transaction
+ */
+typedef void (*mb_rtu_done_cb_t)(void *ctx, mb_rtu_status_t status);
+
+typedef struct
+{
+    uint8_t slave_addr;
+    uint8_t function;           // MB_RTU_FUNC_READ_HOLDING or MB_RTU_FUNC_READ_INPUT
+    uint16_t reg_start;
+    uint16_t reg_count;
+    uint16_t *regs;             // Output buffer, must stay valid until the callback runs
+    uint32_t timeout_ms;        // Response timeout, 0 for the configured default
+    mb_rtu_done_cb_t done;      // Completion callback (may be NULL)
+    void *ctx;                  // Passed to the callback
+} mb_rtu_request_t;
+
+/**
+ * @brief Installs the UART driver and starts the master task
+ * @returns esp_err_t code with any errors
+ */
+esp_err_t mb_rtu_master_init(uart_port_t port, uint32_t baudrate, int txd, int rxd, int rts);
+
+/**
+ * @brief Queues a request. Returns immediately, the callback reports the result.
+ * @returns ESP_ERR_TIMEOUT if the queue is full
+ */
+esp_err_t mb_rtu_master_submit(const mb_rtu_request_t *request);
+
+/**
+ * @brief Submits a read and waits for its completion
+ * @param timeout_ms - response timeout, 0 for the configured default
+ * @returns result of the transaction, MB_RTU_BUSY if the queue was full and nothing was sent
+ */
+mb_rtu_status_t mb_rtu_master_read(uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count,
+                                   uint16_t *regs, uint32_t timeout_ms);
+
+/**
+ * @brief Maps a transaction status to an esp_err_t: ESP_ERR_TIMEOUT, ESP_ERR_INVALID_CRC, ESP_FAIL for an
+ * exception, ESP_ERR_INVALID_RESPONSE for any other bad response, or ESP_ERR_INVALID_STATE for MB_RTU_BUSY
+ * (as freemodbus reports a busy master)
+ */
+esp_err_t mb_rtu_status_to_err(mb_rtu_status_t status);
+
+/**
+ * @brief Stops the master task and removes the UART driver
+ */
+void mb_rtu_master_shutdown(void);
@@ -0,0 +1,177 @@
+/*
+    Modbus bus scan
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "mb_rtu_master.h"
+#include "mb_fingerprint.h"
+#include "mb_scan.h"
+
+#if defined(CONFIG_MB_MASTER_NATIVE) && defined(MB_SCAN_ENABLED)
+
+static const char *TAG = "MB_SCAN";
+
+#define MB_SCAN_ADDRESSES   (MB_SCAN_LAST_ADDR - MB_SCAN_FIRST_ADDR + 1)
+
+// A full master queue drains within this, so going longer without a completion means the master is stuck
+#define MB_SCAN_WAIT_MS     (MB_RTU_MASTER_QUEUE_LEN * (CONFIG_MB_SCAN_TIMEOUT_MS + 100))
+// With nothing outstanding a refused submit is retried this often before the sweep gives up
+#define MB_SCAN_RETRIES     (10)
+#define MB_SCAN_RETRY_MS    (100)
+
+// Result of the sweep probe of one address, filled in by the master task
+typedef struct
+{
+    mb_rtu_status_t status;
+    uint32_t bus_us;            // From the previous completion to this one
+    uint16_t regs[1];
+} scan_slot_t;
+
+static scan_slot_t slots[MB_SCAN_ADDRESSES];
+static TaskHandle_t scan_task = NULL;
+static int64_t last_done_us;
+
+/**
+ * @brief Completion of a sweep probe, runs on the master task
+ */
+static void probe_done(void *ctx, mb_rtu_status_t status)
+{
+    scan_slot_t *slot = (scan_slot_t *)ctx;
+    int64_t now = esp_timer_get_time();
+    slot->status = status;
+    slot->bus_us = (uint32_t)(now - last_done_us);
+    last_done_us = now;
+    // Cleared by an aborted sweep, so a late completion can't wake the task for something else
+    TaskHandle_t task = scan_task;
+    if (task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+/**
+ * @brief Sends one cheap read to every address, keeping the master's queue full
+ * @returns ESP_OK, or the error that stopped the sweep
+ */
+static esp_err_t sweep(void)
+{
+    uint16_t submitted = 0, done = 0;
+    int retries = 0;
+    esp_err_t err = ESP_OK;
+
+    scan_task = xTaskGetCurrentTaskHandle();
+    last_done_us = esp_timer_get_time();
+    while (done < MB_SCAN_ADDRESSES)
+    {
+        while ((submitted < MB_SCAN_ADDRESSES) && (submitted - done < MB_RTU_MASTER_QUEUE_LEN))
+        {
+            scan_slot_t *slot = &slots[submitted];
+            mb_rtu_request_t request = {
+                .slave_addr = MB_SCAN_FIRST_ADDR + submitted,
+                .function = MB_RTU_FUNC_READ_INPUT,
+                .reg_start = 0x0001,
+                .reg_count = 1,
+                .regs = slot->regs,
+                .timeout_ms = CONFIG_MB_SCAN_TIMEOUT_MS,
+                .done = probe_done,
+                .ctx = slot
+            };
+            err = mb_rtu_master_submit(&request);
+            if (err != ESP_OK)
+            {
+                break;
+            }
+            submitted++;
+        }
+        if (submitted == done)
+        {
+            // Refused with nothing in flight, so no completion is coming to wait for
+            if (++retries > MB_SCAN_RETRIES)
+            {
+                ESP_LOGE(TAG, "Master refused probe of %d: %s", MB_SCAN_FIRST_ADDR + submitted, esp_err_to_name(err));
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(MB_SCAN_RETRY_MS));
+            continue;
+        }
+        retries = 0;
+        uint32_t completed = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MB_SCAN_WAIT_MS));
+        if (completed == 0)
+        {
+            ESP_LOGE(TAG, "No probe completed in %d ms, %d outstanding", MB_SCAN_WAIT_MS, submitted - done);
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        done += completed;
+    }
+    scan_task = NULL;
+    return (done < MB_SCAN_ADDRESSES) ? err : ESP_OK;
+}
+
+static mb_rtu_status_t fingerprint_read(void *ctx, uint8_t slave, uint8_t function, uint16_t reg_start,
+                                        uint16_t reg_count, uint16_t *regs)
+{
+    (void)ctx;
+    return mb_rtu_master_read(slave, function, reg_start, reg_count, regs, 0);
+}
+
+esp_err_t mb_scan_run(regmap_t *map, mb_scan_result_t *result)
+{
+    memset(map, 0, sizeof(regmap_t));
+    memset(result, 0, sizeof(mb_scan_result_t));
+    memset(slots, 0, sizeof(slots));
+
+    ESP_LOGI(TAG, "Scanning addresses %d-%d, %d ms timeout", MB_SCAN_FIRST_ADDR, MB_SCAN_LAST_ADDR, CONFIG_MB_SCAN_TIMEOUT_MS);
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = sweep();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Scan aborted: %s", esp_err_to_name(err));
+        return err;
+    }
+    result->sweep_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    result->probed = MB_SCAN_ADDRESSES;
+
+    for (uint16_t i = 0; i < MB_SCAN_ADDRESSES; i++)
+    {
+        uint8_t slave = MB_SCAN_FIRST_ADDR + i;
+        histogram_record(&result->per_address, slots[i].bus_us / 1000);
+        if (slots[i].status == MB_RTU_TIMEOUT)
+        {
+            continue;
+        }
+        // Anything back, even an exception or a bad frame, means something is there
+        result->responding++;
+        const mb_fingerprint_t *fp = mb_fingerprint_identify(slave, fingerprint_read, NULL);
+        ESP_LOGI(TAG, "Slave %d: %s (%s, %u us)", slave, fp ? fp->name : "unknown device",
+                        mb_rtu_status_name(slots[i].status), slots[i].bus_us);
+        if (fp == NULL)
+        {
+            continue;
+        }
+        result->identified++;
+        if (!fp->add_to_map(map, slave))
+        {
+            ESP_LOGW(TAG, "No room in the register map for the %s at %d", fp->name, slave);
+            result->unmapped++;
+        }
+    }
+    result->total_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+
+    char buffer[128];
+    histogram_format(&result->per_address, buffer, sizeof(buffer));
+    ESP_LOGI(TAG, "Scan done in %u ms (sweep %u ms, avg %u us per address): %d responding, %d identified",
+                    result->total_ms, result->sweep_ms, (unsigned)(result->sweep_ms * 1000 / MB_SCAN_ADDRESSES),
+                    result->responding, result->identified);
+    ESP_LOGI(TAG, "Time per address (ms, max %u): %s", result->per_address.max, buffer);
+    return (map->count > 0) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+    Modbus bus scan
+
+    Finds the sensors on the bus so a new install does not need its slave address set in
+    menuconfig. The scan sweeps addresses 1 to 247 with a short response timeout
+    (CONFIG_MB_SCAN_TIMEOUT_MS), then fingerprints every address that answered
+    (mb_fingerprint.h) and builds a register map of the devices it recognised.
+
+    The sweep is pipelined: probes are queued to the native RTU master ahead of time so it
+    sends the next one as soon as the inter-frame gap allows, without a round trip through
+    the scanning task. There is still only one transaction on the bus at a time.
+
+    Needs the native RTU master (CONFIG_MB_MASTER_NATIVE), started before the scan.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include "histogram.h"
+#include "regmap.h"
+
+#if defined(CONFIG_MB_SCAN_IF_NO_MAP) || defined(CONFIG_MB_SCAN_EVERY_BOOT)
+#define MB_SCAN_ENABLED
+#endif
+
+// Addresses swept, the whole unicast range
+#define MB_SCAN_FIRST_ADDR  (1)
+#define MB_SCAN_LAST_ADDR   (247)
+
+typedef struct
+{
+    uint16_t probed;            // Addresses swept
+    uint16_t responding;        // Addresses that sent anything back
+    uint16_t identified;        // Of those, devices that matched a fingerprint
+    uint16_t unmapped;          // Identified, but the map had no room for them
+    uint32_t sweep_ms;          // Time for the sweep
+    uint32_t total_ms;          // Time for the sweep and the fingerprinting
+    histogram_t per_address;    // Bus time of each address in the sweep (ms)
+} mb_scan_result_t;
+
+/**
+ * @brief Scans the bus and builds a register map of the devices found
+ * @param map - map of the devices identified, in address order
+ * @param result - scan statistics
+ * @returns ESP_OK if at least one device was identified, ESP_ERR_NOT_FOUND if none were, or
+ * the master's error if the sweep had to stop (it refused probes, or stopped completing them)
+ */
+esp_err_t mb_scan_run(regmap_t *map, mb_scan_result_t *result);
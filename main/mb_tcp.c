@@ -0,0 +1,102 @@
+/*
+    Modbus TCP frame core
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include "mb_tcp.h"
+#include "mb_rtu.h"
+
+// Length field of a FC03/FC04 request: unit id, function, start (2), count (2)
+#define MB_TCP_READ_REQUEST_FIELD_LEN   (6)
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+    return p + 2;
+}
+
+/**
+ * @brief Writes the MBAP header of a response
+ * @param pdu_len - length of the PDU that follows
+ */
+static uint8_t *put_header(uint8_t *out, const mb_tcp_request_t *request, size_t pdu_len)
+{
+    out = put_u16(out, request->transaction_id);
+    out = put_u16(out, 0);
+    out = put_u16(out, (uint16_t)(pdu_len + 1));
+    *out++ = request->unit_id;
+    return out;
+}
+
+int mb_tcp_frame_len(const uint8_t *buf, size_t len)
+{
+    if (len < MB_TCP_MBAP_LEN)
+    {
+        return 0;
+    }
+    uint16_t protocol = get_u16(&buf[2]);
+    uint16_t field_len = get_u16(&buf[4]);
+    // At least the unit id and a function code, at most a full PDU
+    if ((protocol != 0) || (field_len < 2) || (field_len > MB_TCP_MAX_ADU - MB_TCP_MBAP_LEN + 1))
+    {
+        return -1;
+    }
+    size_t adu_len = MB_TCP_MBAP_LEN - 1 + field_len;
+    return (len >= adu_len) ? (int)adu_len : 0;
+}
+
+uint8_t mb_tcp_parse_request(const uint8_t *adu, size_t len, mb_tcp_request_t *request)
+{
+    request->transaction_id = get_u16(&adu[0]);
+    request->unit_id = adu[6];
+    request->function = adu[7];
+    request->reg_start = 0;
+    request->reg_count = 0;
+
+    if ((request->function != MB_RTU_FUNC_READ_HOLDING) && (request->function != MB_RTU_FUNC_READ_INPUT))
+    {
+        return MB_TCP_EX_ILLEGAL_FUNCTION;
+    }
+    if (len != MB_TCP_MBAP_LEN - 1 + MB_TCP_READ_REQUEST_FIELD_LEN)
+    {
+        return MB_TCP_EX_ILLEGAL_VALUE;
+    }
+    request->reg_start = get_u16(&adu[8]);
+    request->reg_count = get_u16(&adu[10]);
+    if ((request->reg_count == 0) || (request->reg_count > MB_RTU_MAX_READ_REGS))
+    {
+        return MB_TCP_EX_ILLEGAL_VALUE;
+    }
+    if ((uint32_t)request->reg_start + request->reg_count > 0x10000)
+    {
+        return MB_TCP_EX_ILLEGAL_ADDRESS;
+    }
+    return 0;
+}
+
+size_t mb_tcp_build_read_response(uint8_t *out, const mb_tcp_request_t *request, const uint16_t *regs)
+{
+    uint8_t *p = put_header(out, request, 2 + request->reg_count * 2);
+    *p++ = request->function;
+    *p++ = (uint8_t)(request->reg_count * 2);
+    for (uint16_t i = 0; i < request->reg_count; i++)
+    {
+        p = put_u16(p, regs[i]);
+    }
+    return p - out;
+}
+
+size_t mb_tcp_build_exception(uint8_t *out, const mb_tcp_request_t *request, uint8_t code)
+{
+    uint8_t *p = put_header(out, request, 2);
+    *p++ = request->function | MB_RTU_FUNC_ERROR_FLAG;
+    *p++ = code;
+    return p - out;
+}
@@ -0,0 +1,76 @@
+/*
+    Modbus TCP frame core
+
+    Pure C helpers for the Modbus TCP (MBAP) framing of FC03/FC04 reads: finding a complete
+    ADU in a stream of bytes, checking a request and building the response or exception.
+    Nothing in here touches sockets or FreeRTOS, so it builds on a host as well as the ESP32.
+    The server is in mb_tcp_server.c.
+
+        MBAP header: transaction id (2), protocol id (2, always 0), length (2), unit id (1)
+
+    length counts the unit id and the PDU. All fields are big endian.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Size of the MBAP header, unit id included
+#define MB_TCP_MBAP_LEN             (7)
+// Largest ADU: MBAP header plus a 253 byte PDU
+#define MB_TCP_MAX_ADU              (MB_TCP_MBAP_LEN + 253)
+
+// Exception codes
+#define MB_TCP_EX_ILLEGAL_FUNCTION  (0x01)
+#define MB_TCP_EX_ILLEGAL_ADDRESS   (0x02)
+#define MB_TCP_EX_ILLEGAL_VALUE     (0x03)
+#define MB_TCP_EX_DEVICE_FAILURE    (0x04)
+#define MB_TCP_EX_DEVICE_BUSY       (0x06)
+#define MB_TCP_EX_PATH_UNAVAILABLE  (0x0A)  // Gateway: no path to the unit
+#define MB_TCP_EX_TARGET_FAILED     (0x0B)  // Gateway: the unit did not respond
+
+typedef struct
+{
+    uint16_t transaction_id;
+    uint8_t unit_id;            // Slave address on the serial side
+    uint8_t function;
+    uint16_t reg_start;
+    uint16_t reg_count;
+} mb_tcp_request_t;
+
+/**
+ * @brief Checks whether the start of a buffer holds a complete ADU
+ * @param buf - received bytes
+ * @param len - number of received bytes
+ * @returns length of the ADU when it is complete, 0 if more bytes are needed, or -1 if the
+ * header is not Modbus TCP (the connection should be dropped)
+ */
+int mb_tcp_frame_len(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Decodes a complete ADU as a FC03/FC04 read request
+ * @param adu - the ADU, as found by mb_tcp_frame_len()
+ * @param len - length of the ADU
+ * @param request - filled in; the header fields are set even when an exception is returned
+ * @returns 0 for a valid request, otherwise the exception code to answer with
+ */
+uint8_t mb_tcp_parse_request(const uint8_t *adu, size_t len, mb_tcp_request_t *request);
+
+/**
+ * @brief Builds the response to a read
+ * @param out - output buffer, at least MB_TCP_MAX_ADU bytes
+ * @param request - the request being answered
+ * @param regs - request->reg_count registers in host byte order
+ * @returns length of the response
+ */
+size_t mb_tcp_build_read_response(uint8_t *out, const mb_tcp_request_t *request, const uint16_t *regs);
+
+/**
+ * @brief Builds an exception response
+ * @param out - output buffer, at least MB_TCP_MBAP_LEN + 2 bytes
+ * @returns length of the response
+ */
+size_t mb_tcp_build_exception(uint8_t *out, const mb_tcp_request_t *request, uint8_t code);
@@ -0,0 +1,233 @@
+/*
+    Modbus TCP gateway
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "threads.h"
+#include "mb_regcache.h"
+#include "mb_tcp_server.h"
+#include "mb_tcp_gateway.h"
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+#include "modbus.h"
+#endif
+
+#ifdef CONFIG_MB_TCP_GATEWAY
+
+static const char *TAG = "MB_TCP";
+
+#define NOW_MS() (xTaskGetTickCount() * portTICK_PERIOD_MS)
+
+// How long the server waits for socket activity. While a pass-through request is out it
+// also has to notice the completion, so it comes back sooner.
+#define GATEWAY_IDLE_POLL_MS        (1000)
+#define GATEWAY_PENDING_POLL_MS     (10)
+// How often the counters are logged
+#define GATEWAY_LOG_INTERVAL_MS     (15 * 60 * 1000)
+
+static mb_tcp_server_t server;
+static mb_regcache_t cache;
+static portMUX_TYPE cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct
+{
+    uint32_t hits;              // Answered from the cache
+    uint32_t stale;             // In the cache, but too old
+    uint32_t misses;            // Not in the cache
+    uint32_t passthrough;       // Sent on to the bus
+    uint32_t passthrough_failed;
+} gateway_stats_t;
+
+static gateway_stats_t stats;
+
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+/**
+ * Result of the pass-through request of a client slot. Written by the Modbus reader thread,
+ * read by the gateway task once done is set.
+ */
+typedef struct
+{
+    mb_rtu_status_t status;
+    bool done;
+} passthrough_t;
+
+static passthrough_t passthrough[MB_TCP_SERVER_MAX_CLIENTS];
+
+static void passthrough_done(void *ctx, mb_rtu_status_t status)
+{
+    passthrough_t *p = (passthrough_t *)ctx;
+    p->status = status;
+    __atomic_store_n(&p->done, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues a request for the Modbus reader, which sends it when no poll is due. The answer
+ * is written straight into the client's register buffer, which the server leaves alone until
+ * the request is completed. Slaves the poller has taken offline are not tried.
+ */
+static int passthrough_submit(int slot, const mb_tcp_request_t *request, uint16_t *regs)
+{
+    passthrough_t *p = &passthrough[slot];
+    mb_rtu_request_t rtu = {
+        .slave_addr = request->unit_id,
+        .function = request->function,
+        .reg_start = request->reg_start,
+        .reg_count = request->reg_count,
+        .regs = regs,
+        .timeout_ms = 0,
+        .done = passthrough_done,
+        .ctx = p,
+    };
+
+    // 0 is broadcast and 248 up are reserved, neither can be read
+    if ((request->unit_id == 0) || (request->unit_id > 247))
+    {
+        return MB_TCP_EX_PATH_UNAVAILABLE;
+    }
+    __atomic_store_n(&p->done, false, __ATOMIC_RELAXED);
+    esp_err_t err = modbus_passthrough_submit(&rtu);
+    if (err != ESP_OK)
+    {
+        stats.passthrough_failed++;
+        return (err == ESP_ERR_INVALID_STATE) ? MB_TCP_EX_TARGET_FAILED : MB_TCP_EX_DEVICE_BUSY;
+    }
+    stats.passthrough++;
+    return MB_TCP_DEFERRED;
+}
+
+/**
+ * @brief Answers the pass-through requests that have completed
+ */
+static void passthrough_complete(void)
+{
+    for (int slot = 0; slot < MB_TCP_SERVER_MAX_CLIENTS; slot++)
+    {
+        passthrough_t *p = &passthrough[slot];
+        if (!server.clients[slot].pending || !__atomic_load_n(&p->done, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        uint8_t exception = 0;
+        switch (p->status)
+        {
+            case MB_RTU_OK:
+                break;
+            case MB_RTU_EXCEPTION:
+                exception = MB_TCP_EX_DEVICE_FAILURE;
+                break;
+            case MB_RTU_BUSY:
+                exception = MB_TCP_EX_DEVICE_BUSY;
+                break;
+            default:
+                exception = MB_TCP_EX_TARGET_FAILED;
+                break;
+        }
+        if (exception)
+        {
+            stats.passthrough_failed++;
+        }
+        mb_tcp_server_complete(&server, slot, exception, NOW_MS());
+    }
+}
+#endif
+
+/**
+ * @brief Answers a request from the cache, or passes it on to the bus
+ */
+static int handle_request(void *ctx, int slot, const mb_tcp_request_t *request, uint16_t *regs)
+{
+    portENTER_CRITICAL(&cache_lock);
+    mb_regcache_result_t result = mb_regcache_lookup(&cache, request->unit_id, request->function, request->reg_start,
+                                                     request->reg_count, CONFIG_MB_TCP_CACHE_MAX_AGE_SECONDS * 1000UL,
+                                                     NOW_MS(), regs);
+    portEXIT_CRITICAL(&cache_lock);
+
+    switch (result)
+    {
+        case MB_REGCACHE_HIT:
+            stats.hits++;
+            return 0;
+        case MB_REGCACHE_STALE:
+            stats.stale++;
+            break;
+        default:
+            stats.misses++;
+            break;
+    }
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+    return passthrough_submit(slot, request, regs);
+#else
+    switch (result)
+    {
+        case MB_REGCACHE_STALE:
+            // The poller has not been able to read the slave for a while
+            return MB_TCP_EX_TARGET_FAILED;
+        case MB_REGCACHE_MISS:
+            return MB_TCP_EX_ILLEGAL_ADDRESS;
+        default:
+            return MB_TCP_EX_PATH_UNAVAILABLE;
+    }
+#endif
+}
+
+static void log_stats(void)
+{
+    ESP_LOGI(TAG, "%u connections (%u refused, %u dropped), %u requests, %u exceptions",
+                    server.connections, server.rejected, server.dropped, server.requests, server.exceptions);
+    ESP_LOGI(TAG, "Cache: %u hits, %u stale, %u misses. Pass-through: %u sent, %u failed",
+                    stats.hits, stats.stale, stats.misses, stats.passthrough, stats.passthrough_failed);
+}
+
+static void gateway_task(void *pvParameter)
+{
+    uint32_t last_log = NOW_MS();
+
+    while (1)
+    {
+        uint32_t timeout = mb_tcp_server_has_pending(&server) ? GATEWAY_PENDING_POLL_MS : GATEWAY_IDLE_POLL_MS;
+        mb_tcp_server_poll(&server, timeout, NOW_MS());
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+        passthrough_complete();
+#endif
+        if ((NOW_MS() - last_log) >= GATEWAY_LOG_INTERVAL_MS)
+        {
+            log_stats();
+            last_log = NOW_MS();
+        }
+    }
+}
+
+void mb_tcp_gateway_store(uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count, const uint16_t *regs)
+{
+    portENTER_CRITICAL(&cache_lock);
+    mb_regcache_store(&cache, slave_addr, function, reg_start, reg_count, regs, NOW_MS());
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+esp_err_t mb_tcp_gateway_start(void)
+{
+    mb_regcache_init(&cache);
+    int err = mb_tcp_server_init(&server, CONFIG_MB_TCP_PORT, CONFIG_MB_TCP_MAX_CLIENTS,
+                                 CONFIG_MB_TCP_IDLE_TIMEOUT_SECONDS * 1000UL, handle_request, NULL);
+    if (err != 0)
+    {
+        ESP_LOGE(TAG, "Unable to listen on port %d, errno %d", CONFIG_MB_TCP_PORT, err);
+        return ESP_FAIL;
+    }
+    xTaskCreate(gateway_task, THREAD_MB_TCP_NAME, THREAD_MB_TCP_STACKSIZE, NULL, THREAD_MB_TCP_PRIORITY, NULL);
+    ESP_LOGI(TAG, "Modbus TCP gateway on port %d, %d clients, %s", CONFIG_MB_TCP_PORT, CONFIG_MB_TCP_MAX_CLIENTS,
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+                    "cache misses passed through to the bus"
+#else
+                    "answering from the cache only"
+#endif
+                    );
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+    Modbus TCP gateway
+
+    Exposes the sensors on the RS485 bus to the LAN as a Modbus TCP server (FC03/FC04). The
+    unit id of a request is the slave address on the bus.
+
+    Reads are answered from a register cache (mb_regcache.h) that the poller refreshes after
+    every successful read, so a cache hit costs no serial transaction. A read the cache can't
+    answer gets an exception, or with CONFIG_MB_TCP_PASSTHROUGH is queued to the native RTU
+    master, the same queue the poller's own transactions go through, and answered when it
+    completes. Only one transaction is ever on the bus.
+
+    The server runs in its own task below the Modbus reader (mb_tcp_server.h), so TCP clients
+    never block the local poll loop.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Starts the server on CONFIG_MB_TCP_PORT. Call once the network is up.
+ */
+esp_err_t mb_tcp_gateway_start(void);
+
+/**
+ * @brief Stores the registers of a successful read in the cache. Called by the poller.
+ * @param function - read function (FC03 holding, FC04 input)
+ * @param regs - reg_count registers in host byte order
+ */
+void mb_tcp_gateway_store(uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count, const uint16_t *regs);
@@ -0,0 +1,291 @@
+/*
+    Modbus TCP server
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include "mb_tcp_server.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void close_client(mb_tcp_client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->rx_len = 0;
+    // A pending slot stays taken until its answer is in, see mb_tcp_server_complete()
+}
+
+/**
+ * @brief Sends a response, dropping the client if it can't take it all at once
+ */
+static void respond(mb_tcp_server_t *server, mb_tcp_client_t *client, uint8_t exception)
+{
+    uint8_t out[MB_TCP_MAX_ADU];
+    size_t len;
+
+    if (exception)
+    {
+        len = mb_tcp_build_exception(out, &client->request, exception);
+        server->exceptions++;
+    }
+    else
+    {
+        len = mb_tcp_build_read_response(out, &client->request, client->regs);
+    }
+    if (send(client->fd, out, len, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        server->dropped++;
+        close_client(client);
+    }
+}
+
+/**
+ * @brief Serves the complete requests in a client's receive buffer, up to the first one
+ * that is deferred
+ */
+static void process_frames(mb_tcp_server_t *server, int slot)
+{
+    mb_tcp_client_t *client = &server->clients[slot];
+
+    while ((client->fd >= 0) && !client->pending)
+    {
+        int len = mb_tcp_frame_len(client->rx, client->rx_len);
+        if (len < 0)
+        {
+            server->dropped++;
+            close_client(client);
+            return;
+        }
+        if (len == 0)
+        {
+            return;
+        }
+        server->requests++;
+        int result = mb_tcp_parse_request(client->rx, len, &client->request);
+        if (result == 0)
+        {
+            result = server->handler(server->ctx, slot, &client->request, client->regs);
+        }
+        client->rx_len -= len;
+        memmove(client->rx, client->rx + len, client->rx_len);
+        if (result == MB_TCP_DEFERRED)
+        {
+            client->pending = true;
+            server->deferred++;
+            return;
+        }
+        respond(server, client, (uint8_t)result);
+    }
+}
+
+static void accept_client(mb_tcp_server_t *server, uint32_t now_ms)
+{
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < server->max_clients; i++)
+    {
+        mb_tcp_client_t *client = &server->clients[i];
+        if ((client->fd < 0) && !client->pending)
+        {
+            int one = 1;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            client->fd = fd;
+            client->rx_len = 0;
+            client->last_active_ms = now_ms;
+            server->connections++;
+            return;
+        }
+    }
+    server->rejected++;
+    close(fd);
+}
+
+static void read_client(mb_tcp_server_t *server, int slot, uint32_t now_ms)
+{
+    mb_tcp_client_t *client = &server->clients[slot];
+    ssize_t n = recv(client->fd, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len, 0);
+
+    if (n < 0)
+    {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+            close_client(client);
+        }
+        return;
+    }
+    if (n == 0)
+    {
+        // Closed by the client
+        close_client(client);
+        return;
+    }
+    client->rx_len += n;
+    client->last_active_ms = now_ms;
+    process_frames(server, slot);
+}
+
+int mb_tcp_server_init(mb_tcp_server_t *server, uint16_t port, uint16_t max_clients, uint32_t idle_timeout_ms,
+                       mb_tcp_handler_t handler, void *ctx)
+{
+    struct sockaddr_in addr = { 0 };
+    int one = 1;
+
+    memset(server, 0, sizeof(mb_tcp_server_t));
+    for (int i = 0; i < MB_TCP_SERVER_MAX_CLIENTS; i++)
+    {
+        server->clients[i].fd = -1;
+    }
+    server->max_clients = ((max_clients == 0) || (max_clients > MB_TCP_SERVER_MAX_CLIENTS)) ? MB_TCP_SERVER_MAX_CLIENTS : max_clients;
+    server->idle_timeout_ms = idle_timeout_ms;
+    server->handler = handler;
+    server->ctx = ctx;
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_fd < 0)
+    {
+        return errno;
+    }
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(server->listen_fd, server->max_clients) < 0))
+    {
+        int err = errno;
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return err;
+    }
+    return 0;
+}
+
+uint16_t mb_tcp_server_port(const mb_tcp_server_t *server)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(server->listen_fd, (struct sockaddr *)&addr, &len) < 0)
+    {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+void mb_tcp_server_poll(mb_tcp_server_t *server, uint32_t timeout_ms, uint32_t now_ms)
+{
+    fd_set readable;
+    int max_fd = server->listen_fd;
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+
+    FD_ZERO(&readable);
+    FD_SET(server->listen_fd, &readable);
+    for (uint16_t i = 0; i < server->max_clients; i++)
+    {
+        const mb_tcp_client_t *client = &server->clients[i];
+        // A client with a request in progress is left unread until it is answered
+        if ((client->fd >= 0) && !client->pending)
+        {
+            FD_SET(client->fd, &readable);
+            max_fd = (client->fd > max_fd) ? client->fd : max_fd;
+        }
+    }
+
+    if (select(max_fd + 1, &readable, NULL, NULL, &tv) > 0)
+    {
+        if (FD_ISSET(server->listen_fd, &readable))
+        {
+            accept_client(server, now_ms);
+        }
+        for (uint16_t i = 0; i < server->max_clients; i++)
+        {
+            mb_tcp_client_t *client = &server->clients[i];
+            if ((client->fd >= 0) && !client->pending && FD_ISSET(client->fd, &readable))
+            {
+                read_client(server, i, now_ms);
+            }
+        }
+    }
+
+    if (server->idle_timeout_ms)
+    {
+        for (uint16_t i = 0; i < server->max_clients; i++)
+        {
+            mb_tcp_client_t *client = &server->clients[i];
+            if ((client->fd >= 0) && !client->pending && ((now_ms - client->last_active_ms) > server->idle_timeout_ms))
+            {
+                server->dropped++;
+                close_client(client);
+            }
+        }
+    }
+}
+
+void mb_tcp_server_complete(mb_tcp_server_t *server, int slot, uint8_t exception, uint32_t now_ms)
+{
+    mb_tcp_client_t *client = &server->clients[slot];
+
+    if (!client->pending)
+    {
+        return;
+    }
+    client->pending = false;
+    if (client->fd < 0)
+    {
+        // The client was closed while it waited, the slot is free again
+        return;
+    }
+    client->last_active_ms = now_ms;
+    respond(server, client, exception);
+    process_frames(server, slot);
+}
+
+bool mb_tcp_server_has_pending(const mb_tcp_server_t *server)
+{
+    for (uint16_t i = 0; i < server->max_clients; i++)
+    {
+        if (server->clients[i].pending)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void mb_tcp_server_close(mb_tcp_server_t *server)
+{
+    for (uint16_t i = 0; i < server->max_clients; i++)
+    {
+        if (server->clients[i].fd >= 0)
+        {
+            close_client(&server->clients[i]);
+        }
+        server->clients[i].pending = false;
+    }
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+        server->listen_fd = -1;
+    }
+}
@@ -0,0 +1,109 @@
+/*
+    Modbus TCP server
+
+    A single threaded Modbus TCP server for FC03/FC04 reads with several clients at once. One
+    task calls mb_tcp_server_poll() in a loop; it waits on all the sockets with select(),
+    accepts new clients and passes each complete request to a handler. The handler either
+    answers at once (a cache hit) or defers the answer, for example while the request goes
+    out on the serial bus, and completes it later with mb_tcp_server_complete() from the same
+    task. A client with a deferred request is not read from until it is answered, the others
+    carry on.
+
+    Sockets are non-blocking: a client that does not take its response is dropped rather
+    than holding up the others. Idle clients are closed after a timeout so they do not keep
+    the slots.
+
+    Uses only the BSD socket API, so it builds against lwIP on the ESP32 and on a Linux host
+    (see tools/mbtcp_test). The ESP32 side is in mb_tcp_gateway.c.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "mb_tcp.h"
+#include "mb_rtu.h"
+
+// Largest number of clients a server can be set up for
+#define MB_TCP_SERVER_MAX_CLIENTS   (8)
+// Handler result: the answer will come later through mb_tcp_server_complete()
+#define MB_TCP_DEFERRED             (-1)
+
+/**
+ * @brief Called for every valid request
+ * @param ctx - context given to mb_tcp_server_init()
+ * @param slot - client slot, passed back to mb_tcp_server_complete() for a deferred answer
+ * @param request - the request
+ * @param regs - where to put the registers; stays valid until the request is completed
+ * @returns 0 when regs holds the answer, an exception code, or MB_TCP_DEFERRED
+ */
+typedef int (*mb_tcp_handler_t)(void *ctx, int slot, const mb_tcp_request_t *request, uint16_t *regs);
+
+typedef struct
+{
+    int fd;                     // Socket, -1 when the slot is free or the client has gone
+    bool pending;               // A deferred request is waiting for its answer
+    uint32_t last_active_ms;
+    size_t rx_len;
+    uint8_t rx[MB_TCP_MAX_ADU];
+    mb_tcp_request_t request;   // Request being answered
+    uint16_t regs[MB_RTU_MAX_READ_REGS];
+} mb_tcp_client_t;
+
+typedef struct
+{
+    int listen_fd;
+    uint16_t max_clients;
+    uint32_t idle_timeout_ms;
+    mb_tcp_handler_t handler;
+    void *ctx;
+    mb_tcp_client_t clients[MB_TCP_SERVER_MAX_CLIENTS];
+    // Counters
+    uint32_t connections;       // Clients accepted
+    uint32_t rejected;          // Connections refused because every slot was taken
+    uint32_t requests;          // Requests received
+    uint32_t exceptions;        // Exception responses sent
+    uint32_t deferred;          // Requests answered later
+    uint32_t dropped;           // Clients dropped for a bad frame, a failed send or idling
+} mb_tcp_server_t;
+
+/**
+ * @brief Opens the listening socket
+ * @param port - TCP port, 0 for any free port (see mb_tcp_server_port())
+ * @param max_clients - clients served at once (1 to MB_TCP_SERVER_MAX_CLIENTS)
+ * @param idle_timeout_ms - close clients idle this long, 0 to keep them
+ * @returns 0, or the errno of the failed socket call
+ */
+int mb_tcp_server_init(mb_tcp_server_t *server, uint16_t port, uint16_t max_clients, uint32_t idle_timeout_ms,
+                       mb_tcp_handler_t handler, void *ctx);
+
+/**
+ * @brief Returns the port the server listens on
+ */
+uint16_t mb_tcp_server_port(const mb_tcp_server_t *server);
+
+/**
+ * @brief Waits up to timeout_ms for socket activity and serves it
+ * @param now_ms - current time, for the idle timeout
+ */
+void mb_tcp_server_poll(mb_tcp_server_t *server, uint32_t timeout_ms, uint32_t now_ms);
+
+/**
+ * @brief Answers a deferred request, then serves any requests the client sent after it
+ * @param slot - slot passed to the handler
+ * @param exception - 0 when the client's regs hold the answer, otherwise the exception code
+ */
+void mb_tcp_server_complete(mb_tcp_server_t *server, int slot, uint8_t exception, uint32_t now_ms);
+
+/**
+ * @brief Returns true if any request is waiting for mb_tcp_server_complete()
+ */
+bool mb_tcp_server_has_pending(const mb_tcp_server_t *server);
+
+/**
+ * @brief Closes every client and the listening socket
+ */
+void mb_tcp_server_close(mb_tcp_server_t *server);
@@ -0,0 +1,140 @@
+/*
+    Runtime metrics
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "metrics.h"
+
+#ifdef CONFIG_METRICS_ENABLE
+
+static const char *TAG = "METRICS";
+
+#define METRICS_NAME_C(id, name) name,
+#define METRICS_NAME_G(id, name) name,
+#define METRICS_NAME_H(id, name, unit) name,
+#define METRICS_UNIT_OF_H(id, name, unit) METRICS_UNIT_##unit,
+
+static const char *const counter_names[METRIC_COUNTER_COUNT] = {
+    METRICS_MAP(METRICS_NAME_C, METRICS_IGNORE_G, METRICS_IGNORE_H)
+};
+static const char *const gauge_names[METRIC_GAUGE_COUNT] = {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_NAME_G, METRICS_IGNORE_H)
+};
+static const char *const hist_names[METRIC_HIST_COUNT] = {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_IGNORE_G, METRICS_NAME_H)
+};
+static const uint8_t hist_units[METRIC_HIST_COUNT] = {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_IGNORE_G, METRICS_UNIT_OF_H)
+};
+static const char *const unit_names[] = { [METRICS_UNIT_US] = "us", [METRICS_UNIT_CYCLES] = "cycles" };
+
+uint32_t metrics_counters[METRIC_COUNTER_COUNT];
+int32_t metrics_gauges[METRIC_GAUGE_COUNT];
+static histogram_t hists[METRIC_HIST_COUNT];
+static portMUX_TYPE hist_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void metrics_record(metric_hist_t id, uint32_t value)
+{
+    portENTER_CRITICAL(&hist_lock);
+    histogram_record(&hists[id], value);
+    portEXIT_CRITICAL(&hist_lock);
+}
+
+bool metrics_get_hist(metric_hist_t id, histogram_t *hist)
+{
+    if ((unsigned)id >= METRIC_HIST_COUNT)
+    {
+        return false;
+    }
+    portENTER_CRITICAL(&hist_lock);
+    memcpy(hist, &hists[id], sizeof(histogram_t));
+    portEXIT_CRITICAL(&hist_lock);
+    return true;
+}
+
+int metrics_format(char *buffer, size_t len)
+{
+    int used = 0;
+    int n;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        n = snprintf(buffer + used, len - used, "%s%s:%u", used ? "," : "", counter_names[i],
+                        (unsigned)__atomic_load_n(&metrics_counters[i], __ATOMIC_RELAXED));
+        if ((n < 0) || ((size_t)n >= len - used))
+        {
+            buffer[used] = '\0';
+            return used;
+        }
+        used += n;
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        n = snprintf(buffer + used, len - used, "%s%s:%d", used ? "," : "", gauge_names[i],
+                        (int)__atomic_load_n(&metrics_gauges[i], __ATOMIC_RELAXED));
+        if ((n < 0) || ((size_t)n >= len - used))
+        {
+            buffer[used] = '\0';
+            return used;
+        }
+        used += n;
+    }
+    for (int i = 0; i < METRIC_HIST_COUNT; i++)
+    {
+        histogram_t hist;
+        metrics_get_hist(i, &hist);
+        n = snprintf(buffer + used, len - used, "%s%s:%u/%u/%u/%u/%u", used ? "," : "", hist_names[i],
+                        (unsigned)hist.samples,
+                        (unsigned)(hist.samples ? hist.sum / hist.samples : 0),
+                        (unsigned)histogram_percentile(&hist, 500),
+                        (unsigned)histogram_percentile(&hist, 990),
+                        (unsigned)hist.max);
+        if ((n < 0) || ((size_t)n >= len - used))
+        {
+            buffer[used] = '\0';
+            return used;
+        }
+        used += n;
+    }
+    return used;
+}
+
+void metrics_log(void)
+{
+    char buffer[256];
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        ESP_LOGI(TAG, "%s: %u", counter_names[i], (unsigned)__atomic_load_n(&metrics_counters[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        ESP_LOGI(TAG, "%s: %d", gauge_names[i], (int)__atomic_load_n(&metrics_gauges[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < METRIC_HIST_COUNT; i++)
+    {
+        histogram_t hist;
+
+        metrics_get_hist(i, &hist);
+        histogram_format(&hist, buffer, sizeof(buffer));
+        ESP_LOGI(TAG, "%s: %u samples, mean %u, p50 %u, p99 %u, max %u %s: %s", hist_names[i],
+                        (unsigned)hist.samples,
+                        (unsigned)(hist.samples ? hist.sum / hist.samples : 0),
+                        (unsigned)histogram_percentile(&hist, 500),
+                        (unsigned)histogram_percentile(&hist, 990),
+                        (unsigned)hist.max,
+                        unit_names[hist_units[i]],
+                        buffer);
+    }
+}
+
+#endif
@@ -0,0 +1,167 @@
+/*
+    Runtime metrics
+
+    A fixed registry of counters, gauges and latency histograms for the hot paths: the Modbus
+    transactions and poll cycle, the MQTT publish call and the HomeKit read callback. Every
+    metric is declared once in METRICS_MAP() below and lives in a static table, so recording
+    never allocates. Counters and gauges are a single atomic operation; a histogram sample
+    takes a short critical section.
+
+    Histograms are the power of two histogram_t of histogram.h, kept in one of two units:
+
+    - US, microseconds from esp_timer, for paths that block. A task may move to the other
+      core while it waits and the cycle counters of the two cores are not in step.
+    - CYCLES, CPU cycles from the core's cycle counter, for short paths that do not block.
+      A sample that ended on a different core than it started is dropped and counted in
+      timer_migrated.
+
+    The METRIC_*() macros are the only interface the instrumented code uses. Without
+    CONFIG_METRICS_ENABLE they expand to nothing, arguments included, and no table is built.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "histogram.h"
+
+/*
+    C(id, name) counter, G(id, name) gauge, H(id, name, unit) histogram. name is used in the
+    log and diagnostics messages.
+*/
+#define METRICS_MAP(C, G, H) \
+    C(MB_TRANSACTIONS,      "mb_tx") \
+    C(MB_RETRIES,           "mb_retry") \
+    C(MB_FAILURES,          "mb_fail") \
+    C(MQTT_PUBLISHES,       "mqtt_pub") \
+    C(MQTT_PUBLISH_FAILURES, "mqtt_fail") \
+    C(HOMEKIT_READS,        "hk_read") \
+    C(TIMER_MIGRATED,       "timer_migrated") \
+    G(SAMPLE_QUEUE,         "sample_queue") \
+    G(FREE_HEAP,            "heap_free") \
+    G(MIN_FREE_HEAP,        "heap_min") \
+    H(MB_TRANSACTION,       "mb_tx_us",     US) \
+    H(MB_POLL,              "mb_poll_us",   US) \
+    H(MQTT_PUBLISH,         "mqtt_pub_us",  US) \
+    H(MB_DECODE,            "mb_decode_cyc", CYCLES) \
+    H(HOMEKIT_READ,         "hk_read_cyc",  CYCLES)
+
+#define METRICS_UNIT_US     (0)
+#define METRICS_UNIT_CYCLES (1)
+
+#define METRICS_IGNORE_C(id, name)
+#define METRICS_IGNORE_G(id, name)
+#define METRICS_IGNORE_H(id, name, unit)
+#define METRICS_ENUM_C(id, name) METRIC_##id,
+#define METRICS_ENUM_G(id, name) METRIC_##id,
+#define METRICS_ENUM_H(id, name, unit) METRIC_##id,
+#define METRICS_UNIT_H(id, name, unit) METRIC_UNIT_##id = METRICS_UNIT_##unit,
+
+typedef enum {
+    METRICS_MAP(METRICS_ENUM_C, METRICS_IGNORE_G, METRICS_IGNORE_H)
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_ENUM_G, METRICS_IGNORE_H)
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+typedef enum {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_IGNORE_G, METRICS_ENUM_H)
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+// Unit of each histogram, checked at compile time by the timer macros
+enum {
+    METRICS_MAP(METRICS_IGNORE_C, METRICS_IGNORE_G, METRICS_UNIT_H)
+};
+
+#ifdef CONFIG_METRICS_ENABLE
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "xtensa/hal.h"
+
+extern uint32_t metrics_counters[METRIC_COUNTER_COUNT];
+extern int32_t metrics_gauges[METRIC_GAUGE_COUNT];
+
+/**
+ * @brief Adds a sample to a histogram
+ * @param id - histogram
+ * @param value - sample in the unit of the histogram
+ */
+void metrics_record(metric_hist_t id, uint32_t value);
+
+/**
+ * @brief Copies a histogram, consistent with itself
+ * @returns false if id is out of range
+ */
+bool metrics_get_hist(metric_hist_t id, histogram_t *hist);
+
+/**
+ * @brief Formats every metric as "name:value" pairs separated by commas, histograms as
+ * "name:samples/mean/p50/p99/max". Stops before the first pair that does not fit.
+ * @returns number of characters written (excluding the terminator)
+ */
+int metrics_format(char *buffer, size_t len);
+
+/**
+ * @brief Logs every metric, histograms with their non-empty buckets
+ */
+void metrics_log(void);
+
+#define METRIC_COUNT(id) \
+    (void)__atomic_fetch_add(&metrics_counters[METRIC_##id], 1, __ATOMIC_RELAXED)
+#define METRIC_ADD(id, n) \
+    (void)__atomic_fetch_add(&metrics_counters[METRIC_##id], (uint32_t)(n), __ATOMIC_RELAXED)
+#define METRIC_GAUGE(id, value) \
+    __atomic_store_n(&metrics_gauges[METRIC_##id], (int32_t)(value), __ATOMIC_RELAXED)
+#define METRIC_COUNTER_VALUE(id) \
+    __atomic_load_n(&metrics_counters[METRIC_##id], __ATOMIC_RELAXED)
+#define METRIC_GAUGE_VALUE(id) \
+    __atomic_load_n(&metrics_gauges[METRIC_##id], __ATOMIC_RELAXED)
+
+// Times a blocking path in microseconds: METRIC_TIME_BEGIN(t); ... METRIC_TIME_END(MB_POLL, t);
+#define METRIC_TIME_BEGIN(var) \
+    const int64_t var = esp_timer_get_time()
+#define METRIC_TIME_END(id, var) \
+    do { \
+        _Static_assert(METRIC_UNIT_##id == METRICS_UNIT_US, #id " is not timed in microseconds"); \
+        metrics_record(METRIC_##id, (uint32_t)(esp_timer_get_time() - (var))); \
+    } while (0)
+
+// Times a short, non-blocking path in CPU cycles
+#define METRIC_CYCLES_BEGIN(var) \
+    const uint32_t var = xthal_get_ccount(); \
+    const BaseType_t var##_core = xPortGetCoreID()
+#define METRIC_CYCLES_END(id, var) \
+    do { \
+        _Static_assert(METRIC_UNIT_##id == METRICS_UNIT_CYCLES, #id " is not timed in cycles"); \
+        uint32_t var##_end = xthal_get_ccount(); \
+        if (xPortGetCoreID() == var##_core) \
+        { \
+            metrics_record(METRIC_##id, var##_end - (var)); \
+        } \
+        else \
+        { \
+            METRIC_COUNT(TIMER_MIGRATED); \
+        } \
+    } while (0)
+
+#else
+
+#define METRIC_COUNT(id)            do { } while (0)
+#define METRIC_ADD(id, n)           do { } while (0)
+#define METRIC_GAUGE(id, value)     do { } while (0)
+#define METRIC_TIME_BEGIN(var)
+#define METRIC_TIME_END(id, var)    do { } while (0)
+#define METRIC_CYCLES_BEGIN(var)
+#define METRIC_CYCLES_END(id, var)  do { } while (0)
+
+#endif
@@ -16,31 +16,53 @@
 // limitations under the License.
 
 #include "string.h"
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "mbcontroller.h"
 #include "modbus.h"
 #include "sdkconfig.h"
 #include "threads.h"
 #include "homekit.h"
+#include "bus_sched.h"
+#include "snapshot.h"
+#include "mb_health.h"
+#include "mb_rtu_master.h"
+#include "mb_crc.h"
+#include "history.h"
+#include "rollup.h"
+#include "signal_filter.h"
+#include "regmap.h"
+#include "mb_plan.h"
+#include "mb_scan.h"
+#include "metrics.h"
+#include "sample_queue.h"
+#include "mb_regcache.h"
+#include "mb_tcp_gateway.h"
+#include "nvs_flash.h"
+#include "nvs.h"
 
 #define MB_PORT_NUM     (CONFIG_MB_UART_PORT_NUM)   // Number of UART port used for Modbus connection
 #define MB_DEV_SPEED    (CONFIG_MB_UART_BAUD_RATE)  // The communication speed of the UART
-#define MB_MAX_RETRY    10
 // Note: Some pins on target chip cannot be assigned for UART communication.
 // See UART documentation for selected board and target to configure pins using Kconfig.
 
-// The number of parameters that intended to be used in the particular control process
-#define MASTER_MAX_CIDS num_device_parameters
-
 // Number of reading of parameters from slave
 #define MASTER_MAX_RETRY 2
 
-// Timeout between polls
-#define POLL_TIMEOUT_MS                 (50)
-#define POLL_TIMEOUT_TICS               (POLL_TIMEOUT_MS / portTICK_RATE_MS)
-
 #define MODBUS_TAG "MODBUS"
 
+_Static_assert(CID_COUNT <= REGMAP_MAX_ENTRIES, "The built-in CIDs must fit in a register map");
+_Static_assert(sizeof(sensor_values_t) == CID_COUNT * sizeof(float), "sensor_values_t must have one field per CID");
+_Static_assert(REGMAP_MAX_ENTRIES <= SNAPSHOT_MAX_VALUES, "Increase SNAPSHOT_MAX_VALUES to hold all the CIDs");
+_Static_assert(REGMAP_MAX_ENTRIES <= ROLLUP_MAX_VALUES, "Increase ROLLUP_MAX_VALUES to hold all the CIDs");
+_Static_assert(REGMAP_MAX_ENTRIES <= SAMPLE_MAX_VALUES, "Increase SAMPLE_MAX_VALUES to hold all the CIDs");
+
+// Where a register map can be stored in NVS, see regmap.h
+#define REGMAP_NVS_NAMESPACE "modbus"
+#define REGMAP_NVS_KEY "regmap"
+
 #define MASTER_CHECK(a, ret_val, str, ...) \
     if (!(a)) { \
         ESP_LOGE(MODBUS_TAG, "%s(%u): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
@@ -54,12 +76,42 @@
 #define NO_OPTS() { .opt1 = 0, .opt2 = 0, .opt3 = 0 }
 #define BINARY_OPTS(bit) { .opt1 = bit, .opt2 = 255, .opt3 = 255 }
 
-static input_reg_params_t input_reg_params = { 0 };
+// Working copy of the sensor values. Only the poller touches it; everyone else reads the
+// published snapshot.
+static sensor_snapshot_t input_reg_params = { 0 };
+
+// Filter chain per CID, see signal_filter.h. Rates are configured in 0.1 units per minute.
+#define FILTER_RATE(tenths_per_min) ((tenths_per_min) / 600.0f)
+#define FILTER_CFG(rate) { \
+        .median_n = CONFIG_MB_FILTER_MEDIAN_N, \
+        .ema_alpha = CONFIG_MB_FILTER_EMA_ALPHA_PERCENT / 100.0f, \
+        .max_rate = FILTER_RATE(rate), \
+        .max_rejects = CONFIG_MB_FILTER_MAX_REJECTS \
+    }
 
-// EPSolar Data (Object) Dictionary. We only use grab some of the live data. Stats
-// are not useful to use as they can be processed by the cloud services.
+// The rate check depends on what a CID measures, taken from its unit in the register map, so
+// every temperature and humidity in the map gets one. Other units get no rate check.
+static const signal_filter_cfg_t filter_cfg_temperature = FILTER_CFG(CONFIG_MB_FILTER_TEMP_MAX_RATE);
+static const signal_filter_cfg_t filter_cfg_humidity = FILTER_CFG(CONFIG_MB_FILTER_HUMIDITY_MAX_RATE);
+static const signal_filter_cfg_t filter_cfg_other = FILTER_CFG(0);
+static signal_filter_t filters[REGMAP_MAX_ENTRIES];
+
+// Min/max/mean of every reading over 1m/15m/1h windows. Written by the poller, read by the
+// publishers, so it is guarded by a spinlock (the copy is short).
+static rollup_set_t rollups;
+static portMUX_TYPE rollup_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Current time in ms, used for timestamps and the bus scheduler
+#define NOW_MS() (xTaskGetTickCount() * portTICK_PERIOD_MS)
+
+// Register map in use: the built-in XY-MD02 map, or the one stored in NVS. Loaded once by
+// modbus_init() and fixed after that.
+static regmap_t regmap;
+
+// EPSolar Data (Object) Dictionary, built from the register map. We only use grab some of
+// the live data. Stats are not useful to use as they can be processed by the cloud services.
 //
-// The CID field in the table must be unique.
+// The CID field in the table must be unique, and is the index of the entry in the map.
 // Modbus Slave Addr field defines slave address of the device with correspond parameter.
 // Modbus Reg Type - Type of Modbus register area (Holding register, Input Register and such).
 // Reg Start field defines the start Modbus register number and Reg Size defines the number of registers for the characteristic accordingly.
@@ -67,29 +119,40 @@ static input_reg_params_t input_reg_params = { 0 };
 // Data Type, Data Size specify type of the characteristic and its data size.
 // Parameter Options field specifies the options that can be used to process parameter value (limits or masks).
 // Access Mode - can be used to implement custom options for processing of characteristic (Read/Write restrictions, factory mode values and etc).
-static const mb_parameter_descriptor_t device_parameters[] = {
-    // { CID, Param Name, Units, Modbus Slave Addr, Modbus Reg Type, Reg Start, Reg Size, Instance Offset, Data Type, Data Size, Parameter Options, Access Mode}
-    { CID_INP_DATA_TEMPERATURE, STR("Temperature"), STR("C"), CONFIG_MB_DEVICE_ADDR, MB_PARAM_INPUT, 0x0001, 1,
-         CID_INP_DATA_TEMPERATURE, PARAM_TYPE_FLOAT, PARAM_SIZE_U16, NO_OPTS(), PAR_PERMS_READ },
-    { CID_INP_DATA_HUMIDITY, STR("Humidity"), STR("%"), CONFIG_MB_DEVICE_ADDR, MB_PARAM_INPUT, 0x0002, 1,
-         CID_INP_DATA_HUMIDITY, PARAM_TYPE_FLOAT, PARAM_SIZE_U16, NO_OPTS(), PAR_PERMS_READ },
-};
+static mb_parameter_descriptor_t device_parameters[REGMAP_MAX_ENTRIES];
+static uint16_t num_device_parameters = 0;
+
+// Slaves on the bus and how often each one is polled, one entry per slave address in the
+// register map. Higher priority wins when two slaves are due at the same time.
+static bus_sched_slave_cfg_t bus_slaves[REGMAP_MAX_ENTRIES];
+static uint16_t num_bus_slaves = 0;
 
-// Calculate number of parameters in the table
-static const uint16_t num_device_parameters = (sizeof(device_parameters)/sizeof(device_parameters[0]));
+// Health state of each slave in bus_slaves[], same order
+static mb_health_t slave_health[REGMAP_MAX_ENTRIES];
+
+// Schedule and poll statistics of each slave in bus_slaves[], same order. Run by the reader.
+static bus_sched_t bus_sched;
+// Shortest time between two logs of the bus statistics on deadline misses
+#define BUS_STATS_LOG_INTERVAL_MS       (60 * 1000)
+
+_Static_assert(MB_PLAN_MAX_REGS <= MB_REGCACHE_BLOCK_REGS, "A read plan group must fit in a register cache block");
+_Static_assert(REGMAP_MAX_ENTRIES <= MB_REGCACHE_MAX_BLOCKS, "Increase MB_REGCACHE_MAX_BLOCKS to hold every read plan group");
+
+// Read plan of the register map, built once at init (see mb_plan.h)
+static mb_plan_t read_plan;
 
 /**
- * @brief Sensor data items are stored as int16 items multiplied by 10. This function converts
- * the item to a float.
- * @param i - integer value
- * @returns float of the value multiplied by 10
+ * @brief Returns the latest published value of a CID. Never blocks on the poller.
+ * @param cid - CID to read
+ * @returns value of the CID, or 0.0 if the CID is invalid
  */
 float get_value(uint16_t cid)
 {
     float result = 0.0;
-    if (cid<CID_COUNT)
+    snapshot_value_t value;
+    if ((cid<num_device_parameters) && snapshot_get(cid, &value))
     {
-        result = input_reg_params.inputs[cid];
+        result = value.value;
     }
     else
     {
@@ -98,6 +161,20 @@ float get_value(uint16_t cid)
     return result;
 }
 
+#define SENSOR_MAP_COPY(cid, field, name, unit, area, reg, type, scale_exp) \
+    values->field = snapshot.values[cid].value; \
+    valid = valid && (snapshot.values[cid].quality & SNAPSHOT_QUALITY_VALID);
+
+bool modbus_get_values(sensor_values_t *values)
+{
+    sensor_snapshot_t snapshot;
+    bool valid = true;
+
+    snapshot_read(&snapshot);
+    SENSOR_MAP(SENSOR_MAP_COPY)
+    return valid;
+}
+
 float get_temperature(void)
 {
     return get_value(CID_INP_DATA_TEMPERATURE);
@@ -110,99 +187,604 @@ float get_humidity(void)
 
 void clearmodbus(void)
 {
-    memset(&input_reg_params, 0, sizeof(input_reg_params_t));
+    memset(&input_reg_params, 0, sizeof(sensor_snapshot_t));
+    input_reg_params.count = num_device_parameters;
+    snapshot_publish(&input_reg_params);
+}
+
+uint16_t modbus_cid_count(void)
+{
+    return num_device_parameters;
+}
+
+const regmap_param_t *modbus_cid_param(uint16_t cid)
+{
+    return (cid < regmap.count) ? &regmap.params[cid] : NULL;
+}
+
+/**
+ * @brief Loads the register map stored in NVS, if there is one and it is valid. The first
+ * CID_COUNT entries are the built-in CIDs (HomeKit and ThingSpeak take them by position), so a
+ * map whose first entries do not have the built-in units is refused. Names, slaves and
+ * registers may differ.
+ * @returns true if the map was loaded
+ */
+static bool load_nvs_regmap(regmap_t *map)
+{
+#ifdef CONFIG_MB_REGMAP_NVS
+    uint8_t blob[REGMAP_MAX_BLOB];
+    size_t len = sizeof(blob);
+    nvs_handle_t handle;
+    uint8_t bad_entry = 0;
+
+    // HomeKit may have set up NVS already, which is fine. If it needs an erase, leave that to HomeKit.
+    nvs_flash_init();
+    esp_err_t err = nvs_open(REGMAP_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_get_blob(handle, REGMAP_NVS_KEY, blob, &len);
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGI(MODBUS_TAG, "No register map in NVS (%s)", esp_err_to_name(err));
+        return false;
+    }
+    regmap_status_t status = regmap_parse(blob, len, map, &bad_entry);
+    if (status != REGMAP_OK)
+    {
+        ESP_LOGE(MODBUS_TAG, "Register map in NVS is invalid: %s (entry %d)", regmap_status_name(status), bad_entry);
+        return false;
+    }
+    if (map->count < CID_COUNT)
+    {
+        ESP_LOGE(MODBUS_TAG, "Register map in NVS has %d values, at least %d are needed", map->count, CID_COUNT);
+        return false;
+    }
+    regmap_t builtin;
+    regmap_builtin(&builtin, 0);
+    for (uint8_t i = 0; i < CID_COUNT; i++)
+    {
+        if (strcmp(map->params[i].unit, builtin.params[i].unit) != 0)
+        {
+            ESP_LOGE(MODBUS_TAG, "Register map in NVS has %s (%s) as CID %d, %s (%s) is needed",
+                            map->params[i].name, map->params[i].unit, i, builtin.params[i].name, builtin.params[i].unit);
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef MB_SCAN_ENABLED
+/**
+ * @brief Stores a register map in NVS, where modbus_map_build() picks it up. A scan on every
+ * boot usually finds the same map, so an unchanged one is not written again to spare the flash.
+ * @param changed - set if the stored map was written
+ */
+static esp_err_t save_nvs_regmap(const regmap_t *map, bool *changed)
+{
+    uint8_t blob[REGMAP_MAX_BLOB];
+    uint8_t stored[REGMAP_MAX_BLOB];
+    size_t stored_len = sizeof(stored);
+    nvs_handle_t handle;
+
+    *changed = false;
+
+    size_t len = regmap_encode(map, blob, sizeof(blob));
+    if (len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    nvs_flash_init();
+    esp_err_t err = nvs_open(REGMAP_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    if ((nvs_get_blob(handle, REGMAP_NVS_KEY, stored, &stored_len) == ESP_OK) &&
+        (stored_len == len) && (memcmp(stored, blob, len) == 0))
+    {
+        nvs_close(handle);
+        return ESP_OK;
+    }
+    err = nvs_set_blob(handle, REGMAP_NVS_KEY, blob, len);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    *changed = (err == ESP_OK);
+    return err;
+}
+
+/**
+ * @brief Scans the bus when configured to, and stores the map of what it found. A scan that
+ * finds fewer values than the built-in CIDs leaves the stored map alone.
+ */
+static void scan_bus(void)
+{
+    regmap_t map;
+    mb_scan_result_t result;
+
+#ifdef CONFIG_MB_SCAN_IF_NO_MAP
+    if (load_nvs_regmap(&map))
+    {
+        ESP_LOGI(MODBUS_TAG, "Register map already stored, not scanning the bus");
+        return;
+    }
+#endif
+    esp_err_t err = mb_scan_run(&map, &result);
+    if (err == ESP_ERR_NOT_FOUND)
+    {
+        ESP_LOGW(MODBUS_TAG, "Bus scan found no known sensors");
+        return;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(MODBUS_TAG, "Bus scan failed: %s", esp_err_to_name(err));
+        return;
+    }
+    if (map.count < CID_COUNT)
+    {
+        ESP_LOGW(MODBUS_TAG, "Bus scan found %d values, at least %d are needed", map.count, CID_COUNT);
+        return;
+    }
+    bool changed;
+    err = save_nvs_regmap(&map, &changed);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(MODBUS_TAG, "Unable to store the scanned register map: %s", esp_err_to_name(err));
+        return;
+    }
+    if (!changed)
+    {
+        ESP_LOGI(MODBUS_TAG, "Scanned register map is unchanged, not rewritten");
+        return;
+    }
+    ESP_LOGI(MODBUS_TAG, "Stored the register map of %d sensors found by the scan", result.identified - result.unmapped);
+}
+#endif
+
+/**
+ * @brief Loads the register map and builds the parameter table and the bus table from it
+ */
+static void modbus_map_build(void)
+{
+    if (load_nvs_regmap(&regmap))
+    {
+        ESP_LOGI(MODBUS_TAG, "Using the register map from NVS");
+    }
+    else
+    {
+        ESP_LOGI(MODBUS_TAG, "Using the built-in XY-MD02 register map");
+        regmap_builtin(&regmap, CONFIG_MB_DEVICE_ADDR);
+    }
+
+    num_bus_slaves = 0;
+    for (uint16_t i = 0; i < regmap.count; i++)
+    {
+        const regmap_param_t *param = &regmap.params[i];
+        device_parameters[i] = (mb_parameter_descriptor_t) {
+            .cid = i,
+            .param_key = param->name,
+            .param_units = param->unit,
+            .mb_slave_addr = param->slave,
+            .mb_param_type = (param->reg_type == REGMAP_REG_INPUT) ? MB_PARAM_INPUT : MB_PARAM_HOLDING,
+            .mb_reg_start = param->reg_start,
+            .mb_size = param->reg_count,
+            .param_offset = i,
+            .param_type = PARAM_TYPE_FLOAT,
+            .param_size = (param->reg_count > 1) ? PARAM_SIZE_U32 : PARAM_SIZE_U16,
+            .param_opts = NO_OPTS(),
+            .access = PAR_PERMS_READ
+        };
+        ESP_LOGI(MODBUS_TAG, "CID %d: %s (%s), slave %d, %s reg 0x%04x+%d, %ssigned x1e%d, every %us, priority %u",
+                        i, param->name, param->unit, param->slave,
+                        (param->reg_type == REGMAP_REG_INPUT) ? "input" : "holding",
+                        param->reg_start, param->reg_count,
+                        (param->flags & REGMAP_FLAG_SIGNED) ? "" : "un",
+                        param->scale_exp, param->period_s, param->priority);
+
+        // The shortest period and highest priority of a slave's entries apply to the slave
+        uint32_t period_ms = param->period_s ? param->period_s * 1000UL : CONFIG_MB_THREAD_TIMEOUT * 1000UL;
+        uint16_t s;
+        for (s = 0; (s < num_bus_slaves) && (bus_slaves[s].slave_addr != param->slave); s++)
+        {
+        }
+        if (s == num_bus_slaves)
+        {
+            bus_slaves[num_bus_slaves++] = (bus_sched_slave_cfg_t) { param->slave, period_ms, param->priority };
+        }
+        else
+        {
+            bus_slaves[s].period_ms = (period_ms < bus_slaves[s].period_ms) ? period_ms : bus_slaves[s].period_ms;
+            bus_slaves[s].priority = (param->priority > bus_slaves[s].priority) ? param->priority : bus_slaves[s].priority;
+        }
+    }
+    num_device_parameters = regmap.count;
+}
+
+/**
+ * @brief Builds the read plan from the register map and logs its groups
+ */
+static void modbus_plan_build(void)
+{
+    mb_plan_build(&read_plan, &regmap);
+    for (uint16_t g = 0; g < read_plan.count; g++)
+    {
+        const mb_plan_group_t *group = &read_plan.groups[g];
+        ESP_LOGI(MODBUS_TAG, "Read group #%d: slave %d, FC%02d, regs 0x%04x-0x%04x, %d CIDs",
+                        g,
+                        group->slave_addr,
+                        group->function,
+                        group->reg_start,
+                        group->reg_start + group->reg_size - 1,
+                        group->count);
+    }
+}
+
+/**
+ * @brief Stores a freshly read value in the working copy of the snapshot
+ */
+static void store_value(uint16_t offset, float value)
+{
+    snapshot_value_t *entry = &input_reg_params.values[offset];
+    entry->value = value;
+    entry->timestamp_ms = NOW_MS();
+    entry->quality = SNAPSHOT_QUALITY_VALID | SNAPSHOT_QUALITY_UPDATED;
+}
+
+/**
+ * @brief Runs a decoded reading through its filter chain and stores the result. A reading
+ * rejected as an outlier leaves the previous value in place.
+ */
+static void condition_value(uint16_t offset, float value)
+{
+    float filtered;
+    if (offset >= num_device_parameters)
+    {
+        return;
+    }
+    if (!signal_filter_apply(&filters[offset], value, NOW_MS(), &filtered))
+    {
+        snapshot_value_t *entry = &input_reg_params.values[offset];
+        entry->quality = (entry->quality & SNAPSHOT_QUALITY_VALID) | SNAPSHOT_QUALITY_REJECTED;
+        ESP_LOGW(MODBUS_TAG, "CID %d reading %0.02f rejected as an outlier", offset, value);
+        return;
+    }
+    store_value(offset, filtered);
+}
+
+/**
+ * @brief Picks the filter configuration for a register map entry by its unit
+ */
+static const signal_filter_cfg_t *filter_cfg_for(const regmap_param_t *param)
+{
+    if ((strcmp(param->unit, "C") == 0) || (strcmp(param->unit, "F") == 0))
+    {
+        return &filter_cfg_temperature;
+    }
+    if ((strcmp(param->unit, "%") == 0) || (strcmp(param->unit, "%RH") == 0))
+    {
+        return &filter_cfg_humidity;
+    }
+    return &filter_cfg_other;
+}
+
+static void init_filters(void)
+{
+    for (uint16_t i = 0; i < REGMAP_MAX_ENTRIES; i++)
+    {
+        signal_filter_init(&filters[i], (i < regmap.count) ? filter_cfg_for(&regmap.params[i]) : &filter_cfg_other);
+    }
+}
+
+/**
+ * @brief Clears the updated flag of every value before a poll, so the snapshot it publishes
+ * only flags what that poll read. Each poll covers one slave.
+ */
+static void clear_updated(void)
+{
+    for (uint16_t cid = 0; cid < num_device_parameters; cid++)
+    {
+        input_reg_params.values[cid].quality &= ~SNAPSHOT_QUALITY_UPDATED;
+    }
+}
+
+/**
+ * @brief Flags all the values of a group that could not be read. The previous value is kept.
+ */
+static void mark_group_failed(const mb_plan_group_t *group)
+{
+    for (uint16_t i = 0; i < group->count; i++)
+    {
+        uint16_t cid = read_plan.order[group->first + i];
+        snapshot_value_t *entry = &input_reg_params.values[cid];
+        entry->quality = (entry->quality & SNAPSHOT_QUALITY_VALID) | SNAPSHOT_QUALITY_READ_ERROR;
+    }
+}
+
+/**
+ * @brief Decodes every characteristic out of the register buffer of a group read and runs
+ * them through their filters. The decoder for the register type was picked when the map was
+ * loaded.
+ * @param group - group the registers were read with
+ * @param regs - register values of the group, in host byte order
+ */
+static void decode_group(const mb_plan_group_t *group, const uint16_t *regs)
+{
+    for (uint16_t i = 0; i < group->count; i++)
+    {
+        uint16_t cid;
+        float value = mb_plan_decode(&read_plan, &regmap, group, i, regs, &cid);
+        ESP_LOGD(MODBUS_TAG, "Characteristic #%d %s (%s) value = %0.02f read successful.",
+                        cid,
+                        regmap.params[cid].name,
+                        regmap.params[cid].unit,
+                        value
+                        );
+        condition_value(cid, value);
+    }
+}
+
+/**
+ * @brief Sends a single request on the bus using the selected master implementation
+ * @returns ESP_OK with regs filled in host byte order, or the error of the transaction
+ */
+static esp_err_t send_request(uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count, uint16_t *regs)
+{
+    esp_err_t err;
+    METRIC_TIME_BEGIN(start);
+#ifdef CONFIG_MB_MASTER_NATIVE
+    err = mb_rtu_status_to_err(mb_rtu_master_read(slave_addr, function, reg_start, reg_count, regs, 0));
+#else
+    mb_param_request_t request = {
+        .slave_addr = slave_addr,
+        .command = function,
+        .reg_start = reg_start,
+        .reg_size = reg_count
+    };
+    err = mbc_master_send_request(&request, (void*)regs);
+#endif
+    METRIC_TIME_END(MB_TRANSACTION, start);
+    METRIC_COUNT(MB_TRANSACTIONS);
+    return err;
+}
+
+/**
+ * @brief Maps the error returned by the Modbus controller to a transaction result. The native
+ * master reports a bad CRC as ESP_ERR_INVALID_CRC and an exception as ESP_FAIL. freemodbus does
+ * neither: a frame that fails its CRC or does not parse comes back as ESP_ERR_INVALID_RESPONSE,
+ * the same as an exception response, so with it the invalid response class counts all of
+ * those. Both report a master that could not take the request as ESP_ERR_INVALID_STATE.
+ */
+static mb_result_t classify_result(esp_err_t err)
+{
+    switch (err)
+    {
+        case ESP_OK:
+            return MB_RESULT_OK;
+        case ESP_ERR_TIMEOUT:
+            return MB_RESULT_TIMEOUT;
+        case ESP_ERR_INVALID_CRC:
+            return MB_RESULT_CRC;
+        case ESP_ERR_INVALID_RESPONSE:
+            return MB_RESULT_INVALID;
+        case ESP_ERR_INVALID_STATE:
+            return MB_RESULT_BUSY;
+        default:
+            return MB_RESULT_ERROR;
+    }
 }
 
 /**
- * @brief Reads the data from the modbus for the solar controller.
+ * @brief Finds the health state of a slave
+ * @returns health state, or NULL if the slave is not in bus_slaves[]
+ */
+static mb_health_t *find_health(uint8_t slave_addr)
+{
+    for (uint16_t i = 0; i < num_bus_slaves; i++)
+    {
+        if (slave_health[i].slave_addr == slave_addr)
+        {
+            return &slave_health[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * State of one poll for the read plan callbacks: the last request and its error, for the log
+ * and the result of read_modbus_slave()
+ */
+typedef struct
+{
+    uint8_t slave_addr;
+    uint16_t reg_start;
+    uint16_t reg_count;
+    esp_err_t err;
+} poll_ctx_t;
+
+static mb_result_t plan_send(void *ctx, uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count,
+                             uint16_t *regs)
+{
+    poll_ctx_t *poll = (poll_ctx_t *)ctx;
+    poll->slave_addr = slave_addr;
+    poll->reg_start = reg_start;
+    poll->reg_count = reg_count;
+    poll->err = send_request(slave_addr, function, reg_start, reg_count, regs);
+    return classify_result(poll->err);
+}
+
+static void plan_backoff(void *ctx, uint32_t delay_ms)
+{
+    vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+    METRIC_COUNT(MB_RETRIES);
+}
+
+static void plan_failed(void *ctx, const mb_health_t *health, uint8_t attempt, uint8_t attempts)
+{
+    const poll_ctx_t *poll = (const poll_ctx_t *)ctx;
+    ESP_LOGE(MODBUS_TAG, "Slave %d (%s), regs 0x%04x+%d read fail, err = 0x%x (%s). Attempt %d of %d",
+                    poll->slave_addr,
+                    mb_health_state_name(health->state),
+                    poll->reg_start,
+                    poll->reg_count,
+                    (int)poll->err,
+                    (char*)esp_err_to_name(poll->err),
+                    attempt,
+                    attempts);
+}
+
+static uint32_t plan_now_ms(void *ctx)
+{
+    return NOW_MS();
+}
+
+/**
+ * @brief Adds the values just read from a slave to the rollups
+ */
+static void update_rollups(uint8_t slave_addr)
+{
+    float values[REGMAP_MAX_ENTRIES];
+    uint32_t valid = 0;
+
+    for (uint16_t cid = 0; cid < num_device_parameters; cid++)
+    {
+        values[cid] = input_reg_params.values[cid].value;
+    }
+    for (uint16_t cid = 0; cid < num_device_parameters; cid++)
+    {
+        if ((regmap.params[cid].slave == slave_addr) &&
+            (input_reg_params.values[cid].quality & SNAPSHOT_QUALITY_UPDATED))
+        {
+            valid |= (1UL << cid);
+        }
+    }
+    portENTER_CRITICAL(&rollup_lock);
+    rollup_add(&rollups, (uint32_t)time(NULL), values, valid);
+    portEXIT_CRITICAL(&rollup_lock);
+}
+
+/**
+ * @brief Reads all the groups in the read plan that belong to one slave and decodes the
+ * characteristics out of the responses. Offline slaves are not polled; they get a single
+ * one register probe once per probe interval instead.
+ * @param slave_addr - slave to read
+ * @returns ESP_OK if all groups were read, otherwise the error of the last failed group
+ */
+esp_err_t read_modbus_slave(uint8_t slave_addr)
+{
+    esp_err_t result = ESP_OK;
+    mb_health_t *health = find_health(slave_addr);
+    MASTER_CHECK((health != NULL), ESP_ERR_NOT_FOUND, "slave %d is not in the bus table", slave_addr);
+    METRIC_TIME_BEGIN(poll_start);
+
+    clear_updated();
+    bool offline = (health->state == MB_HEALTH_OFFLINE);
+    poll_ctx_t poll = { .err = ESP_OK };
+    const mb_plan_io_t io = {
+        .send = plan_send,
+        .backoff = plan_backoff,
+        .failed = plan_failed,
+        .now_ms = plan_now_ms,
+        .ctx = &poll
+    };
+    for (uint16_t g = 0; g < read_plan.count; g++)
+    {
+        const mb_plan_group_t *group = &read_plan.groups[g];
+        if (group->slave_addr != slave_addr) continue;
+
+        uint16_t regs[MB_PLAN_MAX_REGS] = { 0 };
+        switch (mb_plan_read(group, health, &io, regs))
+        {
+            case MB_PLAN_READ_OK:
+                break;
+            case MB_PLAN_READ_SKIPPED:
+                mark_group_failed(group);
+                result = ESP_ERR_INVALID_STATE;
+                continue;
+            case MB_PLAN_READ_OFFLINE:
+                ESP_LOGW(MODBUS_TAG, "Slave %d still offline, next probe in %d ms", slave_addr, health->probe_interval_ms);
+                // fall through
+            default:
+                // Move on and hope the next poll works
+                METRIC_COUNT(MB_FAILURES);
+                mark_group_failed(group);
+                result = poll.err;
+                continue;
+        }
+        if (offline)
+        {
+            ESP_LOGI(MODBUS_TAG, "Slave %d is back online", slave_addr);
+            offline = false;
+        }
+#ifdef CONFIG_MB_TCP_GATEWAY
+        mb_tcp_gateway_store(group->slave_addr, group->function, group->reg_start, group->reg_size, regs);
+#endif
+
+        METRIC_CYCLES_BEGIN(decode_start);
+        decode_group(group, regs);
+        METRIC_CYCLES_END(MB_DECODE, decode_start);
+    }
+    input_reg_params.cycle++;
+    input_reg_params.count = num_device_parameters;
+    snapshot_publish(&input_reg_params);
+#ifdef CONFIG_HISTORY_ENABLE
+    history_record(&input_reg_params);
+#endif
+    update_rollups(slave_addr);
+    METRIC_TIME_END(MB_POLL, poll_start);
+
+#ifdef CONFIG_HOMEKIT_ENABLED
+    homekit_notify();
+#endif
+    return result;
+}
+
+/**
+ * @brief Returns the last completed rollup window of a resolution
+ */
+bool modbus_get_rollup(rollup_res_t res, rollup_result_t *result)
+{
+    portENTER_CRITICAL(&rollup_lock);
+    bool ok = rollup_get(&rollups, res, result);
+    portEXIT_CRITICAL(&rollup_lock);
+    return ok;
+}
+
+/**
+ * @brief Returns the health state and counters of a slave
+ * @param index - index of the slave in the bus table
+ * @returns NULL if the index is out of range
+ */
+const mb_health_t *modbus_slave_health(uint16_t index)
+{
+    return (index < num_bus_slaves) ? &slave_health[index] : NULL;
+}
+
+bool modbus_slave_stats(uint16_t index, bus_sched_stats_t *stats)
+{
+    return bus_sched_get_stats(&bus_sched, index, NOW_MS(), stats);
+}
+
+/**
+ * @brief Reads the data from the modbus for all the sensors on the bus.
  * The minimum amount of time between calls to this function is 500ms. Errors will occur if it is called
- * too quickly. Data is retrieve with the "getter" functions.
+ * too quickly. Data is retrieve with the "getter" functions. Each group in the read plan is fetched
+ * with a single transaction and all the characteristics in it are decoded from the shared response.
   */
 void read_modbus(void)
 {
-    esp_err_t err = ESP_OK;
-    const mb_parameter_descriptor_t* param_descriptor = NULL;
-    
     ESP_LOGI(MODBUS_TAG, "Reading modbus data...");
-    
-    for (uint16_t cid = 0; (err != ESP_ERR_NOT_FOUND) && cid < MASTER_MAX_CIDS; cid++) 
-    {
-        // Get data from parameters description table
-        // and use this information to fill the characteristics description table
-        // and having all required fields in just one table
-        err = mbc_master_get_cid_info(cid, &param_descriptor);
-        if ((err != ESP_ERR_NOT_FOUND) && (param_descriptor != NULL))
-        {
-            int32_t value = 0;
-            uint8_t type = 0;
-            err = ESP_ERR_TIMEOUT;
-            for (int retry = 0; (retry < MB_MAX_RETRY) && (err != ESP_OK); retry++) {
-                err = mbc_master_get_parameter(cid, (char*)param_descriptor->param_key, 
-                                                                (uint8_t*)&value, &type);
-                if (err != ESP_OK)
-                {
-                    ESP_LOGE(MODBUS_TAG, "Characteristic #%d (%s) read fail, err = 0x%x (%s). Retrying %d of %d ...",
-                                    param_descriptor->cid,
-                                    (char*)param_descriptor->param_key,
-                                    (int)err,
-                                    (char*)esp_err_to_name(err),
-                                    retry,
-                                    MB_MAX_RETRY);
-                    vTaskDelay(POLL_TIMEOUT_TICS); // timeout between polls
-                }
-            }
-            // If we get here on failure, we just move on and hope it works
-            if (err != ESP_OK) continue;
 
-            if (param_descriptor->mb_param_type == MB_PARAM_INPUT)
-            {
-                // All the EPever input params are 16 bit ints, but they represent a float with two decimal places. So, we divide by 100 and store them
-                // for all values that the table calls a float. Everything is converted without the divide by 100
-                float value_f = 0.0;
-                if (param_descriptor->param_offset>CID_COUNT)
-                {
-                    ESP_LOGE(MODBUS_TAG, "Offset of CID %d (%s) exceeds limit of %d - ignored", cid, (char*)param_descriptor->param_key, CID_COUNT);
-                }
-                else
-                {
-                    if (param_descriptor->param_type == PARAM_TYPE_FLOAT)
-                    {
-                        if (value>0)
-                        {
-                            value_f = (float)(value)/10.0;
-                        }
-                        input_reg_params.inputs[param_descriptor->param_offset] = value_f;
-                    } else if ((param_descriptor->param_type == PARAM_TYPE_U16) || (param_descriptor->param_type == PARAM_TYPE_U8))
-                    {
-                        if (value>0)
-                        {
-                            value_f = (float)(value);
-                        }
-                        input_reg_params.inputs[param_descriptor->param_offset] = value_f;
-                    }
-                    else
-                    {
-                        ESP_LOGE(MODBUS_TAG, "Unknown type for CID %d: %s ", cid, (char*)param_descriptor->param_key);
-                    }
-                    
-                    ESP_LOGI(MODBUS_TAG, "Characteristic #%d %s (%s) value = %0.02f (0x%x) read successful.",
-                                    param_descriptor->cid,
-                                    (char*)param_descriptor->param_key,
-                                    (char*)param_descriptor->param_units,
-                                    value_f,
-                                    value
-                                    );
-                }
-            }
-            else
-            {
-                ESP_LOGE(MODBUS_TAG, "Holding Regs not currently supported");
-            }
-            vTaskDelay(POLL_TIMEOUT_TICS); // timeout between polls
-        }
+    for (uint16_t i = 0; i < num_bus_slaves; i++)
+    {
+        read_modbus_slave(bus_slaves[i].slave_addr);
     }
-    temperature_update(get_temperature());
-    humidity_update(get_humidity());
 }
 
 /**
@@ -211,6 +793,37 @@ void read_modbus(void)
  * with modbus slaves.
  * @returns esp_err_t code with any errors
  */
+#ifdef CONFIG_MB_MASTER_NATIVE
+esp_err_t modbus_init(void)
+{
+    ESP_LOGI(MODBUS_TAG, "Setting up native Modbus RTU master...");
+    MASTER_CHECK(mb_crc_self_test(), ESP_ERR_INVALID_STATE, "%s CRC failed self test", mb_crc_variant());
+    esp_err_t err = mb_rtu_master_init(MB_PORT_NUM, MB_DEV_SPEED, CONFIG_MB_UART_TXD, CONFIG_MB_UART_RXD, CONFIG_MB_UART_RTS);
+    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
+                            "mb rtu master initialization fail, returns(0x%x).",
+                            (uint32_t)err);
+#ifdef MB_SCAN_ENABLED
+    scan_bus();
+#endif
+    modbus_map_build();
+    modbus_plan_build();
+    rollup_init(&rollups, num_device_parameters);
+    init_filters();
+    for (uint16_t i = 0; i < num_bus_slaves; i++)
+    {
+        mb_health_init(&slave_health[i], bus_slaves[i].slave_addr);
+    }
+    ESP_LOGI(MODBUS_TAG, "Modbus master initialized...");
+    return err;
+}
+
+void modbus_shutdown(void)
+{
+    ESP_LOGW(MODBUS_TAG, "Modbus shutdown called");
+    mb_rtu_master_shutdown();
+}
+
+#else
 esp_err_t modbus_init(void)
 {
     ESP_LOGI(MODBUS_TAG, "Setting up Modbus master stack...");
@@ -255,10 +868,18 @@ esp_err_t modbus_init(void)
             "mb serial set mode failure, uart_set_mode() returned (0x%x).", (uint32_t)err);
 
     vTaskDelay(5);
+    modbus_map_build();
     err = mbc_master_set_descriptor(&device_parameters[0], num_device_parameters);
     MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
                                 "mb controller set descriptor fail, returns(0x%x).",
                                 (uint32_t)err);
+    modbus_plan_build();
+    rollup_init(&rollups, num_device_parameters);
+    init_filters();
+    for (uint16_t i = 0; i < num_bus_slaves; i++)
+    {
+        mb_health_init(&slave_health[i], bus_slaves[i].slave_addr);
+    }
     ESP_LOGI(MODBUS_TAG, "Modbus master stack initialized...");
     return err;
 }
@@ -268,25 +889,172 @@ void modbus_shutdown(void)
     ESP_LOGW(MODBUS_TAG, "Modbus shutdown called");
     ESP_ERROR_CHECK(mbc_master_destroy());
 }
+#endif
 
-// If THinkspeak is disabled we need a loop to read the modbus device
+// The bus is always read by this loop; MQTT, HomeKit and the status server only read the snapshot
+
+void modbus_log_bus_stats(void)
+{
+    uint32_t now = NOW_MS();
+    bus_sched_stats_t stats;
+    char buffer[128];
+    for (int i = 0; bus_sched_get_stats(&bus_sched, i, now, &stats); i++)
+    {
+        ESP_LOGI(MODBUS_TAG, "Slave %d: %u polls, %u deadline misses, rate %0.03f/%0.03f Hz, bus time %u ms (avg %u ms)",
+                        stats.slave_addr,
+                        stats.polls,
+                        stats.deadline_misses,
+                        stats.achieved_rate_hz,
+                        stats.requested_rate_hz,
+                        stats.last_busy_ms,
+                        stats.avg_busy_ms);
+        histogram_format(&bus_sched.slaves[i].lateness, buffer, sizeof(buffer));
+        ESP_LOGI(MODBUS_TAG, "Slave %d: lateness (ms, max %u): %s", stats.slave_addr, bus_sched.slaves[i].lateness.max, buffer);
+        histogram_format(&bus_sched.slaves[i].period_error, buffer, sizeof(buffer));
+        ESP_LOGI(MODBUS_TAG, "Slave %d: period error (ms, max %u): %s", stats.slave_addr, bus_sched.slaves[i].period_error.max, buffer);
+    }
+    for (uint16_t i = 0; i < num_bus_slaves; i++)
+    {
+        const mb_health_t *health = &slave_health[i];
+        ESP_LOGI(MODBUS_TAG, "Slave %d: %s, %u transactions, %u timeouts, %u CRC errors, %u invalid responses, %u errors, %u offline, %u recoveries, %u skipped",
+                        health->slave_addr,
+                        mb_health_state_name(health->state),
+                        health->transactions,
+                        health->timeouts,
+                        health->crc_errors,
+                        health->invalid_responses,
+                        health->errors,
+                        health->offline_events,
+                        health->recoveries,
+                        health->skipped_polls);
+    }
+    ESP_LOGI(MODBUS_TAG, "Bus utilisation: %u%%", bus_sched_utilisation(&bus_sched));
+    for (uint16_t i = 0; i < num_device_parameters; i++)
+    {
+        ESP_LOGI(MODBUS_TAG, "CID %d filter: %u readings, %u rejected, %u steps accepted",
+                        i, filters[i].samples, filters[i].rejected, filters[i].steps);
+    }
+#ifdef CONFIG_HISTORY_ENABLE
+    history_log();
+#endif
+}
 
-#ifndef CONFIG_THINKSPEAK_ENABLE
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+// Reads queued by the TCP gateway, one per client at most
+#define PASSTHROUGH_QUEUE_LEN (CONFIG_MB_TCP_MAX_CLIENTS)
+// Longest a pass-through read can hold the bus: the response timeout (the gateway always uses
+// the default) plus the inter-frame gap and sending the request at slow baud rates
+#define PASSTHROUGH_MARGIN_MS (20)
+#define PASSTHROUGH_WORST_MS (CONFIG_MB_RESPONSE_TIMEOUT_MS + PASSTHROUGH_MARGIN_MS)
+
+static QueueHandle_t passthrough_queue = NULL;
+
+/**
+ * @brief Checks that a slave is worth a pass-through read. Slaves the poller doesn't know have
+ * no health state and are always tried.
+ */
+static bool passthrough_allowed(uint8_t slave_addr)
+{
+    const mb_health_t *health = find_health(slave_addr);
+    return (health == NULL) || (health->state != MB_HEALTH_OFFLINE);
+}
+
+esp_err_t modbus_passthrough_submit(const mb_rtu_request_t *request)
+{
+    if ((passthrough_queue == NULL) || !passthrough_allowed(request->slave_addr))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xQueueSend(passthrough_queue, request, 0) != pdTRUE)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Sends a queued pass-through read in the gap before the next poll is due
+ */
+static void run_passthrough(const mb_rtu_request_t *request)
+{
+    mb_rtu_status_t status = MB_RTU_TIMEOUT;
+    // The slave may have gone offline while the request waited
+    if (passthrough_allowed(request->slave_addr))
+    {
+        status = mb_rtu_master_read(request->slave_addr, request->function, request->reg_start, request->reg_count,
+                                    request->regs, request->timeout_ms);
+    }
+    if (request->done)
+    {
+        request->done(request->ctx, status);
+    }
+}
+#endif
 
 static void modbus_reader(void *pvParameter)
 {
-    // Read the modbus on a loop, because Homekit doesn't like to wait
+    bool stats_logged = false;
+    uint32_t stats_logged_ms = 0;
+    uint32_t unlogged_misses = 0;
+
+    // Read the modbus on a loop, because Homekit doesn't like to wait. The scheduler hands out
+    // the bus one slave at a time, earliest deadline first.
+    bus_sched_init(&bus_sched, bus_slaves, num_bus_slaves, MB_POLL_OVERRUN_POLICY, NOW_MS());
     while (1)
     {
-        read_modbus();
-        vTaskDelay(CONFIG_MB_THREAD_TIMEOUT * 1000 / portTICK_PERIOD_MS);
+        uint32_t wait_ms = 0;
+        int slave = bus_sched_next(&bus_sched, NOW_MS(), &wait_ms);
+        if (slave < 0)
+        {
+            TickType_t ticks = (wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+            // Pass-through reads only get the bus while no poll is due, and only take a request
+            // while one would still finish before the next poll. Closer to it, just wait.
+            if (wait_ms >= PASSTHROUGH_WORST_MS)
+            {
+                mb_rtu_request_t request;
+                TickType_t gap_ticks = (wait_ms - PASSTHROUGH_WORST_MS) / portTICK_PERIOD_MS;
+                if (xQueueReceive(passthrough_queue, &request, gap_ticks) == pdTRUE)
+                {
+                    run_passthrough(&request);
+                }
+            }
+            else
+            {
+                vTaskDelay(ticks);
+            }
+#else
+            vTaskDelay(ticks);
+#endif
+            continue;
+        }
+        uint32_t start = NOW_MS();
+        uint32_t misses = bus_sched.slaves[slave].deadline_misses;
+        read_modbus_slave(bus_sched.slaves[slave].cfg.slave_addr);
+        bus_sched_complete(&bus_sched, slave, start, NOW_MS());
+        if (bus_sched.slaves[slave].deadline_misses != misses)
+        {
+            // An overloaded bus misses on every poll, so the statistics are only logged now and
+            // then. They are always available from the status server.
+            unlogged_misses += bus_sched.slaves[slave].deadline_misses - misses;
+            if (!stats_logged || ((NOW_MS() - stats_logged_ms) >= BUS_STATS_LOG_INTERVAL_MS))
+            {
+                ESP_LOGW(MODBUS_TAG, "Slave %d missed its poll deadline (%u misses since the last report)",
+                                bus_sched.slaves[slave].cfg.slave_addr, unlogged_misses);
+                modbus_log_bus_stats();
+                stats_logged = true;
+                stats_logged_ms = NOW_MS();
+                unlogged_misses = 0;
+            }
+        }
     }
 }
 
 void modbus_start(void)
 {
     ESP_LOGI(MODBUS_TAG, "MODBUS Main Loop Start");
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+    passthrough_queue = xQueueCreate(PASSTHROUGH_QUEUE_LEN, sizeof(mb_rtu_request_t));
+#endif
     xTaskCreate(modbus_reader, THREAD_MODBUS_NAME, THREAD_MODBUS_STACKSIZE, NULL, THREAD_MODBUS_PRIORITY, NULL);
 }
-
-#endif
\ No newline at end of file
@@ -1,20 +1,16 @@
 #pragma once
 
 #include <stdint.h>
-
-// Enumeration of all supported CIDs for device (used in parameter definition table)
-enum {
-    CID_INP_DATA_TEMPERATURE = 0,
-    CID_INP_DATA_HUMIDITY,
-    CID_COUNT,
-};
-
-#pragma pack(push, 1)
-typedef struct
-{
-    float inputs[CID_COUNT];
-} input_reg_params_t;
-#pragma pack(pop)
+#include "esp_err.h"
+#include "periodic.h"
+#include "mb_health.h"
+#include "bus_sched.h"
+#include "rollup.h"
+#include "sensor_map.h"
+#include "regmap.h"
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+#include "mb_rtu_master.h"
+#endif
 
 /**
  * @brief Returns temperature value
@@ -22,10 +18,32 @@ typedef struct
 float get_temperature(void);
 
 /**
- * @brief Returns temperature value
+ * @brief Returns humidity value
  */
 float get_humidity(void);
 
+/**
+ * @brief Returns the latest value of a CID from the published snapshot
+ */
+float get_value(uint16_t cid);
+
+/**
+ * @brief Copies the built-in values, all from the same snapshot
+ * @returns true if every one of them has been read at least once
+ */
+bool modbus_get_values(sensor_values_t *values);
+
+/**
+ * @brief Returns the number of CIDs in the register map in use. Valid after modbus_init().
+ */
+uint16_t modbus_cid_count(void);
+
+/**
+ * @brief Returns the register map entry of a CID (name, unit, slave). Valid after modbus_init().
+ * @returns NULL if the CID is out of range
+ */
+const regmap_param_t *modbus_cid_param(uint16_t cid);
+
 /**
  * @brief Clears the input structure to reset the data to all zero
  */
@@ -34,11 +52,19 @@ void clearmodbus(void);
 /**
  * @brief Reads the data from the modbus for the solar controller.
  * The minimum amount of time between calls to this function is 500ms. Errors will occur if it is called
- * too quickly.
- * @returns input_reg_params_t struct with the data
+ * too quickly. The values are published as a snapshot (see snapshot.h) at the end of each
+ * slave's poll.
  */
 void read_modbus(void);
 
+/**
+ * @brief Reads all the registers of a single slave on the bus. Used by the bus scheduler to
+ * poll each slave at its own rate.
+ * @param slave_addr - Modbus address of the slave
+ * @returns ESP_OK if all the registers were read
+ */
+esp_err_t read_modbus_slave(uint8_t slave_addr);
+
 /**
  * @brief Modbus master initialization routine sets up the GPIO for UART communications
  * and starts up the modbus master library. This routine must be called before any communications
@@ -48,8 +74,59 @@ void read_modbus(void);
 esp_err_t modbus_init(void);
 
 void modbus_shutdown(void);
+
+/**
+ * @brief Starts the reader thread, which polls each slave at its own rate with the bus scheduler
+ * (see bus_sched.h). Everything else reads the values from the snapshot.
+ */
 void modbus_start(void);
 
+/**
+ * @brief Returns the health state and error counters of a slave (see mb_health.h)
+ * @param index - index of the slave in the bus table
+ * @returns NULL if the index is out of range
+ */
+const mb_health_t *modbus_slave_health(uint16_t index);
+
+/**
+ * @brief Returns the poll statistics of a slave from the bus scheduler (achieved and requested
+ * rate, deadline misses, lateness, bus time)
+ * @param index - index of the slave in the bus table, the same as for modbus_slave_health()
+ * @returns false if the index is out of range or the poller has not started
+ */
+bool modbus_slave_stats(uint16_t index, bus_sched_stats_t *stats);
+
+/**
+ * @brief Returns the last completed min/max/mean window of a resolution (see rollup.h)
+ * @returns false if no window of that resolution has closed yet
+ */
+bool modbus_get_rollup(rollup_res_t res, rollup_result_t *result);
+
+/**
+ * @brief Logs the per slave poll statistics (achieved rate, deadline misses, bus time) from the
+ * bus scheduler along with the health counters. The poller calls this on a deadline miss, at
+ * most once a minute.
+ */
+void modbus_log_bus_stats(void);
+
+#ifdef CONFIG_MB_TCP_PASSTHROUGH
+/**
+ * @brief Queues a read that did not come from the poller (the TCP gateway's pass-through). The
+ * reader thread sends it while the bus scheduler has no poll due, so it never delays a poll
+ * that is ready, and reports the result through the request's callback from that thread.
+ * @returns ESP_ERR_INVALID_STATE if the slave is offline (see mb_health.h) or the reader is not
+ * running, ESP_ERR_TIMEOUT if the queue is full
+ */
+esp_err_t modbus_passthrough_submit(const mb_rtu_request_t *request);
+#endif
+
+// Overrun policy for the polling loops, selected in menuconfig
+#ifdef CONFIG_MB_POLL_CATCH_UP
+#define MB_POLL_OVERRUN_POLICY PERIODIC_CATCH_UP
+#else
+#define MB_POLL_OVERRUN_POLICY PERIODIC_SKIP
+#endif
+
 
 #ifdef CONFIG_MB_TEST_MODE
 /**
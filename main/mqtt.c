@@ -17,11 +17,22 @@
 #include "driver/adc.h"
 
 #include "esp_log.h"
+#include "esp_system.h"
 #include "wifi.h"
 #include "mqtt_client.h"
+#include "esp_sntp.h"
 #include "modbus.h"
+#include "snapshot.h"
+#include "periodic.h"
+#include "sample_queue.h"
+#include "fanout.h"
+#include "bulk_update.h"
+#include "payload_pool.h"
+#include "publisher.h"
+#include "history.h"
 #include "threads.h"
 #include "led.h"
+#include "metrics.h"
 
 #ifdef CONFIG_THINKSPEAK_ENABLE
 
@@ -29,35 +40,84 @@ static const char *TAG = "MQTT";
 
 #define MQTT_CONNECTED_BIT BIT0
 #define MQTT_NOWONLINE_BIT BIT1
-#define DATA_LEN 256
-#define STATUS_LEN 20
 
-static char topic_string[DATA_LEN];
-static esp_mqtt_client_handle_t client;
+#define MAX_ID_STRING (32)
 
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_mqtt_event_group;
+/**
+ * @brief One MQTT destination: a publisher backend and its own connection
+ */
+typedef struct
+{
+    const publisher_t *backend;
+    esp_mqtt_client_handle_t client;
+    EventGroupHandle_t events;      // FreeRTOS event group to signal when we are connected
+    char id_string[MAX_ID_STRING];  // The client keeps a pointer to its id
+#if defined(CONFIG_METRICS_ENABLE) && (CONFIG_METRICS_MQTT_INTERVAL_SECONDS > 0)
+    TickType_t last_metrics;
+#endif
+} mqtt_sink_t;
+
+#if defined(CONFIG_PUBLISH_FANOUT)
+#if !defined(CONFIG_PUBLISH_SINK_THINGSPEAK) && !defined(CONFIG_PUBLISH_SINK_BROKER)
+#error "Fan-out needs ThingSpeak or an MQTT broker as one of its destinations"
+#endif
+static mqtt_sink_t mqtt_sinks[] = {
+#ifdef CONFIG_PUBLISH_SINK_THINGSPEAK
+    { .backend = &publisher_thingspeak },
+#endif
+#ifdef CONFIG_PUBLISH_SINK_BROKER
+    { .backend = &publisher_broker },
+#endif
+};
+#elif defined(CONFIG_PUBLISH_BACKEND_BROKER)
+static mqtt_sink_t mqtt_sinks[] = { { .backend = &publisher_broker } };
+#else
+static mqtt_sink_t mqtt_sinks[] = { { .backend = &publisher_thingspeak } };
+#endif
+#define NUM_MQTT_SINKS ((int)(sizeof(mqtt_sinks) / sizeof(mqtt_sinks[0])))
 
-void publish(char *data)
+/**
+ * @brief Publishes data to a topic
+ * @param ctx - the mqtt_sink_t to publish on
+ * @param len - length of data, 0 for a NUL terminated string
+ * @returns the MQTT message id, or -1 if the publish failed
+ */
+static int publish_to(void *ctx, const char *topic, const void *data, size_t len)
 {
-    char *defaultdata = "status=ONLINE";
-    if (!data)
+    mqtt_sink_t *sink = (mqtt_sink_t *)ctx;
+
+#ifdef CONFIG_THINKSPEAK_LOG_PASSWDS_IN_LOGS
+    if (len == 0)
     {
-        data = defaultdata;
+        ESP_LOGI(TAG, "Publishing: %s for %s", topic, (const char *)data);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Publishing: %s for %d bytes", topic, (int)len);
     }
-#ifdef CONFIG_THINKSPEAK_LOG_PASSWDS_IN_LOGS
-    ESP_LOGI(TAG, "Publishing: %s for %s", topic_string, data);
 #else
-    ESP_LOGI(TAG, "Publishing: %s", data);
+    if (len == 0)
+    {
+        ESP_LOGI(TAG, "Publishing: %s", (const char *)data);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Publishing: %d bytes", (int)len);
+    }
 #endif    
 #ifdef CONFIG_THINKSPEAK_DONT_PUBLISH
 #warning "MQTT publish is disabled!"
-    ESP_LOGI(TAG, "Publish has been disabled");
+    ESP_LOGI(TAG, "Publish to %s has been disabled", sink->backend->name);
+    return 0;
 #else
-    int msg_id = esp_mqtt_client_publish(client, topic_string, data, 0, 0, 0);
+    METRIC_TIME_BEGIN(start);
+    int msg_id = esp_mqtt_client_publish(sink->client, topic, data, len, 0, 0);
+    METRIC_TIME_END(MQTT_PUBLISH, start);
+    METRIC_COUNT(MQTT_PUBLISHES);
 
     if (msg_id==-1)
     {
+        METRIC_COUNT(MQTT_PUBLISH_FAILURES);
         ESP_LOGE(TAG, "sent status unsuccessful, msg_id=%d", msg_id);
     }
     else if (msg_id>0)
@@ -68,91 +128,294 @@ void publish(char *data)
     {
         ESP_LOGI(TAG, "sent status successful (sent immediately), msg_id=%d", msg_id);
     }
+    return msg_id;
 #endif        
 
 }
 
-static void go_online()
+static void go_online(mqtt_sink_t *sink)
+{
+    ESP_LOGI(TAG, "Sending status update to %s", sink->backend->name);
+    sink->backend->send_status("ONLINE", publish_to, sink);
+}
+
+static bool sink_connected(mqtt_sink_t *sink)
+{
+    return (xEventGroupGetBits(sink->events) & MQTT_CONNECTED_BIT) != 0;
+}
+
+/**
+ * @brief Hands a sample to the publish side: the outage queue, or the fan-out ring
+ */
+static void push_sample(const sample_t *sample)
+{
+#ifdef CONFIG_PUBLISH_FANOUT
+    fanout_push(sample);
+#else
+    sample_queue_push(sample);
+#endif
+}
+
+#if defined(CONFIG_THINKSPEAK_RESOLUTION_1M)
+#define PUBLISH_ROLLUP ROLLUP_1M
+#elif defined(CONFIG_THINKSPEAK_RESOLUTION_15M)
+#define PUBLISH_ROLLUP ROLLUP_15M
+#elif defined(CONFIG_THINKSPEAK_RESOLUTION_1H)
+#define PUBLISH_ROLLUP ROLLUP_1H
+#endif
+
+#ifdef PUBLISH_ROLLUP
+/**
+ * @brief Publishes the mean of each newly closed rollup window, timed at the start of the
+ * window rather than when it was noticed to have closed. Windows in which a value was never
+ * read are skipped.
+ */
+static void queue_sample(void)
+{
+    static uint32_t last_seq = 0;
+    rollup_result_t rollup;
+    sample_t sample = { 0 };
+
+    if (!modbus_get_rollup(PUBLISH_ROLLUP, &rollup) || (rollup.seq == last_seq))
+    {
+        return;
+    }
+    last_seq = rollup.seq;
+    sample.count = (rollup.count < SAMPLE_MAX_VALUES) ? rollup.count : SAMPLE_MAX_VALUES;
+    for (uint16_t i = 0; i < sample.count; i++)
+    {
+        if (rollup.aggs[i].count == 0)
+        {
+            ESP_LOGW(TAG, "No readings in the %s window, not sent", rollup_res_name(PUBLISH_ROLLUP));
+            return;
+        }
+        sample.values[i] = rollup_mean(&rollup.aggs[i]);
+    }
+    sample_stamp_at(&sample, rollup.start);
+    push_sample(&sample);
+}
+#else
+/**
+ * @brief Takes a sample of the current readings for publishing
+ */
+static void queue_sample(void)
+{
+    // Take both values from the same snapshot so they come from the same poll
+    sensor_snapshot_t snapshot;
+    sample_t sample = { 0 };
+
+    snapshot_read(&snapshot);
+    if (snapshot.cycle == 0)
+    {
+        // Nothing has been read yet
+        return;
+    }
+    sample.count = (snapshot.count < SAMPLE_MAX_VALUES) ? snapshot.count : SAMPLE_MAX_VALUES;
+    for (uint16_t i = 0; i < sample.count; i++)
+    {
+        sample.values[i] = snapshot.values[i].value;
+    }
+    sample_stamp(&sample);
+    push_sample(&sample);
+}
+#endif
+
+#if !defined(CONFIG_THINKSPEAK_BULK_UPDATE) && !defined(CONFIG_PUBLISH_FANOUT)
+/**
+ * @brief Sends up to CONFIG_SAMPLE_QUEUE_DRAIN_BATCH queued samples, oldest first. A sample
+ * only leaves the queue once the client has accepted it.
+ */
+static void drain_samples(mqtt_sink_t *sink)
 {
-    char *data = calloc(1, DATA_LEN);
-    ESP_LOGI(TAG, "Sending status update");
-    sprintf(data, "status=ONLINE");
-    publish(data);
-    free(data);
+    sample_t sample;
+    for (int i = 0; i < CONFIG_SAMPLE_QUEUE_DRAIN_BATCH; i++)
+    {
+        if (!sample_queue_front(&sample))
+        {
+            break;
+        }
+        if (!sink->backend->send_sample(&sample, publish_to, sink))
+        {
+            break;
+        }
+        sample_queue_pop();
+    }
+}
+#endif
+
+#ifdef CONFIG_METRICS_ENABLE
+/**
+ * @brief Refreshes the gauges that are sampled rather than recorded as they change
+ */
+static void update_gauges(void)
+{
+#ifdef CONFIG_PUBLISH_FANOUT
+    METRIC_GAUGE(SAMPLE_QUEUE, fanout_max_lag());
+#else
+    METRIC_GAUGE(SAMPLE_QUEUE, sample_queue_count());
+#endif
+    METRIC_GAUGE(FREE_HEAP, esp_get_free_heap_size());
+    METRIC_GAUGE(MIN_FREE_HEAP, esp_get_minimum_free_heap_size());
 }
 
+#if CONFIG_METRICS_MQTT_INTERVAL_SECONDS > 0
+/**
+ * @brief Publishes the metrics as a diagnostics message: to CONFIG_METRICS_MQTT_TOPIC, or
+ * as the backend's status when no topic is set
+ */
+static void publish_metrics(mqtt_sink_t *sink)
+{
+    char *data = payload_alloc();
+    if (data == NULL)
+    {
+        ESP_LOGE(TAG, "No payload buffer free");
+        return;
+    }
+    update_gauges();
+    if (sizeof(CONFIG_METRICS_MQTT_TOPIC) > 1)
+    {
+        metrics_format(data, PAYLOAD_LEN);
+        publish_to(sink, CONFIG_METRICS_MQTT_TOPIC, data, 0);
+    }
+    else
+    {
+        // Only whole metrics, if the backend cuts the status short
+        size_t len = PAYLOAD_LEN;
+        if (sink->backend->status_max_len && (sink->backend->status_max_len < len))
+        {
+            len = sink->backend->status_max_len + 1;
+        }
+        metrics_format(data, len);
+        sink->backend->send_status(data, publish_to, sink);
+    }
+    payload_free(data);
+}
+#endif
+#endif
+
+/**
+ * @brief Sends the online status after each connect, and the metrics when they are due
+ */
+static void service_sink(mqtt_sink_t *sink)
+{
+    EventBits_t bits = xEventGroupGetBits(sink->events);
+    if (bits & MQTT_NOWONLINE_BIT)
+    {
+        xEventGroupClearBits(sink->events, MQTT_NOWONLINE_BIT);
+        go_online(sink);
+    }
+#if defined(CONFIG_METRICS_ENABLE) && (CONFIG_METRICS_MQTT_INTERVAL_SECONDS > 0)
+    if ((bits & MQTT_CONNECTED_BIT) &&
+        ((xTaskGetTickCount() - sink->last_metrics) >= pdMS_TO_TICKS(CONFIG_METRICS_MQTT_INTERVAL_SECONDS * 1000)))
+    {
+        publish_metrics(sink);
+        sink->last_metrics = xTaskGetTickCount();
+    }
+#endif
+}
+
+#ifdef CONFIG_PUBLISH_FANOUT
+/*
+    Fan-out sink callbacks, run on the sink's own task
+*/
+static bool sink_send(void *ctx, const sample_t *sample)
+{
+    mqtt_sink_t *sink = (mqtt_sink_t *)ctx;
+    return sink->backend->send_sample(sample, publish_to, sink);
+}
+
+static bool sink_ready(void *ctx)
+{
+    return sink_connected((mqtt_sink_t *)ctx);
+}
+
+static void sink_service(void *ctx)
+{
+    service_sink((mqtt_sink_t *)ctx);
+}
+#endif
+
 static void mqttpublish(void *pvParameter)
 {
-    char *data = calloc(1, DATA_LEN);
-    char *status = calloc(1, STATUS_LEN);
 //    const uint32_t error_delay = (2000) / portTICK_PERIOD_MS;
+    // The loop runs on absolute deadlines so the upload period does not stretch by however
+    // long the publish took
+    static periodic_t poll_timer;
 #ifdef CONFIG_THINKSPEAK_DONT_PUBLISH
-    const uint32_t delay = 4000 / portTICK_PERIOD_MS;
+    const uint32_t delay_ms = 4000;
 #else    
-    const uint32_t delay = (CONFIG_THINKSPEAK_LOOP_DELAY_SECONDS*1000) / portTICK_PERIOD_MS;
+    const uint32_t delay_ms = CONFIG_THINKSPEAK_LOOP_DELAY_SECONDS*1000;
 
 #endif
-    
-    if (!data)
-    {
-        ESP_LOGE(TAG, "Unable alloc data memory! MQTT aborted!");
-        free(data);
-        free(status);
-        vTaskDelete(NULL);
-        return;
-    }
 
     ESP_LOGI(TAG, "MQTT_PUBLISH_STARTED");
+    periodic_init(&poll_timer, THREAD_MQTT_NAME, delay_ms, MB_POLL_OVERRUN_POLICY);
     while (1)
     {
+        // The modbus reader polls the bus on its own schedule; a sample of the latest readings
+        // is taken every period whether or not we are connected, samples taken while offline
+        // wait in the queue
+        queue_sample();
 
-        // Sit and wait until something happens
-        EventBits_t bits = xEventGroupWaitBits(s_mqtt_event_group,
-                MQTT_CONNECTED_BIT | MQTT_NOWONLINE_BIT,
-                pdFALSE,
-                pdFALSE,
-                portMAX_DELAY);
-
-        if (bits & MQTT_NOWONLINE_BIT)
+#ifndef CONFIG_PUBLISH_FANOUT
+        // With fan-out each sink sends from its own task
+        mqtt_sink_t *sink = &mqtt_sinks[0];
+        service_sink(sink);
+        if (sink_connected(sink))
         {
-            xEventGroupClearBits(s_mqtt_event_group, MQTT_NOWONLINE_BIT);
-            go_online();
-            continue;
+#ifdef CONFIG_THINKSPEAK_BULK_UPDATE
+            // Samples go up in batches over HTTP, MQTT only carries the online status
+            bulk_update_poll("GOOD_ESP");
+#else
+            drain_samples(sink);
+#endif
         }
-        if (bits & MQTT_CONNECTED_BIT)
+        else
         {
-            // Read the EPsolar box here
-            read_modbus();
-            status = "GOOD_ESP";
-            snprintf(data, DATA_LEN, "field1=%0.02f&field2=%0.02f&status=%s", 
-                            get_epever_value(CID_INP_DATA_TEMPERATURE),
-                            get_epever_value(CID_INP_DATA_HUMIDITY),
-                            status
-                            );
-            publish(data);
+            ESP_LOGI(TAG,"Not connected, %u samples queued", sample_queue_count());
         }
-        else
+#endif
+        if (poll_timer.overruns && (poll_timer.cycles % 60 == 0))
         {
-            ESP_LOGI(TAG,"Not connected");
+            periodic_log(&poll_timer);
         }
-        vTaskDelay(delay);
+        if (poll_timer.cycles % 60 == 0)
+        {
+#ifdef CONFIG_PUBLISH_FANOUT
+            fanout_log();
+#else
+            sample_queue_stats_t stats;
+            sample_queue_get_stats(&stats);
+            ESP_LOGI(TAG, "Sample queue: %u in RAM, %u in flash, %u sent, %u dropped",
+                            stats.queued, stats.spilled, stats.sent, stats.dropped);
+#endif
+            payload_pool_log();
+#ifdef CONFIG_HISTORY_ENABLE
+            history_log();
+#endif
+#ifdef CONFIG_METRICS_ENABLE
+            update_gauges();
+            metrics_log();
+#endif
+        }
+        periodic_wait(&poll_timer);
     }
 }
 
-static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
+static esp_err_t mqtt_event_handler_cb(mqtt_sink_t *sink, esp_mqtt_event_handle_t event)
 {
     char *errortype = NULL;
     char *connecterror = NULL;
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-            xEventGroupSetBits(s_mqtt_event_group, MQTT_NOWONLINE_BIT);
-            xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED: %s", sink->backend->name);
+            xEventGroupSetBits(sink->events, MQTT_NOWONLINE_BIT);
+            xEventGroupSetBits(sink->events, MQTT_CONNECTED_BIT);
             //led_off();
             break;
         case MQTT_EVENT_DISCONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-            xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+            ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED: %s", sink->backend->name);
+            xEventGroupClearBits(sink->events, MQTT_CONNECTED_BIT);
             //led2_on();
             break;
         case MQTT_EVENT_SUBSCRIBED:
@@ -213,54 +476,91 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
-    mqtt_event_handler_cb(event_data);
+    mqtt_event_handler_cb((mqtt_sink_t *)handler_args, event_data);
 }
 
-#define MAX_ID_STRING (32)
-
-static char *create_id_string(void)
+/**
+ * @brief Makes the client id from the MAC address. Sinks after the first get a suffix, so two
+ * sinks on the same broker do not throw each other off.
+ */
+static char *create_id_string(mqtt_sink_t *sink, int index)
 {
     uint8_t mac[6];
-    char *id_string = calloc(1, MAX_ID_STRING);
-    if (id_string != NULL)
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    int n = snprintf(sink->id_string, MAX_ID_STRING, "mqttx_%02x%02X%02X", mac[3], mac[4], mac[5]);
+    if (index > 0)
     {
-        esp_read_mac(mac, ESP_MAC_WIFI_STA);
-        sprintf(id_string, "mqttx_%02x%02X%02X", mac[3], mac[4], mac[5]);
+        snprintf(sink->id_string + n, MAX_ID_STRING - n, "_%d", index);
     }
-    return id_string;
+    return sink->id_string;
 }
 
-void mqtt_app_start(void)
+static void start_client(mqtt_sink_t *sink, int index)
 {
-    snprintf(topic_string, DATA_LEN, "channels/%d/publish/%s", CONFIG_THINKSPEAK_CHANNELID, CONFIG_THINKSPEAK_CHANNEL_WRITE_KEY);
+    // We run create_id_string here because we want to know what the client id is
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .uri = sink->backend->uri,
+        .client_id = create_id_string(sink, index),
+        .username = sink->backend->username,
+        .password = sink->backend->password
+    };
 
+    sink->client = esp_mqtt_client_init(&mqtt_cfg);
 #ifdef CONFIG_THINKSPEAK_LOG_PASSWDS_IN_LOGS
-    ESP_LOGI(TAG, "[APP] Using topic: %s", topic_string);
+    ESP_LOGI(TAG, "URL: %s and Login: '%s' Pass: '%s' ClientId: '%s'", mqtt_cfg.uri, mqtt_cfg.username, mqtt_cfg.password, mqtt_cfg.client_id); 
 #else
-    ESP_LOGI(TAG, "[APP] Display of topic string disabled");
+    ESP_LOGI(TAG, "URL: %s and Login: '%s' ClientId: '%s'", mqtt_cfg.uri, mqtt_cfg.username, mqtt_cfg.client_id); 
 #endif    
+    esp_mqtt_client_register_event(sink->client, ESP_EVENT_ANY_ID, mqtt_event_handler, sink);
+    esp_mqtt_client_start(sink->client);
+}
 
-    s_mqtt_event_group = xEventGroupCreate();
+void mqtt_app_start(void)
+{
+#ifdef CONFIG_PUBLISH_FANOUT
+    fanout_init();
+#else
+    sample_queue_init();
+#endif
+    for (int i = 0; i < NUM_MQTT_SINKS; i++)
+    {
+        mqtt_sink_t *sink = &mqtt_sinks[i];
+        ESP_LOGI(TAG, "Publishing to %s", sink->backend->name);
+        sink->backend->init();
+        sink->events = xEventGroupCreate();
+#if defined(CONFIG_METRICS_ENABLE) && (CONFIG_METRICS_MQTT_INTERVAL_SECONDS > 0)
+        sink->last_metrics = xTaskGetTickCount();
+#endif
+#ifdef CONFIG_PUBLISH_FANOUT
+        const fanout_sink_t fanout_sink = {
+            .name = sink->backend->name,
+            .send = sink_send,
+            .ready = sink_ready,
+            .service = sink_service,
+            .ctx = sink,
+        };
+        fanout_add_sink(&fanout_sink);
+#endif
+    }
 
-    // We run create_id_string here because we want to know what the client id is
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .uri = CONFIG_BROKER_URL,
-        .client_id = create_id_string(),
-        .username = "thingspeak",
-        .password = CONFIG_THINKSPEAK_MQTT_KEY
-    };
+    // Samples are timestamped from the clock so queued ones can be uploaded with their real time
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, CONFIG_THINKSPEAK_SNTP_SERVER);
+    sntp_init();
+#ifdef CONFIG_THINKSPEAK_BULK_UPDATE
+    bulk_update_init();
+#endif
 
     // Wait for the WIFI to come up
     wifi_waitforconnect();
 
-    client = esp_mqtt_client_init(&mqtt_cfg);
-#ifdef CONFIG_THINKSPEAK_LOG_PASSWDS_IN_LOGS
-    ESP_LOGI(TAG, "URL: %s and Login: '%s' Pass: '%s' ClientId: '%s'", mqtt_cfg.uri, mqtt_cfg.username, mqtt_cfg.password, mqtt_cfg.client_id); 
-#else
-    ESP_LOGI(TAG, "URL: %s and Login: '%s' ClientId: '%s'", mqtt_cfg.uri, mqtt_cfg.username, mqtt_cfg.client_id); 
-#endif    
-    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
-    esp_mqtt_client_start(client);
+    for (int i = 0; i < NUM_MQTT_SINKS; i++)
+    {
+        start_client(&mqtt_sinks[i], i);
+    }
+#ifdef CONFIG_PUBLISH_FANOUT
+    fanout_start();
+#endif
     xTaskCreate(mqttpublish, THREAD_MQTT_NAME, THREAD_MQTT_STACKSIZE, NULL, THREAD_MQTT_PRIORITY, NULL);
 
 }
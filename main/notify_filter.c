@@ -0,0 +1,68 @@
+/*
+    Change driven notification filter
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <math.h>
+#include "notify_filter.h"
+
+void notify_filter_init(notify_filter_t *filter, const notify_filter_cfg_t *cfg)
+{
+    memset(filter, 0, sizeof(notify_filter_t));
+    filter->cfg = *cfg;
+}
+
+bool notify_filter_check(notify_filter_t *filter, float value, uint32_t now_ms)
+{
+    bool notify;
+    bool heartbeat = false;
+
+    filter->offered++;
+    if (!filter->primed)
+    {
+        notify = true;
+    }
+    else
+    {
+        uint32_t elapsed = now_ms - filter->last_notify_ms;
+        if (elapsed < filter->cfg.min_interval_ms)
+        {
+            return false;
+        }
+        if (isnan(value) || isnan(filter->last_value))
+        {
+            // Going to or from an invalid reading is always a change
+            notify = (isnan(value) != isnan(filter->last_value));
+        }
+        else
+        {
+            float deadband = filter->cfg.rel_deadband * fabsf(filter->last_value);
+            if (deadband < filter->cfg.abs_deadband)
+            {
+                deadband = filter->cfg.abs_deadband;
+            }
+            float change = fabsf(value - filter->last_value);
+            notify = (change > 0.0f) && (change >= deadband);
+        }
+        if (!notify && filter->cfg.max_interval_ms && (elapsed >= filter->cfg.max_interval_ms))
+        {
+            notify = true;
+            heartbeat = true;
+        }
+    }
+
+    if (notify)
+    {
+        filter->primed = true;
+        filter->last_value = value;
+        filter->last_notify_ms = now_ms;
+        filter->notified++;
+        if (heartbeat)
+        {
+            filter->heartbeats++;
+        }
+    }
+    return notify;
+}
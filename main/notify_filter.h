@@ -0,0 +1,56 @@
+/*
+    Change driven notification filter
+
+    Decides whether a new reading is worth pushing to the HomeKit controllers. A value is
+    passed on when it has moved by more than the deadband from the last value that was
+    notified, and then no more often than the minimum interval. The deadband is the larger of
+    an absolute amount and a fraction of the last notified value. So a controller is still
+    refreshed now and then, the value is also passed on once the maximum interval has passed
+    without a notification, changed or not.
+
+    Comparing against the last notified value (not the last reading) means a slow drift is
+    notified once it adds up to the deadband.
+
+    All times are in milliseconds from a free running clock supplied by the caller.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    float abs_deadband;         // Smallest change notified, in the units of the value
+    float rel_deadband;         // Smallest change notified, as a fraction of the value (0 to disable)
+    uint32_t min_interval_ms;   // Shortest time between notifications
+    uint32_t max_interval_ms;   // Notify at least this often even if unchanged (0 to disable)
+} notify_filter_cfg_t;
+
+typedef struct
+{
+    notify_filter_cfg_t cfg;
+    bool primed;                // A value has been notified
+    float last_value;           // Last value notified
+    uint32_t last_notify_ms;    // Time of the last notification
+    // Counters
+    uint32_t offered;           // Values passed to notify_filter_check()
+    uint32_t notified;          // Values that were passed on
+    uint32_t heartbeats;        // Notifications sent only because the maximum interval ran out
+} notify_filter_t;
+
+/**
+ * @brief Sets up a filter. The first value offered is always notified.
+ */
+void notify_filter_init(notify_filter_t *filter, const notify_filter_cfg_t *cfg);
+
+/**
+ * @brief Checks a new value and records it as notified when it passes
+ * @param filter - filter
+ * @param value - new reading
+ * @param now_ms - current time
+ * @returns true if the value should be sent to the controllers
+ */
+bool notify_filter_check(notify_filter_t *filter, float value, uint32_t now_ms);
@@ -0,0 +1,217 @@
+/*
+    Sensor value payload encodings
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <math.h>
+#include "payload_codec.h"
+
+// CBOR major types, already shifted into the top three bits
+#define CBOR_UINT           (0x00)
+#define CBOR_NEGINT         (0x20)
+#define CBOR_TEXT           (0x60)
+#define CBOR_ARRAY          (0x80)
+#define CBOR_MAP            (0xA0)
+#define CBOR_TAG            (0xC0)
+#define CBOR_TAG_DECIMAL    (4)
+
+// Largest float below 2^31, so the rounded value always fits in an int32_t
+#define FIXED_POINT_LIMIT   (2147483520.0f)
+
+static const uint32_t pow10_table[PAYLOAD_CODEC_MAX_DECIMALS + 1] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+bool payload_fixed_point(float value, uint8_t decimals, int32_t *mantissa)
+{
+    if ((decimals > PAYLOAD_CODEC_MAX_DECIMALS) || !isfinite(value))
+    {
+        return false;
+    }
+    float scaled = value * (float)pow10_table[decimals];
+    scaled += (scaled < 0.0f) ? -0.5f : 0.5f;
+    if ((scaled >= FIXED_POINT_LIMIT) || (scaled <= -FIXED_POINT_LIMIT))
+    {
+        return false;
+    }
+    *mantissa = (int32_t)scaled;
+    return true;
+}
+
+/**
+ * @brief Writes an unsigned number in decimal, at least min_digits long
+ */
+static size_t put_decimal(char *out, uint32_t n, uint8_t min_digits)
+{
+    char digits[10];
+    size_t count = 0;
+
+    do
+    {
+        digits[count++] = '0' + (n % 10);
+        n /= 10;
+    } while ((n != 0) || (count < min_digits));
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+size_t payload_format_fixed(char *out, int32_t mantissa, uint8_t decimals)
+{
+    size_t n = 0;
+    // Negate as unsigned so INT32_MIN works
+    uint32_t magnitude = (mantissa < 0) ? (0U - (uint32_t)mantissa) : (uint32_t)mantissa;
+
+    if (mantissa < 0)
+    {
+        out[n++] = '-';
+    }
+    if (decimals == 0)
+    {
+        return n + put_decimal(out + n, magnitude, 1);
+    }
+    n += put_decimal(out + n, magnitude / pow10_table[decimals], 1);
+    out[n++] = '.';
+    n += put_decimal(out + n, magnitude % pow10_table[decimals], decimals);
+    return n;
+}
+
+static size_t encode_text(uint8_t *out, int32_t mantissa, uint8_t decimals, bool has_time, uint32_t time)
+{
+    char *p = (char *)out;
+
+    *p++ = '{';
+    if (has_time)
+    {
+        memcpy(p, "\"t\":", 4);
+        p += 4;
+        p += put_decimal(p, time, 1);
+        *p++ = ',';
+    }
+    memcpy(p, "\"v\":", 4);
+    p += 4;
+    p += payload_format_fixed(p, mantissa, decimals);
+    *p++ = '}';
+    return p - (char *)out;
+}
+
+/**
+ * @brief Writes a CBOR head: major type and argument in the shortest form
+ */
+static uint8_t *cbor_head(uint8_t *p, uint8_t major, uint32_t arg)
+{
+    if (arg < 24)
+    {
+        *p++ = major | arg;
+    }
+    else if (arg <= 0xFF)
+    {
+        *p++ = major | 24;
+        *p++ = arg;
+    }
+    else if (arg <= 0xFFFF)
+    {
+        *p++ = major | 25;
+        *p++ = arg >> 8;
+        *p++ = arg;
+    }
+    else
+    {
+        *p++ = major | 26;
+        *p++ = arg >> 24;
+        *p++ = arg >> 16;
+        *p++ = arg >> 8;
+        *p++ = arg;
+    }
+    return p;
+}
+
+static uint8_t *cbor_int(uint8_t *p, int32_t n)
+{
+    // A negative n is encoded as -1 - n, which can't overflow
+    return (n < 0) ? cbor_head(p, CBOR_NEGINT, (uint32_t)(-1 - n)) : cbor_head(p, CBOR_UINT, (uint32_t)n);
+}
+
+static uint8_t *cbor_key(uint8_t *p, char key)
+{
+    *p++ = CBOR_TEXT | 1;
+    *p++ = key;
+    return p;
+}
+
+static size_t encode_cbor(uint8_t *out, int32_t mantissa, uint8_t decimals, bool has_time, uint32_t time)
+{
+    uint8_t *p = cbor_head(out, CBOR_MAP, has_time ? 2 : 1);
+
+    if (has_time)
+    {
+        p = cbor_key(p, 't');
+        p = cbor_head(p, CBOR_UINT, time);
+    }
+    p = cbor_key(p, 'v');
+    if (decimals != 0)
+    {
+        p = cbor_head(p, CBOR_TAG, CBOR_TAG_DECIMAL);
+        p = cbor_head(p, CBOR_ARRAY, 2);
+        p = cbor_int(p, -(int32_t)decimals);
+    }
+    p = cbor_int(p, mantissa);
+    return p - out;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t n)
+{
+    *p++ = n >> 24;
+    *p++ = n >> 16;
+    *p++ = n >> 8;
+    *p++ = n;
+    return p;
+}
+
+static size_t encode_packed(uint8_t *out, int32_t mantissa, uint8_t decimals, bool has_time, uint32_t time)
+{
+    uint8_t *p = out;
+
+    *p++ = (uint8_t)(-(int8_t)decimals);
+    p = put_u32(p, (uint32_t)mantissa);
+    if (has_time)
+    {
+        p = put_u32(p, time);
+    }
+    return p - out;
+}
+
+size_t payload_encode_value(payload_codec_t codec, uint8_t *out, float value, uint8_t decimals,
+                            bool has_time, uint32_t time)
+{
+    int32_t mantissa;
+
+    if (!payload_fixed_point(value, decimals, &mantissa))
+    {
+        return 0;
+    }
+    switch (codec)
+    {
+        case PAYLOAD_CODEC_TEXT:
+            return encode_text(out, mantissa, decimals, has_time, time);
+        case PAYLOAD_CODEC_CBOR:
+            return encode_cbor(out, mantissa, decimals, has_time, time);
+        case PAYLOAD_CODEC_PACKED:
+            return encode_packed(out, mantissa, decimals, has_time, time);
+        default:
+            return 0;
+    }
+}
+
+const char *payload_codec_name(payload_codec_t codec)
+{
+    switch (codec)
+    {
+        case PAYLOAD_CODEC_TEXT:    return "json";
+        case PAYLOAD_CODEC_CBOR:    return "cbor";
+        case PAYLOAD_CODEC_PACKED:  return "packed";
+        default:                    return "unknown";
+    }
+}
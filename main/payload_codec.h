@@ -0,0 +1,66 @@
+/*
+    Sensor value payload encodings
+
+    Encodes one timestamped value for a per-sensor MQTT topic. Every encoding carries the value
+    as a fixed-point integer, mantissa * 10^-decimals, so no float is ever formatted; the
+    mantissa is rounded from the float with integer arithmetic only.
+
+        PAYLOAD_CODEC_TEXT      JSON text: {"t":1603000000,"v":23.5}
+        PAYLOAD_CODEC_CBOR      CBOR (RFC 8949) map with the same keys; "v" is a decimal
+                                fraction (tag 4) [-decimals, mantissa], or a plain integer
+                                when decimals is 0
+        PAYLOAD_CODEC_PACKED    exponent i8, mantissa i32, time u32, big endian
+
+    The time is seconds since the epoch and is left out (the packed form is then 5 bytes)
+    when the sample was taken before the clock was set.
+
+    This is plain C with no ESP-IDF dependencies, see tools/codec_bench.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Most decimals a value can be sent with
+#define PAYLOAD_CODEC_MAX_DECIMALS  (6)
+// Longest encoded value, any codec
+#define PAYLOAD_CODEC_MAX_LEN       (40)
+
+typedef enum
+{
+    PAYLOAD_CODEC_TEXT = 0,
+    PAYLOAD_CODEC_CBOR,
+    PAYLOAD_CODEC_PACKED,
+} payload_codec_t;
+
+/**
+ * @brief Rounds a value to a fixed-point mantissa
+ * @param decimals - digits after the decimal point, up to PAYLOAD_CODEC_MAX_DECIMALS
+ * @param mantissa - set to round(value * 10^decimals)
+ * @returns false if the value is not finite or does not fit in 32 bits
+ */
+bool payload_fixed_point(float value, uint8_t decimals, int32_t *mantissa);
+
+/**
+ * @brief Writes a fixed-point value as decimal text, without a terminating NUL
+ * @returns characters written, at most 12
+ */
+size_t payload_format_fixed(char *out, int32_t mantissa, uint8_t decimals);
+
+/**
+ * @brief Encodes one value
+ * @param out - output buffer, at least PAYLOAD_CODEC_MAX_LEN bytes
+ * @param has_time - false to leave out the time
+ * @returns bytes written, or 0 if the value can't be encoded (see payload_fixed_point())
+ */
+size_t payload_encode_value(payload_codec_t codec, uint8_t *out, float value, uint8_t decimals,
+                            bool has_time, uint32_t time);
+
+/**
+ * @brief Name of a codec for logging
+ */
+const char *payload_codec_name(payload_codec_t codec);
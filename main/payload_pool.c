@@ -0,0 +1,99 @@
+/*
+    MQTT payload pool
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+#include "payload_pool.h"
+
+#ifdef CONFIG_THINKSPEAK_ENABLE
+
+static const char *TAG = "PAYLOAD";
+
+_Static_assert(CONFIG_MQTT_PAYLOAD_BUFFERS <= 32, "Payload pool uses a 32 bit free mask");
+
+static char pool[CONFIG_MQTT_PAYLOAD_BUFFERS][PAYLOAD_LEN];
+static uint32_t used_mask = 0;
+static payload_pool_stats_t stats;
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+char *payload_alloc(void)
+{
+    char *payload = NULL;
+
+    portENTER_CRITICAL(&pool_lock);
+    for (int i = 0; i < CONFIG_MQTT_PAYLOAD_BUFFERS; i++)
+    {
+        if (!(used_mask & (1UL << i)))
+        {
+            used_mask |= (1UL << i);
+            payload = pool[i];
+            stats.in_use++;
+            stats.allocs++;
+            if (stats.in_use > stats.high_water)
+            {
+                stats.high_water = stats.in_use;
+            }
+            break;
+        }
+    }
+    if (payload == NULL)
+    {
+        stats.failures++;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (payload != NULL)
+    {
+        payload[0] = '\0';
+    }
+    return payload;
+}
+
+void payload_free(char *payload)
+{
+    if (payload == NULL)
+    {
+        return;
+    }
+    if ((payload < pool[0]) || (payload >= pool[0] + sizeof(pool)) || ((payload - pool[0]) % PAYLOAD_LEN != 0))
+    {
+        ESP_LOGE(TAG, "Freeing a buffer that is not from the pool");
+        return;
+    }
+    int i = (payload - pool[0]) / PAYLOAD_LEN;
+    portENTER_CRITICAL(&pool_lock);
+    if (used_mask & (1UL << i))
+    {
+        used_mask &= ~(1UL << i);
+        stats.in_use--;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+}
+
+void payload_pool_get_stats(payload_pool_stats_t *out)
+{
+    portENTER_CRITICAL(&pool_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&pool_lock);
+}
+
+void payload_pool_log(void)
+{
+    payload_pool_stats_t s;
+    payload_pool_get_stats(&s);
+    ESP_LOGI(TAG, "Payload pool: %u/%d in use, high water %u, %u allocs, %u failures",
+                    s.in_use, CONFIG_MQTT_PAYLOAD_BUFFERS, s.high_water, s.allocs, s.failures);
+    ESP_LOGI(TAG, "Heap: %u free, %u minimum free, %u largest block",
+                    esp_get_free_heap_size(), esp_get_minimum_free_heap_size(),
+                    (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+    MQTT payload pool
+
+    Fixed pool of payload buffers for the publish path, so publishing never touches the heap.
+    The pool holds CONFIG_MQTT_PAYLOAD_BUFFERS buffers of CONFIG_MQTT_PAYLOAD_LEN bytes, sized
+    at compile time. Buffers are taken with payload_alloc() and handed back with payload_free()
+    once the publish call returns (the MQTT client copies what it keeps).
+
+    tools/payload_test runs the publish path on a host and fails if it allocates. The
+    bulk-update upload is not covered: its body is a static buffer in bulk_update.c, but
+    esp_http_client allocates inside IDF for every request.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+#define PAYLOAD_LEN (CONFIG_MQTT_PAYLOAD_LEN)
+
+typedef struct
+{
+    uint32_t in_use;            // Buffers currently taken
+    uint32_t high_water;        // Most buffers ever taken at once
+    uint32_t allocs;            // Total buffers handed out
+    uint32_t failures;          // Requests made while the pool was empty
+} payload_pool_stats_t;
+
+/**
+ * @brief Takes a buffer of PAYLOAD_LEN bytes from the pool
+ * @returns the buffer, or NULL if all buffers are in use
+ */
+char *payload_alloc(void);
+
+/**
+ * @brief Returns a buffer to the pool
+ */
+void payload_free(char *payload);
+
+/**
+ * @brief Returns the pool counters
+ */
+void payload_pool_get_stats(payload_pool_stats_t *stats);
+
+/**
+ * @brief Logs the pool counters along with the heap free, low water and largest free block,
+ * which shows whether the heap is fragmenting over time
+ */
+void payload_pool_log(void);
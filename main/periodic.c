@@ -0,0 +1,73 @@
+/*
+    Periodic task timing
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "periodic.h"
+
+static const char *TAG = "PERIODIC";
+
+void periodic_init(periodic_t *timer, const char *name, uint32_t period_ms, periodic_policy_t policy)
+{
+    memset(timer, 0, sizeof(periodic_t));
+    timer->name = name;
+    timer->period = period_ms / portTICK_PERIOD_MS;
+    if (timer->period == 0)
+    {
+        timer->period = 1;
+    }
+    timer->policy = policy;
+    timer->last_wake = xTaskGetTickCount();
+    timer->next_wake = timer->last_wake + timer->period;
+}
+
+void periodic_wait(periodic_t *timer)
+{
+    TickType_t now = xTaskGetTickCount();
+    int32_t behind = (int32_t)(now - timer->next_wake);
+
+    if (behind > 0)
+    {
+        // The work ran past the deadline
+        uint32_t missed = (uint32_t)behind / timer->period;
+        timer->overruns++;
+        if ((timer->policy == PERIODIC_SKIP) || (missed >= PERIODIC_MAX_CATCH_UP))
+        {
+            // Move to the first deadline that is still in the future
+            timer->next_wake += (missed + 1) * timer->period;
+            timer->skipped += missed + 1;
+        }
+        ESP_LOGW(TAG, "%s: overran deadline by %u ms", timer->name, (unsigned)(behind * portTICK_PERIOD_MS));
+    }
+
+    // vTaskDelayUntil() wakes at prev + period, and returns at once if that has already passed
+    TickType_t prev = timer->next_wake - timer->period;
+    vTaskDelayUntil(&prev, timer->period);
+
+    now = xTaskGetTickCount();
+    int32_t late = (int32_t)(now - timer->next_wake);
+    int32_t error = (int32_t)(now - timer->last_wake) - (int32_t)timer->period;
+    histogram_record(&timer->lateness, (late > 0 ? late : 0) * portTICK_PERIOD_MS);
+    histogram_record(&timer->period_error, (error > 0 ? error : -error) * portTICK_PERIOD_MS);
+
+    timer->last_wake = now;
+    timer->next_wake += timer->period;
+    timer->cycles++;
+}
+
+void periodic_log(const periodic_t *timer)
+{
+    char buffer[128];
+
+    ESP_LOGI(TAG, "%s: %u cycles, %u overruns, %u skipped", timer->name,
+                    (unsigned)timer->cycles, (unsigned)timer->overruns, (unsigned)timer->skipped);
+    histogram_format(&timer->lateness, buffer, sizeof(buffer));
+    ESP_LOGI(TAG, "%s: lateness (ms, max %u): %s", timer->name, (unsigned)timer->lateness.max, buffer);
+    histogram_format(&timer->period_error, buffer, sizeof(buffer));
+    ESP_LOGI(TAG, "%s: period error (ms, max %u): %s", timer->name, (unsigned)timer->period_error.max, buffer);
+}
@@ -0,0 +1,64 @@
+/*
+    Periodic task timing
+
+    Runs a loop on absolute deadlines (the vTaskDelayUntil() model) so the period does not
+    stretch by however long the work in the loop took. When the work overruns a deadline the
+    configured policy either skips the missed periods or runs back to back to catch up (limited
+    to PERIODIC_MAX_CATCH_UP periods). Actual period error and wake-up lateness are recorded in
+    histograms.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "histogram.h"
+
+// Largest number of missed periods that the catch-up policy will run back to back. Beyond
+// this the missed periods are skipped instead.
+#define PERIODIC_MAX_CATCH_UP (3)
+
+/**
+ * What to do when the work in the loop runs past the next deadline
+ */
+typedef enum
+{
+    PERIODIC_SKIP = 0,      // Drop the missed periods and wait for the next future deadline
+    PERIODIC_CATCH_UP,      // Run the missed periods immediately, one after another
+} periodic_policy_t;
+
+typedef struct
+{
+    const char *name;           // Name used in the log
+    uint32_t period;            // Period in ticks
+    periodic_policy_t policy;
+    uint32_t next_wake;         // Absolute tick of the next deadline
+    uint32_t last_wake;         // Tick of the last actual wake up
+    uint32_t cycles;            // Number of completed waits
+    uint32_t overruns;          // Number of times the work ran past the next deadline
+    uint32_t skipped;           // Number of periods dropped by the skip policy
+    histogram_t lateness;       // Actual wake up minus deadline (ms)
+    histogram_t period_error;   // |actual period - nominal period| (ms)
+} periodic_t;
+
+/**
+ * @brief Sets up the timer. The first deadline is one period from now.
+ * @param timer - timer state
+ * @param name - name used in the log
+ * @param period_ms - period in ms
+ * @param policy - overrun policy
+ */
+void periodic_init(periodic_t *timer, const char *name, uint32_t period_ms, periodic_policy_t policy);
+
+/**
+ * @brief Blocks the calling task until the next deadline
+ * @param timer - timer state
+ */
+void periodic_wait(periodic_t *timer);
+
+/**
+ * @brief Logs the overrun counters and histograms
+ * @param timer - timer state
+ */
+void periodic_log(const periodic_t *timer);
@@ -0,0 +1,59 @@
+/*
+    Publisher backends
+
+    A backend turns samples and status messages into MQTT topics and payloads for one kind of
+    destination. mqtt.c owns the clients, the connections and the samples; it hands each
+    sample to the backend together with a send function for the backend's connection, and
+    the backend decides the topics and the encoding. Selected with the "Publish to" choice in
+    Kconfig, or several at once with CONFIG_PUBLISH_FANOUT (see fanout.h).
+
+        publisher_thingspeak    channels/<id>/publish/<key>, field1=..&field2=..&status=..
+        publisher_broker        <prefix>/<sensor> per value, encoded with payload_codec.h,
+                                and <prefix>/status
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sample_queue.h"
+
+/**
+ * @brief Sends one message on the backend's connection
+ * @param ctx - context passed to the backend along with the send function
+ * @param len - payload length, 0 for a NUL terminated string
+ * @returns the MQTT message id, or -1 if the publish failed
+ */
+typedef int (*publisher_send_t)(void *ctx, const char *topic, const void *data, size_t len);
+
+typedef struct
+{
+    const char *name;
+    const char *uri;            // Broker
+    const char *username;       // MQTT login
+    const char *password;
+    size_t status_max_len;      // Longest status the destination keeps, 0 for no limit
+    /**
+     * @brief Builds the topics, called once before anything is sent
+     */
+    void (*init)(void);
+    /**
+     * @brief Sends a sample
+     * @returns false if it was not (completely) sent; it stays queued and is sent again
+     */
+    bool (*send_sample)(const sample_t *sample, publisher_send_t send, void *ctx);
+    /**
+     * @brief Sends a status text, such as "ONLINE" or the metrics
+     */
+    bool (*send_status)(const char *status, publisher_send_t send, void *ctx);
+} publisher_t;
+
+#ifdef CONFIG_PUBLISHER_THINGSPEAK
+extern const publisher_t publisher_thingspeak;
+#endif
+#ifdef CONFIG_PUBLISHER_BROKER
+extern const publisher_t publisher_broker;
+#endif
@@ -0,0 +1,163 @@
+/*
+    MQTT broker publisher backend
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "modbus.h"
+#include "derived.h"
+#include "payload_codec.h"
+#include "publisher.h"
+
+#ifdef CONFIG_PUBLISHER_BROKER
+
+static const char *TAG = "BROKER";
+
+#if defined(CONFIG_PUBLISH_ENCODING_CBOR)
+#define BROKER_CODEC PAYLOAD_CODEC_CBOR
+#elif defined(CONFIG_PUBLISH_ENCODING_PACKED)
+#define BROKER_CODEC PAYLOAD_CODEC_PACKED
+#else
+#define BROKER_CODEC PAYLOAD_CODEC_TEXT
+#endif
+
+#define TOPIC_LEN 64
+// Derived values are sent with a fixed resolution
+#define DERIVED_DECIMALS 2
+
+typedef enum
+{
+    DERIVED_DEW_POINT = 0,
+    DERIVED_ABS_HUMIDITY,
+    DERIVED_HEAT_INDEX,
+    DERIVED_COUNT
+} derived_topic_t;
+
+typedef struct
+{
+    char topic[TOPIC_LEN];
+    uint8_t decimals;
+} value_topic_t;
+
+static value_topic_t value_topics[SAMPLE_MAX_VALUES];
+static uint16_t num_value_topics;
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+static value_topic_t derived_topics[DERIVED_COUNT];
+#endif
+static char status_topic[TOPIC_LEN];
+
+/**
+ * @brief Builds <prefix>/<name>, with the name lower case and anything but letters and
+ * digits replaced by '_'
+ */
+static void make_topic(char *topic, const char *name)
+{
+    int n = snprintf(topic, TOPIC_LEN, "%s/", CONFIG_PUBLISH_TOPIC_PREFIX);
+    for (const char *c = name; (*c != '\0') && (n < TOPIC_LEN - 1); c++)
+    {
+        topic[n++] = isalnum((unsigned char)*c) ? tolower((unsigned char)*c) : '_';
+    }
+    topic[n] = '\0';
+}
+
+static void broker_init(void)
+{
+    uint16_t count = modbus_cid_count();
+
+    num_value_topics = (count < SAMPLE_MAX_VALUES) ? count : SAMPLE_MAX_VALUES;
+    for (uint16_t cid = 0; cid < num_value_topics; cid++)
+    {
+        const regmap_param_t *param = modbus_cid_param(cid);
+        int decimals = -param->scale_exp;
+#ifndef CONFIG_THINKSPEAK_RESOLUTION_RAW
+        // A window mean falls between the steps of the register, keep one more digit of it
+        decimals++;
+#endif
+        value_topics[cid].decimals = (decimals < 0) ? 0 : (decimals > PAYLOAD_CODEC_MAX_DECIMALS) ? PAYLOAD_CODEC_MAX_DECIMALS : decimals;
+        make_topic(value_topics[cid].topic, param->name);
+    }
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+    static const char *derived_names[DERIVED_COUNT] = { "dew_point", "abs_humidity", "heat_index" };
+    for (int i = 0; i < DERIVED_COUNT; i++)
+    {
+        make_topic(derived_topics[i].topic, derived_names[i]);
+        derived_topics[i].decimals = DERIVED_DECIMALS;
+    }
+#endif
+    make_topic(status_topic, "status");
+    ESP_LOGI(TAG, "Publishing %d values to %s/<sensor> as %s", num_value_topics, CONFIG_PUBLISH_TOPIC_PREFIX,
+                    payload_codec_name(BROKER_CODEC));
+}
+
+/**
+ * @brief Sends one value to its topic. A value that can't be encoded (not a number) is
+ * skipped rather than failing the sample.
+ */
+static bool send_value(const value_topic_t *topic, float value, bool has_time, uint32_t time, publisher_send_t send, void *ctx)
+{
+    uint8_t data[PAYLOAD_CODEC_MAX_LEN];
+    size_t len = payload_encode_value(BROKER_CODEC, data, value, topic->decimals, has_time, time);
+
+    if (len == 0)
+    {
+        ESP_LOGW(TAG, "%s: value can't be sent", topic->topic);
+        return true;
+    }
+    return send(ctx, topic->topic, data, len) != -1;
+}
+
+/**
+ * @brief Sends each value of a sample to its own topic. If one fails the whole sample is sent
+ * again later, so the values before it may arrive twice.
+ */
+static bool broker_send_sample(const sample_t *sample, publisher_send_t send, void *ctx)
+{
+    uint32_t time = 0;
+    bool has_time = sample_epoch_time(sample, &time);
+    uint16_t count = (sample->count < num_value_topics) ? sample->count : num_value_topics;
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (!send_value(&value_topics[i], sample->values[i], has_time, time, send, ctx))
+        {
+            return false;
+        }
+    }
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+    derived_metrics_t metrics;
+    if (derived_compute(sample->values[CID_INP_DATA_TEMPERATURE], sample->values[CID_INP_DATA_HUMIDITY], &metrics))
+    {
+        const float derived[DERIVED_COUNT] = { metrics.dew_point, metrics.abs_humidity, metrics.heat_index };
+        for (int i = 0; i < DERIVED_COUNT; i++)
+        {
+            if (!send_value(&derived_topics[i], derived[i], has_time, time, send, ctx))
+            {
+                return false;
+            }
+        }
+    }
+#endif
+    return true;
+}
+
+static bool broker_send_status(const char *status, publisher_send_t send, void *ctx)
+{
+    return send(ctx, status_topic, status, 0) != -1;
+}
+
+const publisher_t publisher_broker = {
+    .name = "MQTT broker",
+    .uri = CONFIG_PUBLISH_BROKER_URL,
+    .username = (sizeof(CONFIG_PUBLISH_BROKER_USERNAME) > 1) ? CONFIG_PUBLISH_BROKER_USERNAME : NULL,
+    .password = (sizeof(CONFIG_PUBLISH_BROKER_PASSWORD) > 1) ? CONFIG_PUBLISH_BROKER_PASSWORD : NULL,
+    .init = broker_init,
+    .send_sample = broker_send_sample,
+    .send_status = broker_send_status,
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+    ThingSpeak publisher backend
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "sensor_map.h"
+#include "derived.h"
+#include "payload_pool.h"
+#include "publisher.h"
+
+#ifdef CONFIG_PUBLISHER_THINGSPEAK
+
+static const char *TAG = "THINGSPEAK";
+
+#define TOPIC_LEN 128
+// ThingSpeak keeps at most this many characters of a status, and it has to fit in a payload
+// buffer after the field name
+#define STATUS_PREFIX "status="
+#define STATUS_KEPT_LEN 255
+#define STATUS_FIT_LEN (PAYLOAD_LEN - sizeof(STATUS_PREFIX))
+#define STATUS_MAX_LEN ((STATUS_KEPT_LEN < STATUS_FIT_LEN) ? STATUS_KEPT_LEN : STATUS_FIT_LEN)
+
+static char topic_string[TOPIC_LEN];
+
+static void thingspeak_init(void)
+{
+    snprintf(topic_string, TOPIC_LEN, "channels/%d/publish/%s", CONFIG_THINKSPEAK_CHANNELID, CONFIG_THINKSPEAK_CHANNEL_WRITE_KEY);
+
+#ifdef CONFIG_THINKSPEAK_LOG_PASSWDS_IN_LOGS
+    ESP_LOGI(TAG, "[APP] Using topic: %s", topic_string);
+#else
+    ESP_LOGI(TAG, "[APP] Display of topic string disabled");
+#endif
+}
+
+/**
+ * @brief Formats a queued sample as a ThingSpeak update. Samples with a known time carry
+ * created_at so ThingSpeak files them at the time they were taken, not when they arrive.
+ */
+static void format_sample(char *data, size_t len, const sample_t *sample, const char *status)
+{
+    int n = snprintf(data, len, "field1=%0.02f&field2=%0.02f&status=%s",
+                    sample->values[CID_INP_DATA_TEMPERATURE],
+                    sample->values[CID_INP_DATA_HUMIDITY],
+                    status
+                    );
+#ifdef CONFIG_THINKSPEAK_DERIVED_FIELDS
+    derived_metrics_t metrics;
+    if ((n > 0) && ((size_t)n < len) &&
+        derived_compute(sample->values[CID_INP_DATA_TEMPERATURE], sample->values[CID_INP_DATA_HUMIDITY], &metrics))
+    {
+        n += snprintf(data + n, len - n, "&field3=%0.02f&field4=%0.02f&field5=%0.02f",
+                    metrics.dew_point, metrics.abs_humidity, metrics.heat_index);
+    }
+#endif
+    uint32_t epoch;
+    if ((n > 0) && ((size_t)n < len) && sample_epoch_time(sample, &epoch))
+    {
+        time_t t = (time_t)epoch;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(data + n, len - n, "&created_at=%Y-%m-%dT%H:%M:%SZ", &tm);
+    }
+}
+
+static bool thingspeak_send_sample(const sample_t *sample, publisher_send_t send, void *ctx)
+{
+    char *data = payload_alloc();
+    if (data == NULL)
+    {
+        ESP_LOGE(TAG, "No payload buffer free");
+        return false;
+    }
+    format_sample(data, PAYLOAD_LEN, sample, "GOOD_ESP");
+    bool sent = (send(ctx, topic_string, data, 0) != -1);
+    payload_free(data);
+    return sent;
+}
+
+/**
+ * @brief Sends a status update to the channel, cut to the length ThingSpeak keeps
+ */
+static bool thingspeak_send_status(const char *status, publisher_send_t send, void *ctx)
+{
+    char *data = payload_alloc();
+    if (data == NULL)
+    {
+        ESP_LOGE(TAG, "No payload buffer free");
+        return false;
+    }
+    snprintf(data, PAYLOAD_LEN, STATUS_PREFIX "%.*s", (int)STATUS_MAX_LEN, status);
+    bool sent = (send(ctx, topic_string, data, 0) != -1);
+    payload_free(data);
+    return sent;
+}
+
+const publisher_t publisher_thingspeak = {
+    .name = "ThingSpeak",
+    .uri = CONFIG_BROKER_URL,
+    .username = "thingspeak",
+    .password = CONFIG_THINKSPEAK_MQTT_KEY,
+    .status_max_len = STATUS_MAX_LEN,
+    .init = thingspeak_init,
+    .send_sample = thingspeak_send_sample,
+    .send_status = thingspeak_send_status,
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+    Sensor register map
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "mb_crc.h"
+#include "regmap.h"
+#include "sensor_map.h"
+
+// Highest unicast Modbus address
+#define REGMAP_MAX_SLAVE        (247)
+#define REGMAP_MAX_SCALE_EXP    (6)
+
+// 10^e as a constant expression, so the built-in table can use it
+#define POW10(e) \
+    ((e) == -6 ? 1e-6f : (e) == -5 ? 1e-5f : (e) == -4 ? 1e-4f : (e) == -3 ? 1e-3f : \
+     (e) == -2 ? 1e-2f : (e) == -1 ? 1e-1f : (e) ==  0 ? 1.0f  : (e) ==  1 ? 1e1f  : \
+     (e) ==  2 ? 1e2f  : (e) ==  3 ? 1e3f  : (e) ==  4 ? 1e4f  : (e) ==  5 ? 1e5f  : 1e6f)
+
+static size_t field_len(const char *field, size_t max)
+{
+    size_t n = 0;
+    while ((n < max) && field[n])
+    {
+        n++;
+    }
+    return n;
+}
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+float regmap_decode_s16(const uint16_t *reg, float scale)
+{
+    return (float)(int16_t)reg[0] * scale;
+}
+
+float regmap_decode_u16(const uint16_t *reg, float scale)
+{
+    return (float)reg[0] * scale;
+}
+
+float regmap_decode_s32(const uint16_t *reg, float scale)
+{
+    return (float)(int32_t)((uint32_t)reg[0] | ((uint32_t)reg[1] << 16)) * scale;
+}
+
+float regmap_decode_u32(const uint16_t *reg, float scale)
+{
+    return (float)((uint32_t)reg[0] | ((uint32_t)reg[1] << 16)) * scale;
+}
+
+// Built-in map, generated from sensor_map.h. The slave address is filled in at run time.
+#define BUILTIN_PARAM(cid, field, param_name, param_unit, area, reg, type, exp) \
+    [cid] = { \
+        .decode = REGMAP_TYPE_##type##_DECODE, \
+        .scale = POW10(exp), \
+        .reg_start = (reg), \
+        .reg_type = REGMAP_REG_##area, \
+        .reg_count = REGMAP_TYPE_##type##_REGS, \
+        .flags = REGMAP_TYPE_##type##_FLAGS, \
+        .scale_exp = (exp), \
+        .unit = param_unit, \
+        .name = param_name, \
+    },
+
+#define BUILTIN_CHECK(cid, field, param_name, param_unit, area, reg, type, exp) \
+    _Static_assert((cid) < REGMAP_MAX_ENTRIES, "CID " #cid " does not fit in a register map"); \
+    _Static_assert(sizeof(param_name) - 1 <= REGMAP_NAME_LEN, "Name of " #cid " is too long"); \
+    _Static_assert(sizeof(param_unit) - 1 <= REGMAP_UNIT_LEN, "Unit of " #cid " is too long"); \
+    _Static_assert(((exp) >= -REGMAP_MAX_SCALE_EXP) && ((exp) <= REGMAP_MAX_SCALE_EXP), "Scale of " #cid " is out of range"); \
+    _Static_assert((reg) + REGMAP_TYPE_##type##_REGS <= 0x10000, "Registers of " #cid " are out of range");
+
+SENSOR_MAP(BUILTIN_CHECK)
+
+static const regmap_param_t builtin_params[CID_COUNT] = {
+    SENSOR_MAP(BUILTIN_PARAM)
+};
+
+void regmap_builtin(regmap_t *map, uint8_t slave)
+{
+    memset(map, 0, sizeof(regmap_t));
+    for (uint8_t i = 0; i < CID_COUNT; i++)
+    {
+        map->params[i] = builtin_params[i];
+        map->params[i].slave = slave;
+    }
+    map->count = CID_COUNT;
+}
+
+/**
+ * @brief Checks that a unit or name can be printed into JSON, Prometheus labels and MQTT
+ * topics as is: printable ASCII up to the NUL or the end of the field, no quote or backslash
+ */
+static bool text_ok(const char *text, size_t len)
+{
+    for (size_t i = 0; (i < len) && (text[i] != '\0'); i++)
+    {
+        if ((text[i] < ' ') || (text[i] > '~') || (text[i] == '"') || (text[i] == '\\'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool regmap_param_check(regmap_param_t *param)
+{
+    if ((param->slave < 1) || (param->slave > REGMAP_MAX_SLAVE) ||
+        ((param->reg_type != REGMAP_REG_HOLDING) && (param->reg_type != REGMAP_REG_INPUT)) ||
+        (param->reg_count < 1) || (param->reg_count > 2) ||
+        ((uint32_t)param->reg_start + param->reg_count > 0x10000) ||
+        (param->flags & ~REGMAP_FLAG_SIGNED) ||
+        (param->scale_exp < -REGMAP_MAX_SCALE_EXP) || (param->scale_exp > REGMAP_MAX_SCALE_EXP) ||
+        (param->name[0] == '\0') ||
+        !text_ok(param->name, REGMAP_NAME_LEN) || !text_ok(param->unit, REGMAP_UNIT_LEN))
+    {
+        return false;
+    }
+    param->scale = POW10(param->scale_exp);
+    if (param->flags & REGMAP_FLAG_SIGNED)
+    {
+        param->decode = (param->reg_count > 1) ? regmap_decode_s32 : regmap_decode_s16;
+    }
+    else
+    {
+        param->decode = (param->reg_count > 1) ? regmap_decode_u32 : regmap_decode_u16;
+    }
+    return true;
+}
+
+regmap_status_t regmap_parse(const uint8_t *blob, size_t len, regmap_t *map, uint8_t *bad_entry)
+{
+    if (len < REGMAP_HEADER_SIZE)
+    {
+        return REGMAP_ERR_SIZE;
+    }
+    if (get_u16(&blob[0]) != REGMAP_MAGIC)
+    {
+        return REGMAP_ERR_MAGIC;
+    }
+    if ((blob[2] != REGMAP_VERSION) && (blob[2] != 1))
+    {
+        return REGMAP_ERR_VERSION;
+    }
+    size_t entry_size = (blob[2] == 1) ? REGMAP_ENTRY_SIZE_V1 : REGMAP_ENTRY_SIZE;
+    uint8_t count = blob[3];
+    if ((count == 0) || (count > REGMAP_MAX_ENTRIES))
+    {
+        return REGMAP_ERR_COUNT;
+    }
+    if (len != REGMAP_HEADER_SIZE + (size_t)count * entry_size)
+    {
+        return REGMAP_ERR_SIZE;
+    }
+    const uint8_t *entries = &blob[REGMAP_HEADER_SIZE];
+    if (get_u16(&blob[4]) != mb_crc16(entries, (size_t)count * entry_size))
+    {
+        return REGMAP_ERR_CRC;
+    }
+
+    memset(map, 0, sizeof(regmap_t));
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const uint8_t *e = &entries[i * entry_size];
+        regmap_param_t *param = &map->params[i];
+        param->slave = e[0];
+        param->reg_type = e[1];
+        param->reg_start = get_u16(&e[2]);
+        param->reg_count = e[4];
+        param->flags = e[5];
+        param->scale_exp = (int8_t)e[6];
+        memcpy(param->unit, &e[8], REGMAP_UNIT_LEN);
+        memcpy(param->name, &e[8 + REGMAP_UNIT_LEN], REGMAP_NAME_LEN);
+        if (entry_size > REGMAP_ENTRY_SIZE_V1)
+        {
+            param->priority = e[7];
+            param->period_s = get_u16(&e[REGMAP_ENTRY_SIZE_V1]);
+        }
+        if (!regmap_param_check(param))
+        {
+            if (bad_entry)
+            {
+                *bad_entry = i;
+            }
+            return REGMAP_ERR_ENTRY;
+        }
+    }
+    map->count = count;
+    return REGMAP_OK;
+}
+
+size_t regmap_encode(const regmap_t *map, uint8_t *blob, size_t len)
+{
+    size_t size = REGMAP_HEADER_SIZE + (size_t)map->count * REGMAP_ENTRY_SIZE;
+    if ((map->count == 0) || (map->count > REGMAP_MAX_ENTRIES) || (len < size))
+    {
+        return 0;
+    }
+
+    memset(blob, 0, size);
+    uint8_t *entries = &blob[REGMAP_HEADER_SIZE];
+    for (uint8_t i = 0; i < map->count; i++)
+    {
+        regmap_param_t param = map->params[i];
+        if (!regmap_param_check(&param))
+        {
+            return 0;
+        }
+        uint8_t *e = &entries[i * REGMAP_ENTRY_SIZE];
+        e[0] = param.slave;
+        e[1] = param.reg_type;
+        put_u16(&e[2], param.reg_start);
+        e[4] = param.reg_count;
+        e[5] = param.flags;
+        e[6] = (uint8_t)param.scale_exp;
+        e[7] = param.priority;
+        // NUL padded by the memset, not necessarily terminated
+        memcpy(&e[8], param.unit, field_len(param.unit, REGMAP_UNIT_LEN));
+        memcpy(&e[8 + REGMAP_UNIT_LEN], param.name, field_len(param.name, REGMAP_NAME_LEN));
+        put_u16(&e[REGMAP_ENTRY_SIZE_V1], param.period_s);
+    }
+    put_u16(&blob[0], REGMAP_MAGIC);
+    blob[2] = REGMAP_VERSION;
+    blob[3] = map->count;
+    put_u16(&blob[4], mb_crc16(entries, (size_t)map->count * REGMAP_ENTRY_SIZE));
+    return size;
+}
+
+const char *regmap_status_name(regmap_status_t status)
+{
+    switch (status)
+    {
+        case REGMAP_OK:             return "OK";
+        case REGMAP_ERR_SIZE:       return "bad size";
+        case REGMAP_ERR_MAGIC:      return "bad magic";
+        case REGMAP_ERR_VERSION:    return "unsupported version";
+        case REGMAP_ERR_COUNT:      return "bad entry count";
+        case REGMAP_ERR_CRC:        return "CRC mismatch";
+        case REGMAP_ERR_ENTRY:      return "bad entry";
+        default:                    return "unknown";
+    }
+}
@@ -0,0 +1,162 @@
+/*
+    Sensor register map
+
+    Describes the values polled from the bus: which slave, register area and registers each
+    one is read from and how the raw registers are turned into a value. The map is normally
+    the built-in XY-MD02 one, but a different map can be stored in NVS as a compact binary
+    blob, so the same firmware image can be deployed where the sensor mix differs.
+
+    Blob layout (little endian):
+
+        header  magic u16 (REGMAP_MAGIC), version u8, count u8, crc u16, reserved u16
+        entry   slave u8, reg_type u8, reg_start u16, reg_count u8, flags u8, scale_exp i8,
+                priority u8, unit char[4], name char[12], period_s u16,
+                reserved u16                                        (x count)
+
+    Version 1 entries end after the name (REGMAP_ENTRY_SIZE_V1) and have no poll period or
+    priority; they are still read, with the defaults. A slave is polled every period_s
+    seconds (0 for the default poll period) and wins ties with slaves due at the same time
+    by priority (higher wins). Where the entries of one slave differ, the shortest period and
+    the highest priority apply.
+
+    The crc is the Modbus CRC-16 of the entries. A value is raw * 10^scale_exp, with raw read
+    as a signed number when REGMAP_FLAG_SIGNED is set. A two register value has the low word
+    in the first register. Unit and name are NUL padded and need not be NUL terminated. They
+    are printed into JSON, Prometheus labels and MQTT topics, so only printable ASCII other
+    than '"' and '\\' is accepted.
+
+    The entry index is the CID. The first CID_COUNT entries are the values the rest of the
+    firmware knows by name (see sensor_map.h, which also defines the built-in map).
+
+    Each entry is given a decoder for its register type when the map is loaded, so decoding
+    a reading does not branch on the type.
+
+    This is plain C with no ESP-IDF dependencies, see tools/regmap_gen to build a blob.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Most values a map can hold, four XY-MD02 sensors. Every reading travels as one of these, so
+// SAMPLE_MAX_VALUES, ROLLUP_MAX_VALUES and TSDB_MAX_SERIES must be at least as large
+// (modbus.c and history.c check at compile time). TSDB_MAX_SERIES can't go past 8, and a
+// larger sample needs a new flash spill record layout (see sample_queue.c).
+#define REGMAP_MAX_ENTRIES      (8)
+#define REGMAP_MAGIC            (0x4D52)        // "RM"
+#define REGMAP_VERSION          (2)
+#define REGMAP_HEADER_SIZE      (8)
+#define REGMAP_ENTRY_SIZE       (28)
+#define REGMAP_ENTRY_SIZE_V1    (24)
+#define REGMAP_MAX_BLOB         (REGMAP_HEADER_SIZE + REGMAP_MAX_ENTRIES * REGMAP_ENTRY_SIZE)
+#define REGMAP_UNIT_LEN         (4)
+#define REGMAP_NAME_LEN         (12)
+
+// Register areas
+#define REGMAP_REG_HOLDING      (0)             // Read with FC03
+#define REGMAP_REG_INPUT        (1)             // Read with FC04
+
+// Entry flags
+#define REGMAP_FLAG_SIGNED      (0x01)
+
+/*
+ * Register types for sensor_map.h: registers used, flags and decoder of each
+ */
+#define REGMAP_TYPE_S16_REGS    (1)
+#define REGMAP_TYPE_S16_FLAGS   (REGMAP_FLAG_SIGNED)
+#define REGMAP_TYPE_S16_DECODE  regmap_decode_s16
+#define REGMAP_TYPE_U16_REGS    (1)
+#define REGMAP_TYPE_U16_FLAGS   (0)
+#define REGMAP_TYPE_U16_DECODE  regmap_decode_u16
+#define REGMAP_TYPE_S32_REGS    (2)
+#define REGMAP_TYPE_S32_FLAGS   (REGMAP_FLAG_SIGNED)
+#define REGMAP_TYPE_S32_DECODE  regmap_decode_s32
+#define REGMAP_TYPE_U32_REGS    (2)
+#define REGMAP_TYPE_U32_FLAGS   (0)
+#define REGMAP_TYPE_U32_DECODE  regmap_decode_u32
+
+/**
+ * @brief Turns the registers of a value into the scaled value
+ * @param reg - first register of the value, in host byte order
+ * @param scale - multiplier
+ */
+typedef float (*regmap_decode_t)(const uint16_t *reg, float scale);
+
+float regmap_decode_s16(const uint16_t *reg, float scale);
+float regmap_decode_u16(const uint16_t *reg, float scale);
+float regmap_decode_s32(const uint16_t *reg, float scale);
+float regmap_decode_u32(const uint16_t *reg, float scale);
+
+typedef enum
+{
+    REGMAP_OK = 0,
+    REGMAP_ERR_SIZE,            // Blob shorter or longer than its header says
+    REGMAP_ERR_MAGIC,
+    REGMAP_ERR_VERSION,
+    REGMAP_ERR_COUNT,           // No entries, or more than REGMAP_MAX_ENTRIES
+    REGMAP_ERR_CRC,
+    REGMAP_ERR_ENTRY,           // An entry has a bad field, see the index returned
+} regmap_status_t;
+
+/*
+ * One value to poll, unpacked from the blob into the form the poller uses
+ */
+typedef struct
+{
+    regmap_decode_t decode;     // Picked from the register count and flags
+    float scale;                // 10^scale_exp
+    uint16_t reg_start;
+    uint8_t slave;              // 1 to 247
+    uint8_t reg_type;           // REGMAP_REG_*
+    uint8_t reg_count;          // 1 or 2
+    uint8_t flags;              // REGMAP_FLAG_*
+    int8_t scale_exp;           // -6 to 6
+    uint8_t priority;           // Bus scheduler tie breaker of the slave
+    uint16_t period_s;          // Poll period of the slave, 0 for the default
+    char unit[REGMAP_UNIT_LEN + 1];
+    char name[REGMAP_NAME_LEN + 1];
+} regmap_param_t;
+
+typedef struct
+{
+    uint8_t count;
+    regmap_param_t params[REGMAP_MAX_ENTRIES];
+} regmap_t;
+
+/**
+ * @brief Fills in the built-in XY-MD02 map from sensor_map.h
+ * @param map - map to fill in
+ * @param slave - Modbus address of the sensor
+ */
+void regmap_builtin(regmap_t *map, uint8_t slave);
+
+/**
+ * @brief Checks and unpacks a blob
+ * @param blob - stored map
+ * @param len - bytes in blob
+ * @param map - unpacked map, only valid when REGMAP_OK is returned
+ * @param bad_entry - set to the index of the failing entry for REGMAP_ERR_ENTRY, may be NULL
+ */
+regmap_status_t regmap_parse(const uint8_t *blob, size_t len, regmap_t *map, uint8_t *bad_entry);
+
+/**
+ * @brief Packs a map into a blob
+ * @returns bytes written, or 0 if the map is invalid or does not fit in len
+ */
+size_t regmap_encode(const regmap_t *map, uint8_t *blob, size_t len);
+
+/**
+ * @brief Checks the fields of one entry and fills in its scale and decoder. The name must not
+ * be empty, and the name and unit may only hold printable ASCII other than '"' and '\\'.
+ * @returns true if the entry is usable
+ */
+bool regmap_param_check(regmap_param_t *param);
+
+/**
+ * @brief Name of a status for logging
+ */
+const char *regmap_status_name(regmap_status_t status);
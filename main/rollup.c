@@ -0,0 +1,112 @@
+/*
+    Streaming min/max/mean rollups
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <math.h>
+#include "rollup.h"
+
+static const uint32_t rollup_periods[ROLLUP_COUNT] = {
+    [ROLLUP_1M] = 60,
+    [ROLLUP_15M] = 15 * 60,
+    [ROLLUP_1H] = 60 * 60,
+};
+
+static void window_reset(rollup_window_t *window, uint16_t count, uint32_t start)
+{
+    window->current.start = start;
+    window->current.period = window->period;
+    window->current.count = count;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        rollup_agg_t *agg = &window->current.aggs[i];
+        agg->min = INFINITY;
+        agg->max = -INFINITY;
+        agg->sum = 0.0f;
+        agg->count = 0;
+    }
+}
+
+void rollup_init(rollup_set_t *set, uint16_t count)
+{
+    memset(set, 0, sizeof(rollup_set_t));
+    set->count = (count > ROLLUP_MAX_VALUES) ? ROLLUP_MAX_VALUES : count;
+    for (int r = 0; r < ROLLUP_COUNT; r++)
+    {
+        set->windows[r].period = rollup_periods[r];
+    }
+}
+
+void rollup_add(rollup_set_t *set, uint32_t ts, const float *values, uint32_t valid)
+{
+    for (int r = 0; r < ROLLUP_COUNT; r++)
+    {
+        rollup_window_t *window = &set->windows[r];
+        uint32_t start = ts - (ts % window->period);
+
+        if (!window->open)
+        {
+            window_reset(window, set->count, start);
+            window->open = true;
+        }
+        else if (start != window->current.start)
+        {
+            // The reading is in a new window (or the clock was set): close the current one
+            uint32_t seq = window->completed.seq + 1;
+            window->completed = window->current;
+            window->completed.seq = seq;
+            window_reset(window, set->count, start);
+        }
+
+        for (uint16_t i = 0; i < set->count; i++)
+        {
+            if (!(valid & (1UL << i)))
+            {
+                continue;
+            }
+            rollup_agg_t *agg = &window->current.aggs[i];
+            if (values[i] < agg->min)
+            {
+                agg->min = values[i];
+            }
+            if (values[i] > agg->max)
+            {
+                agg->max = values[i];
+            }
+            agg->sum += values[i];
+            agg->count++;
+        }
+    }
+}
+
+bool rollup_get(const rollup_set_t *set, rollup_res_t res, rollup_result_t *result)
+{
+    if ((res >= ROLLUP_COUNT) || (set->windows[res].completed.seq == 0))
+    {
+        return false;
+    }
+    *result = set->windows[res].completed;
+    return true;
+}
+
+float rollup_mean(const rollup_agg_t *agg)
+{
+    return agg->count ? agg->sum / agg->count : NAN;
+}
+
+const char *rollup_res_name(rollup_res_t res)
+{
+    switch (res)
+    {
+        case ROLLUP_1M:
+            return "1m";
+        case ROLLUP_15M:
+            return "15m";
+        case ROLLUP_1H:
+            return "1h";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,95 @@
+/*
+    Streaming min/max/mean rollups
+
+    Aggregates every reading into fixed, clock aligned windows of 1 minute, 15 minutes and
+    1 hour. Each window keeps a running min, max, sum and count per CID, so adding a sample is
+    O(1) and the memory is fixed. When a sample lands in a new window the current one is
+    closed and kept as the completed aggregate for that resolution, which publishers pick up.
+
+    This is plain C with no ESP-IDF dependencies. The caller provides the locking.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Values per sample a rollup can hold
+#define ROLLUP_MAX_VALUES (8)
+
+typedef enum
+{
+    ROLLUP_1M = 0,
+    ROLLUP_15M,
+    ROLLUP_1H,
+    ROLLUP_COUNT
+} rollup_res_t;
+
+/**
+ * Aggregate of one value over a window
+ */
+typedef struct
+{
+    float min;
+    float max;
+    float sum;
+    uint32_t count;             // Readings in the window, 0 if the value was never read
+} rollup_agg_t;
+
+/**
+ * A closed window
+ */
+typedef struct
+{
+    uint32_t start;             // Start of the window (seconds)
+    uint32_t period;            // Length of the window (seconds)
+    uint32_t seq;               // Incremented each time a window closes, 0 before the first
+    uint16_t count;             // Values in aggs[]
+    rollup_agg_t aggs[ROLLUP_MAX_VALUES];
+} rollup_result_t;
+
+typedef struct
+{
+    uint32_t period;
+    bool open;                  // A sample has been added to the current window
+    rollup_result_t current;
+    rollup_result_t completed;
+} rollup_window_t;
+
+typedef struct
+{
+    uint16_t count;             // Values per sample
+    rollup_window_t windows[ROLLUP_COUNT];
+} rollup_set_t;
+
+/**
+ * @brief Sets up the windows for count values per sample
+ */
+void rollup_init(rollup_set_t *set, uint16_t count);
+
+/**
+ * @brief Adds a reading to every window
+ * @param set - rollups
+ * @param ts - time of the reading in seconds
+ * @param values - count values
+ * @param valid - bit i set if values[i] was read
+ */
+void rollup_add(rollup_set_t *set, uint32_t ts, const float *values, uint32_t valid);
+
+/**
+ * @brief Returns the last closed window of a resolution
+ * @returns false if no window of that resolution has closed yet
+ */
+bool rollup_get(const rollup_set_t *set, rollup_res_t res, rollup_result_t *result);
+
+/**
+ * @brief Mean of an aggregate, NAN if there were no readings
+ */
+float rollup_mean(const rollup_agg_t *agg);
+
+/**
+ * @brief Name of a resolution for logging
+ */
+const char *rollup_res_name(rollup_res_t res);
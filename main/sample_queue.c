@@ -0,0 +1,477 @@
+/*
+    Store-and-forward sample queue
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "sdkconfig.h"
+#include "sample_queue.h"
+
+#ifdef CONFIG_THINKSPEAK_ENABLE
+
+// Sample was recovered from flash after a reboot, its boot relative time is meaningless now
+#define SAMPLE_FLAG_PREV_BOOT   (0x8000)
+
+// Any time before this means the clock has not been set yet (2020-01-01)
+#define EPOCH_VALID_AFTER       (1577836800L)
+
+void sample_stamp(sample_t *sample)
+{
+    time_t now = time(NULL);
+    if (now > EPOCH_VALID_AFTER)
+    {
+        sample->time = (uint32_t)now;
+        sample->flags |= SAMPLE_FLAG_EPOCH;
+    }
+    else
+    {
+        sample->time = xTaskGetTickCount() / configTICK_RATE_HZ;
+        sample->flags &= ~SAMPLE_FLAG_EPOCH;
+    }
+}
+
+void sample_stamp_at(sample_t *sample, uint32_t when)
+{
+    if (when > EPOCH_VALID_AFTER)
+    {
+        sample->time = when;
+        sample->flags |= SAMPLE_FLAG_EPOCH;
+        return;
+    }
+    // Before the clock was set time() counts from boot, place the sample by its age
+    time_t now = time(NULL);
+    uint32_t uptime = xTaskGetTickCount() / configTICK_RATE_HZ;
+    uint32_t age = ((uint32_t)now >= when) ? (uint32_t)now - when : 0;
+    if ((now > EPOCH_VALID_AFTER) || (age > uptime))
+    {
+        // The clock has been set since, so the age is unknown
+        age = 0;
+    }
+    sample->time = uptime - age;
+    sample->flags &= ~SAMPLE_FLAG_EPOCH;
+}
+
+bool sample_epoch_time(const sample_t *sample, uint32_t *epoch)
+{
+    if (sample->flags & SAMPLE_FLAG_EPOCH)
+    {
+        *epoch = sample->time;
+        return true;
+    }
+    time_t now = time(NULL);
+    if ((sample->flags & SAMPLE_FLAG_PREV_BOOT) || (now <= EPOCH_VALID_AFTER))
+    {
+        return false;
+    }
+    // Boot relative: work back from the current uptime
+    uint32_t uptime = xTaskGetTickCount() / configTICK_RATE_HZ;
+    *epoch = (uint32_t)now - (uptime - sample->time);
+    return true;
+}
+
+// With fan-out the samples go to the shared ring in fanout.c instead
+#ifndef CONFIG_PUBLISH_FANOUT
+
+static sample_t ring[CONFIG_SAMPLE_QUEUE_LEN];
+static uint32_t ring_head = 0;          // Oldest sample
+static uint32_t ring_count = 0;
+static uint32_t next_seq = 0;           // Sequence number of the next sample pushed
+static sample_queue_stats_t stats;
+
+#ifdef CONFIG_SAMPLE_QUEUE_FLASH_SPILL
+
+static const char *TAG = "SAMPLEQ";
+
+// Partition holding the spill area (type 0x40, see partitions_hap.csv)
+#define SPILL_PARTITION_TYPE    (0x40)
+#define SPILL_PARTITION_NAME    "samples"
+#define SPILL_SECTOR_SIZE       (4096)
+#define SPILL_ERASED            (0xFFFFFFFFUL)
+
+/*
+ * A sector is erased before it is written, so all the records in a sector have the same
+ * layout, and the first one tells which. Records of an older layout are still read (and
+ * converted) until they are sent, so an update does not lose the samples waiting in flash.
+ *
+ * Layout 1, up to 4 values: the sample_t of the first builds, 32 bytes.
+ * Layout 2: has SPILL_MAGIC_V2 after the sent marker, 64 bytes. A time of SPILL_MAGIC_V2 is
+ * in 1996, or 26 years of uptime, so a layout 1 record can't be mistaken for it.
+ */
+#define SPILL_MAGIC_V2          (0x324C5053UL)  // "SPL2"
+#define SPILL_V1_VALUES         (4)
+#define SPILL_V2_SIZE           (64)
+#define SPILL_V2_VALUES         ((SPILL_V2_SIZE - 20) / sizeof(float))
+
+typedef enum
+{
+    SPILL_LAYOUT_V1 = 1,
+    SPILL_LAYOUT_V2,
+} spill_layout_t;
+
+typedef struct
+{
+    uint32_t seq;               // Sequence number of the sample, SPILL_ERASED for an empty slot
+    uint32_t sent;              // SPILL_ERASED until sent, then cleared to 0 without an erase
+    uint32_t time;
+    uint16_t flags;
+    uint16_t count;
+    float values[SPILL_V1_VALUES];
+} spill_record_v1_t;
+
+typedef struct
+{
+    uint32_t seq;               // As in layout 1
+    uint32_t sent;
+    uint32_t magic;             // SPILL_MAGIC_V2
+    uint32_t time;
+    uint16_t flags;
+    uint16_t count;
+    float values[SPILL_V2_VALUES];
+} spill_record_t;
+
+_Static_assert(sizeof(spill_record_v1_t) == 32, "Layout 1 is fixed");
+_Static_assert(sizeof(spill_record_t) == SPILL_V2_SIZE, "Layout 2 is fixed");
+_Static_assert(SPILL_SECTOR_SIZE % sizeof(spill_record_t) == 0, "Spill records must not straddle sectors");
+_Static_assert(SAMPLE_MAX_VALUES <= SPILL_V2_VALUES, "Samples no longer fit in a spill record, add a layout");
+_Static_assert(offsetof(spill_record_t, sent) == offsetof(spill_record_v1_t, sent), "Sent is marked in the same place in every layout");
+
+// Slots are numbered sector * SPILL_SLOT_STRIDE + record, so each sector can hold its own layout
+#define SPILL_SLOT_STRIDE       (SPILL_SECTOR_SIZE / sizeof(spill_record_v1_t))
+#define SPILL_MAX_SECTORS       (64)
+
+static const esp_partition_t *spill_partition = NULL;
+static uint32_t spill_sectors = 0;
+static uint8_t sector_layout[SPILL_MAX_SECTORS];
+static uint32_t spill_read = 0;         // Slot of the oldest unsent record
+static uint32_t spill_write = 0;        // Slot the next record goes to
+static uint32_t spill_boot_seq = 0;     // First sequence number pushed since boot
+
+static size_t spill_record_size(uint32_t sector)
+{
+    return (sector_layout[sector] == SPILL_LAYOUT_V1) ? sizeof(spill_record_v1_t) : sizeof(spill_record_t);
+}
+
+static uint32_t spill_per_sector(uint32_t sector)
+{
+    return SPILL_SECTOR_SIZE / spill_record_size(sector);
+}
+
+static uint32_t spill_offset(uint32_t slot)
+{
+    uint32_t sector = slot / SPILL_SLOT_STRIDE;
+    return sector * SPILL_SECTOR_SIZE + (slot % SPILL_SLOT_STRIDE) * spill_record_size(sector);
+}
+
+static uint32_t spill_sector_start(uint32_t sector)
+{
+    return (sector % spill_sectors) * SPILL_SLOT_STRIDE;
+}
+
+static uint32_t spill_next(uint32_t slot)
+{
+    uint32_t sector = slot / SPILL_SLOT_STRIDE;
+    if ((slot % SPILL_SLOT_STRIDE) + 1 < spill_per_sector(sector))
+    {
+        return slot + 1;
+    }
+    return spill_sector_start(sector + 1);
+}
+
+/**
+ * @brief Reads a record of either layout into the current one
+ */
+static esp_err_t spill_read_record(uint32_t slot, spill_record_t *record)
+{
+    if (sector_layout[slot / SPILL_SLOT_STRIDE] != SPILL_LAYOUT_V1)
+    {
+        return esp_partition_read(spill_partition, spill_offset(slot), record, sizeof(spill_record_t));
+    }
+    spill_record_v1_t old;
+    esp_err_t err = esp_partition_read(spill_partition, spill_offset(slot), &old, sizeof(old));
+    memset(record, 0, sizeof(spill_record_t));
+    record->seq = old.seq;
+    record->sent = old.sent;
+    record->magic = SPILL_MAGIC_V2;
+    record->time = old.time;
+    record->flags = old.flags;
+    record->count = (old.count < SPILL_V1_VALUES) ? old.count : SPILL_V1_VALUES;
+    memcpy(record->values, old.values, sizeof(old.values));
+    return err;
+}
+
+/**
+ * @brief Steps to the next record to send. The rest of an older layout sector is left empty
+ * after an update (see spill_recover()), so empty slots before spill_write are skipped.
+ */
+static uint32_t spill_next_record(uint32_t slot)
+{
+    spill_record_t record;
+    slot = spill_next(slot);
+    while ((slot != spill_write) && (spill_read_record(slot, &record) == ESP_OK) && (record.seq == SPILL_ERASED))
+    {
+        slot = spill_next(slot);
+    }
+    return slot;
+}
+
+/**
+ * @brief Tells the layout of a sector from its first record. An erased sector is written in
+ * the current layout.
+ */
+static spill_layout_t spill_detect_layout(uint32_t sector)
+{
+    spill_record_t first;
+    if ((esp_partition_read(spill_partition, sector * SPILL_SECTOR_SIZE, &first, sizeof(first)) != ESP_OK) ||
+        (first.seq == SPILL_ERASED) || (first.magic == SPILL_MAGIC_V2))
+    {
+        return SPILL_LAYOUT_V2;
+    }
+    return SPILL_LAYOUT_V1;
+}
+
+/**
+ * @brief Scans the spill area for the unsent records left from before a reboot
+ */
+static void spill_recover(void)
+{
+    spill_record_t record;
+    uint32_t max_seq = 0, oldest_unsent_seq = SPILL_ERASED;
+    uint32_t old_layout = 0;
+    bool found = false;
+
+    for (uint32_t sector = 0; sector < spill_sectors; sector++)
+    {
+        sector_layout[sector] = spill_detect_layout(sector);
+    }
+    for (uint32_t sector = 0; sector < spill_sectors; sector++)
+    {
+        for (uint32_t i = 0; i < spill_per_sector(sector); i++)
+        {
+            uint32_t slot = sector * SPILL_SLOT_STRIDE + i;
+            if ((spill_read_record(slot, &record) != ESP_OK) || (record.seq == SPILL_ERASED))
+            {
+                continue;
+            }
+            if (!found || (record.seq > max_seq))
+            {
+                max_seq = record.seq;
+                spill_write = spill_next(slot);
+                found = true;
+            }
+            if (record.sent == SPILL_ERASED)
+            {
+                stats.spilled++;
+                old_layout += (sector_layout[sector] == SPILL_LAYOUT_V1);
+                if (record.seq < oldest_unsent_seq)
+                {
+                    oldest_unsent_seq = record.seq;
+                    spill_read = slot;
+                }
+            }
+        }
+    }
+    if ((spill_write % SPILL_SLOT_STRIDE != 0) && (sector_layout[spill_write / SPILL_SLOT_STRIDE] == SPILL_LAYOUT_V1))
+    {
+        // New records can't go in the rest of an older layout sector, start the next one
+        spill_write = spill_sector_start(spill_write / SPILL_SLOT_STRIDE + 1);
+    }
+    // Samples are spilled in push order, so new ones carry on after the newest in flash
+    next_seq = found ? max_seq + 1 : 0;
+    spill_boot_seq = next_seq;
+    if (stats.spilled == 0)
+    {
+        spill_read = spill_write;
+    }
+    ESP_LOGI(TAG, "Spill area: %u sectors, %u unsent samples recovered (%u in an older layout)",
+                    spill_sectors, stats.spilled, old_layout);
+}
+
+/**
+ * @brief Appends a sample to the spill area. Entering a new sector erases it, losing any
+ * unsent samples still in it (the area is full).
+ */
+static bool spill_push(const sample_t *sample)
+{
+    if (spill_partition == NULL)
+    {
+        return false;
+    }
+    uint32_t sector = spill_write / SPILL_SLOT_STRIDE;
+    if (spill_write % SPILL_SLOT_STRIDE == 0)
+    {
+        if ((stats.spilled > 0) && (spill_read / SPILL_SLOT_STRIDE == sector))
+        {
+            uint32_t lost = 0;
+            spill_record_t record;
+            for (uint32_t i = spill_read % SPILL_SLOT_STRIDE; i < spill_per_sector(sector); i++)
+            {
+                if ((spill_read_record(sector * SPILL_SLOT_STRIDE + i, &record) == ESP_OK) &&
+                    (record.seq != SPILL_ERASED) && (record.sent == SPILL_ERASED))
+                {
+                    lost++;
+                }
+            }
+            lost = (lost < stats.spilled) ? lost : stats.spilled;
+            ESP_LOGW(TAG, "Spill area full, dropping %u oldest samples", lost);
+            stats.dropped += lost;
+            stats.spilled -= lost;
+            spill_read = (stats.spilled > 0) ? spill_sector_start(sector + 1) : spill_write;
+        }
+        if (esp_partition_erase_range(spill_partition, sector * SPILL_SECTOR_SIZE, SPILL_SECTOR_SIZE) != ESP_OK)
+        {
+            return false;
+        }
+        sector_layout[sector] = SPILL_LAYOUT_V2;
+    }
+    spill_record_t record = {
+        .seq = sample->seq,
+        .sent = SPILL_ERASED,
+        .magic = SPILL_MAGIC_V2,
+        .time = sample->time,
+        .flags = sample->flags,
+        .count = sample->count,
+    };
+    memcpy(record.values, sample->values, sizeof(sample->values));
+    if (esp_partition_write(spill_partition, spill_offset(spill_write), &record, sizeof(record)) != ESP_OK)
+    {
+        return false;
+    }
+    if (stats.spilled == 0)
+    {
+        spill_read = spill_write;
+    }
+    spill_write = spill_next(spill_write);
+    stats.spilled++;
+    return true;
+}
+
+static void spill_pop(void)
+{
+    uint32_t sent = 0;
+    esp_partition_write(spill_partition, spill_offset(spill_read) + offsetof(spill_record_t, sent), &sent, sizeof(sent));
+    stats.spilled--;
+    spill_read = (stats.spilled > 0) ? spill_next_record(spill_read) : spill_write;
+}
+
+#endif
+
+esp_err_t sample_queue_init(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    ring_head = 0;
+    ring_count = 0;
+    next_seq = 0;
+#ifdef CONFIG_SAMPLE_QUEUE_FLASH_SPILL
+    spill_partition = esp_partition_find_first(SPILL_PARTITION_TYPE, ESP_PARTITION_SUBTYPE_ANY, SPILL_PARTITION_NAME);
+    if (spill_partition == NULL)
+    {
+        ESP_LOGE(TAG, "No '%s' partition, samples will not be spilled to flash", SPILL_PARTITION_NAME);
+        return ESP_ERR_NOT_FOUND;
+    }
+    spill_sectors = spill_partition->size / SPILL_SECTOR_SIZE;
+    if (spill_sectors > SPILL_MAX_SECTORS)
+    {
+        spill_sectors = SPILL_MAX_SECTORS;
+    }
+    spill_recover();
+#endif
+    return ESP_OK;
+}
+
+void sample_queue_push(const sample_t *sample)
+{
+    stats.pushed++;
+    if (ring_count == CONFIG_SAMPLE_QUEUE_LEN)
+    {
+        // Full: make room by moving the oldest sample to flash, or dropping it
+#ifdef CONFIG_SAMPLE_QUEUE_FLASH_SPILL
+        if (!spill_push(&ring[ring_head]))
+#endif
+        {
+            stats.dropped++;
+        }
+        ring_head = (ring_head + 1) % CONFIG_SAMPLE_QUEUE_LEN;
+        ring_count--;
+    }
+    sample_t *slot = &ring[(ring_head + ring_count) % CONFIG_SAMPLE_QUEUE_LEN];
+    *slot = *sample;
+    slot->seq = next_seq++;
+    ring_count++;
+}
+
+uint32_t sample_queue_peek(sample_t *samples, uint32_t max)
+{
+    uint32_t n = 0;
+#ifdef CONFIG_SAMPLE_QUEUE_FLASH_SPILL
+    uint32_t slot = spill_read;
+    for (uint32_t i = 0; (i < stats.spilled) && (n < max); i++)
+    {
+        spill_record_t record;
+        if (spill_read_record(slot, &record) != ESP_OK)
+        {
+            return n;
+        }
+        memset(&samples[n], 0, sizeof(sample_t));
+        samples[n].time = record.time;
+        samples[n].seq = record.seq;
+        samples[n].flags = record.flags;
+        samples[n].count = (record.count < SAMPLE_MAX_VALUES) ? record.count : SAMPLE_MAX_VALUES;
+        memcpy(samples[n].values, record.values, samples[n].count * sizeof(float));
+        if (record.seq < spill_boot_seq)
+        {
+            samples[n].flags |= SAMPLE_FLAG_PREV_BOOT;
+        }
+        n++;
+        slot = spill_next_record(slot);
+    }
+#endif
+    for (uint32_t i = 0; (i < ring_count) && (n < max); i++)
+    {
+        samples[n++] = ring[(ring_head + i) % CONFIG_SAMPLE_QUEUE_LEN];
+    }
+    return n;
+}
+
+bool sample_queue_front(sample_t *sample)
+{
+    return sample_queue_peek(sample, 1) == 1;
+}
+
+void sample_queue_pop(void)
+{
+#ifdef CONFIG_SAMPLE_QUEUE_FLASH_SPILL
+    if (stats.spilled > 0)
+    {
+        spill_pop();
+        stats.sent++;
+        return;
+    }
+#endif
+    if (ring_count > 0)
+    {
+        ring_head = (ring_head + 1) % CONFIG_SAMPLE_QUEUE_LEN;
+        ring_count--;
+        stats.sent++;
+    }
+}
+
+uint32_t sample_queue_count(void)
+{
+    return ring_count + stats.spilled;
+}
+
+void sample_queue_get_stats(sample_queue_stats_t *out)
+{
+    *out = stats;
+    out->queued = ring_count;
+}
+
+#endif
+#endif
@@ -0,0 +1,113 @@
+/*
+    Store-and-forward sample queue
+
+    Bounded queue of timestamped samples that keeps collecting while WiFi or the broker is
+    down and is drained when the connection returns. Samples live in a fixed size RAM ring
+    (CONFIG_SAMPLE_QUEUE_LEN entries). With CONFIG_SAMPLE_QUEUE_FLASH_SPILL, samples that
+    would be pushed out of a full ring are spilled to the "samples" flash partition instead
+    of being dropped. The spill area is a circular log that survives a reboot. Once a spilled
+    sample is sent it is marked by clearing bits, so no extra erase is needed. Spill records
+    are versioned per flash sector, so samples spilled by an older build are still sent after
+    an update.
+
+    Samples always come out oldest first (flash, then RAM). The queue is not thread safe, the
+    producer and consumer must be the same task.
+
+    With CONFIG_PUBLISH_FANOUT the queue is not built and samples go to fanout.h instead;
+    sample_t, sample_stamp() and sample_epoch_time() are used by both.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Number of values stored per sample
+#define SAMPLE_MAX_VALUES (8)
+
+// The sample time is in seconds since the epoch (the clock was set when it was taken),
+// otherwise it is seconds since boot
+#define SAMPLE_FLAG_EPOCH (0x0001)
+
+typedef struct
+{
+    uint32_t time;              // See SAMPLE_FLAG_EPOCH
+    uint32_t seq;               // Queue sequence number, set by sample_queue_push()
+    uint16_t flags;
+    uint16_t count;             // Number of valid values
+    float values[SAMPLE_MAX_VALUES];
+} sample_t;
+
+typedef struct
+{
+    uint32_t queued;            // Samples in RAM
+    uint32_t spilled;           // Samples waiting in flash
+    uint32_t pushed;            // Total samples added
+    uint32_t sent;              // Total samples removed after sending
+    uint32_t dropped;           // Samples lost because RAM and flash were full
+} sample_queue_stats_t;
+
+/**
+ * @brief Sets up the queue and recovers any unsent samples from the flash spill area
+ * @returns ESP_OK, or an error if the spill partition is missing (the RAM queue still works)
+ */
+esp_err_t sample_queue_init(void);
+
+/**
+ * @brief Fills in a sample's timestamp with the current time
+ */
+void sample_stamp(sample_t *sample);
+
+/**
+ * @brief Fills in a sample's timestamp with an earlier time
+ * @param sample - sample
+ * @param when - time the sample belongs to, as returned by time()
+ */
+void sample_stamp_at(sample_t *sample, uint32_t when);
+
+/**
+ * @brief Adds a sample. When RAM is full the oldest sample is spilled to flash, or dropped
+ * if there is no spill area (or it is also full). The queued copy gets the next sequence
+ * number, which it keeps in flash and across a reboot, so a sample read with
+ * sample_queue_peek() can be told apart from any other.
+ */
+void sample_queue_push(const sample_t *sample);
+
+/**
+ * @brief Returns the oldest sample without removing it
+ * @returns false if the queue is empty
+ */
+bool sample_queue_front(sample_t *sample);
+
+/**
+ * @brief Copies up to max of the oldest samples, oldest first, without removing them
+ * @returns number of samples copied
+ */
+uint32_t sample_queue_peek(sample_t *samples, uint32_t max);
+
+/**
+ * @brief Removes the oldest sample, call once it has been sent
+ */
+void sample_queue_pop(void);
+
+/**
+ * @brief Number of samples waiting (RAM and flash)
+ */
+uint32_t sample_queue_count(void);
+
+/**
+ * @brief Converts a sample time to seconds since the epoch
+ * @param sample - sample
+ * @param epoch - set to the time of the sample
+ * @returns false if the time cannot be worked out (the clock is not set, or the sample is from
+ * before a reboot and was taken before the clock was set)
+ */
+bool sample_epoch_time(const sample_t *sample, uint32_t *epoch);
+
+/**
+ * @brief Returns the queue counters
+ */
+void sample_queue_get_stats(sample_queue_stats_t *stats);
@@ -0,0 +1,70 @@
+/*
+    Shared sample ring
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "sample_ring.h"
+
+void sample_ring_init(sample_ring_t *ring, sample_t *slots, uint32_t size)
+{
+    ring->slots = slots;
+    ring->size = size;
+    ring->head = 0;
+}
+
+void sample_ring_push(sample_ring_t *ring, const sample_t *sample)
+{
+    // Only the writer changes head, so a plain read is fine here
+    uint32_t head = ring->head;
+
+    // Readers that see any of the new sample must also see the head that made its slot
+    // unreadable, see the check in sample_ring_peek()
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&ring->slots[head % ring->size], sample, sizeof(sample_t));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void sample_cursor_init(const sample_ring_t *ring, sample_cursor_t *cursor)
+{
+    memset(cursor, 0, sizeof(sample_cursor_t));
+    cursor->next = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+bool sample_ring_peek(const sample_ring_t *ring, sample_cursor_t *cursor, sample_t *sample)
+{
+    while (1)
+    {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == cursor->next)
+        {
+            return false;
+        }
+        if (head - cursor->next > ring->size - 1)
+        {
+            // Lapped: skip to the oldest sample still in the ring
+            uint32_t oldest = head - (ring->size - 1);
+            cursor->dropped += oldest - cursor->next;
+            cursor->next = oldest;
+        }
+        memcpy(sample, &ring->slots[cursor->next % ring->size], sizeof(sample_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // The slot is only rewritten once head has moved a whole ring past the sample
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - cursor->next < ring->size)
+        {
+            return true;
+        }
+    }
+}
+
+void sample_ring_advance(sample_cursor_t *cursor)
+{
+    cursor->next++;
+    cursor->sent++;
+}
+
+uint32_t sample_ring_lag(const sample_ring_t *ring, const sample_cursor_t *cursor)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - cursor->next;
+}
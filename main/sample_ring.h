@@ -0,0 +1,74 @@
+/*
+    Shared sample ring
+
+    One producer, any number of consumers. The MQTT task writes each sample once; every consumer
+    (publish sink) reads through its own cursor at its own pace and the ring never waits for
+    any of them. A consumer that falls more than a ring behind loses its oldest unread samples,
+    which are counted as dropped on its cursor; the others are not affected.
+
+    Samples are numbered by a free-running 32 bit sequence. head is the number of the next
+    sample written, so a cursor's lag is head - next. The writer fills slot head % size and
+    then bumps head, so the slot being written is never one a reader may take: a ring of
+    size slots holds size - 1 readable samples. A reader copies its sample without a lock and
+    checks head again afterwards; if the writer came round onto that slot meanwhile the copy
+    is thrown away and the reader skips ahead, as in snapshot.c.
+
+    Only one task may call sample_ring_push(). Each cursor belongs to one task.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sample_queue.h"
+
+typedef struct
+{
+    sample_t *slots;
+    uint32_t size;              // Slots; size - 1 samples can be waiting
+    uint32_t head;              // Sequence number of the next sample written
+} sample_ring_t;
+
+typedef struct
+{
+    uint32_t next;              // Sequence number of the next sample to read
+    uint32_t sent;              // Samples taken with sample_ring_advance()
+    uint32_t dropped;           // Samples overwritten before they were read
+} sample_cursor_t;
+
+/**
+ * @brief Sets up an empty ring over caller provided storage
+ * @param slots - storage for size samples
+ * @param size - number of slots, at least 2
+ */
+void sample_ring_init(sample_ring_t *ring, sample_t *slots, uint32_t size);
+
+/**
+ * @brief Adds a sample, overwriting the oldest one if the ring is full
+ */
+void sample_ring_push(sample_ring_t *ring, const sample_t *sample);
+
+/**
+ * @brief Starts a cursor at the next sample to be written
+ */
+void sample_cursor_init(const sample_ring_t *ring, sample_cursor_t *cursor);
+
+/**
+ * @brief Copies the cursor's next sample without taking it. Samples it has lost to the
+ * writer are skipped and counted as dropped.
+ * @returns false if the cursor has read everything
+ */
+bool sample_ring_peek(const sample_ring_t *ring, sample_cursor_t *cursor, sample_t *sample);
+
+/**
+ * @brief Takes the sample returned by sample_ring_peek(), call once it has been sent
+ */
+void sample_ring_advance(sample_cursor_t *cursor);
+
+/**
+ * @brief Number of samples written that the cursor has not taken, including any it is about
+ * to lose
+ */
+uint32_t sample_ring_lag(const sample_ring_t *ring, const sample_cursor_t *cursor);
@@ -0,0 +1,43 @@
+/*
+    Built-in sensor map
+
+    The XY-MD02 registers, defined once. Each X() line generates:
+
+    - the CID enum,
+    - an entry of the built-in register map (regmap.c), a const table with the decoder for
+      the register type picked at compile time,
+    - a field of sensor_values_t, the values by name (see modbus_get_values()),
+
+    and static checks that they agree (regmap.c, modbus.c).
+
+        X(cid, field, name, unit, area, reg, type, scale_exp)
+
+    area is INPUT or HOLDING. type is S16, U16, S32 or U32; the 32 bit types take two
+    registers, low word first. A value is the raw register value * 10^scale_exp.
+
+    This is plain C with no ESP-IDF dependencies.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#define SENSOR_MAP(X) \
+    X(CID_INP_DATA_TEMPERATURE, temperature, "Temperature", "C", INPUT, 0x0001, S16, -1) \
+    X(CID_INP_DATA_HUMIDITY,    humidity,    "Humidity",    "%", INPUT, 0x0002, S16, -1)
+
+#define SENSOR_MAP_CID(cid, field, name, unit, area, reg, type, scale_exp) cid,
+#define SENSOR_MAP_FIELD(cid, field, name, unit, area, reg, type, scale_exp) float field;
+
+// Enumeration of the CIDs the firmware knows by name. These are the first entries of every
+// register map; a map loaded from NVS may add more after them (see regmap.h).
+enum {
+    SENSOR_MAP(SENSOR_MAP_CID)
+    CID_COUNT,
+};
+
+// The built-in values by name
+typedef struct
+{
+    SENSOR_MAP(SENSOR_MAP_FIELD)
+} sensor_values_t;
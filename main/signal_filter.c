@@ -0,0 +1,112 @@
+/*
+    Signal conditioning
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include <math.h>
+#include "signal_filter.h"
+
+// Shortest time used for the rate check, so two readings close together are not rejected
+// for a change of one count
+#define SIGNAL_MIN_DT_MS (1000)
+
+void signal_filter_init(signal_filter_t *filter, const signal_filter_cfg_t *cfg)
+{
+    memset(filter, 0, sizeof(signal_filter_t));
+    filter->cfg = *cfg;
+    if (filter->cfg.median_n < 1)
+    {
+        filter->cfg.median_n = 1;
+    }
+    if (filter->cfg.median_n > SIGNAL_MEDIAN_MAX)
+    {
+        filter->cfg.median_n = SIGNAL_MEDIAN_MAX;
+    }
+    if ((filter->cfg.median_n & 1) == 0)
+    {
+        filter->cfg.median_n--;
+    }
+    if ((filter->cfg.ema_alpha <= 0.0f) || (filter->cfg.ema_alpha > 1.0f))
+    {
+        filter->cfg.ema_alpha = 1.0f;
+    }
+}
+
+float signal_median(const float *values, uint8_t count)
+{
+    // Insertion sort of a copy, the window is tiny
+    float sorted[SIGNAL_MEDIAN_MAX];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        float v = values[i];
+        int j = i - 1;
+        while ((j >= 0) && (sorted[j] > v))
+        {
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = v;
+    }
+    if (count & 1)
+    {
+        return sorted[count / 2];
+    }
+    return (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0f;
+}
+
+bool signal_filter_apply(signal_filter_t *filter, float raw, uint32_t now_ms, float *out)
+{
+    filter->samples++;
+
+    if (filter->primed && (filter->cfg.max_rate > 0.0f))
+    {
+        uint32_t dt_ms = now_ms - filter->last_ms;
+        if (dt_ms < SIGNAL_MIN_DT_MS)
+        {
+            dt_ms = SIGNAL_MIN_DT_MS;
+        }
+        float limit = filter->cfg.max_rate * dt_ms / 1000.0f;
+        if (fabsf(raw - filter->last_raw) > limit)
+        {
+            if (++filter->rejects <= filter->cfg.max_rejects)
+            {
+                filter->rejected++;
+                return false;
+            }
+            // Kept on arriving: a real step, restart the median and EMA at the new level
+            filter->steps++;
+            filter->window_fill = 0;
+            filter->window_pos = 0;
+            filter->primed = false;
+        }
+    }
+    filter->rejects = 0;
+    filter->last_raw = raw;
+    filter->last_ms = now_ms;
+
+    float value = raw;
+    if (filter->cfg.median_n > 1)
+    {
+        filter->window[filter->window_pos] = raw;
+        filter->window_pos = (filter->window_pos + 1) % filter->cfg.median_n;
+        if (filter->window_fill < filter->cfg.median_n)
+        {
+            filter->window_fill++;
+        }
+        value = signal_median(filter->window, filter->window_fill);
+    }
+
+    if (!filter->primed || (filter->cfg.ema_alpha >= 1.0f))
+    {
+        filter->ema = value;
+    }
+    else
+    {
+        filter->ema += filter->cfg.ema_alpha * (value - filter->ema);
+    }
+    filter->primed = true;
+    *out = filter->ema;
+    return true;
+}
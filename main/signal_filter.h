@@ -0,0 +1,73 @@
+/*
+    Signal conditioning
+
+    A fixed memory filter chain applied to each reading before it is published:
+
+    1. Rate of change rejection: a reading that moved further from the last accepted reading
+       than max_rate allows for the time between them is treated as a glitch and dropped. If
+       max_rejects readings in a row are rejected the new level is taken as a real step and
+       accepted, so a genuine jump cannot lock the filter out.
+    2. Median of the last median_n accepted readings (odd, up to SIGNAL_MEDIAN_MAX), which
+       removes single spikes that got past the rate check.
+    3. Exponential moving average with weight ema_alpha for the new reading (1 disables it).
+
+    Each stage can be turned off in the config. This is plain C with no ESP-IDF dependencies.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Longest median window
+#define SIGNAL_MEDIAN_MAX (9)
+
+typedef struct
+{
+    uint8_t median_n;           // Median window, 1 to disable
+    float ema_alpha;            // Weight of a new reading (0 < alpha <= 1), 1 to disable
+    float max_rate;             // Largest believable change per second, 0 to disable
+    uint8_t max_rejects;        // Rejections in a row before a step is accepted
+} signal_filter_cfg_t;
+
+typedef struct
+{
+    signal_filter_cfg_t cfg;
+    // Rate check
+    bool primed;
+    float last_raw;             // Last accepted reading
+    uint32_t last_ms;           // Time of the last accepted reading
+    uint8_t rejects;            // Rejections in a row
+    // Median
+    float window[SIGNAL_MEDIAN_MAX];
+    uint8_t window_pos;
+    uint8_t window_fill;
+    // EMA
+    float ema;
+    // Counters
+    uint32_t samples;           // Readings offered
+    uint32_t rejected;          // Readings dropped by the rate check
+    uint32_t steps;             // Steps accepted after max_rejects rejections
+} signal_filter_t;
+
+/**
+ * @brief Sets up a filter. The median window is clamped to an odd size up to SIGNAL_MEDIAN_MAX.
+ */
+void signal_filter_init(signal_filter_t *filter, const signal_filter_cfg_t *cfg);
+
+/**
+ * @brief Runs a reading through the chain
+ * @param filter - filter
+ * @param raw - decoded reading
+ * @param now_ms - time of the reading
+ * @param out - set to the filtered value when the reading is accepted
+ * @returns false if the reading was rejected as an outlier (out is not changed)
+ */
+bool signal_filter_apply(signal_filter_t *filter, float raw, uint32_t now_ms, float *out);
+
+/**
+ * @brief Median of up to SIGNAL_MEDIAN_MAX values (exposed for testing and benchmarks)
+ */
+float signal_median(const float *values, uint8_t count);
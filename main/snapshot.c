@@ -0,0 +1,67 @@
+/*
+    Sensor snapshot publication
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "snapshot.h"
+
+typedef struct
+{
+    uint32_t seq;               // Odd while the writer is filling the slot
+    sensor_snapshot_t data;
+} snapshot_slot_t;
+
+static snapshot_slot_t slots[2];
+static uint32_t latest = 0;     // Index of the slot holding the newest complete snapshot
+
+void snapshot_publish(const sensor_snapshot_t *snapshot)
+{
+    // Only the writer changes latest, so a plain read is fine here
+    uint32_t next = latest ^ 1;
+    snapshot_slot_t *slot = &slots[next];
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->data, snapshot, sizeof(sensor_snapshot_t));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&latest, next, __ATOMIC_RELEASE);
+}
+
+void snapshot_read(sensor_snapshot_t *snapshot)
+{
+    uint32_t index = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+    while (1)
+    {
+        const snapshot_slot_t *slot = &slots[index];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            // The writer has lapped us and is refilling this slot, the other one is complete
+            index ^= 1;
+            continue;
+        }
+        memcpy(snapshot, &slot->data, sizeof(sensor_snapshot_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return;
+        }
+        // Torn copy: start again from whichever slot is now the newest
+        index = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+    }
+}
+
+bool snapshot_get(uint16_t cid, snapshot_value_t *value)
+{
+    if (cid >= SNAPSHOT_MAX_VALUES)
+    {
+        return false;
+    }
+    sensor_snapshot_t snapshot;
+    snapshot_read(&snapshot);
+    *value = snapshot.values[cid];
+    return true;
+}
@@ -0,0 +1,423 @@
+/*
+    Local status server
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "threads.h"
+#include "modbus.h"
+#include "snapshot.h"
+#include "sample_queue.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "status_http.h"
+
+#ifdef CONFIG_STATUS_HTTP_ENABLE
+
+static const char *TAG = "STATUS";
+
+// Prefix of every Prometheus metric name
+#define PROM_PREFIX "temp_modbus_"
+
+typedef struct
+{
+    char buffer[CONFIG_STATUS_HTTP_BUFFER_LEN];
+    size_t len;
+    bool overflow;              // Something did not fit and was left out
+} page_t;
+
+static page_t metrics_page;
+static page_t status_page;
+// Snapshot cycle the pages were rendered from, and when
+static uint32_t rendered_cycle;
+static uint32_t rendered_ms;
+static bool rendered = false;
+// Oldest the pages may get before they are rendered again without a new poll, so the ages,
+// uptime and metrics on them keep moving between polls
+#define MAX_PAGE_AGE_MS (1000)
+static httpd_handle_t server = NULL;
+
+/**
+ * @brief Appends formatted text to a page. Once something does not fit, it and everything
+ * after it is left out, so the page is cut at the end of a piece rather than mid-number.
+ */
+static void append(page_t *page, const char *format, ...)
+{
+    va_list args;
+    size_t space = sizeof(page->buffer) - page->len;
+
+    if (page->overflow)
+    {
+        return;
+    }
+    va_start(args, format);
+    int n = vsnprintf(page->buffer + page->len, space, format, args);
+    va_end(args);
+    if ((n < 0) || ((size_t)n >= space))
+    {
+        page->buffer[page->len] = '\0';
+        page->overflow = true;
+        return;
+    }
+    page->len += n;
+}
+
+/**
+ * @brief Appends text as a quoted string. Quotes and backslashes are escaped and a newline
+ * becomes \n, which JSON strings and Prometheus label values both read back the same way;
+ * other control characters have no escape common to both and are replaced with a space.
+ * Register map names and units are checked for these at load, sink names are not.
+ */
+static void append_quoted(page_t *page, const char *text)
+{
+    char escaped[64];
+    size_t n = 0;
+
+    append(page, "\"");
+    for (; *text != '\0'; text++)
+    {
+        char c = *text;
+        if ((c == '"') || (c == '\\'))
+        {
+            escaped[n++] = '\\';
+            escaped[n++] = c;
+        }
+        else if (c == '\n')
+        {
+            escaped[n++] = '\\';
+            escaped[n++] = 'n';
+        }
+        else
+        {
+            escaped[n++] = ((unsigned char)c < ' ') ? ' ' : c;
+        }
+        if (n >= sizeof(escaped) - 3)
+        {
+            escaped[n] = '\0';
+            append(page, "%s", escaped);
+            n = 0;
+        }
+    }
+    escaped[n] = '\0';
+    append(page, "%s\"", escaped);
+}
+
+static uint32_t now_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static uint32_t uptime_s(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+/**
+ * @brief Writes the labels that identify a CID
+ */
+static void append_cid_labels(page_t *page, uint16_t cid)
+{
+    const regmap_param_t *param = modbus_cid_param(cid);
+    append(page, "{cid=\"%u\",name=", cid);
+    append_quoted(page, param ? param->name : "");
+    append(page, ",unit=");
+    append_quoted(page, param ? param->unit : "");
+    append(page, "}");
+}
+
+static void render_metrics(const sensor_snapshot_t *snapshot)
+{
+    page_t *page = &metrics_page;
+    uint32_t now = now_ms();
+
+    append(page, "# TYPE " PROM_PREFIX "uptime_seconds counter\n" PROM_PREFIX "uptime_seconds %u\n", uptime_s());
+    append(page, "# TYPE " PROM_PREFIX "heap_free_bytes gauge\n" PROM_PREFIX "heap_free_bytes %u\n", esp_get_free_heap_size());
+    append(page, "# TYPE " PROM_PREFIX "poll_cycles counter\n" PROM_PREFIX "poll_cycles %u\n", snapshot->cycle);
+
+    append(page, "# TYPE " PROM_PREFIX "sensor_value gauge\n");
+    for (uint16_t cid = 0; cid < snapshot->count; cid++)
+    {
+        if (snapshot->values[cid].quality & SNAPSHOT_QUALITY_VALID)
+        {
+            append(page, PROM_PREFIX "sensor_value");
+            append_cid_labels(page, cid);
+            append(page, " %0.02f\n", snapshot->values[cid].value);
+        }
+    }
+    append(page, "# TYPE " PROM_PREFIX "sensor_age_seconds gauge\n");
+    for (uint16_t cid = 0; cid < snapshot->count; cid++)
+    {
+        if (snapshot->values[cid].quality & SNAPSHOT_QUALITY_VALID)
+        {
+            append(page, PROM_PREFIX "sensor_age_seconds");
+            append_cid_labels(page, cid);
+            append(page, " %u\n", (now - snapshot->values[cid].timestamp_ms) / 1000);
+        }
+    }
+    append(page, "# TYPE " PROM_PREFIX "sensor_quality gauge\n");
+    for (uint16_t cid = 0; cid < snapshot->count; cid++)
+    {
+        append(page, PROM_PREFIX "sensor_quality");
+        append_cid_labels(page, cid);
+        append(page, " %u\n", snapshot->values[cid].quality);
+    }
+
+    append(page, "# TYPE " PROM_PREFIX "slave_up gauge\n");
+    const mb_health_t *health;
+    for (uint16_t i = 0; (health = modbus_slave_health(i)) != NULL; i++)
+    {
+        append(page, PROM_PREFIX "slave_up{slave=\"%u\",state=\"%s\"} %d\n", health->slave_addr,
+                        mb_health_state_name(health->state), health->state != MB_HEALTH_OFFLINE);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_transactions_total counter\n");
+    for (uint16_t i = 0; (health = modbus_slave_health(i)) != NULL; i++)
+    {
+        append(page, PROM_PREFIX "slave_transactions_total{slave=\"%u\"} %u\n", health->slave_addr, health->transactions);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_failures_total counter\n");
+    for (uint16_t i = 0; (health = modbus_slave_health(i)) != NULL; i++)
+    {
+        append(page, PROM_PREFIX "slave_failures_total{slave=\"%u\",type=\"timeout\"} %u\n", health->slave_addr, health->timeouts);
+        append(page, PROM_PREFIX "slave_failures_total{slave=\"%u\",type=\"crc\"} %u\n", health->slave_addr, health->crc_errors);
+        append(page, PROM_PREFIX "slave_failures_total{slave=\"%u\",type=\"invalid_response\"} %u\n", health->slave_addr,
+                        health->invalid_responses);
+        append(page, PROM_PREFIX "slave_failures_total{slave=\"%u\",type=\"error\"} %u\n", health->slave_addr, health->errors);
+    }
+
+    bus_sched_stats_t stats;
+    append(page, "# TYPE " PROM_PREFIX "slave_polls_total counter\n");
+    for (uint16_t i = 0; modbus_slave_stats(i, &stats); i++)
+    {
+        append(page, PROM_PREFIX "slave_polls_total{slave=\"%u\"} %u\n", stats.slave_addr, stats.polls);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_deadline_misses_total counter\n");
+    for (uint16_t i = 0; modbus_slave_stats(i, &stats); i++)
+    {
+        append(page, PROM_PREFIX "slave_deadline_misses_total{slave=\"%u\"} %u\n", stats.slave_addr, stats.deadline_misses);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_poll_rate_hz gauge\n");
+    for (uint16_t i = 0; modbus_slave_stats(i, &stats); i++)
+    {
+        append(page, PROM_PREFIX "slave_poll_rate_hz{slave=\"%u\",type=\"achieved\"} %0.04f\n", stats.slave_addr, stats.achieved_rate_hz);
+        append(page, PROM_PREFIX "slave_poll_rate_hz{slave=\"%u\",type=\"requested\"} %0.04f\n", stats.slave_addr, stats.requested_rate_hz);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_lateness_max_ms gauge\n");
+    for (uint16_t i = 0; modbus_slave_stats(i, &stats); i++)
+    {
+        append(page, PROM_PREFIX "slave_lateness_max_ms{slave=\"%u\"} %u\n", stats.slave_addr, stats.max_lateness_ms);
+    }
+    append(page, "# TYPE " PROM_PREFIX "slave_bus_time_ms gauge\n");
+    for (uint16_t i = 0; modbus_slave_stats(i, &stats); i++)
+    {
+        append(page, PROM_PREFIX "slave_bus_time_ms{slave=\"%u\"} %u\n", stats.slave_addr, stats.avg_busy_ms);
+    }
+
+#if defined(CONFIG_THINKSPEAK_ENABLE) && defined(CONFIG_PUBLISH_FANOUT)
+    fanout_sink_stats_t sink;
+    append(page, "# TYPE " PROM_PREFIX "sink_up gauge\n");
+    for (uint16_t i = 0; fanout_get_stats(i, &sink); i++)
+    {
+        append(page, PROM_PREFIX "sink_up{sink=");
+        append_quoted(page, sink.name);
+        append(page, "} %d\n", sink.ready);
+    }
+    append(page, "# TYPE " PROM_PREFIX "sink_lag gauge\n");
+    for (uint16_t i = 0; fanout_get_stats(i, &sink); i++)
+    {
+        append(page, PROM_PREFIX "sink_lag{sink=");
+        append_quoted(page, sink.name);
+        append(page, "} %u\n", sink.lag);
+    }
+    append(page, "# TYPE " PROM_PREFIX "samples_sent_total counter\n");
+    for (uint16_t i = 0; fanout_get_stats(i, &sink); i++)
+    {
+        append(page, PROM_PREFIX "samples_sent_total{sink=");
+        append_quoted(page, sink.name);
+        append(page, "} %u\n", sink.sent);
+    }
+    append(page, "# TYPE " PROM_PREFIX "samples_dropped_total counter\n");
+    for (uint16_t i = 0; fanout_get_stats(i, &sink); i++)
+    {
+        append(page, PROM_PREFIX "samples_dropped_total{sink=");
+        append_quoted(page, sink.name);
+        append(page, "} %u\n", sink.dropped);
+    }
+#elif defined(CONFIG_THINKSPEAK_ENABLE)
+    sample_queue_stats_t queue;
+    sample_queue_get_stats(&queue);
+    append(page, "# TYPE " PROM_PREFIX "sample_queue_length gauge\n" PROM_PREFIX "sample_queue_length{store=\"ram\"} %u\n"
+                    PROM_PREFIX "sample_queue_length{store=\"flash\"} %u\n", queue.queued, queue.spilled);
+    append(page, "# TYPE " PROM_PREFIX "samples_sent_total counter\n" PROM_PREFIX "samples_sent_total %u\n", queue.sent);
+    append(page, "# TYPE " PROM_PREFIX "samples_dropped_total counter\n" PROM_PREFIX "samples_dropped_total %u\n", queue.dropped);
+#endif
+
+#ifdef CONFIG_METRICS_ENABLE
+#define PROM_COUNTER(id, name) \
+    append(page, "# TYPE " PROM_PREFIX name "_total counter\n" PROM_PREFIX name "_total %u\n", METRIC_COUNTER_VALUE(id));
+#define PROM_GAUGE(id, name) \
+    append(page, "# TYPE " PROM_PREFIX name " gauge\n" PROM_PREFIX name " %d\n", METRIC_GAUGE_VALUE(id));
+#define PROM_SUMMARY(id, name, unit) \
+    if (metrics_get_hist(METRIC_##id, &hist)) \
+    { \
+        append(page, "# TYPE " PROM_PREFIX name " summary\n" \
+                        PROM_PREFIX name "{quantile=\"0.5\"} %u\n" PROM_PREFIX name "{quantile=\"0.99\"} %u\n" \
+                        PROM_PREFIX name "_sum %llu\n" PROM_PREFIX name "_count %u\n", \
+                        histogram_percentile(&hist, 500), histogram_percentile(&hist, 990), \
+                        (unsigned long long)hist.sum, hist.samples); \
+    }
+    histogram_t hist;
+    METRICS_MAP(PROM_COUNTER, PROM_GAUGE, PROM_SUMMARY)
+#endif
+}
+
+static void render_status(const sensor_snapshot_t *snapshot)
+{
+    page_t *page = &status_page;
+    uint32_t now = now_ms();
+
+    append(page, "{\"uptime\":%u,\"heap_free\":%u,\"cycle\":%u,\"sensors\":[", uptime_s(), esp_get_free_heap_size(), snapshot->cycle);
+    for (uint16_t cid = 0; cid < snapshot->count; cid++)
+    {
+        const regmap_param_t *param = modbus_cid_param(cid);
+        const snapshot_value_t *value = &snapshot->values[cid];
+        append(page, "%s{\"cid\":%u,\"name\":", cid ? "," : "", cid);
+        append_quoted(page, param ? param->name : "");
+        append(page, ",\"unit\":");
+        append_quoted(page, param ? param->unit : "");
+        append(page, ",\"quality\":%u,", value->quality);
+        if (value->quality & SNAPSHOT_QUALITY_VALID)
+        {
+            append(page, "\"value\":%0.02f,\"age\":%u}", value->value, (now - value->timestamp_ms) / 1000);
+        }
+        else
+        {
+            append(page, "\"value\":null,\"age\":null}");
+        }
+    }
+    append(page, "],\"slaves\":[");
+    const mb_health_t *health;
+    for (uint16_t i = 0; (health = modbus_slave_health(i)) != NULL; i++)
+    {
+        append(page, "%s{\"address\":%u,\"state\":\"%s\",\"transactions\":%u,\"timeouts\":%u,\"crc_errors\":%u,\"invalid_responses\":%u,\"errors\":%u,"
+                        "\"offline_events\":%u",
+                        i ? "," : "", health->slave_addr, mb_health_state_name(health->state), health->transactions,
+                        health->timeouts, health->crc_errors, health->invalid_responses, health->errors, health->offline_events);
+        bus_sched_stats_t stats;
+        if (modbus_slave_stats(i, &stats))
+        {
+            append(page, ",\"polls\":%u,\"deadline_misses\":%u,\"rate_hz\":%0.04f,\"requested_rate_hz\":%0.04f,\"max_lateness_ms\":%u,\"bus_time_ms\":%u",
+                            stats.polls, stats.deadline_misses, stats.achieved_rate_hz, stats.requested_rate_hz,
+                            stats.max_lateness_ms, stats.avg_busy_ms);
+        }
+        append(page, "}");
+    }
+    append(page, "]");
+#if defined(CONFIG_THINKSPEAK_ENABLE) && defined(CONFIG_PUBLISH_FANOUT)
+    fanout_sink_stats_t sink;
+    append(page, ",\"sinks\":[");
+    for (uint16_t i = 0; fanout_get_stats(i, &sink); i++)
+    {
+        append(page, "%s{\"name\":", i ? "," : "");
+        append_quoted(page, sink.name);
+        append(page, ",\"up\":%s,\"lag\":%u,\"sent\":%u,\"dropped\":%u}",
+                        sink.ready ? "true" : "false", sink.lag, sink.sent, sink.dropped);
+    }
+    append(page, "]");
+#elif defined(CONFIG_THINKSPEAK_ENABLE)
+    sample_queue_stats_t queue;
+    sample_queue_get_stats(&queue);
+    append(page, ",\"queue\":{\"ram\":%u,\"flash\":%u,\"sent\":%u,\"dropped\":%u}", queue.queued, queue.spilled, queue.sent, queue.dropped);
+#endif
+    append(page, "}\n");
+}
+
+/**
+ * @brief Renders both pages again if there has been a poll since they were last rendered, or
+ * they are older than MAX_PAGE_AGE_MS
+ */
+static void refresh(void)
+{
+    static sensor_snapshot_t snapshot;
+
+    snapshot_read(&snapshot);
+    if (rendered && (snapshot.cycle == rendered_cycle) && ((now_ms() - rendered_ms) < MAX_PAGE_AGE_MS))
+    {
+        return;
+    }
+    metrics_page.len = 0;
+    metrics_page.overflow = false;
+    render_metrics(&snapshot);
+    status_page.len = 0;
+    status_page.overflow = false;
+    render_status(&snapshot);
+    if ((metrics_page.overflow || status_page.overflow) && !rendered)
+    {
+        ESP_LOGW(TAG, "Status pages do not fit in %d bytes, some lines are left out", CONFIG_STATUS_HTTP_BUFFER_LEN);
+    }
+    rendered_cycle = snapshot.cycle;
+    rendered_ms = now_ms();
+    rendered = true;
+}
+
+static esp_err_t metrics_get_handler(httpd_req_t *req)
+{
+    refresh();
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    return httpd_resp_send(req, metrics_page.buffer, metrics_page.len);
+}
+
+static esp_err_t status_get_handler(httpd_req_t *req)
+{
+    refresh();
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, status_page.buffer, status_page.len);
+}
+
+static const httpd_uri_t metrics_uri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metrics_get_handler,
+};
+
+static const httpd_uri_t status_uri = {
+    .uri = "/status",
+    .method = HTTP_GET,
+    .handler = status_get_handler,
+};
+
+esp_err_t status_http_start(void)
+{
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_STATUS_HTTP_PORT;
+    // HomeKit runs its own server, keep clear of its control port
+    config.ctrl_port = CONFIG_STATUS_HTTP_PORT + 1;
+    config.task_priority = THREAD_STATUS_HTTP_PRIORITY;
+    config.stack_size = THREAD_STATUS_HTTP_STACKSIZE;
+    config.max_uri_handlers = 2;
+    // Scrapers open a connection per scrape, don't let idle ones use up the sockets
+    config.lru_purge_enable = true;
+
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Unable to start the status server: %s", esp_err_to_name(err));
+        return err;
+    }
+    httpd_register_uri_handler(server, &metrics_uri);
+    httpd_register_uri_handler(server, &status_uri);
+    ESP_LOGI(TAG, "Serving /metrics and /status on port %d", CONFIG_STATUS_HTTP_PORT);
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+    Local status server
+
+    A small HTTP server on the LAN so the sensor can be scraped without going through
+    ThingSpeak:
+
+        GET /metrics    Prometheus text format
+        GET /status     JSON
+
+    Both carry the latest sensor snapshot, the health counters of each slave and, when they
+    are enabled, the sample queue and the runtime metrics (metrics.h).
+
+    The responses are rendered into static buffers when there has been a poll since the last
+    render, or the last render is more than a second old: a scrape that finds neither sends
+    the buffer as it is, with no formatting. The age limit keeps the uptime, value ages and
+    metrics current when the poll period is long. Rendering and sending both happen in the server's own task, which runs
+    below the Modbus and MQTT tasks, and the snapshot is read without locking (snapshot.h),
+    so a scrape never holds up a poll or a HomeKit read.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include "esp_err.h"
+
+/**
+ * @brief Starts the server on CONFIG_STATUS_HTTP_PORT. Call once the network is up.
+ */
+esp_err_t status_http_start(void);
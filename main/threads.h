@@ -21,11 +21,37 @@
 #define THREAD_MQTT_STACKSIZE configMINIMAL_STACK_SIZE * 8
 #define THREAD_MQTT_PRIORITY 9
 
-// MODBUS Thread (used for testing only)
+// MODBUS reader thread, polls the bus with the scheduler. Above the publish sinks so a slow
+// destination never delays a poll.
 #define THREAD_MODBUS_NAME "modbus_reader"
-#define THREAD_MODBUS_PRIORITY 5
+#define THREAD_MODBUS_PRIORITY 7
 #define THREAD_MODBUS_STACKSIZE configMINIMAL_STACK_SIZE * 4
 
+// Native Modbus RTU master thread (owns the UART). Same priority as the freemodbus port task.
+#define THREAD_MB_RTU_NAME "mb_rtu_master"
+#define THREAD_MB_RTU_PRIORITY 10
+#define THREAD_MB_RTU_STACKSIZE configMINIMAL_STACK_SIZE * 4
+
+// Local status HTTP server. Below the Modbus and MQTT threads so a scrape never delays a poll.
+#define THREAD_STATUS_HTTP_PRIORITY 3
+#define THREAD_STATUS_HTTP_STACKSIZE configMINIMAL_STACK_SIZE * 6
+
+// Modbus TCP gateway. Below the Modbus reader so LAN clients never hold up the local poll.
+#define THREAD_MB_TCP_NAME "mb_tcp"
+#define THREAD_MB_TCP_PRIORITY 4
+#define THREAD_MB_TCP_STACKSIZE configMINIMAL_STACK_SIZE * 4
+
+// ThingSpeak bulk uploads over HTTP. Below the MODBUS reader so a slow upload never delays a
+// poll; the MQTT thread only hands the batches over.
+#define THREAD_BULK_NAME "bulk_upload"
+#define THREAD_BULK_PRIORITY 5
+#define THREAD_BULK_STACKSIZE configMINIMAL_STACK_SIZE * 8
+
+// Publish sinks, one task each (named after the sink). Below the MQTT thread, which feeds them,
+// and the MODBUS reader.
+#define THREAD_SINK_PRIORITY 6
+#define THREAD_SINK_STACKSIZE configMINIMAL_STACK_SIZE * 8
+
 // Make sure we configure MQTT with a different priority than the above
 #if THREAD_MQTT_PRIORITY < 6
 #error "MQTT_TASK_PRIORITY must us 6 or higher"
@@ -0,0 +1,270 @@
+/*
+    Compressed time-series store
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <string.h>
+#include "tsdb.h"
+
+// Largest encoding of one sample: a 32 bit varint for the time, the presence bitmap and a 17
+// bit varint per value
+#define TSDB_MAX_SAMPLE_BYTES   (5 + 1 + 3 * TSDB_MAX_SERIES)
+
+static inline uint32_t zigzag_encode(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint8_t *varint_put(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline const uint8_t *varint_get(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t result = 0;
+    for (int shift = 0; (p < end) && (shift < 35); shift += 7)
+    {
+        uint8_t b = *p++;
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Bitmap of the values present (not TSDB_MISSING) in a sample
+ */
+static uint8_t present_mask(const int16_t *values, uint8_t series)
+{
+    uint8_t mask = 0;
+    for (uint8_t i = 0; i < series; i++)
+    {
+        if (values[i] != TSDB_MISSING)
+        {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+/**
+ * @brief Takes the values present in a sample as the new bases of their series
+ */
+static void update_prev(tsdb_t *db, const int16_t *values, uint8_t present)
+{
+    for (uint8_t i = 0; i < db->series; i++)
+    {
+        if (present & (1 << i))
+        {
+            db->prev_values[i] = values[i];
+        }
+    }
+    db->prev_present = present;
+}
+
+static tsdb_block_t *open_block(tsdb_t *db)
+{
+    return db->used ? &db->blocks[(db->head + db->used - 1) % db->nblocks] : NULL;
+}
+
+/**
+ * @brief Starts a new block with the sample in its header, reusing the oldest block when
+ * the ring is full
+ */
+static void start_block(tsdb_t *db, uint32_t ts, const int16_t *values)
+{
+    if (db->used == db->nblocks)
+    {
+        tsdb_block_t *oldest = &db->blocks[db->head];
+        db->samples -= oldest->header.count;
+        db->bytes -= sizeof(tsdb_block_header_t) + oldest->header.len;
+        db->head = (db->head + 1) % db->nblocks;
+        db->used--;
+    }
+    tsdb_block_t *block = &db->blocks[(db->head + db->used) % db->nblocks];
+    db->used++;
+
+    memset(&block->header, 0, sizeof(block->header));
+    block->header.magic = TSDB_BLOCK_MAGIC;
+    block->header.series = db->series;
+    block->header.seq = db->next_seq++;
+    block->header.first_ts = ts;
+    block->header.last_ts = ts;
+    block->header.count = 1;
+    // The bases carry over from the previous block, so a series missing here still has one
+    update_prev(db, values, present_mask(values, db->series));
+    block->header.first_present = db->prev_present;
+    memcpy(block->header.first_values, db->prev_values, db->series * sizeof(int16_t));
+
+    db->prev_ts = ts;
+    db->prev_delta = 0;
+    db->samples++;
+    db->bytes += sizeof(tsdb_block_header_t);
+}
+
+void tsdb_init(tsdb_t *db, tsdb_block_t *blocks, uint32_t nblocks, uint8_t series, uint32_t first_seq)
+{
+    memset(db, 0, sizeof(tsdb_t));
+    db->blocks = blocks;
+    db->nblocks = nblocks;
+    db->series = (series > TSDB_MAX_SERIES) ? TSDB_MAX_SERIES : series;
+    db->next_seq = first_seq;
+}
+
+const tsdb_block_t *tsdb_append(tsdb_t *db, uint32_t ts, const int16_t *values)
+{
+    tsdb_block_t *block = open_block(db);
+
+    if ((block == NULL) || (ts < db->prev_ts))
+    {
+        // Nothing open yet, or the clock went backwards (a block must stay in time order)
+        start_block(db, ts, values);
+        return block;
+    }
+
+    uint8_t buf[TSDB_MAX_SAMPLE_BYTES];
+    uint8_t *p = buf;
+    int32_t delta = (int32_t)(ts - db->prev_ts);
+    uint8_t present = present_mask(values, db->series);
+    bool changed = (present != db->prev_present);
+    p = varint_put(p, (zigzag_encode(delta - db->prev_delta) << 1) | changed);
+    if (changed)
+    {
+        *p++ = present;
+    }
+    for (uint8_t i = 0; i < db->series; i++)
+    {
+        if (present & (1 << i))
+        {
+            p = varint_put(p, zigzag_encode((int32_t)values[i] - db->prev_values[i]));
+        }
+    }
+    size_t len = p - buf;
+
+    if ((block->header.len + len > TSDB_BLOCK_DATA) || (block->header.count == UINT16_MAX))
+    {
+        start_block(db, ts, values);
+        return block;
+    }
+
+    memcpy(&block->data[block->header.len], buf, len);
+    block->header.len += len;
+    block->header.count++;
+    block->header.last_ts = ts;
+    db->prev_ts = ts;
+    db->prev_delta = delta;
+    update_prev(db, values, present);
+    db->samples++;
+    db->bytes += len;
+    return NULL;
+}
+
+uint32_t tsdb_block_query(const tsdb_block_t *block, uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx, bool *stopped)
+{
+    const tsdb_block_header_t *h = &block->header;
+    uint32_t found = 0;
+
+    if ((h->magic != TSDB_BLOCK_MAGIC) || (h->count == 0) || (h->series > TSDB_MAX_SERIES) ||
+        (h->len > TSDB_BLOCK_DATA) || (h->last_ts < from) || (h->first_ts > to))
+    {
+        return 0;
+    }
+
+    uint32_t ts = h->first_ts;
+    int32_t delta = 0;
+    uint8_t present = h->first_present;
+    int16_t bases[TSDB_MAX_SERIES];
+    int16_t values[TSDB_MAX_SERIES];
+    memcpy(bases, h->first_values, sizeof(bases));
+
+    const uint8_t *p = block->data;
+    const uint8_t *end = block->data + h->len;
+    for (uint16_t n = 0; n < h->count; n++)
+    {
+        if (n > 0)
+        {
+            uint32_t v;
+            if ((p = varint_get(p, end, &v)) == NULL)
+            {
+                break;
+            }
+            delta += zigzag_decode(v >> 1);
+            ts += delta;
+            if (v & 1)
+            {
+                if (p >= end)
+                {
+                    break;
+                }
+                present = *p++;
+            }
+            for (uint8_t i = 0; i < h->series; i++)
+            {
+                if (!(present & (1 << i)))
+                {
+                    continue;
+                }
+                if ((p = varint_get(p, end, &v)) == NULL)
+                {
+                    return found;
+                }
+                bases[i] = (int16_t)(bases[i] + zigzag_decode(v));
+            }
+        }
+        for (uint8_t i = 0; i < h->series; i++)
+        {
+            values[i] = (present & (1 << i)) ? bases[i] : TSDB_MISSING;
+        }
+        if (ts > to)
+        {
+            break;
+        }
+        if (ts >= from)
+        {
+            found++;
+            if (!cb(ctx, ts, values, h->series))
+            {
+                if (stopped)
+                {
+                    *stopped = true;
+                }
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+uint32_t tsdb_query(const tsdb_t *db, uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx)
+{
+    uint32_t found = 0;
+    bool stopped = false;
+
+    for (uint32_t i = 0; (i < db->used) && !stopped; i++)
+    {
+        found += tsdb_block_query(&db->blocks[(db->head + i) % db->nblocks], from, to, cb, ctx, &stopped);
+    }
+    return found;
+}
+
+const tsdb_block_t *tsdb_oldest_block(const tsdb_t *db)
+{
+    return db->used ? &db->blocks[db->head] : NULL;
+}
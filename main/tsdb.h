@@ -0,0 +1,129 @@
+/*
+    Compressed time-series store
+
+    Keeps a history of samples in fixed size blocks. Each sample is a timestamp (seconds) and
+    up to TSDB_MAX_SERIES int16 values in the sensor's own fixed point (x10). The first sample
+    of a block is stored as is in the block header. After that:
+
+    - timestamps are stored as the delta of the delta (a steady poll period encodes as 0),
+      with the low bit set when the set of values present changed, in which case a presence
+      bitmap follows,
+    - each value present is stored as the delta from the last value present in that series,
+
+    both zigzag encoded as varints, so a steady sensor costs one byte per field. A missing
+    value (TSDB_MISSING, a failed read or a slave not polled in that sample) takes no space
+    and does not break the deltas of its series, so rows that alternate between slaves polled
+    at different times stay small.
+
+    Blocks are kept in a ring supplied by the caller; when the ring is full the oldest block
+    is reused. A block is sealed when the next sample does not fit or the time goes backwards.
+    The block header holds the first and last timestamp so range queries skip whole blocks.
+
+    This is plain C with no ESP-IDF dependencies, see history.c for the device side.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of values per sample the store can hold
+#define TSDB_MAX_SERIES     (8)
+// Size of a block, including the header. A multiple of the flash sector size divides evenly.
+#define TSDB_BLOCK_SIZE     (256)
+// Value stored for a sample that could not be read
+#define TSDB_MISSING        (INT16_MIN)
+// Marks a block header as valid. Changed with the encoding, so older archived blocks are skipped.
+#define TSDB_BLOCK_MAGIC    (0x5455)
+
+typedef struct
+{
+    uint16_t magic;             // TSDB_BLOCK_MAGIC
+    uint8_t series;             // Values per sample
+    uint8_t first_present;      // Bitmap of the values present in the first sample
+    uint32_t seq;               // Block sequence number, increases by one per block
+    uint32_t first_ts;          // Time of the first sample
+    uint32_t last_ts;           // Time of the last sample
+    uint16_t count;             // Samples in the block
+    uint16_t len;               // Bytes of data[] used
+    int16_t first_values[TSDB_MAX_SERIES];  // Last value present in each series, 0 if none yet
+} tsdb_block_header_t;
+
+_Static_assert(TSDB_MAX_SERIES <= 8, "The presence bitmap is one byte");
+
+#define TSDB_BLOCK_DATA     (TSDB_BLOCK_SIZE - sizeof(tsdb_block_header_t))
+
+typedef struct
+{
+    tsdb_block_header_t header;
+    uint8_t data[TSDB_BLOCK_DATA];
+} tsdb_block_t;
+
+_Static_assert(sizeof(tsdb_block_t) == TSDB_BLOCK_SIZE, "tsdb block must be TSDB_BLOCK_SIZE bytes");
+
+typedef struct
+{
+    tsdb_block_t *blocks;       // Ring of blocks
+    uint32_t nblocks;
+    uint32_t head;              // Oldest block
+    uint32_t used;              // Blocks in use, including the open one
+    uint8_t series;
+    uint32_t next_seq;
+    // Encoder state for the open block
+    uint32_t prev_ts;
+    int32_t prev_delta;
+    uint8_t prev_present;
+    int16_t prev_values[TSDB_MAX_SERIES];   // Last value present in each series
+    // Counters
+    uint32_t samples;           // Samples held in the ring
+    uint32_t bytes;             // Bytes used by the samples held (headers included)
+} tsdb_t;
+
+/**
+ * @brief Called for every sample found by a query
+ * @param ctx - context passed to the query
+ * @param ts - time of the sample
+ * @param values - series values, TSDB_MISSING for a missing one
+ * @param series - number of values
+ * @returns false to stop the query
+ */
+typedef bool (*tsdb_query_cb_t)(void *ctx, uint32_t ts, const int16_t *values, uint8_t series);
+
+/**
+ * @brief Sets up a store over a ring of blocks
+ * @param db - store
+ * @param blocks - ring of nblocks blocks
+ * @param nblocks - number of blocks (at least 2)
+ * @param series - values per sample (1 to TSDB_MAX_SERIES)
+ * @param first_seq - sequence number of the first block (continues an archive after a reboot)
+ */
+void tsdb_init(tsdb_t *db, tsdb_block_t *blocks, uint32_t nblocks, uint8_t series, uint32_t first_seq);
+
+/**
+ * @brief Adds a sample
+ * @param db - store
+ * @param ts - time of the sample in seconds
+ * @param values - db->series values
+ * @returns the block that was sealed to make room for the sample (for archiving), or NULL.
+ * The pointer is valid until the next call.
+ */
+const tsdb_block_t *tsdb_append(tsdb_t *db, uint32_t ts, const int16_t *values);
+
+/**
+ * @brief Decodes the samples in one block that fall in [from, to]
+ * @returns number of samples passed to cb, stops early if cb returns false
+ */
+uint32_t tsdb_block_query(const tsdb_block_t *block, uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx, bool *stopped);
+
+/**
+ * @brief Finds all samples in the ring that fall in [from, to], oldest first
+ * @returns number of samples passed to cb
+ */
+uint32_t tsdb_query(const tsdb_t *db, uint32_t from, uint32_t to, tsdb_query_cb_t cb, void *ctx);
+
+/**
+ * @brief Returns the oldest block in the ring, or NULL if empty
+ */
+const tsdb_block_t *tsdb_oldest_block(const tsdb_t *db);
@@ -0,0 +1,362 @@
+/*
+    Host check and benchmark of the broker payload encodings
+
+    Encodes a sweep of values with each codec in main/payload_codec.c and decodes the result
+    again: the CBOR with a small decoder written from RFC 8949, the JSON text and the packed
+    form by hand. Exits with an error if any value does not come back as the rounded value.
+    Then compares the time and size of a sample (temperature and humidity) sent as the
+    ThingSpeak query string formatted with snprintf("%0.02f") against the same sample
+    encoded per sensor with each codec.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include "payload_codec.h"
+
+#define SAMPLE_TIME     (1603000000U)
+
+static const payload_codec_t codecs[] = { PAYLOAD_CODEC_TEXT, PAYLOAD_CODEC_CBOR, PAYLOAD_CODEC_PACKED };
+#define NUM_CODECS      (sizeof(codecs) / sizeof(codecs[0]))
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n count    samples timed (default 2000000)\n",
+            name);
+}
+
+/**
+ * @brief Reads a CBOR head
+ * @returns the major type (shifted down), or -1 for a form the encoder never writes
+ */
+static int cbor_head(const uint8_t **p, uint32_t *arg)
+{
+    uint8_t b = *(*p)++;
+    uint8_t info = b & 0x1F;
+
+    if (info < 24)
+    {
+        *arg = info;
+    }
+    else if (info == 24)
+    {
+        *arg = *(*p)++;
+    }
+    else if (info == 25)
+    {
+        *arg = ((*p)[0] << 8) | (*p)[1];
+        *p += 2;
+    }
+    else if (info == 26)
+    {
+        *arg = ((uint32_t)(*p)[0] << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+        *p += 4;
+    }
+    else
+    {
+        return -1;
+    }
+    return b >> 5;
+}
+
+static bool cbor_int(const uint8_t **p, int64_t *n)
+{
+    uint32_t arg;
+    int major = cbor_head(p, &arg);
+
+    if (major == 0)
+    {
+        *n = arg;
+        return true;
+    }
+    if (major == 1)
+    {
+        *n = -1 - (int64_t)arg;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Decodes {"t":time,"v":value} into mantissa, exponent and time
+ */
+static bool decode_cbor(const uint8_t *buf, size_t len, int64_t *mantissa, int *exponent, bool *has_time, uint32_t *time)
+{
+    const uint8_t *p = buf;
+    uint32_t pairs, arg;
+
+    *has_time = false;
+    if (cbor_head(&p, &pairs) != 5)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < pairs; i++)
+    {
+        if ((cbor_head(&p, &arg) != 3) || (arg != 1))
+        {
+            return false;
+        }
+        char key = *p++;
+        if (key == 't')
+        {
+            if (cbor_head(&p, time) != 0)
+            {
+                return false;
+            }
+            *has_time = true;
+        }
+        else if (key == 'v')
+        {
+            const uint8_t *start = p;
+            if (cbor_head(&p, &arg) == 6)
+            {
+                int64_t e;
+                if ((arg != 4) || (cbor_head(&p, &arg) != 4) || (arg != 2) || !cbor_int(&p, &e) || !cbor_int(&p, mantissa))
+                {
+                    return false;
+                }
+                *exponent = (int)e;
+            }
+            else
+            {
+                p = start;
+                *exponent = 0;
+                if (!cbor_int(&p, mantissa))
+                {
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return (size_t)(p - buf) == len;
+}
+
+static bool decode_packed(const uint8_t *buf, size_t len, int64_t *mantissa, int *exponent, bool *has_time, uint32_t *time)
+{
+    if ((len != 5) && (len != 9))
+    {
+        return false;
+    }
+    *exponent = (int8_t)buf[0];
+    *mantissa = (int32_t)(((uint32_t)buf[1] << 24) | (buf[2] << 16) | (buf[3] << 8) | buf[4]);
+    *has_time = (len == 9);
+    if (*has_time)
+    {
+        *time = ((uint32_t)buf[5] << 24) | (buf[6] << 16) | (buf[7] << 8) | buf[8];
+    }
+    return true;
+}
+
+/**
+ * @brief Reads {"t":time,"v":value} back, keeping the value as mantissa and exponent
+ */
+static bool decode_text(const uint8_t *buf, size_t len, int64_t *mantissa, int *exponent, bool *has_time, uint32_t *time)
+{
+    char text[PAYLOAD_CODEC_MAX_LEN + 1];
+    char *p;
+
+    if ((len == 0) || (len > PAYLOAD_CODEC_MAX_LEN))
+    {
+        return false;
+    }
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    *has_time = (sscanf(text, "{\"t\":%u,", time) == 1);
+    p = strstr(text, "\"v\":");
+    if ((p == NULL) || (text[len - 1] != '}'))
+    {
+        return false;
+    }
+    p += 4;
+    bool negative = (*p == '-');
+    p += negative;
+    *mantissa = 0;
+    *exponent = 0;
+    bool fraction = false;
+    for (; *p != '}'; p++)
+    {
+        if (*p == '.')
+        {
+            fraction = true;
+            continue;
+        }
+        *mantissa = *mantissa * 10 + (*p - '0');
+        *exponent -= fraction;
+    }
+    *mantissa = negative ? -*mantissa : *mantissa;
+    return true;
+}
+
+/**
+ * @brief Encodes a value with every codec and checks it decodes to the rounded value
+ * @returns number of failures
+ */
+static int check_value(float value, uint8_t decimals, bool has_time)
+{
+    int failures = 0;
+    double expected = round((double)value * pow(10, decimals));
+
+    for (size_t c = 0; c < NUM_CODECS; c++)
+    {
+        uint8_t buf[PAYLOAD_CODEC_MAX_LEN];
+        size_t len = payload_encode_value(codecs[c], buf, value, decimals, has_time, SAMPLE_TIME);
+        int64_t mantissa = 0;
+        int exponent = 0;
+        bool got_time = false;
+        uint32_t time = 0;
+        bool ok;
+
+        switch (codecs[c])
+        {
+            case PAYLOAD_CODEC_CBOR:    ok = decode_cbor(buf, len, &mantissa, &exponent, &got_time, &time); break;
+            case PAYLOAD_CODEC_PACKED:  ok = decode_packed(buf, len, &mantissa, &exponent, &got_time, &time); break;
+            default:                    ok = decode_text(buf, len, &mantissa, &exponent, &got_time, &time); break;
+        }
+        ok = ok && (len > 0) && (len <= PAYLOAD_CODEC_MAX_LEN) && (exponent == -(int)decimals) &&
+             (fabs((double)mantissa - expected) <= 1.0) && (got_time == has_time) && (!has_time || (time == SAMPLE_TIME));
+        // Half a step, plus the rounding of the float product near a tie
+        double exact = (double)value * pow(10, decimals);
+        if (ok && (fabs((double)mantissa - exact) > 0.5 + fabs(exact) * FLT_EPSILON))
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            printf("FAIL: %s %.7g with %d decimals: %zu bytes, mantissa %lld exponent %d\n",
+                   payload_codec_name(codecs[c]), value, decimals, len, (long long)mantissa, exponent);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int check_limits(void)
+{
+    int failures = 0;
+    int32_t mantissa;
+
+    if (payload_fixed_point(NAN, 1, &mantissa) || payload_fixed_point(INFINITY, 1, &mantissa) ||
+        payload_fixed_point(3e9f, 0, &mantissa) || payload_fixed_point(-3e3f, 6, &mantissa) ||
+        payload_fixed_point(1.0f, PAYLOAD_CODEC_MAX_DECIMALS + 1, &mantissa))
+    {
+        printf("FAIL: a value out of range was encoded\n");
+        failures++;
+    }
+    char text[16];
+    size_t n = payload_format_fixed(text, INT32_MIN, 0);
+    text[n] = '\0';
+    if (strcmp(text, "-2147483648") != 0)
+    {
+        printf("FAIL: INT32_MIN formatted as %s\n", text);
+        failures++;
+    }
+    n = payload_format_fixed(text, -5, 3);
+    text[n] = '\0';
+    if (strcmp(text, "-0.005") != 0)
+    {
+        printf("FAIL: -5e-3 formatted as %s\n", text);
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = 2000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    int failures = check_limits();
+    uint32_t points = 0;
+    for (float v = -60.0f; v <= 130.0f; v += 0.013f)
+    {
+        for (uint8_t decimals = 0; decimals <= 3; decimals++)
+        {
+            failures += check_value(v, decimals, (points & 1) != 0);
+            points++;
+        }
+    }
+    for (uint8_t decimals = 0; decimals <= PAYLOAD_CODEC_MAX_DECIMALS; decimals++)
+    {
+        failures += check_value(2000.0f / (float)pow(10, decimals), decimals, true);
+        failures += check_value(-2000.0f / (float)pow(10, decimals), decimals, true);
+        points += 2;
+    }
+    printf("Round trip: %u values x %zu codecs, %d failures\n", points, NUM_CODECS, failures);
+
+    // Time a sample the way each backend sends it
+    enum { INPUTS = 4096 };
+    static float t_in[INPUTS], rh_in[INPUTS];
+    srand(1);
+    for (int i = 0; i < INPUTS; i++)
+    {
+        t_in[i] = -20.0f + (float)(rand() % 800) / 10.0f;
+        rh_in[i] = (float)(rand() % 1000) / 10.0f;
+    }
+    char text[256];
+    volatile size_t sink = 0;
+    size_t bytes = 0;
+    double start = now_s();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t j = i % INPUTS;
+        bytes = snprintf(text, sizeof(text), "field1=%0.02f&field2=%0.02f&status=%s&created_at=2020-10-18T05:46:40Z",
+                         t_in[j], rh_in[j], "GOOD_ESP");
+        sink += bytes;
+    }
+    double elapsed = now_s() - start;
+    printf("%-12s %6.1f ns/sample, %2zu bytes in 1 message\n", "ThingSpeak:", elapsed / count * 1e9, bytes);
+    for (size_t c = 0; c < NUM_CODECS; c++)
+    {
+        uint8_t buf[PAYLOAD_CODEC_MAX_LEN];
+        start = now_s();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t j = i % INPUTS;
+            bytes = payload_encode_value(codecs[c], buf, t_in[j], 1, true, SAMPLE_TIME);
+            bytes += payload_encode_value(codecs[c], buf, rh_in[j], 1, true, SAMPLE_TIME);
+            sink += bytes;
+        }
+        elapsed = now_s() - start;
+        char label[16];
+        snprintf(label, sizeof(label), "%s:", payload_codec_name(codecs[c]));
+        printf("%-12s %6.1f ns/sample, %2zu bytes in 2 messages\n", label, elapsed / count * 1e9, bytes);
+    }
+    (void)sink;
+
+    if (failures)
+    {
+        printf("FAIL: %d values did not round trip\n", failures);
+        return 1;
+    }
+    return 0;
+}
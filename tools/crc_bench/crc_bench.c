@@ -0,0 +1,263 @@
+/*
+    Host check and benchmark for the Modbus CRC-16 and LRC
+
+    Links the bitwise, table and slice-by-4 builds of main/mb_crc.c into one program. Checks
+    each against Modbus frames with known CRC and LRC, fed whole and in pieces, runs the
+    firmware's own self test, and checks that the three agree on random buffers of every length
+    up to a little over the longest RTU frame. Exits with an error on any mismatch. Then times
+    each variant and the LRC over a frame sized buffer and reports bytes per ns and, on x86,
+    bytes per TSC cycle.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define MB_CRC16_INIT           (0xFFFF)
+#define MAX_RTU_FRAME           (256)
+#define RANDOM_MAX_LEN          (300)
+
+// The variants, renamed by the Makefile
+#define DECLARE_VARIANT(name) \
+    uint16_t name##_crc16_update(uint16_t crc, const uint8_t *data, size_t len); \
+    uint16_t name##_crc16(const uint8_t *data, size_t len); \
+    uint8_t name##_lrc(const uint8_t *data, size_t len); \
+    bool name##_crc_self_test(void); \
+    const char *name##_crc_variant(void);
+
+DECLARE_VARIANT(bitwise)
+DECLARE_VARIANT(table)
+DECLARE_VARIANT(slice4)
+
+typedef struct
+{
+    uint16_t (*update)(uint16_t crc, const uint8_t *data, size_t len);
+    uint16_t (*crc16)(const uint8_t *data, size_t len);
+    uint8_t (*lrc)(const uint8_t *data, size_t len);
+    bool (*self_test)(void);
+    const char *(*name)(void);
+} crc_variant_t;
+
+static const crc_variant_t variants[] = {
+    { bitwise_crc16_update, bitwise_crc16, bitwise_lrc, bitwise_crc_self_test, bitwise_crc_variant },
+    { table_crc16_update, table_crc16, table_lrc, table_crc_self_test, table_crc_variant },
+    { slice4_crc16_update, slice4_crc16, slice4_lrc, slice4_crc_self_test, slice4_crc_variant },
+};
+#define VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+typedef struct
+{
+    const char *label;
+    uint8_t frame[16];
+    size_t len;
+    uint16_t crc;
+    uint8_t lrc;
+} vector_t;
+
+// Check values worked out separately from the firmware. The low CRC byte goes on the wire first.
+static const vector_t vectors[] = {
+    { "read holding 0-9", { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A }, 6, 0xCDC5, 0xF2 },
+    { "spec example", { 0x11, 0x03, 0x00, 0x6B, 0x00, 0x03 }, 6, 0x8776, 0x7E },
+    { "read input 1-2", { 0x01, 0x04, 0x00, 0x01, 0x00, 0x02 }, 6, 0x0B20, 0xF8 },
+    { "XY-MD02 response", { 0x01, 0x04, 0x04, 0x00, 0xE1, 0x01, 0x80 }, 7, 0x82AB, 0x95 },
+    { "exception", { 0x01, 0x84, 0x02 }, 3, 0xC1C2, 0x79 },
+    { "ASCII example", { 0x01, 0x03, 0x00, 0x00, 0x00, 0x01 }, 6, 0x0A84, 0xFB },
+    { "write single", { 0x01, 0x06, 0x00, 0x01, 0x00, 0x03 }, 6, 0x0B98, 0xF5 },
+    { "check string", { '1', '2', '3', '4', '5', '6', '7', '8', '9' }, 9, 0x4B37, 0x23 },
+};
+#define VECTORS (sizeof(vectors) / sizeof(vectors[0]))
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL: " __VA_ARGS__); printf("\n"); } } while (0)
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -l len      bytes per timed buffer (default 256, the longest RTU frame)\n"
+            "  -n count    buffers timed per variant (default 200000)\n",
+            name);
+}
+
+static void check_vectors(const crc_variant_t *variant)
+{
+    const char *name = variant->name();
+    CHECK(variant->self_test(), "%s: firmware self test", name);
+    for (size_t i = 0; i < VECTORS; i++)
+    {
+        const vector_t *v = &vectors[i];
+        uint16_t crc = variant->crc16(v->frame, v->len);
+        CHECK(crc == v->crc, "%s: %s CRC 0x%04X, expected 0x%04X", name, v->label, crc, v->crc);
+        uint8_t lrc = variant->lrc(v->frame, v->len);
+        CHECK(lrc == v->lrc, "%s: %s LRC 0x%02X, expected 0x%02X", name, v->label, lrc, v->lrc);
+        // Every split of the frame into two pieces, as the UART might deliver it
+        for (size_t split = 0; split <= v->len; split++)
+        {
+            crc = variant->update(MB_CRC16_INIT, v->frame, split);
+            crc = variant->update(crc, v->frame + split, v->len - split);
+            CHECK(crc == v->crc, "%s: %s CRC split at %zu 0x%04X", name, v->label, split, crc);
+        }
+        // A frame with its CRC appended checks to zero
+        uint8_t framed[sizeof(v->frame) + 2];
+        for (size_t j = 0; j < v->len; j++)
+        {
+            framed[j] = v->frame[j];
+        }
+        framed[v->len] = v->crc & 0xFF;
+        framed[v->len + 1] = v->crc >> 8;
+        crc = variant->crc16(framed, v->len + 2);
+        CHECK(crc == 0, "%s: %s with CRC appended 0x%04X", name, v->label, crc);
+    }
+}
+
+static void check_agree(void)
+{
+    static uint8_t buf[RANDOM_MAX_LEN + 3];
+    srand(1);
+    for (size_t len = 0; len <= RANDOM_MAX_LEN; len++)
+    {
+        // Every start alignment, so slice-by-4 sees all the tail lengths
+        for (size_t offset = 0; offset < 4; offset++)
+        {
+            for (size_t i = 0; i < len + offset; i++)
+            {
+                buf[i] = (uint8_t)rand();
+            }
+            const uint8_t *data = buf + offset;
+            uint16_t crc = bitwise_crc16(data, len);
+            uint8_t lrc = bitwise_lrc(data, len);
+            for (size_t v = 1; v < VARIANTS; v++)
+            {
+                uint16_t other = variants[v].crc16(data, len);
+                CHECK(other == crc, "%s: length %zu offset %zu CRC 0x%04X, bitwise 0x%04X",
+                      variants[v].name(), len, offset, other, crc);
+                CHECK(variants[v].lrc(data, len) == lrc, "%s: length %zu offset %zu LRC",
+                      variants[v].name(), len, offset);
+                // Chained in uneven pieces
+                size_t done = 0, piece = 1;
+                uint16_t chained = MB_CRC16_INIT;
+                while (done < len)
+                {
+                    size_t n = (piece < len - done) ? piece : len - done;
+                    chained = variants[v].update(chained, data + done, n);
+                    done += n;
+                    piece = piece * 2 + 1;
+                }
+                CHECK(chained == crc, "%s: length %zu offset %zu chained CRC 0x%04X, bitwise 0x%04X",
+                      variants[v].name(), len, offset, chained, crc);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Times a checksum over the same buffer count times
+ */
+static void bench(const char *label, uint32_t (*fn)(const crc_variant_t *, const uint8_t *, size_t),
+                  const crc_variant_t *variant, const uint8_t *buf, size_t len, uint32_t count)
+{
+    volatile uint32_t sink = 0;
+
+    double start = now_s();
+#ifdef HAVE_TSC
+    uint64_t start_tsc = __rdtsc();
+#endif
+    for (uint32_t i = 0; i < count; i++)
+    {
+        sink += fn(variant, buf, len);
+    }
+#ifdef HAVE_TSC
+    uint64_t cycles = __rdtsc() - start_tsc;
+#endif
+    double elapsed = now_s() - start;
+    (void)sink;
+
+    double bytes = (double)len * count;
+    printf("%-12s %.2f bytes/ns, %.2f ns/frame", label, bytes / (elapsed * 1e9), elapsed / count * 1e9);
+#ifdef HAVE_TSC
+    printf(", %.2f bytes/TSC cycle", bytes / cycles);
+#endif
+    printf("\n");
+}
+
+static uint32_t run_crc(const crc_variant_t *variant, const uint8_t *buf, size_t len)
+{
+    return variant->crc16(buf, len);
+}
+
+static uint32_t run_lrc(const crc_variant_t *variant, const uint8_t *buf, size_t len)
+{
+    return variant->lrc(buf, len);
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = MAX_RTU_FRAME;
+    uint32_t count = 200000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': len = strtoul(optarg, NULL, 0); break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if ((len < 1) || (count < 1))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (size_t v = 0; v < VARIANTS; v++)
+    {
+        check_vectors(&variants[v]);
+    }
+    check_agree();
+    printf("Vectors:     %zu frames, %zu variants, random buffers 0 to %d bytes\n",
+           VECTORS, VARIANTS, RANDOM_MAX_LEN);
+
+    uint8_t *buf = malloc(len);
+    if (buf == NULL)
+    {
+        return 1;
+    }
+    srand(2);
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t)rand();
+    }
+    printf("Timing:      %zu byte buffer, %u times\n", len, count);
+    for (size_t v = 0; v < VARIANTS; v++)
+    {
+        bench(variants[v].name(), run_crc, &variants[v], buf, len, count);
+    }
+    bench("LRC", run_lrc, &variants[0], buf, len, count);
+    free(buf);
+
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
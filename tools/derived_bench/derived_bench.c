@@ -0,0 +1,200 @@
+/*
+    Host accuracy check and benchmark for the derived metrics
+
+    Sweeps temperature and humidity over the range the firmware handles and compares the fast
+    dew point and absolute humidity in derived.c against the logf()/expf() reference. Exits
+    with an error if either is outside the documented bound. Then times the dew point, the
+    absolute humidity and the heat index on their own, each against the same formula with
+    logf()/expf(), and all three together, and reports the time (and, on x86, TSC cycles)
+    per evaluation.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "derived.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+// Bounds stated in derived.h
+#define MAX_DEW_POINT_ERROR     (0.02)      // C
+#define MAX_ABS_HUMIDITY_ERROR  (0.002)     // Relative
+
+// Magnus coefficients used by derived.c, for the single metric references
+#define MAGNUS_A        (17.62f)
+#define MAGNUS_B        (243.12f)
+#define MAGNUS_E0       (6.112f)
+#define AH_FACTOR       (216.7f)
+#define KELVIN          (273.15f)
+
+typedef bool (*derived_fn_t)(float, float, derived_metrics_t *);
+typedef float (*metric_fn_t)(float, float);
+
+static float reference_dew_point(float temperature, float humidity)
+{
+    float gamma = logf(humidity / 100.0f) + MAGNUS_A * temperature / (MAGNUS_B + temperature);
+    return MAGNUS_B * gamma / (MAGNUS_A - gamma);
+}
+
+static float reference_abs_humidity(float temperature, float humidity)
+{
+    float e = MAGNUS_E0 * expf(MAGNUS_A * temperature / (MAGNUS_B + temperature)) * humidity / 100.0f;
+    return AH_FACTOR * e / (KELVIN + temperature);
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t step     temperature step of the sweep in C (default 0.05)\n"
+            "  -r step     humidity step of the sweep in %% (default 0.1)\n"
+            "  -n count    evaluations timed (default 10000000)\n",
+            name);
+}
+
+/**
+ * @brief Times fn over a table of inputs
+ */
+static void bench(const char *label, derived_fn_t fn, const float *t, const float *rh, uint32_t inputs, uint32_t count)
+{
+    derived_metrics_t out;
+    volatile float sink = 0.0f;
+
+    double start = now_s();
+#ifdef HAVE_TSC
+    uint64_t start_tsc = __rdtsc();
+#endif
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t j = i % inputs;
+        fn(t[j], rh[j], &out);
+        sink += out.dew_point + out.abs_humidity;
+    }
+#ifdef HAVE_TSC
+    uint64_t cycles = __rdtsc() - start_tsc;
+#endif
+    double elapsed = now_s() - start;
+    (void)sink;
+
+    printf("%-22s %.1f ns/eval", label, elapsed / count * 1e9);
+#ifdef HAVE_TSC
+    printf(", %.0f TSC cycles/eval", (double)cycles / count);
+#endif
+    printf("\n");
+}
+
+/**
+ * @brief Times a single metric over a table of inputs
+ */
+static void bench_metric(const char *label, metric_fn_t fn, const float *t, const float *rh, uint32_t inputs, uint32_t count)
+{
+    volatile float sink = 0.0f;
+
+    double start = now_s();
+#ifdef HAVE_TSC
+    uint64_t start_tsc = __rdtsc();
+#endif
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t j = i % inputs;
+        sink += fn(t[j], rh[j]);
+    }
+#ifdef HAVE_TSC
+    uint64_t cycles = __rdtsc() - start_tsc;
+#endif
+    double elapsed = now_s() - start;
+    (void)sink;
+
+    printf("%-22s %.1f ns/eval", label, elapsed / count * 1e9);
+#ifdef HAVE_TSC
+    printf(", %.0f TSC cycles/eval", (double)cycles / count);
+#endif
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    float t_step = 0.05f, rh_step = 0.1f;
+    uint32_t count = 10000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:r:n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': t_step = atof(optarg); break;
+            case 'r': rh_step = atof(optarg); break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    double max_dp = 0, max_ah = 0;
+    float max_dp_t = 0, max_dp_rh = 0, max_ah_t = 0, max_ah_rh = 0;
+    uint32_t points = 0;
+    for (float t = DERIVED_TABLE_MIN_C; t <= DERIVED_TABLE_MAX_C; t += t_step)
+    {
+        for (float rh = 1.0f; rh <= 100.0f; rh += rh_step)
+        {
+            derived_metrics_t fast, ref;
+            derived_compute(t, rh, &fast);
+            derived_reference(t, rh, &ref);
+            double dp = fabs(fast.dew_point - ref.dew_point);
+            double ah = fabs(fast.abs_humidity - ref.abs_humidity) / ref.abs_humidity;
+            if (dp > max_dp)
+            {
+                max_dp = dp;
+                max_dp_t = t;
+                max_dp_rh = rh;
+            }
+            if (ah > max_ah)
+            {
+                max_ah = ah;
+                max_ah_t = t;
+                max_ah_rh = rh;
+            }
+            points++;
+        }
+    }
+    printf("Points:     %u (%d to %dC, 1 to 100%%RH)\n", points, DERIVED_TABLE_MIN_C, DERIVED_TABLE_MAX_C);
+    printf("Dew point:  max error %.4fC at %.2fC %.1f%%RH (bound %.2fC)\n", max_dp, max_dp_t, max_dp_rh, MAX_DEW_POINT_ERROR);
+    printf("Abs humid:  max error %.3f%% at %.2fC %.1f%%RH (bound %.1f%%)\n", max_ah * 100, max_ah_t, max_ah_rh, MAX_ABS_HUMIDITY_ERROR * 100);
+
+    // Inputs spread over the range, so the timing is not one cached case
+    enum { INPUTS = 4096 };
+    static float t_in[INPUTS], rh_in[INPUTS];
+    srand(1);
+    for (int i = 0; i < INPUTS; i++)
+    {
+        t_in[i] = DERIVED_TABLE_MIN_C + (float)rand() / RAND_MAX * (DERIVED_TABLE_MAX_C - DERIVED_TABLE_MIN_C);
+        rh_in[i] = 1.0f + (float)rand() / RAND_MAX * 99.0f;
+    }
+    bench_metric("Dew point fast:", derived_dew_point, t_in, rh_in, INPUTS, count);
+    bench_metric("Dew point reference:", reference_dew_point, t_in, rh_in, INPUTS, count);
+    bench_metric("Abs humid fast:", derived_abs_humidity, t_in, rh_in, INPUTS, count);
+    bench_metric("Abs humid reference:", reference_abs_humidity, t_in, rh_in, INPUTS, count);
+    bench_metric("Heat index:", derived_heat_index, t_in, rh_in, INPUTS, count);
+    bench("All fast:", derived_compute, t_in, rh_in, INPUTS, count);
+    bench("All reference:", derived_reference, t_in, rh_in, INPUTS, count);
+
+    if ((max_dp > MAX_DEW_POINT_ERROR) || (max_ah > MAX_ABS_HUMIDITY_ERROR))
+    {
+        printf("FAIL: error outside the bound\n");
+        return 1;
+    }
+    return 0;
+}
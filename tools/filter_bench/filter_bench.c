@@ -0,0 +1,274 @@
+/*
+    Host benchmark for the signal conditioning chain
+
+    First checks the pieces with known inputs: signed 16 bit decoding of negative temperatures
+    (regmap.c), the median, the EMA and the rate of change rejection, including a real step.
+
+    Then runs a synthetic temperature signal (slow sine plus read noise, with the odd glitch
+    read and a real step half way through) through signal_filter.c with the firmware's default
+    settings, or the ones given on the command line. Reports the throughput, how many glitches
+    got through and the error against the clean signal before and after filtering.
+
+    Exits with an error if a check fails, a glitch got through, or the filtered signal is
+    further from the clean one than the raw readings.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "signal_filter.h"
+#include "regmap.h"
+#include "sensor_map.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL: " __VA_ARGS__); printf("\n"); } } while (0)
+
+static bool near(float a, float b)
+{
+    return fabsf(a - b) < 1e-4f;
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static float noise(float amplitude)
+{
+    return amplitude * ((float)rand() / RAND_MAX * 2.0f - 1.0f);
+}
+
+/**
+ * @brief Register decoding: the XY-MD02 reports below zero as two's complement
+ */
+static void test_decode(void)
+{
+    const uint16_t minus_20[] = { 0xFF38 };     // -200
+    const uint16_t minus_0_1[] = { 0xFFFF };    // -1
+    const uint16_t plus_22_5[] = { 0x00E1 };    // 225
+    const uint16_t most_negative[] = { 0x8000 };
+    const uint16_t most_positive[] = { 0x7FFF };
+
+    CHECK(near(regmap_decode_s16(minus_20, 0.1f), -20.0f), "s16 0xFF38 = %f", regmap_decode_s16(minus_20, 0.1f));
+    CHECK(near(regmap_decode_s16(minus_0_1, 0.1f), -0.1f), "s16 0xFFFF = %f", regmap_decode_s16(minus_0_1, 0.1f));
+    CHECK(near(regmap_decode_s16(plus_22_5, 0.1f), 22.5f), "s16 0x00E1 = %f", regmap_decode_s16(plus_22_5, 0.1f));
+    CHECK(near(regmap_decode_s16(most_negative, 0.1f), -3276.8f), "s16 0x8000 = %f", regmap_decode_s16(most_negative, 0.1f));
+    CHECK(near(regmap_decode_s16(most_positive, 0.1f), 3276.7f), "s16 0x7FFF = %f", regmap_decode_s16(most_positive, 0.1f));
+    CHECK(near(regmap_decode_u16(minus_20, 0.1f), 6533.6f), "u16 0xFF38 = %f", regmap_decode_u16(minus_20, 0.1f));
+
+    // The built-in map must decode both values as signed
+    regmap_t map;
+    regmap_builtin(&map, 1);
+    const regmap_param_t *t = &map.params[CID_INP_DATA_TEMPERATURE];
+    const regmap_param_t *rh = &map.params[CID_INP_DATA_HUMIDITY];
+    CHECK(t->decode == regmap_decode_s16, "built-in temperature is not decoded as signed 16 bit");
+    CHECK(rh->decode == regmap_decode_s16, "built-in humidity is not decoded as signed 16 bit");
+    CHECK(near(t->decode(minus_20, t->scale), -20.0f), "built-in temperature 0xFF38 = %f", t->decode(minus_20, t->scale));
+}
+
+static void test_median(void)
+{
+    const float three[] = { 3.0f, 1.0f, 2.0f };
+    const float five[] = { 5.0f, -1.0f, 100.0f, 2.0f, 3.0f };
+    const float two[] = { 1.0f, 4.0f };
+    const float nine[] = { -9, -8, -7, -6, -5, -4, -3, -2, -1 };
+    CHECK(near(signal_median(three, 3), 2.0f), "median of 3");
+    CHECK(near(signal_median(five, 5), 3.0f), "median of 5");
+    CHECK(near(signal_median(two, 2), 2.5f), "median of 2");
+    CHECK(near(signal_median(nine, 9), -5.0f), "median of 9");
+
+    // A single spike never reaches the output of a 3 wide median
+    signal_filter_cfg_t cfg = { .median_n = 3, .ema_alpha = 1.0f, .max_rate = 0.0f, .max_rejects = 3 };
+    signal_filter_t filter;
+    signal_filter_init(&filter, &cfg);
+    const float in[] = { -4.0f, -4.0f, 55.0f, -4.0f, -4.0f, -60.0f, -4.0f };
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++)
+    {
+        float out = 0.0f;
+        CHECK(signal_filter_apply(&filter, in[i], i * 5000, &out), "median reading %zu rejected", i);
+        CHECK(near(out, -4.0f), "median reading %zu: %f", i, out);
+    }
+
+    // Window sizes are clamped to odd, up to SIGNAL_MEDIAN_MAX
+    cfg.median_n = 4;
+    signal_filter_init(&filter, &cfg);
+    CHECK(filter.cfg.median_n == 3, "median 4 clamped to %u", filter.cfg.median_n);
+    cfg.median_n = 20;
+    signal_filter_init(&filter, &cfg);
+    CHECK(filter.cfg.median_n == SIGNAL_MEDIAN_MAX, "median 20 clamped to %u", filter.cfg.median_n);
+}
+
+static void test_ema(void)
+{
+    signal_filter_cfg_t cfg = { .median_n = 1, .ema_alpha = 0.5f, .max_rate = 0.0f, .max_rejects = 3 };
+    signal_filter_t filter;
+    float out = 0.0f;
+
+    signal_filter_init(&filter, &cfg);
+    signal_filter_apply(&filter, -10.0f, 0, &out);
+    CHECK(near(out, -10.0f), "EMA starts at the first reading: %f", out);
+    signal_filter_apply(&filter, 10.0f, 5000, &out);
+    CHECK(near(out, 0.0f), "EMA step 1: %f", out);
+    signal_filter_apply(&filter, 10.0f, 10000, &out);
+    CHECK(near(out, 5.0f), "EMA step 2: %f", out);
+    signal_filter_apply(&filter, 10.0f, 15000, &out);
+    CHECK(near(out, 7.5f), "EMA step 3: %f", out);
+
+    // Out of range weights disable the EMA
+    cfg.ema_alpha = 0.0f;
+    signal_filter_init(&filter, &cfg);
+    signal_filter_apply(&filter, 1.0f, 0, &out);
+    signal_filter_apply(&filter, 3.0f, 5000, &out);
+    CHECK(near(out, 3.0f), "EMA with alpha 0 is not disabled: %f", out);
+}
+
+static void test_rate_limit(void)
+{
+    // 5 units a minute, so 0.41 in a 5 s poll
+    signal_filter_cfg_t cfg = { .median_n = 1, .ema_alpha = 1.0f, .max_rate = 5.0f / 60, .max_rejects = 3 };
+    signal_filter_t filter;
+    float out = 0.0f;
+
+    signal_filter_init(&filter, &cfg);
+    CHECK(signal_filter_apply(&filter, -12.0f, 0, &out) && near(out, -12.0f), "first reading");
+    CHECK(!signal_filter_apply(&filter, -72.0f, 5000, &out) && near(out, -12.0f), "glitch down accepted");
+    CHECK(!signal_filter_apply(&filter, 48.0f, 10000, &out) && near(out, -12.0f), "glitch up accepted");
+    CHECK(signal_filter_apply(&filter, -11.8f, 15000, &out) && near(out, -11.8f), "small change rejected");
+    CHECK(filter.rejected == 2, "%u rejected, expected 2", filter.rejected);
+
+    // A real step is rejected max_rejects times, then taken
+    uint32_t t = 20000;
+    for (int i = 0; i < cfg.max_rejects; i++, t += 5000)
+    {
+        CHECK(!signal_filter_apply(&filter, -1.0f, t, &out), "step reading %d accepted early", i);
+    }
+    CHECK(signal_filter_apply(&filter, -1.0f, t, &out) && near(out, -1.0f), "step not accepted: %f", out);
+    CHECK(filter.steps == 1, "%u steps, expected 1", filter.steps);
+    CHECK(signal_filter_apply(&filter, -1.1f, t + 5000, &out) && near(out, -1.1f), "reading after the step");
+
+    // A long gap allows a bigger change
+    CHECK(signal_filter_apply(&filter, 3.0f, t + 5000 + 60000, &out), "change after a gap rejected");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n count    readings (default 100000)\n"
+            "  -p period   poll period in ms (default 5000)\n"
+            "  -m median   median window (default 3)\n"
+            "  -a alpha    EMA weight of a new reading, 0-1 (default 1)\n"
+            "  -r rate     largest change in units per minute (default 5.0)\n"
+            "  -x rejects  rejections before a step is accepted (default 3)\n"
+            "  -g percent  glitch reads (default 1)\n"
+            "  -s seed     random seed (default 1)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = 100000, period_ms = 5000, glitch_pct = 1, seed = 1;
+    signal_filter_cfg_t cfg = { .median_n = 3, .ema_alpha = 1.0f, .max_rate = 5.0f / 60, .max_rejects = 3 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:m:a:r:x:g:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 'p': period_ms = strtoul(optarg, NULL, 0); break;
+            case 'm': cfg.median_n = atoi(optarg); break;
+            case 'a': cfg.ema_alpha = atof(optarg); break;
+            case 'r': cfg.max_rate = atof(optarg) / 60; break;
+            case 'x': cfg.max_rejects = atoi(optarg); break;
+            case 'g': glitch_pct = strtoul(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    srand(seed);
+
+    test_decode();
+    test_median();
+    test_ema();
+    test_rate_limit();
+    printf("Unit checks: %s\n", failures ? "failed" : "passed");
+
+    float *clean = malloc(count * sizeof(float));
+    float *raw = malloc(count * sizeof(float));
+    uint8_t *glitch = calloc(count, 1);
+    if (!clean || !raw || !glitch)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // A daily cycle around -5C (the sensor must handle below zero), with a 10C step half way
+        float t = (float)i * period_ms / 1000.0f;
+        clean[i] = -5.0f + 8.0f * sinf(t * 2.0f * (float)M_PI / 86400.0f) + ((i >= count / 2) ? 10.0f : 0.0f);
+        // The sensor reports in 0.1 steps
+        raw[i] = roundf((clean[i] + noise(0.1f)) * 10.0f) / 10.0f;
+        if ((uint32_t)(rand() % 100) < glitch_pct)
+        {
+            raw[i] += (rand() & 1) ? 60.0f : -60.0f;
+            glitch[i] = 1;
+        }
+    }
+
+    signal_filter_t filter;
+    signal_filter_init(&filter, &cfg);
+    uint32_t passed_glitches = 0;
+    double raw_err = 0, out_err = 0;
+    float out = 0.0f;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bool accepted = signal_filter_apply(&filter, raw[i], i * period_ms, &out);
+        if (accepted && glitch[i])
+        {
+            passed_glitches++;
+        }
+        raw_err += (raw[i] - clean[i]) * (raw[i] - clean[i]);
+        out_err += (out - clean[i]) * (out - clean[i]);
+    }
+
+    signal_filter_init(&filter, &cfg);
+    double start = now_s();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        signal_filter_apply(&filter, raw[i], i * period_ms, &out);
+    }
+    double elapsed = now_s() - start;
+
+    uint32_t glitches = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        glitches += glitch[i];
+    }
+    printf("Readings:    %u, %u glitches\n", count, glitches);
+    printf("Rejected:    %u, %u steps accepted, %u glitches passed\n", filter.rejected, filter.steps, passed_glitches);
+    double raw_rms = sqrt(raw_err / count), out_rms = sqrt(out_err / count);
+    printf("RMS error:   raw %.3f, filtered %.3f\n", raw_rms, out_rms);
+    printf("Throughput:  %.1f Mreadings/s (%.1f ns/reading)\n", count / elapsed / 1e6, elapsed / count * 1e9);
+
+    free(clean);
+    free(raw);
+    free(glitch);
+
+    CHECK(passed_glitches == 0, "%u glitches got through the filter", passed_glitches);
+    CHECK(out_rms <= raw_rms, "filtered RMS error %.3f is worse than raw %.3f", out_rms, raw_rms);
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+    Host unit tests of the Modbus RTU frame and timing core
+
+    Checks main/mb_rtu.c against frames with known CRCs (worked out independently of
+    main/mb_crc.c):
+
+        - FC03/FC04 read requests, and requests with bad arguments
+        - FC03/FC04 responses, including the XY-MD02 temperature/humidity read
+        - exception responses
+        - short frames, bad CRCs, and responses from the wrong slave, to the wrong function
+          or with the wrong byte count
+        - character time, t1.5, t3.5 and frame time at several baud rates
+
+    Exits with an error if any check fails.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mb_rtu.h"
+
+static int checks;
+static int failures;
+
+#define CHECK(cond, ...) do { checks++; if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+#define CHECK_STATUS(got, want, what) \
+    CHECK((got) == (want), "%s: got %s, expected %s", what, mb_rtu_status_name(got), mb_rtu_status_name(want))
+
+static void test_requests(void)
+{
+    static const uint8_t fc03[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+    static const uint8_t fc03_spec[] = { 0x11, 0x03, 0x00, 0x6B, 0x00, 0x03, 0x76, 0x87 };
+    static const uint8_t fc04[] = { 0x01, 0x04, 0x00, 0x01, 0x00, 0x02, 0x20, 0x0B };
+    uint8_t frame[MB_RTU_READ_REQUEST_LEN];
+
+    CHECK(mb_rtu_build_read_request(frame, 1, MB_RTU_FUNC_READ_HOLDING, 0, 10) == sizeof(fc03) &&
+          memcmp(frame, fc03, sizeof(fc03)) == 0, "FC03 request");
+    CHECK(mb_rtu_build_read_request(frame, 0x11, MB_RTU_FUNC_READ_HOLDING, 0x6B, 3) == sizeof(fc03_spec) &&
+          memcmp(frame, fc03_spec, sizeof(fc03_spec)) == 0, "FC03 request from the spec");
+    CHECK(mb_rtu_build_read_request(frame, 1, MB_RTU_FUNC_READ_INPUT, 1, 2) == sizeof(fc04) &&
+          memcmp(frame, fc04, sizeof(fc04)) == 0, "FC04 request");
+
+    CHECK(mb_rtu_build_read_request(frame, 1, MB_RTU_FUNC_READ_INPUT, 1, 0) == 0, "zero registers accepted");
+    CHECK(mb_rtu_build_read_request(frame, 1, MB_RTU_FUNC_READ_INPUT, 1, MB_RTU_MAX_READ_REGS + 1) == 0,
+          "%d registers accepted", MB_RTU_MAX_READ_REGS + 1);
+    CHECK(mb_rtu_build_read_request(frame, 1, MB_RTU_FUNC_READ_INPUT, 1, MB_RTU_MAX_READ_REGS) == MB_RTU_READ_REQUEST_LEN,
+          "%d registers refused", MB_RTU_MAX_READ_REGS);
+    CHECK(mb_rtu_build_read_request(frame, 1, 0x06, 1, 1) == 0, "write function accepted");
+}
+
+static void test_responses(void)
+{
+    // XY-MD02: 22.5C, 38.4%RH
+    static const uint8_t fc04[] = { 0x01, 0x04, 0x04, 0x00, 0xE1, 0x01, 0x80, 0xAB, 0x82 };
+    // Negative temperature (-20.0C as int16), 38.4%RH
+    static const uint8_t fc03[] = { 0x01, 0x03, 0x04, 0xFF, 0x38, 0x01, 0x80, 0x4B, 0xDA };
+    uint16_t regs[2];
+
+    CHECK(mb_rtu_read_response_len(2) == sizeof(fc04), "response length for 2 registers");
+
+    memset(regs, 0, sizeof(regs));
+    CHECK_STATUS(mb_rtu_parse_read_response(fc04, sizeof(fc04), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL), MB_RTU_OK, "FC04 response");
+    CHECK((regs[0] == 0x00E1) && (regs[1] == 0x0180), "FC04 registers %04X %04X", regs[0], regs[1]);
+
+    memset(regs, 0, sizeof(regs));
+    CHECK_STATUS(mb_rtu_parse_read_response(fc03, sizeof(fc03), 1, MB_RTU_FUNC_READ_HOLDING, 2, regs, NULL), MB_RTU_OK, "FC03 response");
+    CHECK(((int16_t)regs[0] == -200) && (regs[1] == 0x0180), "FC03 registers %04X %04X", regs[0], regs[1]);
+
+    // Extra bytes after a complete frame are ignored
+    uint8_t longer[sizeof(fc04) + 2];
+    memcpy(longer, fc04, sizeof(fc04));
+    longer[sizeof(fc04)] = 0x55;
+    longer[sizeof(fc04) + 1] = 0xAA;
+    CHECK_STATUS(mb_rtu_parse_read_response(longer, sizeof(longer), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL), MB_RTU_OK, "trailing bytes");
+}
+
+static void test_exceptions(void)
+{
+    // Illegal data address for FC04, and the well known FC03 example
+    static const uint8_t fc04_exception[] = { 0x01, 0x84, 0x02, 0xC2, 0xC1 };
+    static const uint8_t fc03_exception[] = { 0x01, 0x83, 0x02, 0xC0, 0xF1 };
+    uint16_t regs[2];
+    uint8_t code = 0;
+
+    CHECK_STATUS(mb_rtu_parse_read_response(fc04_exception, sizeof(fc04_exception), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, &code),
+                 MB_RTU_EXCEPTION, "FC04 exception");
+    CHECK(code == 0x02, "FC04 exception code %u", code);
+    code = 0;
+    CHECK_STATUS(mb_rtu_parse_read_response(fc03_exception, sizeof(fc03_exception), 1, MB_RTU_FUNC_READ_HOLDING, 2, regs, &code),
+                 MB_RTU_EXCEPTION, "FC03 exception");
+    CHECK(code == 0x02, "FC03 exception code %u", code);
+    // The exception code is optional
+    CHECK_STATUS(mb_rtu_parse_read_response(fc03_exception, sizeof(fc03_exception), 1, MB_RTU_FUNC_READ_HOLDING, 2, regs, NULL),
+                 MB_RTU_EXCEPTION, "exception without code");
+    // An exception to the other function is not ours
+    CHECK(mb_rtu_parse_read_response(fc03_exception, sizeof(fc03_exception), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL) != MB_RTU_EXCEPTION,
+          "exception to another function taken");
+
+    uint8_t bad[sizeof(fc04_exception)];
+    memcpy(bad, fc04_exception, sizeof(bad));
+    bad[4] ^= 0x01;
+    CHECK_STATUS(mb_rtu_parse_read_response(bad, sizeof(bad), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL), MB_RTU_BAD_CRC, "exception with bad CRC");
+    CHECK_STATUS(mb_rtu_parse_read_response(fc04_exception, sizeof(fc04_exception), 2, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL),
+                 MB_RTU_BAD_ADDRESS, "exception from another slave");
+    for (size_t len = 2; len < sizeof(fc04_exception); len++)
+    {
+        CHECK_STATUS(mb_rtu_parse_read_response(fc04_exception, len, 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL),
+                     MB_RTU_INCOMPLETE, "short exception");
+    }
+}
+
+static void test_bad_frames(void)
+{
+    static const uint8_t fc04[] = { 0x01, 0x04, 0x04, 0x00, 0xE1, 0x01, 0x80, 0xAB, 0x82 };
+    // Same registers with valid CRCs but from slave 2, as FC03, and with a byte count of 2
+    static const uint8_t other_slave[] = { 0x02, 0x04, 0x04, 0x00, 0xE1, 0x01, 0x80, 0x98, 0x82 };
+    static const uint8_t other_function[] = { 0x01, 0x03, 0x04, 0x00, 0xE1, 0x01, 0x80, 0xAA, 0x35 };
+    static const uint8_t bad_count[] = { 0x01, 0x04, 0x02, 0x00, 0xE1, 0x01, 0x80, 0x23, 0x82 };
+    uint16_t regs[2];
+
+    for (size_t len = 0; len < sizeof(fc04); len++)
+    {
+        CHECK_STATUS(mb_rtu_parse_read_response(fc04, len, 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL), MB_RTU_INCOMPLETE, "short frame");
+    }
+    // Every single bit error is caught
+    for (size_t i = 0; i < sizeof(fc04); i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            uint8_t bad[sizeof(fc04)];
+            memcpy(bad, fc04, sizeof(bad));
+            bad[i] ^= (uint8_t)(1 << bit);
+            mb_rtu_status_t status = mb_rtu_parse_read_response(bad, sizeof(bad), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL);
+            // Flipping the function into an exception makes the frame look like a (bad) exception
+            CHECK((status == MB_RTU_BAD_CRC) || ((i == 1) && (bit == 7)),
+                  "bit %d of byte %zu: got %s", bit, i, mb_rtu_status_name(status));
+        }
+    }
+    CHECK_STATUS(mb_rtu_parse_read_response(other_slave, sizeof(other_slave), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL),
+                 MB_RTU_BAD_ADDRESS, "response from another slave");
+    CHECK_STATUS(mb_rtu_parse_read_response(other_function, sizeof(other_function), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL),
+                 MB_RTU_BAD_FUNCTION, "response to another function");
+    CHECK_STATUS(mb_rtu_parse_read_response(bad_count, sizeof(bad_count), 1, MB_RTU_FUNC_READ_INPUT, 2, regs, NULL),
+                 MB_RTU_BAD_LENGTH, "wrong byte count");
+}
+
+typedef struct
+{
+    uint32_t baudrate;
+    uint32_t char_us;
+    uint32_t t15_us;
+    uint32_t t35_us;
+} timing_vector_t;
+
+static void test_timing(void)
+{
+    // 11 bits per character, rounded up; t1.5/t3.5 fixed above 19200 baud
+    static const timing_vector_t vectors[] = {
+        { 1200,   9167, 13751, 32085 },
+        { 2400,   4584,  6876, 16044 },
+        { 4800,   2292,  3438,  8022 },
+        { 9600,   1146,  1719,  4011 },
+        { 19200,   573,   860,  2006 },
+        { 38400,   287,   750,  1750 },
+        { 57600,   191,   750,  1750 },
+        { 115200,   96,   750,  1750 },
+    };
+
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        const timing_vector_t *v = &vectors[i];
+        uint32_t char_us = mb_rtu_char_time_us(v->baudrate);
+        uint32_t t15 = mb_rtu_t15_us(v->baudrate);
+        uint32_t t35 = mb_rtu_t35_us(v->baudrate);
+        CHECK(char_us == v->char_us, "%u baud: character time %u us, expected %u", v->baudrate, char_us, v->char_us);
+        CHECK(t15 == v->t15_us, "%u baud: t1.5 %u us, expected %u", v->baudrate, t15, v->t15_us);
+        CHECK(t35 == v->t35_us, "%u baud: t3.5 %u us, expected %u", v->baudrate, t35, v->t35_us);
+        // Never shorter than the exact gap, or frames would be cut early
+        if (v->baudrate <= 19200)
+        {
+            double exact_char = 11e6 / v->baudrate;
+            CHECK(t15 >= 1.5 * exact_char, "%u baud: t1.5 below 1.5 characters", v->baudrate);
+            CHECK(t35 >= 3.5 * exact_char, "%u baud: t3.5 below 3.5 characters", v->baudrate);
+        }
+        CHECK(mb_rtu_frame_time_us(v->baudrate, MB_RTU_READ_REQUEST_LEN) == v->char_us * MB_RTU_READ_REQUEST_LEN,
+              "%u baud: frame time", v->baudrate);
+    }
+    CHECK(mb_rtu_char_time_us(0) == 0, "zero baud");
+}
+
+int main(void)
+{
+    test_requests();
+    test_responses();
+    test_exceptions();
+    test_bad_frames();
+    test_timing();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,412 @@
+/*
+    Host test of the Modbus TCP server
+
+    Runs the firmware's server (main/mb_tcp_server.c) on a local port in its own thread, in
+    front of a register cache filled the way the poller fills it, and talks to it with plain
+    TCP clients:
+
+        - reads answered from the cache, from several clients at once
+        - a pass-through read, deferred and completed 50ms later, while another client keeps
+          getting cache hits without waiting for it
+        - a request sent one byte at a time, and two requests in one segment
+        - exceptions for a bad function, an uncached range and an unknown unit
+        - a connection with a bad protocol id is dropped
+
+    Exits with an error if any check fails.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mb_tcp_server.h"
+#include "mb_regcache.h"
+
+#define FC_READ_HOLDING     (0x03)
+#define FC_READ_INPUT       (0x04)
+
+// Units served by the test handler
+#define UNIT_CACHED         (1)     // In the cache
+#define UNIT_PASSTHROUGH    (2)     // Deferred, as if sent to the bus
+#define PASSTHROUGH_MS      (50)    // Time a pass-through read takes
+
+#define CONCURRENT_CLIENTS  (4)
+#define READS_PER_CLIENT    (500)
+// Worst acceptable cache hit round trip on loopback while a pass-through is waiting
+#define MAX_HIT_LATENCY_MS  (20.0)
+
+static mb_tcp_server_t server;
+static mb_regcache_t cache;
+static volatile bool stop;
+static int failures;
+
+// Deferred request of each slot, only touched by the server thread
+static uint32_t deferred_until[MB_TCP_SERVER_MAX_CLIENTS];
+
+static uint32_t now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static double now_ms_f(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED); } } while (0)
+
+/**
+ * @brief Test handler: answers from the cache, defers reads to the pass-through unit
+ */
+static int handle_request(void *ctx, int slot, const mb_tcp_request_t *request, uint16_t *regs)
+{
+    (void)ctx;
+    if (request->unit_id == UNIT_PASSTHROUGH)
+    {
+        deferred_until[slot] = now_ms() + PASSTHROUGH_MS;
+        return MB_TCP_DEFERRED;
+    }
+    switch (mb_regcache_lookup(&cache, request->unit_id, request->function, request->reg_start,
+                               request->reg_count, 0, now_ms(), regs))
+    {
+        case MB_REGCACHE_HIT:
+            return 0;
+        case MB_REGCACHE_UNKNOWN_SLAVE:
+            return MB_TCP_EX_PATH_UNAVAILABLE;
+        default:
+            return MB_TCP_EX_ILLEGAL_ADDRESS;
+    }
+}
+
+static void *server_thread(void *arg)
+{
+    (void)arg;
+    while (!stop)
+    {
+        mb_tcp_server_poll(&server, mb_tcp_server_has_pending(&server) ? 5 : 50, now_ms());
+        for (int slot = 0; slot < MB_TCP_SERVER_MAX_CLIENTS; slot++)
+        {
+            mb_tcp_client_t *client = &server.clients[slot];
+            if (client->pending && ((int32_t)(now_ms() - deferred_until[slot]) >= 0))
+            {
+                // The "bus" answers with the register addresses
+                for (uint16_t i = 0; i < client->request.reg_count; i++)
+                {
+                    client->regs[i] = client->request.reg_start + i;
+                }
+                mb_tcp_server_complete(&server, slot, 0, now_ms());
+            }
+        }
+    }
+    return NULL;
+}
+
+static int connect_client(uint16_t port)
+{
+    struct sockaddr_in addr = { 0 };
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static size_t build_request(uint8_t *out, uint16_t tid, uint8_t unit, uint8_t function, uint16_t start, uint16_t count)
+{
+    uint8_t req[12] = {
+        tid >> 8, tid & 0xFF, 0, 0, 0, 6, unit, function, start >> 8, start & 0xFF, count >> 8, count & 0xFF
+    };
+    memcpy(out, req, sizeof(req));
+    return sizeof(req);
+}
+
+static bool recv_all(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(fd, buf + got, len - got, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads one response
+ * @returns the function code (with 0x80 set for an exception), or -1 if the connection closed
+ */
+static int read_response(int fd, uint16_t *tid, uint8_t *payload, size_t *payload_len)
+{
+    uint8_t hdr[MB_TCP_MBAP_LEN];
+    uint8_t pdu[MB_TCP_MAX_ADU];
+
+    if (!recv_all(fd, hdr, sizeof(hdr)))
+    {
+        return -1;
+    }
+    size_t len = ((hdr[4] << 8) | hdr[5]) - 1;
+    if ((len == 0) || (len > sizeof(pdu)) || !recv_all(fd, pdu, len))
+    {
+        return -1;
+    }
+    *tid = (hdr[0] << 8) | hdr[1];
+    *payload_len = len - 1;
+    memcpy(payload, pdu + 1, len - 1);
+    return pdu[0];
+}
+
+/**
+ * @brief Sends a read and checks the registers of the response against the expected ones
+ */
+static void check_read(int fd, uint16_t tid, uint8_t unit, uint8_t function, uint16_t start, uint16_t count,
+                       const uint16_t *expected)
+{
+    uint8_t out[16], payload[MB_TCP_MAX_ADU];
+    size_t len = build_request(out, tid, unit, function, start, count), payload_len;
+    uint16_t got_tid;
+
+    send(fd, out, len, 0);
+    int fc = read_response(fd, &got_tid, payload, &payload_len);
+    CHECK(fc == function, "unit %d read of %d: function %d", unit, start, fc);
+    CHECK(got_tid == tid, "transaction id %d, expected %d", got_tid, tid);
+    if ((fc != function) || (payload_len != 1U + count * 2) || (payload[0] != count * 2))
+    {
+        CHECK(false, "unit %d read of %d: %zu byte payload", unit, start, payload_len);
+        return;
+    }
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint16_t reg = (payload[1 + i * 2] << 8) | payload[2 + i * 2];
+        CHECK(reg == expected[i], "register %d is %d, expected %d", start + i, reg, expected[i]);
+    }
+}
+
+static void check_exception(int fd, uint8_t unit, uint8_t function, uint16_t start, uint16_t count, uint8_t code)
+{
+    uint8_t out[16], payload[MB_TCP_MAX_ADU];
+    size_t len = build_request(out, 77, unit, function, start, count), payload_len;
+    uint16_t tid;
+
+    send(fd, out, len, 0);
+    int fc = read_response(fd, &tid, payload, &payload_len);
+    CHECK((fc == (function | 0x80)) && (payload_len == 1) && (payload[0] == code),
+          "unit %d function %d: expected exception %d, got function %d code %d", unit, function, code, fc, payload[0]);
+}
+
+static const uint16_t input_regs[2] = { 235, 456 };    // 23.5C, 45.6%
+static uint16_t holding_regs[16];
+
+typedef struct
+{
+    uint16_t port;
+    double max_latency_ms;
+} hit_client_t;
+
+static void *hit_client(void *arg)
+{
+    hit_client_t *c = (hit_client_t *)arg;
+    int fd = connect_client(c->port);
+
+    for (int i = 0; i < READS_PER_CLIENT; i++)
+    {
+        double start = now_ms_f();
+        if (i & 1)
+        {
+            check_read(fd, i, UNIT_CACHED, FC_READ_HOLDING, 0x100 + (i % 8), 8, &holding_regs[i % 8]);
+        }
+        else
+        {
+            check_read(fd, i, UNIT_CACHED, FC_READ_INPUT, 1, 2, input_regs);
+        }
+        double latency = now_ms_f() - start;
+        c->max_latency_ms = (latency > c->max_latency_ms) ? latency : c->max_latency_ms;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void test_concurrent_hits(uint16_t port)
+{
+    pthread_t threads[CONCURRENT_CLIENTS];
+    hit_client_t clients[CONCURRENT_CLIENTS];
+
+    double start = now_ms_f();
+    for (int i = 0; i < CONCURRENT_CLIENTS; i++)
+    {
+        clients[i] = (hit_client_t){ .port = port };
+        pthread_create(&threads[i], NULL, hit_client, &clients[i]);
+    }
+    for (int i = 0; i < CONCURRENT_CLIENTS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ms_f() - start;
+    printf("%d clients x %d cache reads: %.1f ms, %.1f us per read\n", CONCURRENT_CLIENTS, READS_PER_CLIENT,
+           elapsed, elapsed * 1000.0 / (CONCURRENT_CLIENTS * READS_PER_CLIENT));
+}
+
+/**
+ * @brief A pass-through read must not hold up the cache hits of another client
+ */
+static void test_passthrough(uint16_t port)
+{
+    static const uint16_t expected[3] = { 10, 11, 12 };
+    uint8_t out[16];
+    int slow = connect_client(port);
+    int fast = connect_client(port);
+    double max_hit_ms = 0.0;
+
+    double start = now_ms_f();
+    send(slow, out, build_request(out, 500, UNIT_PASSTHROUGH, FC_READ_INPUT, 10, 3), 0);
+    int hits = 0;
+    while (now_ms_f() - start < PASSTHROUGH_MS * 0.8)
+    {
+        double hit_start = now_ms_f();
+        check_read(fast, hits, UNIT_CACHED, FC_READ_INPUT, 1, 2, input_regs);
+        double latency = now_ms_f() - hit_start;
+        max_hit_ms = (latency > max_hit_ms) ? latency : max_hit_ms;
+        hits++;
+    }
+
+    uint8_t payload[MB_TCP_MAX_ADU];
+    size_t payload_len;
+    uint16_t tid;
+    int fc = read_response(slow, &tid, payload, &payload_len);
+    double passthrough_ms = now_ms_f() - start;
+    CHECK((fc == FC_READ_INPUT) && (tid == 500) && (payload_len == 7), "pass-through response");
+    for (int i = 0; (i < 3) && (payload_len == 7); i++)
+    {
+        CHECK(((payload[1 + i * 2] << 8) | payload[2 + i * 2]) == expected[i], "pass-through register %d", i);
+    }
+    CHECK(passthrough_ms >= PASSTHROUGH_MS - 1, "pass-through answered after %.1f ms", passthrough_ms);
+    CHECK(max_hit_ms < MAX_HIT_LATENCY_MS, "cache hit took %.1f ms during a pass-through", max_hit_ms);
+    printf("Pass-through: %.1f ms, meanwhile %d cache reads on another client, slowest %.2f ms\n",
+           passthrough_ms, hits, max_hit_ms);
+    close(slow);
+    close(fast);
+}
+
+/**
+ * @brief Requests split into single bytes, two requests in one segment and a deferred request
+ * followed by a hit on the same connection, which must be answered in order
+ */
+static void test_framing(uint16_t port)
+{
+    uint8_t out[32], payload[MB_TCP_MAX_ADU];
+    size_t payload_len;
+    uint16_t tid;
+    int fd = connect_client(port);
+
+    size_t len = build_request(out, 1000, UNIT_CACHED, FC_READ_INPUT, 1, 2);
+    for (size_t i = 0; i < len; i++)
+    {
+        send(fd, &out[i], 1, 0);
+        usleep(1000);
+    }
+    int fc = read_response(fd, &tid, payload, &payload_len);
+    CHECK((fc == FC_READ_INPUT) && (tid == 1000), "byte at a time request");
+
+    len = build_request(out, 1001, UNIT_CACHED, FC_READ_INPUT, 1, 1);
+    len += build_request(out + len, 1002, UNIT_CACHED, FC_READ_INPUT, 2, 1);
+    send(fd, out, len, 0);
+    CHECK((read_response(fd, &tid, payload, &payload_len) == FC_READ_INPUT) && (tid == 1001), "first pipelined");
+    CHECK((read_response(fd, &tid, payload, &payload_len) == FC_READ_INPUT) && (tid == 1002), "second pipelined");
+
+    len = build_request(out, 1003, UNIT_PASSTHROUGH, FC_READ_HOLDING, 7, 1);
+    len += build_request(out + len, 1004, UNIT_CACHED, FC_READ_INPUT, 1, 2);
+    send(fd, out, len, 0);
+    CHECK((read_response(fd, &tid, payload, &payload_len) == FC_READ_HOLDING) && (tid == 1003), "deferred first");
+    CHECK((read_response(fd, &tid, payload, &payload_len) == FC_READ_INPUT) && (tid == 1004), "hit after deferred");
+    close(fd);
+}
+
+static void test_exceptions(uint16_t port)
+{
+    int fd = connect_client(port);
+
+    check_exception(fd, UNIT_CACHED, 0x06, 1, 1, MB_TCP_EX_ILLEGAL_FUNCTION);
+    check_exception(fd, UNIT_CACHED, FC_READ_INPUT, 1, 0, MB_TCP_EX_ILLEGAL_VALUE);
+    check_exception(fd, UNIT_CACHED, FC_READ_INPUT, 1, 126, MB_TCP_EX_ILLEGAL_VALUE);
+    check_exception(fd, UNIT_CACHED, FC_READ_INPUT, 2, 2, MB_TCP_EX_ILLEGAL_ADDRESS);
+    check_exception(fd, 9, FC_READ_INPUT, 1, 1, MB_TCP_EX_PATH_UNAVAILABLE);
+    // Still usable after the exceptions
+    check_read(fd, 1, UNIT_CACHED, FC_READ_INPUT, 1, 2, input_regs);
+    close(fd);
+
+    // Not Modbus TCP: protocol id 1
+    uint8_t out[16], payload[MB_TCP_MAX_ADU];
+    size_t len = build_request(out, 1, UNIT_CACHED, FC_READ_INPUT, 1, 1), payload_len;
+    uint16_t tid;
+    out[3] = 1;
+    fd = connect_client(port);
+    send(fd, out, len, 0);
+    CHECK(read_response(fd, &tid, payload, &payload_len) < 0, "bad protocol id must drop the connection");
+    close(fd);
+}
+
+int main(void)
+{
+    pthread_t thread;
+
+    mb_regcache_init(&cache);
+    for (int i = 0; i < 16; i++)
+    {
+        holding_regs[i] = 0x1000 + i;
+    }
+    mb_regcache_store(&cache, UNIT_CACHED, FC_READ_INPUT, 1, 2, input_regs, now_ms());
+    mb_regcache_store(&cache, UNIT_CACHED, FC_READ_HOLDING, 0x100, 16, holding_regs, now_ms());
+
+    int err = mb_tcp_server_init(&server, 0, CONCURRENT_CLIENTS + 2, 0, handle_request, NULL);
+    if (err != 0)
+    {
+        fprintf(stderr, "Server init failed: %s\n", strerror(err));
+        return 1;
+    }
+    uint16_t port = mb_tcp_server_port(&server);
+    pthread_create(&thread, NULL, server_thread, NULL);
+
+    test_concurrent_hits(port);
+    test_passthrough(port);
+    test_framing(port);
+    test_exceptions(port);
+
+    stop = true;
+    pthread_join(thread, NULL);
+    printf("Server: %u connections, %u requests, %u exceptions, %u deferred, %u dropped\n",
+           server.connections, server.requests, server.exceptions, server.deferred, server.dropped);
+    mb_tcp_server_close(&server);
+
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
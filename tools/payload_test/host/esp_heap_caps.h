@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+
+#define MALLOC_CAP_8BIT         (1 << 2)
+
+static inline size_t heap_caps_get_largest_free_block(int caps) { (void)caps; return 0; }
@@ -0,0 +1,4 @@
+#pragma once
+
+// Only the type, the host build has no flash spill
+typedef struct esp_partition esp_partition_t;
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+static inline uint32_t esp_get_free_heap_size(void) { return 0; }
+static inline uint32_t esp_get_minimum_free_heap_size(void) { return 0; }
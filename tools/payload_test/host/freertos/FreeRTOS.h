@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int portMUX_TYPE;
+
+#define configTICK_RATE_HZ              (100)
+#define portMUX_INITIALIZER_UNLOCKED    (0)
+#define portENTER_CRITICAL(mux)         ((void)(mux))
+#define portEXIT_CRITICAL(mux)          ((void)(mux))
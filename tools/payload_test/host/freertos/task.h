@@ -0,0 +1,8 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+// Ticks since the test started, advanced by payload_test.c
+extern TickType_t host_ticks;
+
+static inline TickType_t xTaskGetTickCount(void) { return host_ticks; }
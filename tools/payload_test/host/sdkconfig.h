@@ -0,0 +1,29 @@
+/*
+    Host configuration for payload_test: both publisher backends, the RAM sample queue and
+    the derived fields, as a ThingSpeak build with them selected would have. The broker
+    encoding is JSON unless the Makefile picks CBOR or packed.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#pragma once
+
+#define CONFIG_THINKSPEAK_ENABLE 1
+#define CONFIG_PUBLISHER_THINGSPEAK 1
+#define CONFIG_PUBLISHER_BROKER 1
+#define CONFIG_THINKSPEAK_DERIVED_FIELDS 1
+#define CONFIG_THINKSPEAK_RESOLUTION_RAW 1
+#define CONFIG_THINKSPEAK_CHANNELID 1234567
+#define CONFIG_THINKSPEAK_CHANNEL_WRITE_KEY "0123456789ABCDEF"
+#define CONFIG_THINKSPEAK_MQTT_KEY "MQTTKEY"
+#define CONFIG_BROKER_URL "mqtt://mqtt.thingspeak.com"
+#define CONFIG_PUBLISH_BROKER_URL "mqtt://broker.local"
+#define CONFIG_PUBLISH_BROKER_USERNAME ""
+#define CONFIG_PUBLISH_BROKER_PASSWORD ""
+#define CONFIG_PUBLISH_TOPIC_PREFIX "temp_modbus"
+#if !defined(CONFIG_PUBLISH_ENCODING_CBOR) && !defined(CONFIG_PUBLISH_ENCODING_PACKED)
+#define CONFIG_PUBLISH_ENCODING_JSON 1
+#endif
+#define CONFIG_SAMPLE_QUEUE_LEN 64
+#define CONFIG_MQTT_PAYLOAD_LEN 256
+#define CONFIG_MQTT_PAYLOAD_BUFFERS 2
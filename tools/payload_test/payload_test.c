@@ -0,0 +1,243 @@
+/*
+    Host test that the publish path does not touch the heap
+
+    Builds the publish side of the firmware on a host: the sample queue, both publisher
+    backends (ThingSpeak and broker), the payload encodings, the derived metrics and the
+    payload pool. Runs thousands of publish cycles the way mqtt.c does: stamp a sample, queue
+    it, send the queued samples through each backend (with outages and failed sends along
+    the way) and send a status now and then. malloc, calloc and realloc are wrapped at link
+    time, and the test fails if the firmware code calls any of them during the cycles, if a
+    payload buffer is not returned to the pool, or if a payload is malformed.
+
+    The bulk-update upload (bulk_update.c) is not covered: its body is a static buffer, but
+    esp_http_client allocates inside IDF on every request.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "freertos/task.h"
+#include "modbus.h"
+#include "sample_queue.h"
+#include "payload_pool.h"
+#include "publisher.h"
+
+#define DRAIN_BATCH     (4)
+
+TickType_t host_ticks = 0;
+
+static bool counting = false;
+static uint32_t heap_calls = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    if (counting)
+    {
+        heap_calls++;
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    if (counting)
+    {
+        heap_calls++;
+    }
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    if (counting)
+    {
+        heap_calls++;
+    }
+    return __real_realloc(p, size);
+}
+
+/*
+    The two values of the default sensor map, in place of modbus.c
+*/
+static const regmap_param_t params[] = {
+    { .scale = 0.1f, .slave = 1, .reg_type = REGMAP_REG_INPUT, .reg_start = 1, .reg_count = 1,
+      .flags = REGMAP_FLAG_SIGNED, .scale_exp = -1, .unit = "C", .name = "Temperature" },
+    { .scale = 0.1f, .slave = 1, .reg_type = REGMAP_REG_INPUT, .reg_start = 2, .reg_count = 1,
+      .flags = REGMAP_FLAG_SIGNED, .scale_exp = -1, .unit = "%", .name = "Humidity" },
+};
+
+uint16_t modbus_cid_count(void)
+{
+    return sizeof(params) / sizeof(params[0]);
+}
+
+const regmap_param_t *modbus_cid_param(uint16_t cid)
+{
+    return &params[cid];
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL: " __VA_ARGS__); printf("\n"); } } while (0)
+
+typedef struct
+{
+    const publisher_t *backend;
+    bool thingspeak;            // Payloads are field1=...
+    bool online;
+    uint32_t sends;
+    uint32_t samples;
+} sink_t;
+
+static uint32_t cycle = 0;
+
+/**
+ * @brief Stands in for esp_mqtt_client_publish(): checks the payload, and fails while offline
+ */
+static int fake_send(void *ctx, const char *topic, const void *data, size_t len)
+{
+    sink_t *sink = (sink_t *)ctx;
+    if (!sink->online)
+    {
+        return -1;
+    }
+    sink->sends++;
+    CHECK((topic != NULL) && (topic[0] != '\0'), "%s: empty topic", sink->backend->name);
+    if (len == 0)
+    {
+        const char *text = (const char *)data;
+        size_t n = strlen(text);
+        CHECK((n > 0) && (n < PAYLOAD_LEN), "%s: payload length %zu", sink->backend->name, n);
+        if (sink->thingspeak)
+        {
+            CHECK((strncmp(text, "field1=", 7) == 0) || (strncmp(text, "status=", 7) == 0),
+                  "%s: payload '%s'", sink->backend->name, text);
+        }
+    }
+    else
+    {
+        // CBOR and packed values are binary, with their length given
+        CHECK((data != NULL) && (len <= PAYLOAD_LEN), "%s: binary payload length %zu", sink->backend->name, len);
+    }
+    return (int)sink->sends;
+}
+
+static void drain(sink_t *sink)
+{
+    sample_t sample;
+    for (int i = 0; i < DRAIN_BATCH; i++)
+    {
+        if (!sample_queue_front(&sample) || !sink->backend->send_sample(&sample, fake_send, sink))
+        {
+            break;
+        }
+        sample_queue_pop();
+        sink->samples++;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n count    publish cycles (default 20000)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t cycles = 20000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': cycles = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    sink_t sinks[] = {
+        { .backend = &publisher_thingspeak, .thingspeak = true },
+        { .backend = &publisher_broker },
+    };
+    const int num_sinks = sizeof(sinks) / sizeof(sinks[0]);
+
+    // Set up is allowed to allocate, as it does at boot
+    sample_queue_init();
+    for (int i = 0; i < num_sinks; i++)
+    {
+        sinks[i].backend->init();
+    }
+    char status[PAYLOAD_LEN];
+    memset(status, 'x', sizeof(status) - 1);
+    status[sizeof(status) - 1] = '\0';
+
+    counting = true;
+    uint32_t calls_before = heap_calls;
+    for (cycle = 0; cycle < cycles; cycle++)
+    {
+        host_ticks += 60 * configTICK_RATE_HZ;
+
+        // One sink at a time drains the shared queue, the other is down for a while now and then
+        sink_t *sink = &sinks[(cycle / 1000) % num_sinks];
+        sink->online = (cycle % 300) >= 50;
+
+        sample_t sample = { 0 };
+        sample.count = modbus_cid_count();
+        sample.values[CID_INP_DATA_TEMPERATURE] = -40.0f + (float)(cycle % 1000) / 10.0f;
+        sample.values[CID_INP_DATA_HUMIDITY] = (float)(cycle % 1001) / 10.0f;
+        sample_stamp(&sample);
+        sample_queue_push(&sample);
+
+        if (sink->online)
+        {
+            if ((cycle % 300) == 50)
+            {
+                sink->backend->send_status("ONLINE", fake_send, sink);
+            }
+            if ((cycle % 60) == 0)
+            {
+                // As long as the metrics status gets
+                sink->backend->send_status(status, fake_send, sink);
+            }
+            drain(sink);
+        }
+
+        payload_pool_stats_t stats;
+        payload_pool_get_stats(&stats);
+        CHECK(stats.in_use == 0, "cycle %u: %u payload buffers not returned", cycle, stats.in_use);
+        if (heap_calls != calls_before)
+        {
+            CHECK(false, "cycle %u: %u heap allocations", cycle, heap_calls - calls_before);
+            calls_before = heap_calls;
+        }
+    }
+    counting = false;
+
+    payload_pool_stats_t stats;
+    payload_pool_get_stats(&stats);
+    printf("%u cycles, %u samples sent, %u queued, %u messages, %u payload buffers used (high water %u, %u failures), %u heap allocations\n",
+           cycles, sinks[0].samples + sinks[1].samples, sample_queue_count(), sinks[0].sends + sinks[1].sends,
+           stats.allocs, stats.high_water, stats.failures, heap_calls);
+    CHECK(stats.failures == 0, "%u payload requests found the pool empty", stats.failures);
+    CHECK(stats.allocs > 0, "the pool was never used");
+    CHECK(heap_calls == 0, "%u heap allocations in the publish path", heap_calls);
+
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+    Register map generator
+
+    Turns a text description of the sensors on the bus into the binary register map the
+    firmware loads from NVS (see main/regmap.h), or decodes and checks an existing blob.
+    One value per line:
+
+        name unit slave input|holding reg regs signed|unsigned scale_exp [period_s [priority]]
+
+    period_s is the poll period of the slave in seconds, 0 or left out for the firmware's
+    default, and priority breaks ties between slaves due at the same time (higher wins, 0 if
+    left out). Blank lines and lines starting with # are ignored. The blob can be written to the
+    "modbus" namespace, key "regmap", with the ESP-IDF NVS partition generator.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "regmap.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -o blob.bin map.txt    build a blob from a text map\n"
+            "       %s -d blob.bin            decode and check a blob\n",
+            name, name);
+}
+
+static void print_map(const regmap_t *map)
+{
+    for (uint8_t i = 0; i < map->count; i++)
+    {
+        const regmap_param_t *p = &map->params[i];
+        printf("CID %d: %-12s %-4s slave %3d %-7s 0x%04x+%d %-8s x1e%d, every %us, priority %u\n",
+               i, p->name, p->unit, p->slave,
+               (p->reg_type == REGMAP_REG_INPUT) ? "input" : "holding",
+               p->reg_start, p->reg_count,
+               (p->flags & REGMAP_FLAG_SIGNED) ? "signed" : "unsigned",
+               p->scale_exp, p->period_s, p->priority);
+    }
+}
+
+/**
+ * @brief Reads a text map
+ * @returns false with a message on the first bad line
+ */
+static bool read_map(FILE *f, regmap_t *map)
+{
+    char line[256];
+    int line_no = 0;
+
+    memset(map, 0, sizeof(regmap_t));
+    while (fgets(line, sizeof(line), f))
+    {
+        char name[64], unit[16], area[16], sign[16];
+        unsigned slave, reg, regs, period_s = 0, priority = 0;
+        int scale_exp;
+
+        line_no++;
+        char *start = line + strspn(line, " \t\r\n");
+        if ((*start == '\0') || (*start == '#'))
+        {
+            continue;
+        }
+        int fields = sscanf(start, "%63s %15s %u %15s %i %u %15s %d %u %u", name, unit, &slave, area, (int *)&reg, &regs,
+                            sign, &scale_exp, &period_s, &priority);
+        if (fields < 8)
+        {
+            fprintf(stderr, "Line %d: expected 8 to 10 fields\n", line_no);
+            return false;
+        }
+        if (map->count == REGMAP_MAX_ENTRIES)
+        {
+            fprintf(stderr, "Line %d: a map holds at most %d values\n", line_no, REGMAP_MAX_ENTRIES);
+            return false;
+        }
+        if ((strlen(name) > REGMAP_NAME_LEN) || (strlen(unit) > REGMAP_UNIT_LEN))
+        {
+            fprintf(stderr, "Line %d: name is limited to %d characters, unit to %d\n", line_no, REGMAP_NAME_LEN, REGMAP_UNIT_LEN);
+            return false;
+        }
+
+        regmap_param_t *p = &map->params[map->count];
+        strcpy(p->name, name);
+        strcpy(p->unit, unit);
+        p->slave = (uint8_t)slave;
+        p->reg_type = (strcmp(area, "input") == 0) ? REGMAP_REG_INPUT : REGMAP_REG_HOLDING;
+        p->reg_start = (uint16_t)reg;
+        p->reg_count = (uint8_t)regs;
+        p->flags = (strcmp(sign, "signed") == 0) ? REGMAP_FLAG_SIGNED : 0;
+        p->scale_exp = (int8_t)scale_exp;
+        p->period_s = (uint16_t)period_s;
+        p->priority = (uint8_t)priority;
+        if ((slave > 255) || (reg > 0xFFFF) || (regs > 255) || (period_s > 0xFFFF) || (priority > 255) ||
+            (strcmp(area, "input") && strcmp(area, "holding")) ||
+            (strcmp(sign, "signed") && strcmp(sign, "unsigned")) ||
+            !regmap_param_check(p))
+        {
+            fprintf(stderr, "Line %d: invalid value (names and units are printable ASCII without '\"' or '\\')\n", line_no);
+            return false;
+        }
+        map->count++;
+    }
+    return true;
+}
+
+static int build(const char *out_name, const char *in_name)
+{
+    regmap_t map;
+    uint8_t blob[REGMAP_MAX_BLOB];
+
+    FILE *in = fopen(in_name, "r");
+    if (in == NULL)
+    {
+        perror(in_name);
+        return 1;
+    }
+    bool ok = read_map(in, &map);
+    fclose(in);
+    if (!ok)
+    {
+        return 1;
+    }
+    size_t len = regmap_encode(&map, blob, sizeof(blob));
+    if (len == 0)
+    {
+        fprintf(stderr, "Map is empty or invalid\n");
+        return 1;
+    }
+    FILE *out = fopen(out_name, "wb");
+    if ((out == NULL) || (fwrite(blob, 1, len, out) != len))
+    {
+        perror(out_name);
+        return 1;
+    }
+    fclose(out);
+    print_map(&map);
+    printf("Wrote %u bytes to %s\n", (unsigned)len, out_name);
+    return 0;
+}
+
+static int decode(const char *in_name)
+{
+    regmap_t map;
+    uint8_t blob[REGMAP_MAX_BLOB + 1];
+    uint8_t bad_entry = 0;
+
+    FILE *in = fopen(in_name, "rb");
+    if (in == NULL)
+    {
+        perror(in_name);
+        return 1;
+    }
+    size_t len = fread(blob, 1, sizeof(blob), in);
+    fclose(in);
+    regmap_status_t status = regmap_parse(blob, len, &map, &bad_entry);
+    if (status != REGMAP_OK)
+    {
+        printf("Invalid: %s", regmap_status_name(status));
+        if (status == REGMAP_ERR_ENTRY)
+        {
+            printf(" (entry %d)", bad_entry);
+        }
+        printf("\n");
+        return 1;
+    }
+    print_map(&map);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_name = NULL, *decode_name = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:d:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o': out_name = optarg; break;
+            case 'd': decode_name = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (decode_name)
+    {
+        return decode(decode_name);
+    }
+    if (out_name && (optind < argc))
+    {
+        return build(out_name, argv[optind]);
+    }
+    usage(argv[0]);
+    return 1;
+}
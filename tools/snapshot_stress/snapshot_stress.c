@@ -0,0 +1,206 @@
+/*
+    Host stress test of the sensor snapshot
+
+    Runs main/snapshot.c with several reader threads copying the snapshot as fast as they can
+    while writer threads publish new ones back to back, far faster than the poller ever does.
+    Every value, timestamp and quality flag of a published snapshot is derived from its cycle
+    number, so a reader can tell if it got a copy mixed from two publishes (torn). Each reader
+    also checks that the cycle never goes backwards. Exits with an error on either.
+
+    snapshot_publish() must only be called by one task at a time, so the writers take turns
+    under a mutex, the way the poller would if it moved between tasks. A fast interval timer
+    makes whichever thread it lands on yield, so threads are switched in the middle of copies
+    even on a single core host.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "snapshot.h"
+
+#define MAX_THREADS     (64)
+
+typedef struct
+{
+    pthread_t thread;
+    uint64_t reads;
+    uint64_t torn;
+    uint64_t backwards;
+} reader_t;
+
+static volatile bool running = true;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_cycle = 1;
+static uint64_t publishes = 0;
+
+static void fill(sensor_snapshot_t *snapshot, uint32_t cycle)
+{
+    snapshot->cycle = cycle;
+    snapshot->count = SNAPSHOT_MAX_VALUES;
+    for (uint16_t i = 0; i < SNAPSHOT_MAX_VALUES; i++)
+    {
+        snapshot->values[i].value = (float)((cycle + i) & 0xFFFF);
+        snapshot->values[i].timestamp_ms = cycle * 3 + i;
+        snapshot->values[i].quality = (uint8_t)(cycle + i);
+    }
+}
+
+static bool consistent(const sensor_snapshot_t *snapshot)
+{
+    sensor_snapshot_t expected;
+    fill(&expected, snapshot->cycle);
+    if (snapshot->count != expected.count)
+    {
+        return false;
+    }
+    for (uint16_t i = 0; i < SNAPSHOT_MAX_VALUES; i++)
+    {
+        if ((snapshot->values[i].value != expected.values[i].value) ||
+            (snapshot->values[i].timestamp_ms != expected.values[i].timestamp_ms) ||
+            (snapshot->values[i].quality != expected.values[i].quality))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *writer(void *arg)
+{
+    (void)arg;
+    sensor_snapshot_t snapshot;
+    while (running)
+    {
+        pthread_mutex_lock(&publish_lock);
+        fill(&snapshot, next_cycle++);
+        snapshot_publish(&snapshot);
+        publishes++;
+        pthread_mutex_unlock(&publish_lock);
+    }
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    reader_t *r = (reader_t *)arg;
+    sensor_snapshot_t snapshot;
+    uint32_t last = 0;
+    while (running)
+    {
+        snapshot_read(&snapshot);
+        r->reads++;
+        if (snapshot.cycle == 0)
+        {
+            // Nothing published yet
+            continue;
+        }
+        if (!consistent(&snapshot))
+        {
+            r->torn++;
+        }
+        if (snapshot.cycle < last)
+        {
+            r->backwards++;
+        }
+        last = snapshot.cycle;
+    }
+    return NULL;
+}
+
+static void preempt(int sig)
+{
+    (void)sig;
+    sched_yield();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -r N    reader threads (default 4)\n"
+            "  -w N    writer threads (default 2)\n"
+            "  -s N    seconds to run (default 2)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int readers = 4;
+    int writers = 2;
+    int seconds = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:w:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': readers = atoi(optarg); break;
+            case 'w': writers = atoi(optarg); break;
+            case 's': seconds = atoi(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if ((readers < 1) || (readers > MAX_THREADS) || (writers < 1) || (writers > MAX_THREADS) || (seconds < 1))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct sigaction action = { .sa_handler = preempt };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &action, NULL);
+    struct itimerval interval = { { 0, 50 }, { 0, 50 } };
+    setitimer(ITIMER_REAL, &interval, NULL);
+
+    static reader_t reader_threads[MAX_THREADS];
+    pthread_t writer_threads[MAX_THREADS];
+    for (int i = 0; i < readers; i++)
+    {
+        pthread_create(&reader_threads[i].thread, NULL, reader, &reader_threads[i]);
+    }
+    for (int i = 0; i < writers; i++)
+    {
+        pthread_create(&writer_threads[i], NULL, writer, NULL);
+    }
+    // sleep() would be cut short by the timer
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += seconds;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL) != 0)
+    {
+    }
+    running = false;
+    for (int i = 0; i < writers; i++)
+    {
+        pthread_join(writer_threads[i], NULL);
+    }
+
+    uint64_t reads = 0, torn = 0, backwards = 0;
+    for (int i = 0; i < readers; i++)
+    {
+        pthread_join(reader_threads[i].thread, NULL);
+        reads += reader_threads[i].reads;
+        torn += reader_threads[i].torn;
+        backwards += reader_threads[i].backwards;
+    }
+
+    printf("%d readers, %d writers, %d s: %llu publishes, %llu reads, %llu torn, %llu out of order\n",
+           readers, writers, seconds, (unsigned long long)publishes, (unsigned long long)reads,
+           (unsigned long long)torn, (unsigned long long)backwards);
+    if (torn || backwards)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    return 0;
+}
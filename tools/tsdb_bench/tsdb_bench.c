@@ -0,0 +1,232 @@
+/*
+    Host benchmark for the compressed time-series store
+
+    Feeds a synthetic XY-MD02 signal (slow random walk of temperature and humidity in x10
+    fixed point, polled every period with a little jitter and the odd failed read) through
+    tsdb.c and reports the bytes used per sample and the encode and decode rates. Every
+    decoded sample is checked against what was written.
+
+    With several slaves (-m), each slave is polled on its own at a different point in the
+    period and stored as a row of its own with the other slaves' values missing, the way
+    history.c records them. That must not cost much more than one row holding every slave:
+    the run fails if a poll round takes more than ROUND_LIMIT times the bytes of one sensor.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "tsdb.h"
+
+// Values per sensor (temperature and humidity)
+#define SENSOR_SERIES   (2)
+#define MAX_SLAVES      (TSDB_MAX_SERIES / SENSOR_SERIES)
+// Most a poll round of several slaves may take, in bytes per slave of a single sensor run
+#define ROUND_LIMIT     (1.5)
+
+typedef struct
+{
+    uint32_t ts;
+    int16_t values[TSDB_MAX_SERIES];
+} bench_sample_t;
+
+typedef struct
+{
+    const bench_sample_t *expected;
+    uint8_t series;
+    uint32_t next;
+    uint32_t errors;
+} verify_ctx_t;
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static bool verify_cb(void *ctx, uint32_t ts, const int16_t *values, uint8_t series)
+{
+    verify_ctx_t *v = (verify_ctx_t *)ctx;
+    const bench_sample_t *e = &v->expected[v->next++];
+    if ((ts != e->ts) || (series != v->series) || memcmp(values, e->values, series * sizeof(int16_t)))
+    {
+        v->errors++;
+    }
+    return true;
+}
+
+static bool count_cb(void *ctx, uint32_t ts, const int16_t *values, uint8_t series)
+{
+    (void)ts;
+    (void)values;
+    (void)series;
+    (*(uint32_t *)ctx)++;
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n count    samples to write (default 100000)\n"
+            "  -p period   poll period in seconds (default 60)\n"
+            "  -j jitter   timestamp jitter in seconds, applied to 1 in 10 polls (default 1)\n"
+            "  -e percent  failed reads, stored as missing (default 1)\n"
+            "  -m slaves   sensors on the bus, each stored as a row of its own (1 to %d, default 1)\n"
+            "  -s seed     random seed (default 1)\n",
+            name, MAX_SLAVES);
+}
+
+/**
+ * @brief Writes a signal through a store and reads it back
+ * @returns bytes used per sample, or a negative value if the check failed
+ */
+static double run(const bench_sample_t *samples, uint32_t count, uint8_t series, bool report)
+{
+    // Size the ring so everything fits, even at the worst case encoding
+    uint32_t nblocks = count / (TSDB_BLOCK_DATA / (6 + 3 * series)) + 2;
+    tsdb_block_t *blocks = calloc(nblocks, sizeof(tsdb_block_t));
+    if (!blocks)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1.0;
+    }
+
+    tsdb_t db;
+    tsdb_init(&db, blocks, nblocks, series, 0);
+    double start = now_s();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tsdb_append(&db, samples[i].ts, samples[i].values);
+    }
+    double encode_s = now_s() - start;
+
+    verify_ctx_t verify = { samples, series, 0, 0 };
+    uint32_t found = tsdb_query(&db, 0, UINT32_MAX, verify_cb, &verify);
+
+    uint32_t decoded = 0;
+    start = now_s();
+    tsdb_query(&db, 0, UINT32_MAX, count_cb, &decoded);
+    double decode_s = now_s() - start;
+
+    double per_sample = (double)db.bytes / db.samples;
+    if (report)
+    {
+        size_t raw = sizeof(uint32_t) + series * sizeof(int16_t);
+        printf("Samples:      %u in %u blocks of %d bytes\n", db.samples, db.used, TSDB_BLOCK_SIZE);
+        printf("Storage:      %u bytes, %.2f bytes/sample (raw %zu, %.1fx)\n", db.bytes,
+                per_sample, raw, (double)raw * db.samples / db.bytes);
+        printf("With padding: %.2f bytes/sample\n", (double)db.used * TSDB_BLOCK_SIZE / db.samples);
+        printf("Encode:       %.1f Msamples/s\n", count / encode_s / 1e6);
+        printf("Decode:       %.1f Msamples/s\n", decoded / decode_s / 1e6);
+        printf("Verify:       %u of %u samples, %u mismatches\n", found, count, verify.errors);
+    }
+    free(blocks);
+    return ((found == count) && (verify.errors == 0)) ? per_sample : -1.0;
+}
+
+/**
+ * @brief Makes the signal of a number of sensors. With several, each poll round is a row per
+ * slave, spread over the period, holding only that slave's values.
+ * @returns number of samples
+ */
+static uint32_t make_signal(bench_sample_t *samples, uint32_t rounds, uint32_t slaves, uint32_t period,
+                            uint32_t jitter, uint32_t error_pct)
+{
+    int16_t temp[MAX_SLAVES], hum[MAX_SLAVES];
+    uint32_t ts = 1604188800;
+    uint32_t n = 0;
+
+    for (uint32_t s = 0; s < slaves; s++)
+    {
+        temp[s] = 215 + s * 10;
+        hum[s] = 450 - s * 20;
+    }
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        ts += period;
+        for (uint32_t s = 0; s < slaves; s++)
+        {
+            bench_sample_t *sample = &samples[n++];
+            sample->ts = ts + s * period / slaves;
+            if (jitter && (rand() % 10 == 0))
+            {
+                sample->ts += rand() % (2 * jitter + 1) - jitter;
+            }
+            temp[s] += rand() % 3 - 1;
+            hum[s] += rand() % 5 - 2;
+            for (uint32_t i = 0; i < slaves * SENSOR_SERIES; i++)
+            {
+                sample->values[i] = TSDB_MISSING;
+            }
+            sample->values[s * SENSOR_SERIES] = temp[s];
+            sample->values[s * SENSOR_SERIES + 1] = hum[s];
+            if ((uint32_t)(rand() % 100) < error_pct)
+            {
+                sample->values[s * SENSOR_SERIES + rand() % SENSOR_SERIES] = TSDB_MISSING;
+            }
+        }
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t count = 100000, period = 60, jitter = 1, error_pct = 1, seed = 1, slaves = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:j:e:m:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 'p': period = strtoul(optarg, NULL, 0); break;
+            case 'j': jitter = strtoul(optarg, NULL, 0); break;
+            case 'e': error_pct = strtoul(optarg, NULL, 0); break;
+            case 'm': slaves = strtoul(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if ((slaves < 1) || (slaves > MAX_SLAVES) || (count < 1))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench_sample_t *samples = calloc((size_t)count * slaves, sizeof(bench_sample_t));
+    if (!samples)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // The same signal for one sensor, as the reference for the cost of a poll round
+    srand(seed);
+    uint32_t single = make_signal(samples, count, 1, period, jitter, error_pct);
+    double single_bytes = run(samples, single, SENSOR_SERIES, slaves == 1);
+    int result = (single_bytes < 0) ? 1 : 0;
+    if (slaves > 1)
+    {
+        srand(seed);
+        uint32_t rows = make_signal(samples, count, slaves, period, jitter, error_pct);
+        double bytes = run(samples, rows, slaves * SENSOR_SERIES, true);
+        double round = bytes * slaves;
+        printf("Poll round:   %.2f bytes for %u slaves, %.2f bytes for one (%.2fx per slave)\n",
+                round, slaves, single_bytes, round / (single_bytes * slaves));
+        if ((bytes < 0) || (round > ROUND_LIMIT * single_bytes * slaves))
+        {
+            printf("FAIL: a poll round of %u slaves takes %.2f bytes, limit %.2f\n", slaves, round,
+                    ROUND_LIMIT * single_bytes * slaves);
+            result = 1;
+        }
+    }
+
+    free(samples);
+    return result;
+}
@@ -0,0 +1,395 @@
+/*
+    Host Modbus poller
+
+    Polls an XY-MD02 (real, through a USB RS485 adapter, or the simulator in this directory)
+    with the same read plan, decoding and retry path (mb_plan.c, regmap.c), frame core
+    (mb_rtu.c, mb_crc.c) and health policy (mb_health.c) as the firmware, and reports
+    throughput, latency and error counts. Used to measure poll timing and retry behaviour
+    reproducibly off the bench. The built-in XY-MD02 map is polled unless a register map blob
+    (tools/regmap_gen) is given.
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include "mb_crc.h"
+#include "mb_rtu.h"
+#include "mb_health.h"
+#include "mb_plan.h"
+#include "regmap.h"
+
+typedef struct
+{
+    const char *device;
+    const char *map_file;
+    uint8_t address;
+    uint32_t baudrate;
+    uint32_t polls;
+    uint32_t interval_ms;
+    uint32_t timeout_ms;
+    int verbose;
+} poll_config_t;
+
+static poll_config_t config = {
+    .address = 1,
+    .baudrate = 9600,
+    .polls = 100,
+    .interval_ms = 0,
+    .timeout_ms = 200,
+};
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static speed_t baud_to_speed(uint32_t baud)
+{
+    switch (baud)
+    {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default: return B9600;
+    }
+}
+
+static int open_port(void)
+{
+    int fd = open(config.device, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        perror(config.device);
+        exit(1);
+    }
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baud_to_speed(config.baudrate));
+    cfsetospeed(&tio, baud_to_speed(config.baudrate));
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+/**
+ * @brief One transaction, same flow as the firmware's native master: gap, send, collect
+ * until the frame is complete, the line goes quiet or the response timeout expires.
+ */
+static mb_rtu_status_t transaction(int fd, uint8_t address, uint8_t function, uint16_t start, uint16_t count,
+                                   uint16_t *regs)
+{
+    uint8_t tx[MB_RTU_READ_REQUEST_LEN];
+    uint8_t rx[MB_RTU_MAX_FRAME];
+    size_t rx_len = 0;
+    uint32_t gap_us = mb_rtu_t35_us(config.baudrate);
+
+    usleep(gap_us);
+    tcflush(fd, TCIFLUSH);
+    size_t len = mb_rtu_build_read_request(tx, address, function, start, count);
+    if (write(fd, tx, len) != (ssize_t)len)
+    {
+        return MB_RTU_TIMEOUT;
+    }
+
+    uint64_t deadline = now_us() + (uint64_t)config.timeout_ms * 1000;
+    mb_rtu_status_t status = MB_RTU_TIMEOUT;
+    while (1)
+    {
+        uint64_t now = now_us();
+        if (now >= deadline)
+        {
+            return MB_RTU_TIMEOUT;
+        }
+        uint64_t wait = rx_len ? gap_us : (deadline - now);
+        if (wait > deadline - now)
+        {
+            wait = deadline - now;
+        }
+        struct timeval tv = { .tv_sec = (time_t)(wait / 1000000), .tv_usec = (suseconds_t)(wait % 1000000) };
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        int ready = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (ready < 0)
+        {
+            if (errno == EINTR) continue;
+            return MB_RTU_TIMEOUT;
+        }
+        if (ready == 0)
+        {
+            // Line went quiet: whatever we have is the whole frame
+            return rx_len ? (status == MB_RTU_INCOMPLETE ? MB_RTU_BAD_LENGTH : status) : MB_RTU_TIMEOUT;
+        }
+        ssize_t n = read(fd, &rx[rx_len], sizeof(rx) - rx_len);
+        if (n > 0)
+        {
+            rx_len += (size_t)n;
+            status = mb_rtu_parse_read_response(rx, rx_len, address, function, count, regs, NULL);
+            if (status != MB_RTU_INCOMPLETE)
+            {
+                return status;
+            }
+        }
+    }
+}
+
+static mb_result_t to_result(mb_rtu_status_t status)
+{
+    switch (status)
+    {
+        case MB_RTU_OK: return MB_RESULT_OK;
+        case MB_RTU_TIMEOUT: return MB_RESULT_TIMEOUT;
+        case MB_RTU_BAD_CRC: return MB_RESULT_CRC;
+        case MB_RTU_BAD_ADDRESS:
+        case MB_RTU_BAD_FUNCTION:
+        case MB_RTU_BAD_LENGTH: return MB_RESULT_INVALID;
+        default: return MB_RESULT_ERROR;
+    }
+}
+
+// Read plan callbacks, see mb_plan.h
+typedef struct
+{
+    int fd;
+    uint32_t poll;
+    mb_rtu_status_t status;     // Status of the last transaction
+} poll_ctx_t;
+
+static mb_result_t plan_send(void *ctx, uint8_t slave_addr, uint8_t function, uint16_t reg_start, uint16_t reg_count,
+                             uint16_t *regs)
+{
+    poll_ctx_t *poll = (poll_ctx_t *)ctx;
+    poll->status = transaction(poll->fd, slave_addr, function, reg_start, reg_count, regs);
+    return to_result(poll->status);
+}
+
+static void plan_backoff(void *ctx, uint32_t delay_ms)
+{
+    (void)ctx;
+    usleep(delay_ms * 1000);
+}
+
+static void plan_failed(void *ctx, const mb_health_t *health, uint8_t attempt, uint8_t attempts)
+{
+    const poll_ctx_t *poll = (const poll_ctx_t *)ctx;
+    if (config.verbose)
+    {
+        printf("poll %u slave %u attempt %u of %u: %s (%s)\n", poll->poll, health->slave_addr, attempt, attempts,
+               mb_rtu_status_name(poll->status), mb_health_state_name(health->state));
+    }
+}
+
+static uint32_t plan_now_ms(void *ctx)
+{
+    (void)ctx;
+    return now_ms();
+}
+
+/**
+ * @brief Loads the register map to poll: a blob from tools/regmap_gen, or the built-in
+ * XY-MD02 map at the slave address
+ */
+static void load_map(regmap_t *map)
+{
+    if (config.map_file == NULL)
+    {
+        regmap_builtin(map, config.address);
+        return;
+    }
+    uint8_t blob[REGMAP_MAX_BLOB];
+    FILE *f = fopen(config.map_file, "rb");
+    if (f == NULL)
+    {
+        perror(config.map_file);
+        exit(1);
+    }
+    size_t len = fread(blob, 1, sizeof(blob), f);
+    fclose(f);
+    uint8_t bad_entry = 0;
+    regmap_status_t status = regmap_parse(blob, len, map, &bad_entry);
+    if (status != REGMAP_OK)
+    {
+        fprintf(stderr, "%s: %s (entry %u)\n", config.map_file, regmap_status_name(status), bad_entry);
+        exit(1);
+    }
+}
+
+/**
+ * @brief Finds the health state of a slave, adding it on first use
+ */
+static mb_health_t *find_health(mb_health_t *health, uint16_t *count, uint8_t slave_addr)
+{
+    for (uint16_t i = 0; i < *count; i++)
+    {
+        if (health[i].slave_addr == slave_addr)
+        {
+            return &health[i];
+        }
+    }
+    mb_health_init(&health[*count], slave_addr);
+    return &health[(*count)++];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] device\n"
+            "  -a addr      slave address of the built-in map (default 1)\n"
+            "  -m file      poll the register map in a blob from regmap_gen instead\n"
+            "  -b baud      baud rate (default 9600)\n"
+            "  -n polls     number of polls (default 100)\n"
+            "  -i ms        interval between polls (default 0, back to back)\n"
+            "  -t ms        response timeout (default 200)\n"
+            "  -v           print every reading\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "a:m:b:n:i:t:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': config.address = (uint8_t)atoi(optarg); break;
+            case 'm': config.map_file = optarg; break;
+            case 'b': config.baudrate = (uint32_t)atoi(optarg); break;
+            case 'n': config.polls = (uint32_t)atoi(optarg); break;
+            case 'i': config.interval_ms = (uint32_t)atoi(optarg); break;
+            case 't': config.timeout_ms = (uint32_t)atoi(optarg); break;
+            case 'v': config.verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+    }
+    config.device = argv[optind];
+
+    static regmap_t map;
+    static mb_plan_t plan;
+    load_map(&map);
+    mb_plan_build(&plan, &map);
+
+    mb_health_t health[REGMAP_MAX_ENTRIES];
+    uint16_t slaves = 0;
+    for (uint16_t g = 0; g < plan.count; g++)
+    {
+        find_health(health, &slaves, plan.groups[g].slave_addr);
+    }
+
+    poll_ctx_t ctx = { .fd = open_port() };
+    const mb_plan_io_t io = {
+        .send = plan_send,
+        .backoff = plan_backoff,
+        .failed = plan_failed,
+        .now_ms = plan_now_ms,
+        .ctx = &ctx
+    };
+    uint32_t good = 0, failed = 0, skipped = 0;
+    uint64_t busy_us = 0, best_us = UINT64_MAX, worst_us = 0;
+    uint64_t start = now_us();
+
+    for (uint32_t poll = 0; poll < config.polls; poll++)
+    {
+        ctx.poll = poll;
+        uint64_t t0 = now_us();
+        uint32_t read = 0, skips = 0;
+        for (uint16_t g = 0; g < plan.count; g++)
+        {
+            const mb_plan_group_t *group = &plan.groups[g];
+            uint16_t regs[MB_PLAN_MAX_REGS] = { 0 };
+            mb_plan_read_t status = mb_plan_read(group, find_health(health, &slaves, group->slave_addr), &io, regs);
+            if (status == MB_PLAN_READ_SKIPPED)
+            {
+                skips++;
+                continue;
+            }
+            if (status != MB_PLAN_READ_OK)
+            {
+                continue;
+            }
+            read++;
+            for (uint16_t i = 0; config.verbose && (i < group->count); i++)
+            {
+                uint16_t cid;
+                float value = mb_plan_decode(&plan, &map, group, i, regs, &cid);
+                printf("poll %u: %s %.1f %s\n", poll, map.params[cid].name, value, map.params[cid].unit);
+            }
+        }
+        if (skips == plan.count)
+        {
+            // Every slave is offline and none is due a probe
+            skipped++;
+            usleep((config.interval_ms ? config.interval_ms : 10) * 1000);
+            continue;
+        }
+        uint64_t elapsed = now_us() - t0;
+        busy_us += elapsed;
+        if (elapsed < best_us) best_us = elapsed;
+        if (elapsed > worst_us) worst_us = elapsed;
+
+        if (read == plan.count)
+        {
+            good++;
+            if (config.verbose)
+            {
+                printf("poll %u: %llu us\n", poll, (unsigned long long)elapsed);
+            }
+        }
+        else
+        {
+            failed++;
+        }
+        if (config.interval_ms)
+        {
+            usleep(config.interval_ms * 1000);
+        }
+    }
+
+    double total_s = (now_us() - start) / 1e6;
+    uint32_t sent = good + failed;
+    printf("polls %u: good %u, failed %u, skipped (offline) %u\n", config.polls, good, failed, skipped);
+    for (uint16_t i = 0; i < slaves; i++)
+    {
+        printf("slave %u transactions %u: timeouts %u, crc errors %u, invalid responses %u, other errors %u, offline %u, recoveries %u\n",
+               health[i].slave_addr, health[i].transactions, health[i].timeouts, health[i].crc_errors,
+               health[i].invalid_responses, health[i].errors,
+               health[i].offline_events, health[i].recoveries);
+    }
+    if (sent)
+    {
+        printf("poll time: avg %llu us, best %llu us, worst %llu us\n",
+               (unsigned long long)(busy_us / sent), (unsigned long long)best_us, (unsigned long long)worst_us);
+    }
+    printf("throughput: %.1f polls/s over %.2f s\n", total_s > 0 ? good / total_s : 0.0, total_s);
+    close(ctx.fd);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,379 @@
+/*
+    XY-MD02 Modbus RTU slave simulator
+
+    Emulates an XY-MD02 temperature/humidity sensor on a pseudo-terminal so the polling code
+    can be run on a Linux host without the sensor or an RS485 adapter. The slave side of the
+    pty is printed on startup (and optionally symlinked), point the master at it.
+
+    Register map (same as the real sensor):
+        Input 0x0001    temperature x10 (signed)
+        Input 0x0002    humidity x10
+        Holding 0x0101  slave address
+        Holding 0x0102  baud rate (0 = 9600, 1 = 14400, 2 = 19200)
+        Holding 0x0103  temperature correction x10 (signed)
+        Holding 0x0104  humidity correction x10
+
+    FC03, FC04 and FC06 are supported, anything else gets an illegal function exception.
+    Latency, value noise, dropped requests and corrupted CRCs can be injected to exercise the
+    retry and health logic reproducibly (use -s for a fixed random seed).
+
+    (C) 2020 Mark Buckaway - Apache License Version 2.0, January 2004
+*/
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "mb_crc.h"
+#include "mb_rtu.h"
+
+#define SIM_INPUT_REGS      (2)
+#define SIM_HOLDING_BASE    (0x0101)
+#define SIM_HOLDING_REGS    (4)
+
+#define EXC_ILLEGAL_FUNCTION    (0x01)
+#define EXC_ILLEGAL_ADDRESS     (0x02)
+#define EXC_ILLEGAL_VALUE       (0x03)
+
+typedef struct
+{
+    uint8_t address;
+    uint32_t baudrate;          // Used for the inter-frame gap and wire time, a pty has no baud rate
+    uint32_t latency_ms;        // Time from end of request to start of response
+    uint32_t jitter_ms;         // Random extra latency, 0 to jitter_ms
+    uint32_t drop_pct;          // Percentage of requests that get no response
+    uint32_t crc_pct;           // Percentage of responses sent with a corrupted CRC
+    double noise;               // Random walk step for the values (engineering units)
+    double temperature;
+    double humidity;
+    const char *link;           // Optional symlink to the slave side of the pty
+    int verbose;
+} sim_config_t;
+
+typedef struct
+{
+    uint32_t requests;
+    uint32_t responses;
+    uint32_t dropped;
+    uint32_t corrupted;
+    uint32_t exceptions;
+    uint32_t garbage;
+} sim_stats_t;
+
+static sim_config_t config = {
+    .address = 1,
+    .baudrate = 9600,
+    .temperature = 22.5,
+    .humidity = 38.4,
+};
+static sim_stats_t stats;
+static int16_t holding[SIM_HOLDING_REGS];
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static int chance(uint32_t pct)
+{
+    return (pct > 0) && ((uint32_t)(rand() % 100) < pct);
+}
+
+static double uniform(double range)
+{
+    return ((double)rand() / RAND_MAX * 2.0 - 1.0) * range;
+}
+
+static void sleep_ms(uint32_t ms)
+{
+    if (ms)
+    {
+        usleep(ms * 1000);
+    }
+}
+
+/**
+ * @brief Current input register values, x10 fixed point with the corrections applied
+ */
+static int16_t input_register(uint16_t reg)
+{
+    if (reg == 0x0001)
+    {
+        return (int16_t)((config.temperature * 10.0) + holding[2] + (config.temperature < 0 ? -0.5 : 0.5));
+    }
+    return (int16_t)((config.humidity * 10.0) + holding[3] + 0.5);
+}
+
+static void step_values(void)
+{
+    if (config.noise <= 0.0)
+    {
+        return;
+    }
+    config.temperature += uniform(config.noise);
+    config.humidity += uniform(config.noise);
+    if (config.humidity < 0.0) config.humidity = 0.0;
+    if (config.humidity > 100.0) config.humidity = 100.0;
+}
+
+static void send_frame(int fd, uint8_t *frame, size_t len)
+{
+    uint16_t crc = mb_crc16(frame, len);
+    frame[len++] = (uint8_t)(crc & 0xFF);
+    frame[len++] = (uint8_t)(crc >> 8);
+    if (chance(config.crc_pct))
+    {
+        frame[len - 1] ^= 0x5A;
+        stats.corrupted++;
+    }
+    sleep_ms(config.latency_ms + (config.jitter_ms ? (uint32_t)(rand() % (config.jitter_ms + 1)) : 0));
+    // A pty delivers instantly, so spend the time the frame would take on the wire
+    usleep(mb_rtu_frame_time_us(config.baudrate, len));
+    if (write(fd, frame, len) != (ssize_t)len)
+    {
+        perror("write");
+    }
+    stats.responses++;
+}
+
+static void send_exception(int fd, uint8_t function, uint8_t code)
+{
+    uint8_t frame[5] = { config.address, (uint8_t)(function | MB_RTU_FUNC_ERROR_FLAG), code };
+    stats.exceptions++;
+    send_frame(fd, frame, 3);
+}
+
+/**
+ * @brief Handles one complete 8 byte request (FC03, FC04 and FC06 are all 8 bytes)
+ */
+static void handle_request(int fd, const uint8_t *req)
+{
+    uint8_t frame[MB_RTU_MAX_FRAME];
+    uint8_t function = req[1];
+    uint16_t start = (uint16_t)((req[2] << 8) | req[3]);
+    uint16_t value = (uint16_t)((req[4] << 8) | req[5]);
+
+    stats.requests++;
+    if (config.verbose)
+    {
+        printf("request: fc %02x start 0x%04x value/count %u\n", function, start, value);
+    }
+    if (chance(config.drop_pct))
+    {
+        stats.dropped++;
+        return;
+    }
+    step_values();
+
+    switch (function)
+    {
+        case MB_RTU_FUNC_READ_INPUT:
+        case MB_RTU_FUNC_READ_HOLDING:
+        {
+            uint16_t base = (function == MB_RTU_FUNC_READ_INPUT) ? 0x0001 : SIM_HOLDING_BASE;
+            uint16_t count = (function == MB_RTU_FUNC_READ_INPUT) ? SIM_INPUT_REGS : SIM_HOLDING_REGS;
+            if ((value == 0) || (value > MB_RTU_MAX_READ_REGS))
+            {
+                send_exception(fd, function, EXC_ILLEGAL_VALUE);
+                return;
+            }
+            if ((start < base) || (start + value > base + count))
+            {
+                send_exception(fd, function, EXC_ILLEGAL_ADDRESS);
+                return;
+            }
+            frame[0] = config.address;
+            frame[1] = function;
+            frame[2] = (uint8_t)(value * 2);
+            for (uint16_t i = 0; i < value; i++)
+            {
+                int16_t reg = (function == MB_RTU_FUNC_READ_INPUT) ? input_register(start + i) : holding[start + i - base];
+                frame[3 + i * 2] = (uint8_t)((uint16_t)reg >> 8);
+                frame[4 + i * 2] = (uint8_t)((uint16_t)reg & 0xFF);
+            }
+            send_frame(fd, frame, 3 + value * 2);
+            break;
+        }
+        case 0x06:
+        {
+            if ((start < SIM_HOLDING_BASE) || (start >= SIM_HOLDING_BASE + SIM_HOLDING_REGS))
+            {
+                send_exception(fd, function, EXC_ILLEGAL_ADDRESS);
+                return;
+            }
+            // Write single register echoes the request
+            memcpy(frame, req, 6);
+            send_frame(fd, frame, 6);
+            holding[start - SIM_HOLDING_BASE] = (int16_t)value;
+            if (start == SIM_HOLDING_BASE)
+            {
+                config.address = (uint8_t)value;
+                printf("slave address changed to %u\n", config.address);
+            }
+            break;
+        }
+        default:
+            send_exception(fd, function, EXC_ILLEGAL_FUNCTION);
+            break;
+    }
+}
+
+static int open_pty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((fd < 0) || (grantpt(fd) != 0) || (unlockpt(fd) != 0))
+    {
+        perror("openpt");
+        exit(1);
+    }
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    const char *name = ptsname(fd);
+    printf("XY-MD02 simulator: slave %u on %s\n", config.address, name);
+    if (config.link)
+    {
+        unlink(config.link);
+        if (symlink(name, config.link) != 0)
+        {
+            perror("symlink");
+        }
+        else
+        {
+            printf("linked to %s\n", config.link);
+        }
+    }
+    fflush(stdout);
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -a addr      slave address (default 1)\n"
+            "  -b baud      baud rate used for the gap and wire time (default 9600)\n"
+            "  -l ms        response latency (default 0)\n"
+            "  -j ms        random extra latency (default 0)\n"
+            "  -d pct       percentage of requests dropped (default 0)\n"
+            "  -c pct       percentage of responses with a bad CRC (default 0)\n"
+            "  -n step      random walk step for the values (default 0)\n"
+            "  -t temp      starting temperature (default 22.5)\n"
+            "  -H humidity  starting humidity (default 38.4)\n"
+            "  -L path      symlink to the slave side of the pty\n"
+            "  -s seed      random seed (default: time)\n"
+            "  -v           log every request\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned seed = (unsigned)time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:l:j:d:c:n:t:H:L:s:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': config.address = (uint8_t)atoi(optarg); break;
+            case 'b': config.baudrate = (uint32_t)atoi(optarg); break;
+            case 'l': config.latency_ms = (uint32_t)atoi(optarg); break;
+            case 'j': config.jitter_ms = (uint32_t)atoi(optarg); break;
+            case 'd': config.drop_pct = (uint32_t)atoi(optarg); break;
+            case 'c': config.crc_pct = (uint32_t)atoi(optarg); break;
+            case 'n': config.noise = atof(optarg); break;
+            case 't': config.temperature = atof(optarg); break;
+            case 'H': config.humidity = atof(optarg); break;
+            case 'L': config.link = optarg; break;
+            case 's': seed = (unsigned)atoi(optarg); break;
+            case 'v': config.verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    srand(seed);
+    holding[0] = config.address;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    int fd = open_pty();
+
+    uint8_t buffer[MB_RTU_MAX_FRAME];
+    size_t len = 0;
+    uint32_t gap_us = mb_rtu_t35_us(config.baudrate);
+
+    while (running)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        // A partial frame is dropped once the line has been quiet for 3.5 characters
+        struct timeval tv = { .tv_sec = len ? 0 : 1, .tv_usec = len ? gap_us : 0 };
+        int ready = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (ready < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+        if (ready == 0)
+        {
+            if (len)
+            {
+                stats.garbage++;
+                len = 0;
+            }
+            continue;
+        }
+        ssize_t n = read(fd, &buffer[len], sizeof(buffer) - len);
+        if (n <= 0)
+        {
+            // No master has the slave side open yet
+            usleep(100000);
+            continue;
+        }
+        len += (size_t)n;
+        while (len >= MB_RTU_READ_REQUEST_LEN)
+        {
+            uint16_t crc = mb_crc16(buffer, 6);
+            int valid = (buffer[6] == (crc & 0xFF)) && (buffer[7] == (crc >> 8));
+            size_t used = MB_RTU_READ_REQUEST_LEN;
+            if (valid && (buffer[0] == config.address))
+            {
+                handle_request(fd, buffer);
+            }
+            else if (!valid)
+            {
+                // Slide one byte to find the start of the next frame
+                stats.garbage++;
+                used = 1;
+            }
+            // Requests for other slaves are ignored, like on a real bus
+            len -= used;
+            memmove(buffer, &buffer[used], len);
+        }
+    }
+
+    printf("\nrequests %u, responses %u, dropped %u, corrupted %u, exceptions %u, garbage %u\n",
+           stats.requests, stats.responses, stats.dropped, stats.corrupted, stats.exceptions, stats.garbage);
+    if (config.link)
+    {
+        unlink(config.link);
+    }
+    close(fd);
+    return 0;
+}